@@ -28,6 +28,12 @@ include(FindPkgConfig)
 include(cmake/config/xdr.cmake)
 
 check_include_files(door.h HAVE_DOORS)
+check_function_exists(syncfs HAVE_SYNCFS)
+check_function_exists(copy_file_range HAVE_COPY_FILE_RANGE)
+check_include_files(liburing.h HAVE_LIBURING)
+if(HAVE_LIBURING)
+	find_library(URING_LIBRARY NAMES uring)
+endif()
 
 set(CMAKE_MODULE_PATH "${CMAKE_DIR}/Modules")
 find_package(avl)
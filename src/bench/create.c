@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/time.h>
+
+#include <nomad/types.h>
+#include <nomad/objstore.h>
+
+/*
+ * Mass create benchmark
+ *
+ * Creates a directory tree shaped like an unpacked source tree - a number
+ * of directories, each with a number of files - on a non-persistent mem
+ * vdev, and reports the cost per created object.  The objstore must be
+ * able to find the mem backend (i.e., it must be listed in the config and
+ * LD_LIBRARY_PATH must point to it).
+ */
+
+#define DEF_DIRS	1000
+#define DEF_FILES	50
+
+static struct nvclock *null_clock;
+
+static int create_files(struct objstore *vol, const struct noid *dir,
+			unsigned d, unsigned nfiles)
+{
+	char name[64];
+	struct noid child;
+	void *cookie;
+	unsigned f;
+	int ret;
+
+	cookie = objstore_open(vol, dir, null_clock);
+	if (IS_ERR(cookie))
+		return PTR_ERR(cookie);
+
+	ret = 0;
+
+	for (f = 0; f < nfiles; f++) {
+		snprintf(name, sizeof(name), "source-file-%u-%u.c", d, f);
+
+		ret = objstore_create(vol, cookie, name, NATTR_REG | 0644,
+				      &child);
+		if (ret)
+			break;
+	}
+
+	objstore_close(vol, cookie);
+
+	return ret;
+}
+
+static int create_tree(struct objstore *vol, unsigned ndirs, unsigned nfiles)
+{
+	struct noid root;
+	struct noid dir;
+	char name[64];
+	void *cookie;
+	unsigned d;
+	int ret;
+
+	ret = objstore_getroot(vol, &root);
+	if (ret)
+		return ret;
+
+	cookie = objstore_open(vol, &root, null_clock);
+	if (IS_ERR(cookie))
+		return PTR_ERR(cookie);
+
+	for (d = 0; d < ndirs; d++) {
+		snprintf(name, sizeof(name), "subsystem-%u", d);
+
+		ret = objstore_create(vol, cookie, name, NATTR_DIR | 0755,
+				      &dir);
+		if (ret)
+			break;
+
+		ret = create_files(vol, &dir, d, nfiles);
+		if (ret)
+			break;
+	}
+
+	objstore_close(vol, cookie);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct objstore_vdev_usage usage;
+	struct objstore_vdev *vdev;
+	unsigned ndirs = DEF_DIRS;
+	unsigned nfiles = DEF_FILES;
+	uint64_t start, end;
+	struct objstore *vol;
+	uint64_t nobjs;
+	int ret;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [<dirs> [<files per dir>]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (argc > 1)
+		ndirs = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		nfiles = strtoul(argv[2], NULL, 0);
+
+	ret = objstore_init();
+	if (ret) {
+		cmn_err(CE_CRIT, "objstore_init() = %d (%s)", ret,
+			xstrerror(ret));
+		return 1;
+	}
+
+	null_clock = nvclock_alloc(false);
+	if (!null_clock) {
+		cmn_err(CE_CRIT, "failed to allocate a clock");
+		return 1;
+	}
+
+	vdev = objstore_vdev_create("mem", "");
+	if (IS_ERR(vdev)) {
+		cmn_err(CE_CRIT, "failed to create vdev: %s",
+			xstrerror(PTR_ERR(vdev)));
+		return 1;
+	}
+
+	vol = objstore_vol_create(vdev, "bench");
+	if (IS_ERR(vol)) {
+		cmn_err(CE_CRIT, "failed to create volume: %s",
+			xstrerror(PTR_ERR(vol)));
+		return 1;
+	}
+
+	start = gettime();
+	ret = create_tree(vol, ndirs, nfiles);
+	end = gettime();
+
+	if (ret) {
+		cmn_err(CE_CRIT, "failed to create tree: %s", xstrerror(ret));
+		return 1;
+	}
+
+	nobjs = (uint64_t) ndirs * (nfiles + 1);
+
+	printf("created %"PRIu64" objects in %.3f s: %.0f ns/create\n",
+	       nobjs, (double) (end - start) / 1000000000.0,
+	       (double) (end - start) / MAX(nobjs, 1));
+
+	if (!objstore_vdev_usage(vdev, &usage))
+		printf("memory used: %"PRIu64" bytes (%"PRIu64" meta, "
+		       "%"PRIu64" dentry)\n", usage.used, usage.meta,
+		       usage.dentry);
+
+	return 0;
+}
@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/avl.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/time.h>
+
+#include <nomad/types.h>
+
+/*
+ * Vector clock benchmark
+ *
+ * Builds a tree of object versions keyed by their vector clocks - the same
+ * way obj->versions and memobj->versions are - and times lookups in it.
+ * The versions are generated by repeatedly picking an existing version
+ * and bumping one of a few writer nodes, which gives clocks with the node
+ * counts and shapes seen in practice.
+ *
+ * Each lookup is done twice: once with nvclock_cmp_total() and once with
+ * the comparator we used to have, which copied both clocks into fixed
+ * size arrays and sorted them with qsort on every call.  (The old
+ * dominance check didn't handle nodes missing from one of the clocks
+ * correctly, so a few lookups in its tree miss.)
+ */
+
+/*
+ * The second part compares nvclock_cmp(), which uses SSE4.2 or AVX2 when
+ * the CPU has them, against a scalar merge of the same (sorted) entries
+ * for clocks of various sizes.  Both clocks of each pair mention the same
+ * nodes, which is the case the vectorized code handles.
+ */
+
+#define DEF_VERSIONS	1000
+#define DEF_LOOKUPS	1000000
+#define NWRITERS	4
+
+#define CMP_PAIRS	1024
+#define CMP_ROUNDS	1000
+
+/* the clock representation used by the old comparator */
+struct oldclock {
+	struct nvclockent ent[NVCLOCK_NUM_NODES];
+};
+
+struct ver {
+	struct nvclock *clock;
+	struct oldclock old;
+
+	avl_node_t node;
+	avl_node_t oldnode;
+};
+
+/*
+ * The old comparator
+ */
+static int old_ent_cmp(const void *va, const void *vb)
+{
+	const struct nvclockent *a = va;
+	const struct nvclockent *b = vb;
+
+	if (a->node < b->node)
+		return -1;
+	if (a->node > b->node)
+		return 1;
+	return 0;
+}
+
+static int old_prep(const struct oldclock *clock, struct oldclock *sorted)
+{
+	int i;
+
+	*sorted = *clock;
+
+	qsort(sorted->ent, NVCLOCK_NUM_NODES, sizeof(struct nvclockent),
+	      old_ent_cmp);
+
+	/* find first non-zero node */
+	for (i = 0; i < NVCLOCK_NUM_NODES; i++)
+		if (sorted->ent[i].node)
+			break;
+
+	return i;
+}
+
+/* are all elements in @u <= than their corresponding elements in @v? */
+static bool old_all_le(const struct oldclock *u, int i,
+		       const struct oldclock *v, int j)
+{
+	while ((i < NVCLOCK_NUM_NODES) && (j < NVCLOCK_NUM_NODES)) {
+		const struct nvclockent *a = &u->ent[i];
+		const struct nvclockent *b = &v->ent[j];
+
+		if (a->node < b->node)
+			return false;
+
+		if (a->node == b->node) {
+			if (a->seq > b->seq)
+				return false;
+
+			i++;
+			j++;
+		} else {
+			i++;
+		}
+	}
+
+	return true;
+}
+
+static int old_cmp_total(const struct oldclock *c1, const struct oldclock *c2)
+{
+	struct oldclock u, v;
+	int i, j;
+
+	i = old_prep(c1, &u);
+	j = old_prep(c2, &v);
+
+	if ((i == NVCLOCK_NUM_NODES) && (j == NVCLOCK_NUM_NODES))
+		return 0;
+	if (i == NVCLOCK_NUM_NODES)
+		return -1;
+	if (j == NVCLOCK_NUM_NODES)
+		return 1;
+
+	if (!memcmp(&u.ent[i], &v.ent[j],
+		    sizeof(struct nvclockent) * (NVCLOCK_NUM_NODES - i)) &&
+	    (i == j))
+		return 0;
+
+	if (old_all_le(&u, i, &v, j))
+		return -1;
+	if (old_all_le(&v, j, &u, i))
+		return 1;
+
+	/* divergent - the old code sorted both clocks a second time */
+	i = old_prep(c1, &u);
+	j = old_prep(c2, &v);
+
+	for (; (i < NVCLOCK_NUM_NODES) && (j < NVCLOCK_NUM_NODES); i++, j++) {
+		if (u.ent[i].node != v.ent[j].node)
+			return (u.ent[i].node > v.ent[j].node) ? 1 : -1;
+		if (u.ent[i].seq != v.ent[j].seq)
+			return (u.ent[i].seq > v.ent[j].seq) ? 1 : -1;
+	}
+
+	return (i == NVCLOCK_NUM_NODES) ? -1 : 1;
+}
+
+static int ver_cmp(const void *va, const void *vb)
+{
+	const struct ver *a = va;
+	const struct ver *b = vb;
+
+	return nvclock_cmp_total(a->clock, b->clock);
+}
+
+static int old_ver_cmp(const void *va, const void *vb)
+{
+	const struct ver *a = va;
+	const struct ver *b = vb;
+
+	return old_cmp_total(&a->old, &b->old);
+}
+
+/* fill in the old representation, with the entries in random slots */
+static void make_old(struct ver *ver)
+{
+	struct nvclockent ents[NVCLOCK_NUM_NODES];
+	unsigned nents;
+	unsigned i;
+
+	memset(&ver->old, 0, sizeof(ver->old));
+
+	nents = nvclock_get_ents(ver->clock, ents);
+
+	for (i = 0; i < nents; i++) {
+		unsigned slot;
+
+		do {
+			slot = random() % NVCLOCK_NUM_NODES;
+		} while (ver->old.ent[slot].node);
+
+		ver->old.ent[slot] = ents[i];
+	}
+}
+
+static bool is_dup(struct ver *vers, size_t n, struct nvclock *clock)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (nvclock_cmp(vers[i].clock, clock) == NVC_EQ)
+			return true;
+
+	return false;
+}
+
+/*
+ * Most new versions continue the latest one, but every so often a version
+ * branches off an older one - just like a disconnected node would.
+ */
+static struct ver *gen_versions(avl_tree_t *tree, avl_tree_t *oldtree,
+				size_t nversions)
+{
+	struct ver *vers;
+	size_t n;
+
+	vers = calloc(nversions, sizeof(struct ver));
+	if (!vers)
+		goto err;
+
+	for (n = 0; n < nversions; ) {
+		struct ver *ver = &vers[n];
+		size_t parent;
+
+		parent = (random() % 8) ? (n - 1) : (random() % MAX(n, 1));
+
+		ver->clock = n ? nvclock_dup(vers[parent].clock) :
+				 nvclock_alloc(false);
+		if (!ver->clock)
+			goto err;
+
+		if (nvclock_inc_node(ver->clock, 1 + (random() % NWRITERS)))
+			goto err;
+
+		if (is_dup(vers, n, ver->clock)) {
+			nvclock_free(ver->clock);
+			continue;
+		}
+
+		make_old(ver);
+
+		avl_add(tree, ver);
+		avl_add(oldtree, ver);
+		n++;
+	}
+
+	return vers;
+
+err:
+	cmn_err(CE_CRIT, "failed to generate versions");
+	exit(1);
+}
+
+static void bench(const char *name, avl_tree_t *tree, struct ver *vers,
+		  size_t nversions, size_t nlookups)
+{
+	uint64_t start, end;
+	size_t found;
+	size_t i;
+
+	srandom(1);
+
+	found = 0;
+
+	start = gettime();
+	for (i = 0; i < nlookups; i++)
+		if (avl_find(tree, &vers[random() % nversions], NULL))
+			found++;
+	end = gettime();
+
+	printf("%-8s %10zu lookups (%zu found) in %zu versions: "
+	       "%.2f ns/lookup\n", name, nlookups, found, nversions,
+	       (double) (end - start) / nlookups);
+}
+
+/* the scalar merge nvclock_cmp() falls back to */
+static enum nvclockcmp scalar_cmp(const struct nvclockent *u, unsigned un,
+				  const struct nvclockent *v, unsigned vn)
+{
+	bool u_ahead = false;
+	bool v_ahead = false;
+	unsigned i = 0;
+	unsigned j = 0;
+
+	while ((i < un) && (j < vn)) {
+		if (u[i].node < v[j].node) {
+			u_ahead = true;
+			i++;
+		} else if (u[i].node > v[j].node) {
+			v_ahead = true;
+			j++;
+		} else {
+			if (u[i].seq > v[j].seq)
+				u_ahead = true;
+			else if (u[i].seq < v[j].seq)
+				v_ahead = true;
+
+			i++;
+			j++;
+		}
+
+		if (u_ahead && v_ahead)
+			return NVC_DIV;
+	}
+
+	u_ahead |= (i < un);
+	v_ahead |= (j < vn);
+
+	if (u_ahead && v_ahead)
+		return NVC_DIV;
+	if (u_ahead)
+		return NVC_GT;
+	if (v_ahead)
+		return NVC_LT;
+	return NVC_EQ;
+}
+
+struct cmppair {
+	struct nvclock *u;
+	struct nvclock *v;
+	struct nvclockent uents[NVCLOCK_NUM_NODES];
+	struct nvclockent vents[NVCLOCK_NUM_NODES];
+	unsigned nents;
+};
+
+/*
+ * Generate a pair of clocks with @nents nodes each.  Most pairs are equal
+ * or differ in one entry (i.e., one is an ancestor of the other).
+ */
+static void gen_pair(struct cmppair *pair, unsigned nents)
+{
+	uint64_t node;
+	unsigned i;
+
+	pair->u = nvclock_alloc(false);
+	pair->v = nvclock_alloc(false);
+	if (!pair->u || !pair->v)
+		goto err;
+
+	for (i = 0; i < nents; i++) {
+		uint64_t seq = 1 + random() % 1000;
+
+		node = 1 + i * 7;
+
+		if (nvclock_set_node(pair->u, node, seq) ||
+		    nvclock_set_node(pair->v, node, seq))
+			goto err;
+	}
+
+	node = 1 + (random() % nents) * 7;
+
+	switch (random() % 4) {
+		case 0:
+			break;
+		case 1:
+			if (nvclock_inc_node(pair->u, node))
+				goto err;
+			break;
+		case 2:
+			if (nvclock_inc_node(pair->v, node))
+				goto err;
+			break;
+		case 3:
+			if (nvclock_inc_node(pair->u, 1) ||
+			    nvclock_inc_node(pair->v, 1 + (nents - 1) * 7))
+				goto err;
+			break;
+	}
+
+	pair->nents = nvclock_get_ents(pair->u, pair->uents);
+	VERIFY3U(nvclock_get_ents(pair->v, pair->vents), ==, pair->nents);
+
+	return;
+
+err:
+	cmn_err(CE_CRIT, "failed to generate clocks");
+	exit(1);
+}
+
+static void bench_cmp(unsigned nents)
+{
+	struct cmppair *pairs;
+	uint64_t start, mid, end;
+	unsigned sum1, sum2;
+	size_t i, r;
+
+	pairs = calloc(CMP_PAIRS, sizeof(struct cmppair));
+	if (!pairs) {
+		cmn_err(CE_CRIT, "failed to allocate clock pairs");
+		exit(1);
+	}
+
+	for (i = 0; i < CMP_PAIRS; i++)
+		gen_pair(&pairs[i], nents);
+
+	/* the two must agree */
+	for (i = 0; i < CMP_PAIRS; i++)
+		VERIFY3U(nvclock_cmp(pairs[i].u, pairs[i].v), ==,
+			 scalar_cmp(pairs[i].uents, pairs[i].nents,
+				    pairs[i].vents, pairs[i].nents));
+
+	sum1 = 0;
+	sum2 = 0;
+
+	start = gettime();
+	for (r = 0; r < CMP_ROUNDS; r++)
+		for (i = 0; i < CMP_PAIRS; i++)
+			sum1 += scalar_cmp(pairs[i].uents, pairs[i].nents,
+					   pairs[i].vents, pairs[i].nents);
+	mid = gettime();
+	for (r = 0; r < CMP_ROUNDS; r++)
+		for (i = 0; i < CMP_PAIRS; i++)
+			sum2 += nvclock_cmp(pairs[i].u, pairs[i].v);
+	end = gettime();
+
+	VERIFY3U(sum1, ==, sum2);
+
+	printf("%2u nodes: scalar %6.2f ns/cmp, nvclock_cmp %6.2f ns/cmp\n",
+	       nents, (double) (mid - start) / (CMP_ROUNDS * CMP_PAIRS),
+	       (double) (end - mid) / (CMP_ROUNDS * CMP_PAIRS));
+
+	for (i = 0; i < CMP_PAIRS; i++) {
+		nvclock_free(pairs[i].u);
+		nvclock_free(pairs[i].v);
+	}
+
+	free(pairs);
+}
+
+int main(int argc, char **argv)
+{
+	size_t nversions = DEF_VERSIONS;
+	size_t nlookups = DEF_LOOKUPS;
+	static const unsigned cmp_sizes[] = { 2, 3, 4, 6, 8, 12, 16, };
+	avl_tree_t oldtree;
+	avl_tree_t tree;
+	struct ver *vers;
+	size_t i;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [<versions> [<lookups>]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (argc > 1)
+		nversions = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		nlookups = strtoul(argv[2], NULL, 0);
+
+	if (!nversions)
+		nversions = 1;
+
+	avl_create(&tree, ver_cmp, sizeof(struct ver),
+		   offsetof(struct ver, node));
+	avl_create(&oldtree, old_ver_cmp, sizeof(struct ver),
+		   offsetof(struct ver, oldnode));
+
+	srandom(0);
+
+	vers = gen_versions(&tree, &oldtree, nversions);
+
+	bench("qsort", &oldtree, vers, nversions, nlookups);
+	bench("sorted", &tree, vers, nversions, nlookups);
+
+	printf("\n");
+
+	srandom(0);
+
+	for (i = 0; i < ARRAY_LEN(cmp_sizes); i++)
+		bench_cmp(cmp_sizes[i]);
+
+	return 0;
+}
@@ -70,11 +70,24 @@ int cmd_getdent(struct fsconn *conn, union cmd *cmd)
 	struct rpc_getdent_req *req = &cmd->getdent.req;
 	struct rpc_getdent_res *res = &cmd->getdent.res;
 	struct ohandle *oh;
+	uint64_t next;
+	int ret;
 
 	oh = ohandle_find(conn, req->parent);
 	if (!oh)
 		return -EINVAL;
 
-	return objstore_getdent(conn->vol, oh->cookie, req->offset,
-				&res->oid, &res->name, &res->entry_size);
+	/*
+	 * The protocol offset is the objstore's directory cookie.  The
+	 * entry size is whatever gets the client from this cookie to the
+	 * next one.
+	 */
+	ret = objstore_getdent(conn->vol, oh->cookie, req->offset,
+			       &res->oid, &res->name, &next);
+	if (ret)
+		return ret;
+
+	res->entry_size = next - req->offset;
+
+	return 0;
 }
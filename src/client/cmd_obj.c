@@ -77,9 +77,9 @@ int cmd_read(struct fsconn *conn, union cmd *cmd)
 {
 	struct rpc_read_req *req = &cmd->read.req;
 	struct rpc_read_res *res = &cmd->read.res;
+	struct objstore_bufref *ref = &cmd->read.ref;
 	struct ohandle *oh;
 	ssize_t ret;
-	void *buf;
 
 	oh = ohandle_find(conn, req->handle);
 	if (!oh)
@@ -87,23 +87,35 @@ int cmd_read(struct fsconn *conn, union cmd *cmd)
 
 	/* TODO: should we limit the requested read size? */
 
-	buf = malloc(req->length);
-	if (!buf)
-		return -ENOMEM;
-
-	ret = objstore_read(conn->vol, oh->cookie, buf, req->length,
-			    req->offset);
-	if (ret < 0) {
-		free(buf);
+	/*
+	 * Instead of copying the data into a temporary buffer, we get a
+	 * reference to the object store's copy and let XDR send it
+	 * directly from there.  The reference is released by
+	 * cmd_read_done() once the response is on its way.
+	 */
+	ret = objstore_read_ref(conn->vol, oh->cookie, req->length,
+				req->offset, ref);
+	if (ret < 0)
 		return ret;
-	}
 
-	res->data.data_len = ret;
-	res->data.data_val = buf;
+	/* a short reference means we hit EOF */
+	res->data.data_len = ref->len;
+	res->data.data_val = (void *) ref->data;
 
 	return 0;
 }
 
+void cmd_read_done(struct fsconn *conn, union cmd *cmd)
+{
+	struct rpc_read_res *res = &cmd->read.res;
+
+	/* the buffer belongs to the object store, XDR must not free it */
+	res->data.data_len = 0;
+	res->data.data_val = NULL;
+
+	objstore_bufref_put(&cmd->read.ref);
+}
+
 int cmd_write(struct fsconn *conn, union cmd *cmd)
 {
 	struct rpc_write_req *req = &cmd->write.req;
@@ -31,7 +31,7 @@ int cmd_vdev_import(struct fsconn *conn, union cmd *cmd)
 	if (req->create)
 		vdev = objstore_vdev_create(req->type, req->path);
 	else
-		vdev = ERR_PTR(-ENOTSUP);
+		vdev = objstore_vdev_load(req->type, req->path);
 
 	if (IS_ERR(vdev))
 		return PTR_ERR(vdev);
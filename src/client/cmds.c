@@ -60,10 +60,29 @@
 		.res = (void *) xdr_rpc_##what##_res,	\
 	}
 
+#define CMD_ARG_RET_DONE(op, what, hndlr, login, dn)	\
+	{						\
+		.name = #op,				\
+		.opcode = (op),				\
+		.handler = (hndlr),			\
+		.done = (dn),				\
+		.requires_login = (login),		\
+		.reqoff = offsetof(union cmd, what.req),\
+		.resoff = offsetof(union cmd, what.res),\
+		.req = (void *) xdr_rpc_##what##_req,	\
+		.res = (void *) xdr_rpc_##what##_res,	\
+	}
+
 static const struct cmdtbl {
 	const char *name;
 	uint16_t opcode;
 	int (*handler)(struct fsconn *, union cmd *);
+	/*
+	 * Called after a successful handler's response has been sent but
+	 * before the response is freed.  This lets handlers lend buffers
+	 * they don't own to the response.
+	 */
+	void (*done)(struct fsconn *, union cmd *);
 	bool requires_login;
 	size_t reqoff;
 	size_t resoff;
@@ -83,7 +102,8 @@ static const struct cmdtbl {
 	CMD_ARG_RET(NRPC_LOOKUP,        lookup,        cmd_lookup,      true),
 	CMD        (NRPC_NOP,           nop,           cmd_nop,         false),
 	CMD_ARG_RET(NRPC_OPEN,          open,          cmd_open,        true),
-	CMD_ARG_RET(NRPC_READ,          read,          cmd_read,        true),
+	CMD_ARG_RET_DONE(NRPC_READ,     read,          cmd_read,        true,
+			 cmd_read_done),
 	CMD_ARG_RET(NRPC_SETATTR,       setattr,       cmd_setattr,     true),
 	CMD_ARG    (NRPC_UNLINK,        unlink,        cmd_unlink,      true),
 	CMD_ARG_RET(NRPC_VDEV_IMPORT,	vdev_import,   cmd_vdev_import,	false),
@@ -218,9 +238,14 @@ bool process_connection(struct fsconn *conn)
 		ok = send_response(&xdr, conn->fd, ret);
 
 		/* send back the response payload */
-		if (ok && !ret) {
+		if (ok && !ret)
 			ok = process_returns(&xdr, def, &cmd);
 
+		if (!ret) {
+			/* let the handler take back anything it lent out */
+			if (def->done)
+				def->done(conn, &cmd);
+
 			/* free the responses */
 			xdr_destroy(&xdr);
 			xdrfd_create(&xdr, conn->fd, XDR_FREE);
@@ -78,6 +78,7 @@ union cmd {
 	struct {
 		struct rpc_read_req req;
 		struct rpc_read_res res;
+		struct objstore_bufref ref;
 	} read;
 
 	/* setattr */
@@ -123,6 +124,7 @@ extern int cmd_lookup(struct fsconn *conn, union cmd *cmd);
 extern int cmd_nop(struct fsconn *conn, union cmd *cmd);
 extern int cmd_open(struct fsconn *conn, union cmd *cmd);
 extern int cmd_read(struct fsconn *conn, union cmd *cmd);
+extern void cmd_read_done(struct fsconn *conn, union cmd *cmd);
 extern int cmd_setattr(struct fsconn *conn, union cmd *cmd);
 extern int cmd_unlink(struct fsconn *conn, union cmd *cmd);
 extern int cmd_write(struct fsconn *conn, union cmd *cmd);
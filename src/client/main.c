@@ -86,6 +86,10 @@ int main(int argc, char **argv)
 
 	cmn_err(CE_DEBUG, "socksvc() = %d (%s)", ret, xstrerror(ret));
 
+	/* persist the state of any vdevs that keep it in memory */
+	if (objstore_vdev_sync_all())
+		cmn_err(CE_ERROR, "failed to sync all vdevs");
+
 	/* XXX: undo objstore_init() */
 
 err:
@@ -28,6 +28,7 @@
 
 /* version vector */
 #define NVCLOCK_NUM_NODES	16 /* ought to be enough for everyone */
+#define NVCLOCK_INLINE_NODES	2  /* entries stored without extra allocation */
 
 enum nvclockcmp {
 	NVC_LT = -1,
@@ -41,13 +42,23 @@ struct nvclockent {
 	uint64_t seq;
 };
 
+/*
+ * The contents of this structure are private to vclock.c.  In particular,
+ * a clock may own memory and therefore must be copied with nvclock_copy()
+ * and not by assignment.  A zero-filled structure is a valid empty clock.
+ */
 struct nvclock {
-	struct nvclockent ent[NVCLOCK_NUM_NODES];
+	uint8_t nents;		/* number of in-use entries */
+	uint8_t nalloc;		/* size of ext; 0 if using inl */
+	union {
+		struct nvclockent inl[NVCLOCK_INLINE_NODES];
+		struct nvclockent *ext;
+	};
 };
 
 extern struct nvclock *nvclock_alloc(bool autoset);
 extern struct nvclock *nvclock_dup(const struct nvclock *clock);
-extern void nvclock_copy(struct nvclock *dst, const struct nvclock *src);
+extern int nvclock_copy(struct nvclock *dst, const struct nvclock *src);
 extern void nvclock_free(struct nvclock *clock);
 extern enum nvclockcmp nvclock_cmp(const struct nvclock *c1,
 				   const struct nvclock *c2);
@@ -59,6 +70,8 @@ extern int nvclock_set_node(struct nvclock *clock, uint64_t node,
 			    uint64_t seq);
 extern int nvclock_inc_node(struct nvclock *clock, uint64_t node);
 extern uint64_t nvclock_get(struct nvclock *clock);
+extern unsigned nvclock_get_ents(const struct nvclock *clock,
+				 struct nvclockent *ents);
 extern int nvclock_remove(struct nvclock *clock);
 extern int nvclock_set(struct nvclock *clock, uint64_t seq);
 extern int nvclock_inc(struct nvclock *clock);
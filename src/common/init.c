@@ -32,12 +32,54 @@
 #define CFG_ENV_NAME		"NOMAD_CONFIG"
 
 static struct val *backends_list;
+static uint64_t mem_limit;
+static uint64_t posix_pack_max;
+static uint64_t posix_io_depth = 128;
+static uint64_t posix_commit;
+static uint64_t posix_commit_delay = 1000;
+static uint64_t posix_commit_batch = 64;
+static uint64_t posix_direct_io;
 
 struct val *config_get_backends(void)
 {
 	return val_getref(backends_list);
 }
 
+uint64_t config_get_mem_limit(void)
+{
+	return mem_limit;
+}
+
+uint64_t config_get_posix_pack_max(void)
+{
+	return posix_pack_max;
+}
+
+uint64_t config_get_posix_io_depth(void)
+{
+	return posix_io_depth;
+}
+
+uint64_t config_get_posix_commit(void)
+{
+	return posix_commit;
+}
+
+uint64_t config_get_posix_commit_delay(void)
+{
+	return posix_commit_delay;
+}
+
+uint64_t config_get_posix_commit_batch(void)
+{
+	return posix_commit_batch;
+}
+
+uint64_t config_get_posix_direct_io(void)
+{
+	return posix_direct_io;
+}
+
 /*
  * Extract the "host-id" value from the config and start using it.
  */
@@ -102,6 +144,35 @@ static int __set_backends_list(struct val *cfg)
 	return 0;
 }
 
+/*
+ * Extract an optional non-negative integer value from the config.  If it
+ * isn't present, @value is left unchanged.
+ */
+static int __get_opt_int(struct val *cfg, const char *name, uint64_t *value)
+{
+	struct val *tmp;
+	int ret;
+
+	tmp = sexpr_alist_lookup_val(cfg, name);
+	if (!tmp)
+		return 0;
+
+	if (tmp->type != VT_INT) {
+		cmn_err(CE_CRIT, "config has non-integer %s", name);
+		ret = -EINVAL;
+	} else if ((int64_t) tmp->i < 0) {
+		cmn_err(CE_CRIT, "config has negative %s", name);
+		ret = -EINVAL;
+	} else {
+		*value = tmp->i;
+		ret = 0;
+	}
+
+	val_putref(tmp);
+
+	return ret;
+}
+
 static int load_config(void)
 {
 	struct val *cfg;
@@ -129,6 +200,34 @@ static int load_config(void)
 		goto err;
 
 	ret = __set_backends_list(cfg);
+	if (ret)
+		goto err;
+
+	ret = __get_opt_int(cfg, "mem-limit", &mem_limit);
+	if (ret)
+		goto err;
+
+	ret = __get_opt_int(cfg, "posix-pack-max", &posix_pack_max);
+	if (ret)
+		goto err;
+
+	ret = __get_opt_int(cfg, "posix-io-depth", &posix_io_depth);
+	if (ret)
+		goto err;
+
+	ret = __get_opt_int(cfg, "posix-commit", &posix_commit);
+	if (ret)
+		goto err;
+
+	ret = __get_opt_int(cfg, "posix-commit-delay", &posix_commit_delay);
+	if (ret)
+		goto err;
+
+	ret = __get_opt_int(cfg, "posix-commit-batch", &posix_commit_batch);
+	if (ret)
+		goto err;
+
+	ret = __get_opt_int(cfg, "posix-direct-io", &posix_direct_io);
 
 err:
 	/*
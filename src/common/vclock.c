@@ -28,6 +28,11 @@
 
 #include <nomad/types.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SIMD_CMP
+#endif
+
 /*
  * Vector clocks
  *
@@ -36,28 +41,109 @@
  *
  * (1) if a node doesn't appear in the vector, it's sequence id is assumed
  *     to be zero.
- * (2) node zero is reserved.  Internally to this code, it can be used to
- *     indicate an unused entry.  However, a sequence id get of node zero
- *     will return zero.
+ * (2) node zero is reserved.  However, a sequence id get of node zero will
+ *     return zero.
  *
- * As far as this implementation of vector clocks is concerned, the ent[]
- * array is managed as follows:
+ * As far as this implementation of vector clocks is concerned, the entries
+ * are managed as follows:
  *
  * (1) nodes with zero sequence id are *not* stored.  This is important for
  *     the set function.  Whenever the new sequence id ends up equal to
  *     zero, the <node, seq> pair is removed from the vector.
- * (2) entries may not be used contiguously.
+ * (2) the entries are kept in canonical form - sorted by node id and packed
+ *     at the beginning of the array.  This lets us compare two clocks with
+ *     a single linear merge without copying or sorting them first.  Every
+ *     function that modifies a clock (including the XDR decoder) must
+ *     preserve this.
+ * (3) the vast majority of clocks have only one or two entries, so those
+ *     are stored inline in struct nvclock.  Once a clock outgrows the
+ *     inline storage, the entries move to a heap allocated array (doubling
+ *     in size as needed, up to NVCLOCK_NUM_NODES entries).  Since this
+ *     means that a clock may own memory, clocks must not be copied by
+ *     assignment - use nvclock_copy() instead.
  */
 
 static struct mem_cache *vclock_cache;
 
+static void __cmp_init(void);
+
 int nvclock_init_subsys(void)
 {
+	__cmp_init();
+
 	vclock_cache = mem_cache_create("vclock", sizeof(struct nvclock), 0);
 
 	return IS_ERR(vclock_cache) ? PTR_ERR(vclock_cache) : 0;
 }
 
+static inline struct nvclockent *__ents(struct nvclock *clock)
+{
+	return clock->nalloc ? clock->ext : clock->inl;
+}
+
+static inline const struct nvclockent *__cents(const struct nvclock *clock)
+{
+	return clock->nalloc ? clock->ext : clock->inl;
+}
+
+/* release any external storage and make @clock empty */
+static void __clear(struct nvclock *clock)
+{
+	if (clock->nalloc)
+		free(clock->ext);
+
+	memset(clock, 0, sizeof(struct nvclock));
+}
+
+/*
+ * Make sure @clock has room for at least @nents entries.  The existing
+ * entries are preserved.
+ */
+static int __reserve(struct nvclock *clock, int nents)
+{
+	struct nvclockent *tmp;
+	int nalloc;
+
+	if (nents > NVCLOCK_NUM_NODES)
+		return -ENOMEM;
+
+	if (nents <= (clock->nalloc ? clock->nalloc : NVCLOCK_INLINE_NODES))
+		return 0;
+
+	nalloc = NVCLOCK_INLINE_NODES;
+	while (nalloc < nents)
+		nalloc *= 2;
+	nalloc = MIN(nalloc, NVCLOCK_NUM_NODES);
+
+	tmp = malloc(sizeof(struct nvclockent) * nalloc);
+	if (!tmp)
+		return -ENOMEM;
+
+	memcpy(tmp, __ents(clock), sizeof(struct nvclockent) * clock->nents);
+
+	if (clock->nalloc)
+		free(clock->ext);
+
+	clock->ext = tmp;
+	clock->nalloc = nalloc;
+
+	return 0;
+}
+
+/* move the entries back inline if they fit */
+static void __shrink(struct nvclock *clock)
+{
+	struct nvclockent *ext = clock->ext;
+
+	if (!clock->nalloc || (clock->nents > NVCLOCK_INLINE_NODES))
+		return;
+
+	memcpy(clock->inl, ext, sizeof(struct nvclockent) * clock->nents);
+	clock->nalloc = 0;
+
+	free(ext);
+}
+
 struct nvclock *nvclock_alloc(bool autoset)
 {
 	struct nvclock *clock;
@@ -82,53 +168,106 @@ struct nvclock *nvclock_dup(const struct nvclock *clock)
 	if (!ret)
 		return NULL;
 
-	memcpy(ret, clock, sizeof(*ret));
+	if (nvclock_copy(ret, clock)) {
+		nvclock_free(ret);
+		return NULL;
+	}
 
 	return ret;
 }
 
-void nvclock_copy(struct nvclock *dst, const struct nvclock *src)
+int nvclock_copy(struct nvclock *dst, const struct nvclock *src)
 {
-	/*
-	 * Since the contents of struct nvclock are very simple, we can get
-	 * away with doing this.  If the structure ever gains internal
-	 * pointers/etc., we'll have to expand this.
-	 */
-	*dst = *src;
+	int ret;
+
+	if (dst == src)
+		return 0;
+
+	ret = __reserve(dst, src->nents);
+	if (ret)
+		return ret;
+
+	memcpy(__ents(dst), __cents(src),
+	       sizeof(struct nvclockent) * src->nents);
+	dst->nents = src->nents;
+
+	__shrink(dst);
+
+	return 0;
 }
 
 void nvclock_free(struct nvclock *clock)
 {
+	if (!clock)
+		return;
+
+	__clear(clock);
+
 	mem_cache_free(vclock_cache, clock);
 }
 
+/*
+ * Find the index of @node in @clock.  If it isn't present, return the
+ * index where it would have to be inserted to keep the entries sorted.
+ */
+static int __find_idx(const struct nvclock *clock, uint64_t node, bool *found)
+{
+	const struct nvclockent *ent = __cents(clock);
+	int i;
+
+	for (i = 0; i < clock->nents; i++) {
+		if (ent[i].node > node)
+			break;
+
+		if (ent[i].node == node) {
+			*found = true;
+			return i;
+		}
+	}
+
+	*found = false;
+
+	return i;
+}
+
 static struct nvclockent *__get_ent(struct nvclock *clock, uint64_t node,
 				    bool alloc)
 {
+	struct nvclockent *ent;
+	bool found;
+	int ret;
 	int i;
 
 	if (!clock || !node)
 		return ERR_PTR(-EINVAL);
 
-	for (i = 0; i < NVCLOCK_NUM_NODES; i++)
-		if (clock->ent[i].node == node)
-			return &clock->ent[i];
+	i = __find_idx(clock, node, &found);
+	if (found)
+		return &__ents(clock)[i];
 
 	if (!alloc)
 		return ERR_PTR(-ENOENT);
 
 	/*
-	 * We didn't find it; we're supposed to allocate an entry.
+	 * We didn't find it; we're supposed to allocate an entry.  Make
+	 * room for it at index i, keeping the array sorted.
 	 */
 
-	for (i = 0; i < NVCLOCK_NUM_NODES; i++) {
-		if (!clock->ent[i].node) {
-			clock->ent[i].node = node;
-			return &clock->ent[i];
-		}
-	}
+	ret = __reserve(clock, clock->nents + 1);
+	if (ret)
+		return ERR_PTR(ret);
+
+	ent = __ents(clock);
+
+	memmove(&ent[i + 1], &ent[i],
+		sizeof(struct nvclockent) * (clock->nents - i));
+
+	ent[i].node = node;
+	ent[i].seq = 0;
 
-	return ERR_PTR(-ENOMEM);
+	clock->nents++;
+
+	return &ent[i];
 }
 
 /*
@@ -148,22 +287,42 @@ uint64_t nvclock_get(struct nvclock *clock)
 	return nvclock_get_node(clock, nomad_local_node_id());
 }
 
+/*
+ * Copy out all of @clock's entries.  @ents must have room for
+ * NVCLOCK_NUM_NODES entries.  Returns the number of entries copied.
+ */
+unsigned nvclock_get_ents(const struct nvclock *clock, struct nvclockent *ents)
+{
+	memcpy(ents, __cents(clock), sizeof(struct nvclockent) * clock->nents);
+
+	return clock->nents;
+}
+
 /*
  * Remove @node from @clock.
  */
 int nvclock_remove_node(struct nvclock *clock, uint64_t node)
 {
 	struct nvclockent *ent;
+	bool found;
+	int i;
 
 	if (!clock || !node)
 		return -EINVAL;
 
-	ent = __get_ent(clock, node, false);
-	if (IS_ERR(ent))
+	i = __find_idx(clock, node, &found);
+	if (!found)
 		return 0;
 
-	ent->node = 0;
-	ent->seq = 0;
+	/* close the gap to keep the array packed */
+	ent = __ents(clock);
+
+	memmove(&ent[i], &ent[i + 1],
+		sizeof(struct nvclockent) * (clock->nents - i - 1));
+
+	clock->nents--;
+
+	__shrink(clock);
 
 	return 0;
 }
@@ -220,161 +379,234 @@ int nvclock_inc(struct nvclock *clock)
 
 bool nvclock_is_null(const struct nvclock *clock)
 {
-	int i;
+	return !clock || !clock->nents;
+}
 
-	if (!clock)
-		return true;
+#define AHEAD_U		0x1
+#define AHEAD_V		0x2
 
-	for (i = 0; i < NVCLOCK_NUM_NODES; i++) {
-		if (clock->ent[i].node)
-			return false;
-		if (clock->ent[i].seq)
-			return false;
+static inline enum nvclockcmp __ahead_to_cmp(int ahead)
+{
+	switch (ahead) {
+		case AHEAD_U | AHEAD_V:
+			return NVC_DIV;
+		case AHEAD_U:
+			return NVC_GT;
+		case AHEAD_V:
+			return NVC_LT;
 	}
 
-	return true;
+	return NVC_EQ;
 }
 
-static int vc_cmp(const void *va, const void *vb)
+/*
+ * Vectorized comparison of two clocks with the same number of entries.
+ *
+ * Since both clocks are in canonical form, if they mention the same set of
+ * nodes then the nodes line up index for index and the comparison
+ * degenerates into an element-wise comparison of the sequence ids - which
+ * is trivially vectorizable.  This is by far the most common case when
+ * comparing versions of the same object.
+ *
+ * Each entry is 16 bytes (node, seq) and so an SSE register holds exactly
+ * one entry while an AVX2 register holds two.  We compare the whole
+ * register for equality (only the node lanes matter) and compare it for
+ * greater-than in both directions (only the seq lanes matter, since the
+ * node lanes are equal if we get to use the result).  SSE/AVX2 only have a
+ * signed 64-bit compare, so we flip the sign bits first to get an unsigned
+ * comparison.
+ *
+ * Returns the AHEAD_* bitmask, or -1 if the node sets differ and the caller
+ * has to fall back to the generic merge.
+ */
+#ifdef HAVE_SIMD_CMP
+static int __finish_ahead(int nodes_differ, int u_ahead, int v_ahead)
 {
-	const struct nvclockent *a = va;
-	const struct nvclockent *b = vb;
-
-	if (a->node < b->node)
+	if (nodes_differ)
 		return -1;
-	if (a->node > b->node)
-		return 1;
-	return 0;
+
+	return (u_ahead ? AHEAD_U : 0) | (v_ahead ? AHEAD_V : 0);
 }
 
-/*
- * Are all elements in @u <= than their corresponding elements in @v?
- */
-static bool all_le(struct nvclock *u, int i, struct nvclock *v, int j)
+__attribute__((target("sse4.2")))
+static int __cmp_same_sse42(const struct nvclockent *u,
+			    const struct nvclockent *v, int n)
 {
-	while ((i < NVCLOCK_NUM_NODES) && (j < NVCLOCK_NUM_NODES)) {
-		struct nvclockent *a = &u->ent[i];
-		struct nvclockent *b = &v->ent[j];
+	const __m128i nodemask = _mm_set_epi64x(0, -1);
+	const __m128i bias = _mm_set1_epi64x(INT64_MIN);
+	__m128i ne = _mm_setzero_si128();
+	__m128i gt = _mm_setzero_si128();
+	__m128i lt = _mm_setzero_si128();
+	int i;
 
+	for (i = 0; i < n; i++) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &u[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &v[i]);
 
-		if (a->node < b->node) {
-			/*
-			 * @v doesn't have this node, therefore it is
-			 * assumed to be zero.  Since @u's element won't be
-			 * zero (otherwise it'd be omitted), we are
-			 * essentially asking this question:
-			 *
-			 * x <= 0, where x >= 1
-			 *
-			 * which is obviously false.
-			 */
-			return false;
-		}
+		ne = _mm_or_si128(ne, _mm_andnot_si128(_mm_cmpeq_epi64(a, b),
+						       nodemask));
 
-		if (a->node == b->node) {
-			if (a->seq > b->seq)
-				return false;
+		a = _mm_xor_si128(a, bias);
+		b = _mm_xor_si128(b, bias);
 
-			/* advance both */
-			i++;
-			j++;
-		} else {
-			/* let @u catch up */
-			i++;
-		}
+		gt = _mm_or_si128(gt, _mm_cmpgt_epi64(a, b));
+		lt = _mm_or_si128(lt, _mm_cmpgt_epi64(b, a));
 	}
 
-	return true;
+	return __finish_ahead(!_mm_testz_si128(ne, ne),
+			      !_mm_testz_si128(gt, gt),
+			      !_mm_testz_si128(lt, lt));
 }
 
-static enum nvclockcmp __nvclock_cmp(struct nvclock *u, struct nvclock *v,
-				     int i, int j)
+__attribute__((target("avx2")))
+static int __cmp_same_avx2(const struct nvclockent *u,
+			   const struct nvclockent *v, int n)
 {
-	/* handle some trivial cases (one or both vectors being empty) */
-	if (i == NVCLOCK_NUM_NODES && j == NVCLOCK_NUM_NODES)
-		return NVC_EQ;
-	if (i == NVCLOCK_NUM_NODES)
-		return NVC_LT;
-	if (j == NVCLOCK_NUM_NODES)
-		return NVC_GT;
+	const __m256i nodemask = _mm256_set_epi64x(0, -1, 0, -1);
+	const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+	__m256i ne = _mm256_setzero_si256();
+	__m256i gt = _mm256_setzero_si256();
+	__m256i lt = _mm256_setzero_si256();
+	int i;
 
-	/*
-	 * We have two non-empty vectors.
-	 */
-	if (i == j) {
-		bool all_eq;
-		int tmp;
+	for (i = 0; (i + 2) <= n; i += 2) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) &u[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i *) &v[i]);
 
-		/*
-		 * Both vectors have the same number of elements so they
-		 * have a chance of being equal
-		 */
-		all_eq = true;
+		ne = _mm256_or_si256(ne,
+				     _mm256_andnot_si256(_mm256_cmpeq_epi64(a, b),
+							 nodemask));
 
-		for (tmp = i; all_eq && (tmp < NVCLOCK_NUM_NODES); tmp++)
-			all_eq = ((u->ent[tmp].node == v->ent[tmp].node) &&
-				  (u->ent[tmp].seq == v->ent[tmp].seq));
+		a = _mm256_xor_si256(a, bias);
+		b = _mm256_xor_si256(b, bias);
 
-		if (all_eq)
-			return NVC_EQ;
+		gt = _mm256_or_si256(gt, _mm256_cmpgt_epi64(a, b));
+		lt = _mm256_or_si256(lt, _mm256_cmpgt_epi64(b, a));
 	}
 
-	if (all_le(u, i, v, j))
-		return NVC_LT;
+	/* odd number of entries - do the last one with a 128-bit load */
+	if (i < n) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &u[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &v[i]);
 
-	if (all_le(v, j, u, i))
-		return NVC_GT;
+		/*
+		 * The upper 128 bits of _mm256_castsi128_si256() are
+		 * undefined, so we widen by inserting into a zero register.
+		 */
+		ne = _mm256_or_si256(ne, _mm256_inserti128_si256(
+			_mm256_setzero_si256(),
+			_mm_andnot_si128(_mm_cmpeq_epi64(a, b),
+					 _mm256_castsi256_si128(nodemask)), 0));
+
+		a = _mm_xor_si128(a, _mm256_castsi256_si128(bias));
+		b = _mm_xor_si128(b, _mm256_castsi256_si128(bias));
+
+		gt = _mm256_or_si256(gt, _mm256_inserti128_si256(
+			_mm256_setzero_si256(), _mm_cmpgt_epi64(a, b), 0));
+		lt = _mm256_or_si256(lt, _mm256_inserti128_si256(
+			_mm256_setzero_si256(), _mm_cmpgt_epi64(b, a), 0));
+	}
 
-	return NVC_DIV;
+	return __finish_ahead(!_mm256_testz_si256(ne, ne),
+			      !_mm256_testz_si256(gt, gt),
+			      !_mm256_testz_si256(lt, lt));
 }
+#endif
+
+static int (*__cmp_same)(const struct nvclockent *u,
+			 const struct nvclockent *v, int n);
 
 /*
- * Turn @a and @b into @u and @v and initialize @_i and @_j to work with @u
- * and @v.
+ * Pick the best same-node-set comparison function the CPU supports.  If
+ * there isn't one, __cmp_same stays NULL and we always use the scalar
+ * merge.
  */
-static void __nvclock_cmp_prep(const struct nvclock *a, struct nvclock *u,
-			       int *_i, const struct nvclock *b,
-			       struct nvclock *v, int *_j)
+static void __cmp_init(void)
 {
-	int i, j;
+#ifdef HAVE_SIMD_CMP
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		__cmp_same = __cmp_same_avx2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		__cmp_same = __cmp_same_sse42;
+#endif
+}
 
-	*u = *a;
-	*v = *b;
+/*
+ * Compare @u and @v by merging the two (sorted) entry arrays.  We keep
+ * track of whether we've seen an entry where @u is ahead of @v and vice
+ * versa.  Recall that a missing node is the same as a zero sequence id.
+ *
+ * If both clocks have the same number of entries (and there are enough of
+ * them to make it worth it), we first try the vectorized comparison which
+ * handles the case of identical node sets.
+ */
+static enum nvclockcmp __nvclock_cmp(const struct nvclock *u,
+				     const struct nvclock *v)
+{
+	const struct nvclockent *uent = __cents(u);
+	const struct nvclockent *vent = __cents(v);
+	int ahead = 0;
+	int i = 0;
+	int j = 0;
+
+	if (__cmp_same && (u->nents == v->nents) && (u->nents >= 2)) {
+		int ret;
+
+		ret = __cmp_same(uent, vent, u->nents);
+		if (ret >= 0)
+			return __ahead_to_cmp(ret);
+	}
 
-	qsort(u->ent, NVCLOCK_NUM_NODES, sizeof(struct nvclockent), vc_cmp);
-	qsort(v->ent, NVCLOCK_NUM_NODES, sizeof(struct nvclockent), vc_cmp);
+	while ((i < u->nents) && (j < v->nents)) {
+		const struct nvclockent *a = &uent[i];
+		const struct nvclockent *b = &vent[j];
 
-	/* find first non-zero node */
-	for (i = 0; i < NVCLOCK_NUM_NODES; i++)
-		if (u->ent[i].node)
-			break;
+		if (a->node < b->node) {
+			/* @v doesn't have this node (x > 0) */
+			ahead |= AHEAD_U;
+			i++;
+		} else if (a->node > b->node) {
+			/* @u doesn't have this node (0 < x) */
+			ahead |= AHEAD_V;
+			j++;
+		} else {
+			if (a->seq > b->seq)
+				ahead |= AHEAD_U;
+			else if (a->seq < b->seq)
+				ahead |= AHEAD_V;
 
-	for (j = 0; j < NVCLOCK_NUM_NODES; j++)
-		if (v->ent[j].node)
-			break;
+			/* advance both */
+			i++;
+			j++;
+		}
+
+		if (ahead == (AHEAD_U | AHEAD_V))
+			return NVC_DIV;
+	}
 
-	*_i = i;
-	*_j = j;
+	/* whatever remains in either vector is greater than zero */
+	if (i < u->nents)
+		ahead |= AHEAD_U;
+	if (j < v->nents)
+		ahead |= AHEAD_V;
+
+	return __ahead_to_cmp(ahead);
 }
 
 enum nvclockcmp nvclock_cmp(const struct nvclock *c1, const struct nvclock *c2)
 {
-	struct nvclock u, v;
-	int i, j;
-
-	__nvclock_cmp_prep(c1, &u, &i, c2, &v, &j);
-
-	return __nvclock_cmp(&u, &v, i, j);
+	return __nvclock_cmp(c1, c2);
 }
 
 int nvclock_cmp_total(const struct nvclock *c1, const struct nvclock *c2)
 {
-	struct nvclock u, v;
-	int i, j;
-
-	__nvclock_cmp_prep(c1, &u, &i, c2, &v, &j);
+	const struct nvclockent *ent1 = __cents(c1);
+	const struct nvclockent *ent2 = __cents(c2);
+	int i;
 
-	switch (__nvclock_cmp(&u, &v, i, j)) {
+	switch (__nvclock_cmp(c1, c2)) {
 		case NVC_LT:
 			return -1;
 		case NVC_EQ:
@@ -395,10 +627,10 @@ int nvclock_cmp_total(const struct nvclock *c1, const struct nvclock *c2)
 	 * Note that (c1, c2) must return the opposite value of (c2, c1)
 	 * otherwise this comparator can't be used to sort deterministically.
 	 *
-	 * We sort both vector clocks and then we compare them element-wise.
-	 * The first element that isn't equal determines the direction of
-	 * the result we return.  This has the nice property of producing
-	 * human friendly sorting as well.
+	 * We compare the (already sorted) vector clocks element-wise.  The
+	 * first element that isn't equal determines the direction of the
+	 * result we return.  This has the nice property of producing human
+	 * friendly sorting as well.
 	 *
 	 * For example, suppose we are comparing the following vector
 	 * clocks:
@@ -412,32 +644,17 @@ int nvclock_cmp_total(const struct nvclock *c1, const struct nvclock *c2)
 	 * return +1 to indicate "greater than".
 	 */
 
-	u = *c1;
-	v = *c2;
-
-	qsort(u.ent, NVCLOCK_NUM_NODES, sizeof(struct nvclockent), vc_cmp);
-	qsort(v.ent, NVCLOCK_NUM_NODES, sizeof(struct nvclockent), vc_cmp);
-
-	/* find first non-zero node */
-	for (i = 0; i < NVCLOCK_NUM_NODES; i++)
-		if (u.ent[i].node)
-			break;
-
-	for (j = 0; j < NVCLOCK_NUM_NODES; j++)
-		if (v.ent[j].node)
-			break;
-
-	for (; i < NVCLOCK_NUM_NODES && j < NVCLOCK_NUM_NODES; i++, j++) {
+	for (i = 0; (i < c1->nents) && (i < c2->nents); i++) {
 		/* compare the nodes */
-		if (u.ent[i].node > v.ent[j].node)
+		if (ent1[i].node > ent2[i].node)
 			return 1;
-		if (u.ent[i].node < v.ent[j].node)
+		if (ent1[i].node < ent2[i].node)
 			return -1;
 
 		/* nodes are the same, compare the sequence numbers */
-		if (u.ent[i].seq > v.ent[i].seq)
+		if (ent1[i].seq > ent2[i].seq)
 			return 1;
-		if (u.ent[i].seq < v.ent[i].seq)
+		if (ent1[i].seq < ent2[i].seq)
 			return -1;
 
 		/* sequence numbers are the same, move onto the next entry */
@@ -452,9 +669,9 @@ int nvclock_cmp_total(const struct nvclock *c1, const struct nvclock *c2)
 	 * greater of the two.
 	 */
 
-	if (i == NVCLOCK_NUM_NODES)
+	if (i == c1->nents)
 		return -1;
-	if (j == NVCLOCK_NUM_NODES)
+	if (i == c2->nents)
 		return 1;
 
 	ASSERT(0);
@@ -466,28 +683,25 @@ bool_t xdr_nvclock(XDR *xdrs, struct nvclock *clock)
 	uint32_t num_nodes;
 	int i;
 
-	if (xdrs->x_op == XDR_FREE)
+	if (xdrs->x_op == XDR_FREE) {
+		__clear(clock);
 		return TRUE;
+	}
 
 	if (xdrs->x_op == XDR_ENCODE) {
-		/* count the number of in-use nodes */
-		num_nodes = 0;
-		for (i = 0; i < NVCLOCK_NUM_NODES; i++)
-			if (clock->ent[i].node)
-				num_nodes++;
+		struct nvclockent *ent = __ents(clock);
+
+		num_nodes = clock->nents;
 
 		/* send the number of nodes to follow */
 		if (!xdr_uint32_t(xdrs, &num_nodes))
 			return FALSE;
 
 		/* send the in-use <node,seq> pairs */
-		for (i = 0; i < NVCLOCK_NUM_NODES; i++) {
-			if (!clock->ent[i].node)
-				continue;
-
-			if (!xdr_uint64_t(xdrs, &clock->ent[i].node))
+		for (i = 0; i < num_nodes; i++) {
+			if (!xdr_uint64_t(xdrs, &ent[i].node))
 				return FALSE;
-			if (!xdr_uint64_t(xdrs, &clock->ent[i].seq))
+			if (!xdr_uint64_t(xdrs, &ent[i].seq))
 				return FALSE;
 		}
 	} else {
@@ -499,45 +713,61 @@ bool_t xdr_nvclock(XDR *xdrs, struct nvclock *clock)
 		if (num_nodes > NVCLOCK_NUM_NODES)
 			return FALSE;
 
-		/* receive all the sent nodes */
+		/*
+		 * Start with an empty clock.  Note that decoding always
+		 * happens into a zero-initialized structure.
+		 */
+		memset(clock, 0, sizeof(struct nvclock));
+
+		/*
+		 * Receive all the sent nodes.  We can't trust the sender to
+		 * give us a clock in canonical form, so we insert the
+		 * entries one by one.
+		 */
 		for (i = 0; i < num_nodes; i++) {
-			if (!xdr_uint64_t(xdrs, &clock->ent[i].node))
-				return FALSE;
-			if (!xdr_uint64_t(xdrs, &clock->ent[i].seq))
-				return FALSE;
-		}
+			struct nvclockent ent;
+
+			if (!xdr_uint64_t(xdrs, &ent.node) ||
+			    !xdr_uint64_t(xdrs, &ent.seq))
+				goto err;
+
+			/* node zero is reserved */
+			if (!ent.node)
+				goto err;
+
+			/* each node may appear only once */
+			if (!IS_ERR(__get_ent(clock, ent.node, false)))
+				goto err;
 
-		/* and zero out the rest */
-		for (; i < NVCLOCK_NUM_NODES; i++) {
-			clock->ent[i].node = 0;
-			clock->ent[i].seq = 0;
+			if (nvclock_set_node(clock, ent.node, ent.seq))
+				goto err;
 		}
 	}
 
 	return TRUE;
+
+err:
+	__clear(clock);
+
+	return FALSE;
 }
 
 int nvclock_to_str(struct nvclock *clock, char *str, size_t len)
 {
-	uint32_t num_nodes;
+	struct nvclockent *ent = __ents(clock);
 	int ret;
 	int i;
 
-	num_nodes = 0;
-	for (i = 0; i < NVCLOCK_NUM_NODES; i++)
-		if (clock->ent[i].node)
-			num_nodes++;
-
-	ret = snprintf(str, len, "%u-", num_nodes);
+	ret = snprintf(str, len, "%u-", clock->nents);
 	if ((ret < 0) || (ret > len))
 		goto err;
 
 	str += ret;
 	len -= ret;
 
-	for (i = 0; i < num_nodes; i++) {
+	for (i = 0; i < clock->nents; i++) {
 		ret = snprintf(str, len, "%"PRIx64"_%"PRIx64"-",
-			 clock->ent[i].node,  clock->ent[i].seq);
+			 ent[i].node,  ent[i].seq);
 		if ((ret < 0) || (ret > len))
 			goto err;
 
@@ -36,6 +36,12 @@ enum {
 	OBJ_ATTR_SIZE	= 0x02,
 };
 
+/* objstore_seek() whence values - same semantics as SEEK_{DATA,HOLE} */
+enum objstore_seek {
+	OBJ_SEEK_DATA,
+	OBJ_SEEK_HOLE,
+};
+
 struct objstore_vdev {
 	const struct objstore_vdev_def *def;
 
@@ -49,6 +55,15 @@ struct objstore_vdev {
 	void *private;
 };
 
+/* space used by a vdev (in bytes) */
+struct objstore_vdev_usage {
+	uint64_t limit;		/* 0 = unlimited */
+	uint64_t used;		/* total */
+	uint64_t data;		/* file data */
+	uint64_t meta;		/* object & version metadata */
+	uint64_t dentry;	/* directory entries */
+};
+
 struct objstore {
 	struct list_node node;
 
@@ -66,6 +81,39 @@ struct objstore {
 	void *private;
 };
 
+/*
+ * A read-only reference to a range of object data.  The referenced bytes
+ * are guaranteed to stay unchanged until the reference is released with
+ * objstore_bufref_put() - even if the object is modified in the meantime.
+ */
+struct objstore_bufref {
+	const void *data;
+	size_t len;
+
+	/* private to whoever handed out the reference */
+	void (*release)(struct objstore_bufref *ref);
+	void *private;
+};
+
+/*
+ * An asynchronous read or write.  The caller fills in done (and
+ * optionally private) before passing it to objstore_{read,write}_async().
+ * The structure must stay around until done is called.
+ */
+struct objstore_aio {
+	/*
+	 * Called exactly once with what the synchronous variant of the
+	 * operation would have returned.  May be called from any thread
+	 * (including the submitting one, before the submit function
+	 * returns) so it must not block or call back into objstore.
+	 */
+	void (*done)(struct objstore_aio *aio, ssize_t ret);
+	void *private;
+
+	/* private to objstore */
+	struct obj *obj;
+};
+
 extern int objstore_init(void);
 
 /* vdev management */
@@ -74,6 +122,10 @@ extern struct objstore_vdev *objstore_vdev_create(const char *type,
 extern struct objstore_vdev *objstore_vdev_load(const char *type,
 						const char *path);
 extern void objstore_vdev_free(struct objstore_vdev *vdev);
+extern int objstore_vdev_sync(struct objstore_vdev *vdev);
+extern int objstore_vdev_sync_all(void);
+extern int objstore_vdev_usage(struct objstore_vdev *vdev,
+			       struct objstore_vdev_usage *usage);
 
 REFCNT_INLINE_FXNS(struct objstore_vdev, vdev, refcnt, objstore_vdev_free, NULL)
 
@@ -98,8 +150,22 @@ extern int objstore_setattr(struct objstore *vol, void *cookie,
 			    struct nattr *attr, const unsigned valid);
 extern ssize_t objstore_read(struct objstore *vol, void *cookie, void *buf,
 			     size_t len, uint64_t offset);
+extern ssize_t objstore_read_ref(struct objstore *vol, void *cookie,
+				 size_t len, uint64_t offset,
+				 struct objstore_bufref *ref);
+extern void objstore_bufref_put(struct objstore_bufref *ref);
 extern ssize_t objstore_write(struct objstore *vol, void *cookie,
 			      const void *buf, size_t len, uint64_t offset);
+extern int objstore_read_async(struct objstore *vol, void *cookie, void *buf,
+			       size_t len, uint64_t offset,
+			       struct objstore_aio *aio);
+extern int objstore_write_async(struct objstore *vol, void *cookie,
+				const void *buf, size_t len, uint64_t offset,
+				struct objstore_aio *aio);
+extern int objstore_fork(struct objstore *vol, void *cookie,
+			 const struct nvclock *clock);
+extern int objstore_seek(struct objstore *vol, void *cookie, uint64_t offset,
+			 enum objstore_seek whence, uint64_t *result);
 extern int objstore_lookup(struct objstore *vol, void *dircookie,
 			   const char *name, struct noid *child);
 extern int objstore_create(struct objstore *vol, void *dircookie,
@@ -107,7 +173,7 @@ extern int objstore_create(struct objstore *vol, void *dircookie,
 extern int objstore_unlink(struct objstore *vol, void *dircookie,
 			   const char *name);
 extern int objstore_getdent(struct objstore *vol, void *dircookie,
-			    const uint64_t offset, struct noid *child,
-			    char **childname, uint64_t *entry_size);
+			    const uint64_t cookie, struct noid *child,
+			    char **childname, uint64_t *next_cookie);
 
 #endif
@@ -96,6 +96,48 @@ struct obj_ops {
 	ssize_t (*write)(struct objver *ver, const void *buf, size_t len,
 			 uint64_t offset);
 
+	/*
+	 * Like read and write, but may return -EINPROGRESS after starting
+	 * the I/O.  In that case, the backend must call objstore_aio_done()
+	 * with the result once the I/O finishes.  Any other return value
+	 * is the result of an I/O that already finished.  Since the
+	 * object lock is not held when the I/O finishes, the backend must
+	 * not touch @ver after returning -EINPROGRESS.  Since
+	 * objstore_aio_done() may free the object, it must be called from
+	 * a context that can do (and wait for) more of the backend's I/O.
+	 * Backends without asynchronous I/O can leave these NULL.
+	 */
+	ssize_t (*read_async)(struct objver *ver, void *buf, size_t len,
+			      uint64_t offset, struct objstore_aio *aio);
+	ssize_t (*write_async)(struct objver *ver, const void *buf,
+			       size_t len, uint64_t offset,
+			       struct objstore_aio *aio);
+
+	/*
+	 * Like read, but instead of copying the data into a caller supplied
+	 * buffer, hand out a reference to the backend's copy.  May
+	 * reference fewer bytes than requested (e.g., if the data is not
+	 * contiguous in the backend).
+	 */
+	ssize_t (*read_ref)(struct objver *ver, size_t len, uint64_t offset,
+			    struct objstore_bufref *ref);
+
+	/*
+	 * Find the next data or hole offset at or after offset (which is
+	 * less than the object size).  The end of the object counts as a
+	 * hole.  Returns -ENXIO if there is no data past offset.  Backends
+	 * that don't support sparse objects can leave this NULL.
+	 */
+	int (*seek)(struct objver *ver, uint64_t offset,
+		    enum objstore_seek whence, uint64_t *result);
+
+	/*
+	 * Create a new version with @clock that is a copy of @ver (both the
+	 * contents and the attributes).  Returns -EEXIST if there already
+	 * is a version with that clock.
+	 */
+	int (*fork)(struct objver *ver, const struct nvclock *clock);
+
 	int (*lookup)(struct objver *dirver, const char *name,
 		      struct noid *child);
 	int (*create)(struct objver *dirver, const char *name,
@@ -103,9 +145,18 @@ struct obj_ops {
 	int (*unlink)(struct objver *dirver, const char *name,
 		      struct obj *child);
 
-	int (*getdent)(struct objver *dirver, const uint64_t offset,
+	/*
+	 * Return the first directory entry at or after @cookie.  The
+	 * cookie to resume from is returned in @next_cookie.  Cookies are
+	 * opaque to everyone but the backend, but a cookie of zero always
+	 * refers to the start of the directory.  A cookie must remain valid
+	 * (i.e., resuming from it must neither skip nor repeat entries
+	 * that existed for the whole duration of the iteration) across
+	 * creates and unlinks in the same directory.
+	 */
+	int (*getdent)(struct objver *dirver, const uint64_t cookie,
 		       struct noid *child, char **childname,
-		       uint64_t *entry_size);
+		       uint64_t *next_cookie);
 
 	/*
 	 * Called just before the generic object is freed.
@@ -113,6 +164,8 @@ struct obj_ops {
 	void (*free)(struct obj *obj);
 };
 
+extern void objstore_aio_done(struct objstore_aio *aio, ssize_t ret);
+
 struct vol_ops {
 	int (*getroot)(struct objstore *vol, struct noid *root);
 	int (*allocobj)(struct obj *obj);
@@ -121,9 +174,25 @@ struct vol_ops {
 struct objstore_vdev_def {
 	const char *name;
 
+	/*
+	 * Called once when the backend module is loaded, before any other
+	 * op.  If it fails, the backend isn't used.  Can be NULL.
+	 */
+	int (*init)(void);
+
 	int (*create)(struct objstore_vdev *vdev);
 	int (*create_vol)(struct objstore *vol);
 	int (*load)(struct objstore_vdev *vdev);
+	int (*sync)(struct objstore_vdev *vdev);
+
+	/*
+	 * Make all modifications that completed so far durable.  Called
+	 * after every modifying operation, without any locks held.  Can be
+	 * NULL if the backend does not need it.
+	 */
+	int (*commit)(struct objstore_vdev *vdev);
+	int (*usage)(struct objstore_vdev *vdev,
+		     struct objstore_vdev_usage *usage);
 };
 
 #endif
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+
+#include "log.h"
+
+/*
+ * The cleaner
+ *
+ * The cleaner thread wakes up whenever the number of free segments drops
+ * below the low watermark and cleans segments, oldest first, until there
+ * are enough free segments again.
+ *
+ * Cleaning a segment means appending a fresh copy of everything in it
+ * that is still referenced by the index - the metadata of versions whose
+ * newest record is in the segment, any extents whose data is in it, and
+ * any directory entries whose LINK record is in it.  To find those, we
+ * read the whole segment and walk its records the same way replay does,
+ * looking up each record's object in the index.  Each copy is a regular
+ * record carrying the version's current state, so replay doesn't need to
+ * know anything about the cleaner.  Once the copies are on disk, the
+ * segment is freed.
+ *
+ * The last LOG_CLEAN_RESERVE free segments are reserved for the cleaner,
+ * so that it can always make progress.  Everyone else waits for it to
+ * free up space instead.
+ *
+ * The store lock is dropped while reading the segment and while writing
+ * out the copies, so other operations can proceed while a segment is
+ * being cleaned.
+ */
+
+/* oldest in-use segment other than the head, or nsegs if there isn't one */
+static uint32_t oldest_seg(struct logstore *ls)
+{
+	uint32_t oldest;
+	uint32_t seg;
+
+	oldest = ls->nsegs;
+
+	for (seg = 0; seg < ls->nsegs; seg++) {
+		if (!ls->segs[seg].seq || (seg == ls->head))
+			continue;
+
+		if ((oldest == ls->nsegs) ||
+		    (ls->segs[seg].seq < ls->segs[oldest].seq))
+			oldest = seg;
+	}
+
+	return oldest;
+}
+
+/*
+ * If there is so much live data that we can't get back above the low
+ * watermark, cleaning would just keep copying the same data around.
+ */
+static bool too_full(struct logstore *ls)
+{
+	const uint64_t used = ls->used_data + ls->used_meta + ls->used_dentry;
+
+	return used > ((uint64_t) (ls->nsegs - ls->clean_low) << LOG_SEG_SHIFT);
+}
+
+/* find an extent that still refers to the data of a WRITE record */
+static bool live_ext(struct logver *ver, const struct logop *rec,
+		     struct logop *op)
+{
+	const uint64_t end = rec->arg + rec->datalen;
+	struct logext *ext;
+
+	for (ext = log_find_ext(ver, rec->arg); ext && (ext->off < end);
+	     ext = AVL_NEXT(&ver->extents, ext)) {
+		if ((ext->loc < rec->dataloc) ||
+		    (ext->loc >= (rec->dataloc + rec->datalen)))
+			continue;
+
+		log_fill_op(op, LOG_REC_WRITE, ver, ver->clock);
+		op->arg = ext->off;
+		op->data = (const uint8_t *) rec->data +
+			(ext->loc - rec->dataloc);
+		op->datalen = ext->len;
+
+		return true;
+	}
+
+	return false;
+}
+
+/* check if the directory entry still refers to a LINK record */
+static bool live_dentry(struct logver *ver, const struct logop *rec,
+			struct logop *op)
+{
+	struct logdentry *dentry;
+
+	dentry = log_find_dentry(ver, rec->name);
+	if (!dentry || (dentry->loc != rec->loc))
+		return false;
+
+	log_fill_op(op, LOG_REC_LINK, ver, ver->clock);
+	op->name = dentry->name;
+	op->arg = dentry->uniq;
+	op->cookie = dentry->cookie;
+
+	return true;
+}
+
+/*
+ * Find something in the record @rec that is still referenced by the index
+ * and prepare @op to relocate it.  Returns false if there is nothing left.
+ */
+static bool find_live(struct logstore *ls, const struct logop *rec,
+		      struct logop *op)
+{
+	struct logobj *obj;
+	struct logver *ver;
+
+	obj = log_find_obj(ls, &rec->oid);
+	if (!obj)
+		return false;
+
+	/*
+	 * The version's clock may have changed since the record was
+	 * written, so we check all of them.  There are rarely more than
+	 * one.
+	 */
+	for (ver = avl_first(&obj->versions); ver;
+	     ver = AVL_NEXT(&obj->versions, ver)) {
+		switch (rec->type) {
+			case LOG_REC_WRITE:
+				if (live_ext(ver, rec, op))
+					return true;
+				break;
+			case LOG_REC_LINK:
+				if (live_dentry(ver, rec, op))
+					return true;
+				break;
+			default:
+				break;
+		}
+
+		/* relocating any of the above moves the metadata as well */
+		if (ver->metaloc == rec->loc) {
+			log_fill_op(op, LOG_REC_ATTR, ver, ver->clock);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Relocate whatever the index still references in the record @rec, one
+ * piece at a time.  The record's data points into the segment buffer.
+ *
+ * The store lock is dropped while each copy is written out, so we don't
+ * hang on to any index pointers across appends and look things up again
+ * instead.
+ */
+static int relocate_rec(struct logstore *ls, const struct logop *rec,
+			void *arg)
+{
+	struct logop op;
+	int ret;
+
+	for (;;) {
+		/* the copy must be based on the latest state */
+		log_drain(ls);
+
+		if (!find_live(ls, rec, &op))
+			return 0;
+
+		ret = log_append(ls, &op, 1, true);
+		if (ret)
+			return ret;
+
+		/* this replaces whatever we are relocating */
+		ret = log_apply(ls, &op);
+
+		log_append_done(ls, &op);
+
+		if (ret)
+			return ret;
+	}
+}
+
+/* wait for all appends to & reads from a segment to finish */
+static void wait_unpinned(struct logstore *ls, uint32_t seg)
+{
+	while (ls->segs[seg].refs)
+		CONDWAIT(&ls->io_cond, &ls->lock);
+}
+
+static int clean_seg(struct logstore *ls, uint32_t seg)
+{
+	const uint64_t before = ls->clean_bytes;
+	uint8_t *buf;
+	int ret;
+
+	wait_unpinned(ls, seg);
+
+	if (!ls->segs[seg].live)
+		goto free;
+
+	buf = malloc(LOG_SEG_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	/* nobody else appends to or frees the segment */
+	MXUNLOCK(&ls->lock);
+	ret = xpread(ls->fd, buf, LOG_SEG_SIZE, log_seg_off(seg));
+	MXLOCK(&ls->lock);
+
+	if (!ret)
+		ret = log_walk_seg(ls, seg, buf, relocate_rec, NULL);
+
+	free(buf);
+
+	if (ret)
+		return ret;
+
+	VERIFY0(ls->segs[seg].live);
+
+	/* the copies must be on disk before we let go of the originals */
+	MXUNLOCK(&ls->lock);
+	ret = fdatasync(ls->fd) ? -errno : 0;
+	MXLOCK(&ls->lock);
+
+	if (ret)
+		return ret;
+
+free:
+	/* readers that looked up the old locations may still be around */
+	wait_unpinned(ls, seg);
+
+	ret = log_free_seg(ls, seg);
+	if (ret)
+		return ret;
+
+	/* everything was live, we just moved it around */
+	return ((ls->clean_bytes - before) < LOG_SEG_SIZE) ? 0 : -ENOSPC;
+}
+
+static void *cleaner(void *arg)
+{
+	struct logstore *ls = arg;
+
+	MXLOCK(&ls->lock);
+
+	while (!ls->cleaner_exit) {
+		uint32_t seg;
+		int ret;
+
+		if (ls->nfree >= ls->clean_low) {
+			CONDWAIT(&ls->cleaner_cond, &ls->lock);
+			continue;
+		}
+
+		seg = oldest_seg(ls);
+		if ((seg == ls->nsegs) || too_full(ls))
+			ret = -ENOSPC;
+		else
+			ret = clean_seg(ls, seg);
+
+		if (ret) {
+			if (ret != -ENOSPC)
+				cmn_err(CE_WARN, "log cleaner failed to clean "
+					"segment %u: %s", seg, xstrerror(ret));
+
+			/* let the waiters fail & wait for someone to poke us */
+			ls->nospc = true;
+			CONDBCAST(&ls->space_cond);
+			CONDWAIT(&ls->cleaner_cond, &ls->lock);
+			continue;
+		}
+
+		ls->nospc = false;
+		CONDBCAST(&ls->space_cond);
+	}
+
+	MXUNLOCK(&ls->lock);
+
+	return NULL;
+}
+
+int log_cleaner_start(struct logstore *ls)
+{
+	int ret;
+
+	ls->clean_low = MAX(ls->nsegs / 8, LOG_CLEAN_RESERVE + 2);
+	ls->cleaner_exit = false;
+	ls->nospc = false;
+
+	ret = pthread_create(&ls->cleaner, NULL, cleaner, ls);
+	if (ret)
+		return -ret;
+
+	ls->cleaner_running = true;
+
+	return 0;
+}
+
+void log_cleaner_stop(struct logstore *ls)
+{
+	if (!ls->cleaner_running)
+		return;
+
+	MXLOCK(&ls->lock);
+	ls->cleaner_exit = true;
+	CONDSIG(&ls->cleaner_cond);
+	MXUNLOCK(&ls->lock);
+
+	VERIFY0(pthread_join(ls->cleaner, NULL));
+
+	ls->cleaner_running = false;
+}
+
+/*
+ * Wait until there are more than LOG_CLEAN_RESERVE free segments.  Must be
+ * called with the store locked.  The lock is dropped while waiting.
+ */
+int log_wait_for_space(struct logstore *ls)
+{
+	while (ls->nfree <= LOG_CLEAN_RESERVE) {
+		if (!ls->cleaner_running)
+			return -ENOSPC;
+
+		CONDSIG(&ls->cleaner_cond);
+		CONDWAIT(&ls->space_cond, &ls->lock);
+
+		if ((ls->nfree <= LOG_CLEAN_RESERVE) && ls->nospc)
+			return -ENOSPC;
+	}
+
+	return 0;
+}
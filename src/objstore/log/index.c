@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+
+#include "log.h"
+
+/*
+ * The in-memory index
+ *
+ * The index is only ever modified by log_apply(), which is used both when
+ * replaying the log and after appending new records.  This way, the state
+ * we rebuild after a restart is exactly the state we had before.
+ *
+ * Along the way, we keep track of how many bytes in each segment are still
+ * referenced by the index:
+ *
+ *  - the newest record of each version (its metadata)
+ *  - the data of each extent
+ *  - the LINK record of each directory entry
+ */
+
+static int obj_cmp(const void *va, const void *vb)
+{
+	const struct logobj *a = va;
+	const struct logobj *b = vb;
+
+	return noid_cmp(&a->oid, &b->oid);
+}
+
+static int ver_cmp(const void *va, const void *vb)
+{
+	const struct logver *a = va;
+	const struct logver *b = vb;
+
+	return nvclock_cmp_total(a->clock, b->clock);
+}
+
+static int ext_cmp(const void *va, const void *vb)
+{
+	const struct logext *a = va;
+	const struct logext *b = vb;
+
+	if (a->off < b->off)
+		return -1;
+	if (a->off > b->off)
+		return 1;
+	return 0;
+}
+
+static int dentry_name_cmp(const void *va, const void *vb)
+{
+	const struct logdentry *a = va;
+	const struct logdentry *b = vb;
+	int ret;
+
+	ret = strcmp(a->name, b->name);
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return 1;
+	return 0;
+}
+
+static int dentry_cookie_cmp(const void *va, const void *vb)
+{
+	const struct logdentry *a = va;
+	const struct logdentry *b = vb;
+
+	if (a->cookie < b->cookie)
+		return -1;
+	if (a->cookie > b->cookie)
+		return 1;
+	return 0;
+}
+
+static void use(struct logstore *ls, uint64_t *counter, uint64_t loc,
+		uint64_t len)
+{
+	ls->segs[log_loc_seg(loc)].live += len;
+	*counter += len;
+}
+
+static void unuse(struct logstore *ls, uint64_t *counter, uint64_t loc,
+		  uint64_t len)
+{
+	struct logseg *seg = &ls->segs[log_loc_seg(loc)];
+
+	VERIFY3U(seg->live, >=, len);
+	VERIFY3U(*counter, >=, len);
+
+	seg->live -= len;
+	*counter -= len;
+}
+
+void log_index_init(struct logstore *ls)
+{
+	avl_create(&ls->objs, obj_cmp, sizeof(struct logobj),
+		   offsetof(struct logobj, node));
+
+	ls->next_uniq = 1;
+	ls->used_data = 0;
+	ls->used_meta = 0;
+	ls->used_dentry = 0;
+}
+
+void log_index_fini(struct logstore *ls)
+{
+	struct logobj *obj;
+
+	while ((obj = avl_first(&ls->objs)))
+		log_free_obj(ls, obj);
+
+	avl_destroy(&ls->objs);
+}
+
+struct logobj *log_find_obj(struct logstore *ls, const struct noid *oid)
+{
+	struct logobj key = {
+		.oid = *oid,
+	};
+
+	return avl_find(&ls->objs, &key, NULL);
+}
+
+static struct logver *find_ver(struct logobj *obj,
+				const struct nvclock *clock)
+{
+	struct logver key = {
+		.clock = (struct nvclock *) clock,
+	};
+
+	return avl_find(&obj->versions, &key, NULL);
+}
+
+/*
+ * Find the version with the given clock.  A null clock matches the only
+ * version of the object.
+ */
+struct logver *log_find_ver(struct logobj *obj, const struct nvclock *clock)
+{
+	struct logver *ver;
+
+	if (nvclock_is_null(clock)) {
+		if (avl_numnodes(&obj->versions) > 1)
+			return ERR_PTR(-ENOTUNIQ);
+
+		ver = avl_first(&obj->versions);
+	} else {
+		ver = find_ver(obj, clock);
+	}
+
+	return ver ? ver : ERR_PTR(-ENOENT);
+}
+
+/*
+ * Root directories are found as the volume's root-flagged object.  Since
+ * the root is the first object created in a volume, it is usually the
+ * first one we look at.
+ */
+struct logobj *log_find_root(struct logstore *ls, const struct xuuid *vol)
+{
+	struct logobj key;
+	struct logobj *obj;
+	avl_index_t where;
+
+	noid_set(&key.oid, vol, 0);
+
+	obj = avl_find(&ls->objs, &key, &where);
+	if (!obj)
+		obj = avl_nearest(&ls->objs, where, AVL_AFTER);
+
+	for (; obj && !xuuid_compare(&obj->oid.vol, vol);
+	     obj = AVL_NEXT(&ls->objs, obj))
+		if (obj->root)
+			return obj;
+
+	return NULL;
+}
+
+static struct logobj *newobj(struct logstore *ls, const struct noid *oid)
+{
+	struct logobj *obj;
+
+	obj = malloc(sizeof(struct logobj));
+	if (!obj)
+		return NULL;
+
+	obj->oid = *oid;
+	obj->nlink = 0;
+	obj->root = false;
+
+	avl_create(&obj->versions, ver_cmp, sizeof(struct logver),
+		   offsetof(struct logver, node));
+
+	avl_add(&ls->objs, obj);
+
+	return obj;
+}
+
+static struct logver *newver(struct logobj *obj, const struct nvclock *clock)
+{
+	struct logver *ver;
+
+	ver = malloc(sizeof(struct logver));
+	if (!ver)
+		return NULL;
+
+	ver->clock = nvclock_dup(clock);
+	if (!ver->clock) {
+		free(ver);
+		return NULL;
+	}
+
+	memset(&ver->attrs, 0, sizeof(ver->attrs));
+	ver->metaloc = 0;
+	ver->metalen = 0;
+	ver->next_cookie = 1;
+	ver->obj = obj;
+
+	avl_create(&ver->extents, ext_cmp, sizeof(struct logext),
+		   offsetof(struct logext, node));
+	avl_create(&ver->dentries, dentry_name_cmp, sizeof(struct logdentry),
+		   offsetof(struct logdentry, name_node));
+	avl_create(&ver->cookies, dentry_cookie_cmp, sizeof(struct logdentry),
+		   offsetof(struct logdentry, cookie_node));
+
+	avl_add(&obj->versions, ver);
+
+	return ver;
+}
+
+static void freever(struct logstore *ls, struct logver *ver)
+{
+	struct logdentry *dentry;
+	struct logext *ext;
+	void *cookie;
+
+	cookie = NULL;
+	while ((ext = avl_destroy_nodes(&ver->extents, &cookie))) {
+		unuse(ls, &ls->used_data, ext->loc, ext->len);
+		free(ext);
+	}
+
+	cookie = NULL;
+	while ((dentry = avl_destroy_nodes(&ver->cookies, &cookie))) {
+		avl_remove(&ver->dentries, dentry);
+		unuse(ls, &ls->used_dentry, dentry->loc, dentry->len);
+		free(dentry->name);
+		free(dentry);
+	}
+
+	if (ver->metalen)
+		unuse(ls, &ls->used_meta, ver->metaloc, ver->metalen);
+
+	avl_destroy(&ver->extents);
+	avl_destroy(&ver->dentries);
+	avl_destroy(&ver->cookies);
+	nvclock_free(ver->clock);
+	free(ver);
+}
+
+/* remove the object and everything it references from the index */
+void log_free_obj(struct logstore *ls, struct logobj *obj)
+{
+	struct logver *ver;
+	void *cookie;
+
+	cookie = NULL;
+	while ((ver = avl_destroy_nodes(&obj->versions, &cookie)))
+		freever(ls, ver);
+
+	avl_destroy(&obj->versions);
+	avl_remove(&ls->objs, obj);
+	free(obj);
+}
+
+/* objects without any links are unreachable */
+void log_drop_dead(struct logstore *ls)
+{
+	struct logobj *obj;
+	struct logobj *next;
+
+	for (obj = avl_first(&ls->objs); obj; obj = next) {
+		next = AVL_NEXT(&ls->objs, obj);
+
+		if (!obj->nlink && !obj->root)
+			log_free_obj(ls, obj);
+	}
+}
+
+/* returns the extent containing @off, or the first one after it */
+struct logext *log_find_ext(struct logver *ver, uint64_t off)
+{
+	struct logext key = {
+		.off = off,
+	};
+	struct logext *ext;
+	avl_index_t where;
+
+	ext = avl_find(&ver->extents, &key, &where);
+	if (ext)
+		return ext;
+
+	ext = avl_nearest(&ver->extents, where, AVL_BEFORE);
+	if (ext && ((ext->off + ext->len) > off))
+		return ext;
+
+	return avl_nearest(&ver->extents, where, AVL_AFTER);
+}
+
+/* forget about any data in [start, end) */
+static int punch(struct logstore *ls, struct logver *ver, uint64_t start,
+		 uint64_t end)
+{
+	struct logext *next;
+	struct logext *ext;
+
+	for (ext = log_find_ext(ver, start); ext && (ext->off < end);
+	     ext = next) {
+		const uint64_t extend = ext->off + ext->len;
+
+		next = AVL_NEXT(&ver->extents, ext);
+
+		if ((ext->off < start) && (extend > end)) {
+			/* punching out the middle - keep the tail around */
+			struct logext *tail;
+
+			tail = malloc(sizeof(struct logext));
+			if (!tail)
+				return -ENOMEM;
+
+			tail->off = end;
+			tail->len = extend - end;
+			tail->loc = ext->loc + (end - ext->off);
+
+			unuse(ls, &ls->used_data, ext->loc + (start - ext->off),
+			      end - start);
+
+			ext->len = start - ext->off;
+
+			avl_add(&ver->extents, tail);
+		} else if (ext->off < start) {
+			/* trim the end */
+			unuse(ls, &ls->used_data, ext->loc + (start - ext->off),
+			      extend - start);
+
+			ext->len = start - ext->off;
+		} else if (extend > end) {
+			/* trim the start - this doesn't change the order */
+			unuse(ls, &ls->used_data, ext->loc, end - ext->off);
+
+			ext->loc += end - ext->off;
+			ext->len = extend - end;
+			ext->off = end;
+		} else {
+			unuse(ls, &ls->used_data, ext->loc, ext->len);
+
+			avl_remove(&ver->extents, ext);
+			free(ext);
+		}
+	}
+
+	return 0;
+}
+
+static int add_extent(struct logstore *ls, struct logver *ver, uint64_t off,
+		      uint64_t len, uint64_t loc)
+{
+	struct logext *ext;
+	int ret;
+
+	if (!len)
+		return 0;
+
+	ext = malloc(sizeof(struct logext));
+	if (!ext)
+		return -ENOMEM;
+
+	ret = punch(ls, ver, off, off + len);
+	if (ret) {
+		free(ext);
+		return ret;
+	}
+
+	ext->off = off;
+	ext->len = len;
+	ext->loc = loc;
+
+	avl_add(&ver->extents, ext);
+
+	use(ls, &ls->used_data, loc, len);
+
+	return 0;
+}
+
+struct logdentry *log_find_dentry(struct logver *ver, const char *name)
+{
+	struct logdentry key = {
+		.name = (char *) name,
+	};
+
+	return avl_find(&ver->dentries, &key, NULL);
+}
+
+static int add_dentry(struct logstore *ls, struct logver *ver,
+		      const struct logop *op)
+{
+	struct logdentry *dentry;
+
+	dentry = log_find_dentry(ver, op->name);
+	if (dentry) {
+		/* a relocated entry */
+		unuse(ls, &ls->used_dentry, dentry->loc, dentry->len);
+		avl_remove(&ver->cookies, dentry);
+	} else {
+		dentry = malloc(sizeof(struct logdentry));
+		if (!dentry)
+			return -ENOMEM;
+
+		dentry->name = strdup(op->name);
+		if (!dentry->name) {
+			free(dentry);
+			return -ENOMEM;
+		}
+
+		avl_add(&ver->dentries, dentry);
+	}
+
+	/* the cookie comes from the record so that it survives a reload */
+	dentry->cookie = op->cookie;
+	avl_add(&ver->cookies, dentry);
+
+	ver->next_cookie = MAX(ver->next_cookie, op->cookie + 1);
+
+	dentry->uniq = op->arg;
+	dentry->loc = op->loc;
+	dentry->len = op->len;
+
+	use(ls, &ls->used_dentry, dentry->loc, dentry->len);
+
+	return 0;
+}
+
+static void remove_dentry(struct logstore *ls, struct logver *ver,
+			  const char *name)
+{
+	struct logdentry *dentry;
+
+	/*
+	 * The LINK record may have been cleaned up already, in which case
+	 * there is nothing to do.
+	 */
+	dentry = log_find_dentry(ver, name);
+	if (!dentry)
+		return;
+
+	unuse(ls, &ls->used_dentry, dentry->loc, dentry->len);
+
+	avl_remove(&ver->dentries, dentry);
+	avl_remove(&ver->cookies, dentry);
+	free(dentry->name);
+	free(dentry);
+}
+
+/*
+ * Find (or create) the version a record applies to.  Normally, that's the
+ * version with the record's old clock.  If we don't have it, older records
+ * for this version have already been cleaned and the version may be known
+ * under its new clock already (e.g., a record written by the cleaner) or
+ * not at all (the first surviving record).
+ */
+static struct logver *get_ver(struct logstore *ls, const struct logop *op)
+{
+	struct logobj *obj;
+	struct logver *ver;
+	int ret;
+
+	obj = log_find_obj(ls, &op->oid);
+	if (!obj) {
+		obj = newobj(ls, &op->oid);
+		if (!obj)
+			return ERR_PTR(-ENOMEM);
+	}
+
+	ver = op->oldclock ? find_ver(obj, op->oldclock) : NULL;
+	if (!ver)
+		ver = find_ver(obj, op->clock);
+	if (!ver) {
+		ver = newver(obj, op->clock);
+		if (!ver)
+			goto err;
+
+		return ver;
+	}
+
+	if (nvclock_cmp(ver->clock, op->clock) == NVC_EQ)
+		return ver;
+
+	/* the clock is the key, so we need to re-insert the version */
+	avl_remove(&obj->versions, ver);
+	ret = nvclock_copy(ver->clock, op->clock);
+	avl_add(&obj->versions, ver);
+
+	if (ret)
+		return ERR_PTR(ret);
+
+	return ver;
+
+err:
+	if (!avl_numnodes(&obj->versions))
+		log_free_obj(ls, obj);
+
+	return ERR_PTR(-ENOMEM);
+}
+
+int log_apply(struct logstore *ls, const struct logop *op)
+{
+	struct logver *ver;
+	int ret;
+
+	ls->next_uniq = MAX(ls->next_uniq, op->oid.uniq + 1);
+
+	ver = get_ver(ls, op);
+	if (IS_ERR(ver))
+		return PTR_ERR(ver);
+
+	ver->obj->nlink = op->attrs.nlink;
+	ver->obj->root |= op->root;
+	ver->attrs = op->attrs;
+
+	switch (op->type) {
+		case LOG_REC_NEW:
+		case LOG_REC_ATTR:
+			ret = 0;
+			break;
+		case LOG_REC_WRITE:
+			ret = add_extent(ls, ver, op->arg, op->datalen,
+					 op->dataloc);
+			break;
+		case LOG_REC_LINK:
+			ret = add_dentry(ls, ver, op);
+			break;
+		case LOG_REC_UNLINK:
+			remove_dentry(ls, ver, op->name);
+			ret = 0;
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+	}
+
+	if (ret)
+		return ret;
+
+	/* anything past the end of the file is gone */
+	if (NATTR_ISREG(ver->attrs.mode)) {
+		ret = punch(ls, ver, ver->attrs.size, UINT64_MAX);
+		if (ret)
+			return ret;
+	}
+
+	/* this is now the newest record of the version */
+	if (ver->metalen)
+		unuse(ls, &ls->used_meta, ver->metaloc, ver->metalen);
+
+	ver->metaloc = op->loc;
+	ver->metalen = op->len;
+
+	use(ls, &ls->used_meta, ver->metaloc, ver->metalen);
+
+	return 0;
+}
+
+/*
+ * Prepare a record for @ver based on its current state.  The caller
+ * adjusts the attributes, etc. as needed.
+ */
+void log_fill_op(struct logop *op, enum logrec_type type, struct logver *ver,
+		 const struct nvclock *clock)
+{
+	memset(op, 0, sizeof(*op));
+
+	op->type = type;
+	op->root = ver->obj->root;
+	op->oid = ver->obj->oid;
+	op->oldclock = ver->clock;
+	op->clock = clock;
+	op->attrs = ver->attrs;
+	op->attrs.nlink = ver->obj->nlink;
+}
@@ -0,0 +1,749 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/int.h>
+#include <jeffpc/io.h>
+
+#include <nomad/crc32c.h>
+
+#include "log.h"
+
+/*
+ * The log itself - segment management, appending, and replay
+ */
+
+static inline uint32_t seghdr_cksum(const struct logseghdr *hdr)
+{
+	return nomad_crc32c(hdr, offsetof(struct logseghdr, cksum));
+}
+
+/* a seq of zero marks the segment free */
+static int write_seghdr(struct logstore *ls, uint32_t seg, uint64_t seq)
+{
+	struct logseghdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	if (seq) {
+		hdr.magic = cpu32_to_be(LOG_SEG_MAGIC);
+		hdr.version = cpu32_to_be(LOG_VERSION);
+		hdr.seq = cpu64_to_be(seq);
+		hdr.cksum = cpu32_to_be(seghdr_cksum(&hdr));
+	}
+
+	return xpwrite(ls->fd, &hdr, sizeof(hdr), log_seg_off(seg));
+}
+
+/* returns the segment's seq, or 0 if it is free */
+static int read_seghdr(struct logstore *ls, uint32_t seg, uint64_t *seq)
+{
+	struct logseghdr hdr;
+	int ret;
+
+	ret = xpread(ls->fd, &hdr, sizeof(hdr), log_seg_off(seg));
+	if (ret)
+		return ret;
+
+	if ((be32_to_cpu(hdr.magic) != LOG_SEG_MAGIC) ||
+	    (be32_to_cpu(hdr.cksum) != seghdr_cksum(&hdr))) {
+		*seq = 0;
+		return 0;
+	}
+
+	if (be32_to_cpu(hdr.version) != LOG_VERSION)
+		return -ENOTSUP;
+
+	*seq = be64_to_cpu(hdr.seq);
+
+	return 0;
+}
+
+/*
+ * Start a brand new log - every segment is free.
+ */
+int log_format(struct logstore *ls)
+{
+	uint32_t seg;
+	int ret;
+
+	for (seg = 0; seg < ls->nsegs; seg++) {
+		ret = write_seghdr(ls, seg, 0);
+		if (ret)
+			return ret;
+
+		ls->segs[seg].seq = 0;
+		ls->segs[seg].live = 0;
+	}
+
+	ls->nfree = ls->nsegs;
+	ls->nextseq = 1;
+
+	/* make the first append allocate a segment */
+	ls->head = ls->nsegs - 1;
+	ls->headoff = LOG_SEG_SIZE;
+
+	return 0;
+}
+
+/*
+ * Mark a (cleaned) segment as free.  The caller must make sure that
+ * nothing in the index refers to it.
+ */
+int log_free_seg(struct logstore *ls, uint32_t seg)
+{
+	int ret;
+
+	ASSERT3U(seg, !=, ls->head);
+	ASSERT3U(ls->segs[seg].seq, !=, 0);
+	ASSERT0(ls->segs[seg].live);
+
+	ret = write_seghdr(ls, seg, 0);
+	if (ret)
+		return ret;
+
+	ls->segs[seg].seq = 0;
+	ls->nfree++;
+
+	return 0;
+}
+
+/*
+ * Move the head to a free segment unless there is room for @len more
+ * bytes in the current one.  Unless we are the cleaner, we leave the last
+ * few free segments for the cleaner and wait for it to free up more.
+ */
+static int next_seg(struct logstore *ls, size_t len, bool cleaner)
+{
+	uint32_t seg;
+	int ret;
+
+	if (!cleaner) {
+		/* this may drop the lock */
+		ret = log_wait_for_space(ls);
+		if (ret)
+			return ret;
+
+		/* someone else may have moved the head in the mean time */
+		if (ls->headoff + len <= LOG_SEG_SIZE)
+			return 0;
+	}
+
+	if (!ls->nfree)
+		return -ENOSPC;
+
+	for (seg = (ls->head + 1) % ls->nsegs; ls->segs[seg].seq;
+	     seg = (seg + 1) % ls->nsegs)
+		;
+
+	ret = write_seghdr(ls, seg, ls->nextseq);
+	if (ret)
+		return ret;
+
+	ls->segs[seg].seq = ls->nextseq++;
+	ls->segs[seg].live = 0;
+	ls->segs[seg].failed = false;
+	ls->nfree--;
+
+	ls->head = seg;
+	ls->headoff = sizeof(struct logseghdr);
+
+	if (ls->nfree < ls->clean_low)
+		CONDSIG(&ls->cleaner_cond);
+
+	return 0;
+}
+
+static size_t encode_clock(const struct nvclock *clock, uint8_t *buf,
+			   uint8_t *nents)
+{
+	struct nvclockent ents[NVCLOCK_NUM_NODES];
+	struct nvclockent *out = (struct nvclockent *) buf;
+	unsigned n;
+	unsigned i;
+
+	n = clock ? nvclock_get_ents(clock, ents) : 0;
+
+	for (i = 0; i < n; i++) {
+		out[i].node = cpu64_to_be(ents[i].node);
+		out[i].seq = cpu64_to_be(ents[i].seq);
+	}
+
+	*nents = n;
+
+	return n * sizeof(struct nvclockent);
+}
+
+static size_t rec_len(const struct logop *op)
+{
+	struct nvclockent ents[NVCLOCK_NUM_NODES];
+	size_t len;
+
+	len = sizeof(struct logrec);
+	if (op->oldclock)
+		len += nvclock_get_ents(op->oldclock, ents) *
+			sizeof(struct nvclockent);
+	len += nvclock_get_ents(op->clock, ents) * sizeof(struct nvclockent);
+	len += log_pad(op->name ? strlen(op->name) : 0);
+	len += log_pad(op->datalen);
+
+	return len;
+}
+
+/* returns the number of bytes used */
+static size_t encode_rec(struct logop *op, uint8_t *buf, uint64_t loc)
+{
+	struct logrec *rec = (struct logrec *) buf;
+	const size_t namelen = op->name ? strlen(op->name) : 0;
+	size_t off;
+
+	rec->type = op->type;
+	rec->flags = op->root ? LOG_REC_ROOT : 0;
+	rec->vol = op->oid.vol;
+	rec->uniq = cpu64_to_be(op->oid.uniq);
+	rec->mode = cpu16_to_be(op->attrs.mode);
+	rec->namelen = cpu16_to_be(namelen);
+	rec->nlink = cpu32_to_be(op->attrs.nlink);
+	rec->datalen = cpu32_to_be(op->datalen);
+	rec->size = cpu64_to_be(op->attrs.size);
+	rec->atime = cpu64_to_be(op->attrs.atime);
+	rec->btime = cpu64_to_be(op->attrs.btime);
+	rec->ctime = cpu64_to_be(op->attrs.ctime);
+	rec->mtime = cpu64_to_be(op->attrs.mtime);
+	rec->arg = cpu64_to_be(op->arg);
+	rec->cookie = cpu64_to_be(op->cookie);
+
+	off = sizeof(struct logrec);
+	off += encode_clock(op->oldclock, buf + off, &rec->noldclock);
+	off += encode_clock(op->clock, buf + off, &rec->nclock);
+
+	if (namelen)
+		memcpy(buf + off, op->name, namelen);
+	off += log_pad(namelen);
+
+	op->loc = loc;
+	op->len = off;
+	op->dataloc = loc + off;
+
+	if (op->datalen)
+		memcpy(buf + off, op->data, op->datalen);
+	off += log_pad(op->datalen);
+
+	rec->len = cpu32_to_be(off);
+
+	return off;
+}
+
+/*
+ * Append @ops as a single batch.  On success, the location of each record
+ * is filled in, and the caller must apply the ops to the index and then
+ * call log_append_done().  On failure, nothing needs to be undone.
+ *
+ * Must be called with the store locked.  The lock is dropped while the
+ * batch is encoded and written out, so that other operations (including
+ * other appends) can proceed in the mean time.  The space for each batch
+ * is reserved in order, and each append waits for all the earlier ones to
+ * be applied before returning, so the index is updated in the same order
+ * as replay would do it.
+ */
+int log_append(struct logstore *ls, struct logop *ops, size_t nops,
+	       bool cleaner)
+{
+	struct logbatch *batch;
+	uint64_t ticket;
+	uint64_t segseq;
+	uint32_t seg;
+	uint8_t *buf;
+	uint64_t loc;
+	size_t len;
+	size_t off;
+	size_t i;
+	int ret;
+
+	len = sizeof(struct logbatch);
+	for (i = 0; i < nops; i++)
+		len += rec_len(&ops[i]);
+
+	if (len > (LOG_SEG_SIZE - sizeof(struct logseghdr)))
+		return -E2BIG;
+
+	buf = calloc(1, len);
+	if (!buf)
+		return -ENOMEM;
+
+	for (;;) {
+		/* let the cleaner see a stable index */
+		if (!cleaner && ls->draining) {
+			CONDWAIT(&ls->io_cond, &ls->lock);
+			continue;
+		}
+
+		if (ls->headoff + len <= LOG_SEG_SIZE)
+			break;
+
+		/* the cleaner always gets a new segment */
+		if (cleaner)
+			ls->clean_bytes += LOG_SEG_SIZE - ls->headoff;
+
+		ret = next_seg(ls, len, cleaner);
+		if (ret) {
+			free(buf);
+			return ret;
+		}
+	}
+
+	seg = ls->head;
+	segseq = ls->segs[seg].seq;
+	loc = log_seg_off(seg) + ls->headoff;
+
+	ls->headoff += len;
+	log_pin_seg(ls, seg);
+	ticket = ls->next_ticket++;
+
+	if (cleaner)
+		ls->clean_bytes += len;
+
+	MXUNLOCK(&ls->lock);
+
+	off = sizeof(struct logbatch);
+	for (i = 0; i < nops; i++)
+		off += encode_rec(&ops[i], buf + off, loc + off);
+
+	ASSERT3U(off, ==, len);
+
+	batch = (struct logbatch *) buf;
+	batch->magic = cpu32_to_be(LOG_BATCH_MAGIC);
+	batch->len = cpu32_to_be(len);
+	batch->segseq = cpu64_to_be(segseq);
+	batch->nrecs = cpu32_to_be(nops);
+	batch->cksum = cpu32_to_be(nomad_crc32c(buf, len));
+
+	ret = xpwrite(ls->fd, buf, len, loc);
+
+	free(buf);
+
+	MXLOCK(&ls->lock);
+
+	while (ls->applied != ticket)
+		CONDWAIT(&ls->io_cond, &ls->lock);
+
+	/*
+	 * Replay stops at the first batch in a segment that didn't make it
+	 * to disk, so anything after a failed batch is lost as well.  We
+	 * fail those appends too, and make sure that no new ones end up in
+	 * the same segment.
+	 */
+	if (!ret && ls->segs[seg].failed)
+		ret = -EIO;
+
+	if (ret) {
+		ls->segs[seg].failed = true;
+
+		if (seg == ls->head)
+			ls->headoff = LOG_SEG_SIZE;
+
+		log_append_done(ls, ops);
+
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Let the next append proceed.  Must be called with the store locked.
+ */
+void log_append_done(struct logstore *ls, const struct logop *ops)
+{
+	log_unpin_seg(ls, log_loc_seg(ops[0].loc));
+
+	ls->applied++;
+	CONDBCAST(&ls->io_cond);
+}
+
+/*
+ * Append @ops and apply them to the index.  Must be called with the store
+ * locked.  The lock is dropped while the ops are written out.
+ */
+int log_commit(struct logstore *ls, struct logop *ops, size_t nops)
+{
+	size_t i;
+	int ret;
+
+	ret = log_append(ls, ops, nops, false);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nops; i++) {
+		ret = log_apply(ls, &ops[i]);
+		if (ret)
+			break;
+	}
+
+	log_append_done(ls, ops);
+
+	return ret;
+}
+
+/*
+ * Wait for all the appends in flight to be applied.  Must be called with
+ * the store locked.  The lock is dropped while waiting, but no new appends
+ * start until it is reacquired.
+ */
+void log_drain(struct logstore *ls)
+{
+	ls->draining++;
+
+	while (ls->applied != ls->next_ticket)
+		CONDWAIT(&ls->io_cond, &ls->lock);
+
+	ls->draining--;
+	CONDBCAST(&ls->io_cond);
+}
+
+/*
+ * A pinned segment is not freed by the cleaner.  Must be called with the
+ * store locked.
+ */
+void log_pin_seg(struct logstore *ls, uint32_t seg)
+{
+	ls->segs[seg].refs++;
+}
+
+void log_unpin_seg(struct logstore *ls, uint32_t seg)
+{
+	ASSERT3U(ls->segs[seg].refs, >, 0);
+
+	if (!--ls->segs[seg].refs)
+		CONDBCAST(&ls->io_cond);
+}
+
+static int decode_clock(const uint8_t *buf, unsigned nents,
+			struct nvclock *clock)
+{
+	const struct nvclockent *ents = (const struct nvclockent *) buf;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < nents; i++) {
+		ret = nvclock_set_node(clock, be64_to_cpu(ents[i].node),
+				       be64_to_cpu(ents[i].seq));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* returns the record length */
+static ssize_t decode_rec(const uint8_t *buf, size_t buflen, uint64_t loc,
+			  struct logop *op, struct nvclock *oldclock,
+			  struct nvclock *clock, char *name)
+{
+	const struct logrec *rec = (const struct logrec *) buf;
+	uint32_t namelen;
+	uint32_t len;
+	size_t off;
+	int ret;
+
+	if (buflen < sizeof(struct logrec))
+		return -EINVAL;
+
+	len = be32_to_cpu(rec->len);
+	namelen = be16_to_cpu(rec->namelen);
+
+	if ((len > buflen) || (len % 8) ||
+	    (rec->type < LOG_REC_NEW) || (rec->type > LOG_REC_UNLINK) ||
+	    (rec->noldclock > NVCLOCK_NUM_NODES) || !rec->nclock ||
+	    (rec->nclock > NVCLOCK_NUM_NODES) || (namelen > LOG_MAX_NAME) ||
+	    (be32_to_cpu(rec->datalen) > LOG_MAX_WRITE))
+		return -EINVAL;
+
+	off = sizeof(struct logrec) +
+		(rec->noldclock + rec->nclock) * sizeof(struct nvclockent) +
+		log_pad(namelen);
+	if ((off + log_pad(be32_to_cpu(rec->datalen))) != len)
+		return -EINVAL;
+
+	memset(op, 0, sizeof(*op));
+	op->type = rec->type;
+	op->root = !!(rec->flags & LOG_REC_ROOT);
+	noid_set(&op->oid, &rec->vol, be64_to_cpu(rec->uniq));
+	op->attrs.mode = be16_to_cpu(rec->mode);
+	op->attrs.nlink = be32_to_cpu(rec->nlink);
+	op->attrs.size = be64_to_cpu(rec->size);
+	op->attrs.atime = be64_to_cpu(rec->atime);
+	op->attrs.btime = be64_to_cpu(rec->btime);
+	op->attrs.ctime = be64_to_cpu(rec->ctime);
+	op->attrs.mtime = be64_to_cpu(rec->mtime);
+	op->arg = be64_to_cpu(rec->arg);
+	op->cookie = be64_to_cpu(rec->cookie);
+	op->datalen = be32_to_cpu(rec->datalen);
+
+	ret = decode_clock(buf + sizeof(struct logrec), rec->noldclock,
+			   oldclock);
+	if (ret)
+		return ret;
+
+	ret = decode_clock(buf + sizeof(struct logrec) +
+			   rec->noldclock * sizeof(struct nvclockent),
+			   rec->nclock, clock);
+	if (ret)
+		return ret;
+
+	op->oldclock = rec->noldclock ? oldclock : NULL;
+	op->clock = clock;
+
+	memcpy(name, buf + off - log_pad(namelen), namelen);
+	name[namelen] = '\0';
+	op->name = namelen ? name : NULL;
+
+	if (((op->type == LOG_REC_LINK) || (op->type == LOG_REC_UNLINK)) &&
+	    !op->name)
+		return -EINVAL;
+
+	if ((op->type == LOG_REC_LINK) && !op->cookie)
+		return -EINVAL;
+
+	op->loc = loc;
+	op->len = off;
+	op->dataloc = loc + off;
+	op->data = op->datalen ? (buf + off) : NULL;
+
+	return len;
+}
+
+/* returns the record length */
+static ssize_t walk_rec(struct logstore *ls, const uint8_t *buf, size_t len,
+			uint64_t loc,
+			int (*fxn)(struct logstore *, const struct logop *,
+				   void *),
+			void *arg)
+{
+	char name[LOG_MAX_NAME + 1];
+	struct nvclock *oldclock;
+	struct nvclock *clock;
+	struct logop op;
+	ssize_t ret;
+	int err;
+
+	oldclock = nvclock_alloc(false);
+	clock = nvclock_alloc(false);
+	if (!oldclock || !clock) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = decode_rec(buf, len, loc, &op, oldclock, clock, name);
+	if (ret < 0)
+		goto out;
+
+	err = fxn(ls, &op, arg);
+	if (err)
+		ret = err;
+
+out:
+	nvclock_free(oldclock);
+	nvclock_free(clock);
+
+	return ret;
+}
+
+static int walk_batch(struct logstore *ls, const uint8_t *buf, size_t len,
+		      uint32_t nrecs, uint64_t loc,
+		      int (*fxn)(struct logstore *, const struct logop *,
+				 void *),
+		      void *arg)
+{
+	size_t off;
+
+	off = sizeof(struct logbatch);
+
+	for (; nrecs; nrecs--) {
+		ssize_t ret;
+
+		ret = walk_rec(ls, buf + off, len - off, loc + off, fxn, arg);
+		if (ret < 0)
+			return ret;
+
+		off += ret;
+	}
+
+	return (off == len) ? 0 : -EINVAL;
+}
+
+/*
+ * Call @fxn for each record in a segment, in the order they were appended.
+ * @buf holds the contents of the whole segment.  We stop at the first
+ * batch that doesn't check out - it is either the end of the data written
+ * since the segment was last allocated or a torn write.
+ */
+int log_walk_seg(struct logstore *ls, uint32_t seg, uint8_t *buf,
+		 int (*fxn)(struct logstore *, const struct logop *, void *),
+		 void *arg)
+{
+	const uint64_t seq = ls->segs[seg].seq;
+	size_t off;
+	int ret;
+
+	off = sizeof(struct logseghdr);
+
+	while ((off + sizeof(struct logbatch)) <= LOG_SEG_SIZE) {
+		struct logbatch *batch = (struct logbatch *) (buf + off);
+		const uint32_t len = be32_to_cpu(batch->len);
+		const uint32_t cksum = be32_to_cpu(batch->cksum);
+
+		if ((be32_to_cpu(batch->magic) != LOG_BATCH_MAGIC) ||
+		    (be64_to_cpu(batch->segseq) != seq) ||
+		    (len < sizeof(struct logbatch)) || (len % 8) ||
+		    (len > (LOG_SEG_SIZE - off)))
+			break;
+
+		batch->cksum = 0;
+		if (nomad_crc32c(batch, len) != cksum)
+			break;
+
+		ret = walk_batch(ls, buf + off, len, be32_to_cpu(batch->nrecs),
+				 log_seg_off(seg) + off, fxn, arg);
+		if (ret)
+			return ret;
+
+		off += len;
+	}
+
+	return 0;
+}
+
+static int replay_op(struct logstore *ls, const struct logop *op, void *arg)
+{
+	return log_apply(ls, op);
+}
+
+static int replay_seg(struct logstore *ls, uint32_t seg, uint8_t *buf)
+{
+	int ret;
+
+	ret = xpread(ls->fd, buf, LOG_SEG_SIZE, log_seg_off(seg));
+	if (ret)
+		return ret;
+
+	return log_walk_seg(ls, seg, buf, replay_op, NULL);
+}
+
+struct segorder {
+	uint64_t seq;
+	uint32_t seg;
+};
+
+static int segorder_cmp(const void *va, const void *vb)
+{
+	const struct segorder *a = va;
+	const struct segorder *b = vb;
+
+	if (a->seq < b->seq)
+		return -1;
+	if (a->seq > b->seq)
+		return 1;
+	return 0;
+}
+
+/*
+ * Rebuild the index by replaying all the segments from oldest to newest.
+ */
+int log_replay(struct logstore *ls)
+{
+	struct segorder *order;
+	uint32_t nused;
+	uint32_t seg;
+	uint32_t i;
+	uint8_t *buf;
+	int ret;
+
+	order = calloc(ls->nsegs, sizeof(struct segorder));
+	if (!order)
+		return -ENOMEM;
+
+	nused = 0;
+
+	for (seg = 0; seg < ls->nsegs; seg++) {
+		ret = read_seghdr(ls, seg, &ls->segs[seg].seq);
+		if (ret)
+			goto err;
+
+		ls->segs[seg].live = 0;
+
+		if (!ls->segs[seg].seq)
+			continue;
+
+		order[nused].seq = ls->segs[seg].seq;
+		order[nused].seg = seg;
+		nused++;
+	}
+
+	qsort(order, nused, sizeof(struct segorder), segorder_cmp);
+
+	buf = malloc(LOG_SEG_SIZE);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < nused; i++) {
+		ret = replay_seg(ls, order[i].seg, buf);
+		if (ret) {
+			cmn_err(CE_WARN, "failed to replay log segment %u: %s",
+				order[i].seg, xstrerror(ret));
+			goto err_free;
+		}
+	}
+
+	free(buf);
+
+	ls->nfree = ls->nsegs - nused;
+	ls->nextseq = nused ? (order[nused - 1].seq + 1) : 1;
+
+	/*
+	 * We don't know how much of the newest segment made it to disk in
+	 * one piece, so we never append to it.  Instead, the first append
+	 * allocates a new segment.
+	 */
+	ls->head = nused ? order[nused - 1].seg : (ls->nsegs - 1);
+	ls->headoff = LOG_SEG_SIZE;
+
+	free(order);
+
+	/* objects that were unlinked but not yet cleaned up */
+	log_drop_dead(ls);
+
+	return 0;
+
+err_free:
+	free(buf);
+
+err:
+	free(order);
+
+	return ret;
+}
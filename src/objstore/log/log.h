@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __NOMAD_OBJSTORE_LOG_H
+#define __NOMAD_OBJSTORE_LOG_H
+
+#include <pthread.h>
+#include <sys/avl.h>
+#include <jeffpc/list.h>
+#include <jeffpc/synch.h>
+
+#include <nomad/types.h>
+#include <nomad/objstore.h>
+#include <nomad/objstore_backend.h>
+
+/*
+ * Log-structured objstore
+ *
+ * Everything lives in a single file (or block device) which starts with a
+ * superblock and is followed by a number of fixed-size segments:
+ *
+ *   +------------+-----------+-----------+-----+-------------+
+ *   | superblock | segment 0 | segment 1 | ... | segment n-1 |
+ *   +------------+-----------+-----------+-----+-------------+
+ *
+ * Every modification is turned into one or more records which are appended
+ * as a batch to the head segment.  Once the head segment fills up, we move
+ * on to a free segment.  This way, all writes - no matter how small or
+ * scattered they are in the object namespace - turn into sequential I/O.
+ *
+ * Each segment starts with a header containing the segment's sequence
+ * number.  Sequence numbers are assigned in increasing order whenever a
+ * segment is (re)used, so they order the segments from oldest to newest.
+ * A batch is checksummed as a whole and is therefore applied all or
+ * nothing - an operation that needs more than one record (e.g., a create
+ * needs to update both the parent directory and the new child) uses a
+ * single batch.
+ *
+ * Every record carries the complete attributes, link count, and vector
+ * clock of the version it applies to, so the newest record of a version
+ * is enough to reconstruct the version's metadata.  The contents are
+ * described by the records themselves:
+ *
+ *   WRITE   - data at an offset
+ *   LINK    - a directory entry (along with its getdent cookie)
+ *   UNLINK  - removal of a directory entry
+ *   NEW     - a new object
+ *   ATTR    - nothing beyond the metadata
+ *
+ * We do not keep any persistent index.  Instead, loading a vdev replays
+ * all the segments from oldest to newest and rebuilds an in-memory index
+ * of the latest location of everything.  Objects are found by their oid,
+ * versions by their clock, file data by offset (extents), and directory
+ * entries by name.
+ *
+ * Since the log is append-only, space is reclaimed by the cleaner (see
+ * cleaner.c).  It always cleans the oldest segment by appending a fresh
+ * copy of everything in it that is still referenced by the index and then
+ * freeing the segment.  Because the oldest segment is always cleaned first,
+ * records that are no longer referenced (e.g., an UNLINK) can be dropped
+ * safely - anything they override is in the same or an older segment.
+ */
+
+#define LOG_SB_MAGIC		0x4e584c53	/* "NXLS" */
+#define LOG_SEG_MAGIC		0x4e584c47	/* "NXLG" */
+#define LOG_BATCH_MAGIC		0x4e584c42	/* "NXLB" */
+#define LOG_VERSION		2
+
+#define LOG_SB_SIZE		4096
+#define LOG_SEG_SHIFT		22		/* 4 MiB */
+#define LOG_SEG_SIZE		(1ul << LOG_SEG_SHIFT)
+#define LOG_MIN_SEGS		8
+
+/* default size of a newly created file-backed log */
+#define LOG_DEFAULT_SIZE	(1ull << 30)
+
+/* largest amount of data in a single WRITE record */
+#define LOG_MAX_WRITE		(1u << 20)
+#define LOG_MAX_NAME		255
+
+/* segments only the cleaner may use */
+#define LOG_CLEAN_RESERVE	2
+
+/* all on-disk structures are big-endian */
+struct logsb {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t segshift;
+	uint32_t nsegs;
+	struct xuuid uuid;		/* vdev uuid */
+	uint32_t _pad;
+	uint32_t cksum;			/* CRC32C of everything before */
+};
+
+struct logseghdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seq;
+	uint32_t _pad;
+	uint32_t cksum;			/* CRC32C of everything before */
+};
+
+struct logbatch {
+	uint32_t magic;
+	uint32_t len;			/* including this header */
+	uint64_t segseq;		/* seq of the segment it belongs to */
+	uint32_t nrecs;
+	uint32_t cksum;			/* CRC32C of the batch (cksum = 0) */
+};
+
+enum logrec_type {
+	LOG_REC_NEW = 1,
+	LOG_REC_ATTR,
+	LOG_REC_WRITE,
+	LOG_REC_LINK,
+	LOG_REC_UNLINK,
+};
+
+#define LOG_REC_ROOT		0x01		/* volume root */
+
+/*
+ * Each record is followed by the old and new clock entries, the name
+ * (LINK & UNLINK), and the data (WRITE).  The name and the data are both
+ * padded to a multiple of 8 bytes.
+ */
+struct logrec {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t noldclock;		/* zero for new objects */
+	uint8_t nclock;
+	uint32_t len;			/* including this header */
+	struct xuuid vol;
+	uint64_t uniq;
+	uint16_t mode;
+	uint16_t namelen;
+	uint32_t nlink;
+	uint32_t datalen;
+	uint32_t _pad;
+	uint64_t size;
+	uint64_t atime;
+	uint64_t btime;
+	uint64_t ctime;
+	uint64_t mtime;
+	uint64_t arg;			/* WRITE: offset, LINK: child uniq */
+	uint64_t cookie;		/* LINK: directory entry cookie */
+};
+
+static inline size_t log_pad(size_t len)
+{
+	return (len + 7) & ~7ul;
+}
+
+/*
+ * An in-memory representation of a record.  log_append() fills in the
+ * location of the record.
+ */
+struct logop {
+	enum logrec_type type;
+	bool root;
+	struct noid oid;
+	const struct nvclock *oldclock;	/* NULL for new objects */
+	const struct nvclock *clock;
+	struct nattr attrs;		/* including nlink */
+	uint64_t arg;
+	uint64_t cookie;
+	const char *name;
+	const void *data;
+	uint32_t datalen;
+
+	/* location */
+	uint64_t loc;			/* device offset of the record */
+	uint32_t len;			/* record length excluding data */
+	uint64_t dataloc;		/* device offset of the data */
+};
+
+/*
+ * The in-memory index
+ */
+struct logext {
+	/* key */
+	uint64_t off;			/* file offset */
+
+	/* value */
+	uint64_t len;
+	uint64_t loc;			/* device offset of the data */
+
+	avl_node_t node;
+};
+
+struct logdentry {
+	/* key */
+	char *name;
+
+	/* value */
+	uint64_t uniq;
+	uint64_t cookie;
+	uint64_t loc;			/* the LINK record */
+	uint32_t len;
+
+	avl_node_t name_node;
+	avl_node_t cookie_node;
+};
+
+struct logver {
+	/* key */
+	struct nvclock *clock;
+
+	/* value */
+	struct nattr attrs;
+	uint64_t metaloc;		/* newest record of this version */
+	uint32_t metalen;
+	avl_tree_t extents;		/* file data */
+	avl_tree_t dentries;		/* directory entries by name */
+	avl_tree_t cookies;		/* directory entries by cookie */
+	uint64_t next_cookie;
+
+	/* misc */
+	struct logobj *obj;
+	avl_node_t node;
+};
+
+struct logobj {
+	/* key */
+	struct noid oid;
+
+	/* value */
+	avl_tree_t versions;
+	uint32_t nlink;
+	bool root;
+
+	/* misc */
+	avl_node_t node;
+};
+
+struct logseg {
+	uint64_t seq;			/* 0 = free */
+	uint64_t live;			/* bytes referenced by the index */
+	uint32_t refs;			/* appends & reads in progress */
+	bool failed;			/* an append to it failed */
+};
+
+/* the whole store */
+struct logstore {
+	struct objstore_vdev *vdev;
+	int fd;
+
+	/*
+	 * The lock protects everything below - the index and the log
+	 * itself.  It is not held while reading or writing data (see
+	 * log_append()).
+	 */
+	struct lock lock;
+
+	/* the log */
+	uint32_t nsegs;
+	uint32_t nfree;
+	struct logseg *segs;
+	uint32_t head;			/* segment being appended to */
+	uint64_t headoff;		/* offset within the head segment */
+	uint64_t nextseq;		/* seq for the next segment */
+
+	/* appends in flight */
+	uint64_t next_ticket;		/* handed out in log order */
+	uint64_t applied;		/* tickets applied to the index */
+	uint32_t draining;		/* threads in log_drain() */
+	struct cond io_cond;		/* appends applied or segs unpinned */
+
+	/* the index */
+	avl_tree_t objs;
+	uint64_t next_uniq;
+
+	/* space accounting */
+	uint64_t used_data;
+	uint64_t used_meta;
+	uint64_t used_dentry;
+
+	/* the cleaner */
+	pthread_t cleaner;
+	struct cond cleaner_cond;	/* wakes up the cleaner */
+	struct cond space_cond;		/* signaled when segments are freed */
+	uint32_t clean_low;		/* clean when fewer free segments */
+	uint64_t clean_bytes;		/* space used up by the cleaner */
+	bool cleaner_running;
+	bool cleaner_exit;
+	bool nospc;			/* cleaner can't make progress */
+};
+
+static inline uint64_t log_seg_off(uint32_t seg)
+{
+	return LOG_SB_SIZE + ((uint64_t) seg << LOG_SEG_SHIFT);
+}
+
+static inline uint32_t log_loc_seg(uint64_t loc)
+{
+	return (loc - LOG_SB_SIZE) >> LOG_SEG_SHIFT;
+}
+
+extern const struct obj_ops obj_ops;
+
+/* log.c */
+extern int log_format(struct logstore *ls);
+extern int log_replay(struct logstore *ls);
+extern int log_free_seg(struct logstore *ls, uint32_t seg);
+extern int log_append(struct logstore *ls, struct logop *ops, size_t nops,
+		      bool cleaner);
+extern void log_append_done(struct logstore *ls, const struct logop *ops);
+extern void log_drain(struct logstore *ls);
+extern void log_pin_seg(struct logstore *ls, uint32_t seg);
+extern void log_unpin_seg(struct logstore *ls, uint32_t seg);
+extern int log_commit(struct logstore *ls, struct logop *ops, size_t nops);
+extern int log_walk_seg(struct logstore *ls, uint32_t seg, uint8_t *buf,
+			int (*fxn)(struct logstore *, const struct logop *,
+				   void *),
+			void *arg);
+
+/* index.c */
+extern void log_index_init(struct logstore *ls);
+extern void log_index_fini(struct logstore *ls);
+extern int log_apply(struct logstore *ls, const struct logop *op);
+extern struct logobj *log_find_obj(struct logstore *ls,
+				   const struct noid *oid);
+extern struct logver *log_find_ver(struct logobj *obj,
+				   const struct nvclock *clock);
+extern struct logobj *log_find_root(struct logstore *ls,
+				    const struct xuuid *vol);
+extern struct logext *log_find_ext(struct logver *ver, uint64_t off);
+extern struct logdentry *log_find_dentry(struct logver *ver,
+					 const char *name);
+extern void log_free_obj(struct logstore *ls, struct logobj *obj);
+extern void log_drop_dead(struct logstore *ls);
+extern void log_fill_op(struct logop *op, enum logrec_type type,
+			struct logver *ver, const struct nvclock *clock);
+
+/* cleaner.c */
+extern int log_cleaner_start(struct logstore *ls);
+extern void log_cleaner_stop(struct logstore *ls);
+extern int log_wait_for_space(struct logstore *ls);
+
+#endif
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/int.h>
+#include <jeffpc/io.h>
+#include <jeffpc/time.h>
+
+#include <nomad/crc32c.h>
+
+#include "log.h"
+
+static struct lock_class logstore_lc;
+
+static int log_getroot(struct objstore *vol, struct noid *root)
+{
+	struct logstore *ls = vol->vdev->private;
+	struct logobj *obj;
+
+	MXLOCK(&ls->lock);
+	obj = log_find_root(ls, &vol->id);
+	if (obj)
+		*root = obj->oid;
+	MXUNLOCK(&ls->lock);
+
+	return obj ? 0 : -ENOENT;
+}
+
+static int log_allocobj(struct obj *obj)
+{
+	struct logstore *ls = obj->vol->vdev->private;
+	struct logobj *lobj;
+
+	MXLOCK(&ls->lock);
+	lobj = log_find_obj(ls, &obj->oid);
+	if (lobj) {
+		obj->nversions = avl_numnodes(&lobj->versions);
+		obj->nlink = lobj->nlink;
+		obj->private = lobj;
+		obj->ops = &obj_ops;
+	}
+	MXUNLOCK(&ls->lock);
+
+	return lobj ? 0 : -ENOENT;
+}
+
+static const struct vol_ops vol_ops = {
+	.getroot = log_getroot,
+	.allocobj = log_allocobj,
+};
+
+static struct logstore *alloclogstore(struct objstore_vdev *vdev)
+{
+	struct logstore *ls;
+
+	ls = malloc(sizeof(struct logstore));
+	if (!ls)
+		return NULL;
+
+	ls->vdev = vdev;
+	ls->fd = -1;
+	ls->nsegs = 0;
+	ls->segs = NULL;
+	ls->next_ticket = 0;
+	ls->applied = 0;
+	ls->draining = 0;
+	ls->clean_bytes = 0;
+	ls->cleaner_running = false;
+
+	MXINIT(&ls->lock, &logstore_lc);
+	CONDINIT(&ls->io_cond);
+	CONDINIT(&ls->cleaner_cond);
+	CONDINIT(&ls->space_cond);
+
+	log_index_init(ls);
+
+	return ls;
+}
+
+static void freelogstore(struct logstore *ls)
+{
+	log_cleaner_stop(ls);
+
+	log_index_fini(ls);
+
+	if (ls->fd >= 0)
+		xclose(ls->fd);
+
+	free(ls->segs);
+
+	CONDDESTROY(&ls->space_cond);
+	CONDDESTROY(&ls->cleaner_cond);
+	CONDDESTROY(&ls->io_cond);
+	MXDESTROY(&ls->lock);
+	free(ls);
+}
+
+static int alloc_segs(struct logstore *ls, uint64_t size)
+{
+	if (size < LOG_SB_SIZE)
+		return -ENOSPC;
+
+	size = (size - LOG_SB_SIZE) >> LOG_SEG_SHIFT;
+	if (size < LOG_MIN_SEGS)
+		return -ENOSPC;
+
+	ls->nsegs = MIN(size, UINT32_MAX);
+
+	ls->segs = calloc(ls->nsegs, sizeof(struct logseg));
+	if (!ls->segs)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * The log can live in a regular file or on a block device.  A new (empty)
+ * file is grown to LOG_DEFAULT_SIZE first.
+ */
+static int get_size(struct logstore *ls, bool create, uint64_t *size)
+{
+	struct stat statbuf;
+	off_t off;
+	int ret;
+
+	ret = xfstat(ls->fd, &statbuf);
+	if (ret)
+		return ret;
+
+	if (S_ISREG(statbuf.st_mode)) {
+		*size = statbuf.st_size;
+
+		if (!*size && create) {
+			*size = LOG_DEFAULT_SIZE;
+
+			return xftruncate(ls->fd, *size);
+		}
+
+		return 0;
+	}
+
+	off = lseek(ls->fd, 0, SEEK_END);
+	if (off < 0)
+		return -errno;
+
+	*size = off;
+
+	return 0;
+}
+
+static inline uint32_t sb_cksum(const struct logsb *sb)
+{
+	return nomad_crc32c(sb, offsetof(struct logsb, cksum));
+}
+
+static int write_sb(struct logstore *ls)
+{
+	struct logsb sb;
+
+	memset(&sb, 0, sizeof(sb));
+
+	sb.magic = cpu32_to_be(LOG_SB_MAGIC);
+	sb.version = cpu32_to_be(LOG_VERSION);
+	sb.segshift = cpu32_to_be(LOG_SEG_SHIFT);
+	sb.nsegs = cpu32_to_be(ls->nsegs);
+	sb.uuid = ls->vdev->uuid;
+	sb.cksum = cpu32_to_be(sb_cksum(&sb));
+
+	return xpwrite(ls->fd, &sb, sizeof(sb), 0);
+}
+
+static int read_sb(struct logstore *ls, uint64_t size)
+{
+	struct logsb sb;
+	int ret;
+
+	ret = xpread(ls->fd, &sb, sizeof(sb), 0);
+	if (ret)
+		return ret;
+
+	if ((be32_to_cpu(sb.magic) != LOG_SB_MAGIC) ||
+	    (be32_to_cpu(sb.cksum) != sb_cksum(&sb)))
+		return -EINVAL;
+
+	if ((be32_to_cpu(sb.version) != LOG_VERSION) ||
+	    (be32_to_cpu(sb.segshift) != LOG_SEG_SHIFT))
+		return -ENOTSUP;
+
+	ls->nsegs = be32_to_cpu(sb.nsegs);
+	if ((ls->nsegs < LOG_MIN_SEGS) ||
+	    (log_seg_off(ls->nsegs) > size))
+		return -EINVAL;
+
+	ls->segs = calloc(ls->nsegs, sizeof(struct logseg));
+	if (!ls->segs)
+		return -ENOMEM;
+
+	ls->vdev->uuid = sb.uuid;
+
+	return 0;
+}
+
+static int log_create(struct objstore_vdev *vdev)
+{
+	struct logstore *ls;
+	uint64_t size;
+	int ret;
+
+	cmn_err(CE_WARN, "The log objstore backend is still experimental");
+	cmn_err(CE_WARN, "Do not expect compatibility from version to version");
+
+	ls = alloclogstore(vdev);
+	if (!ls)
+		return -ENOMEM;
+
+	ls->fd = xopen(vdev->path, O_RDWR | O_CREAT, 0600);
+	if (ls->fd < 0) {
+		ret = ls->fd;
+		goto err;
+	}
+
+	ret = get_size(ls, true, &size);
+	if (ret)
+		goto err;
+
+	ret = alloc_segs(ls, size);
+	if (ret)
+		goto err;
+
+	ret = log_format(ls);
+	if (ret)
+		goto err;
+
+	/* the superblock goes last, once everything else is in place */
+	if (fdatasync(ls->fd)) {
+		ret = -errno;
+		goto err;
+	}
+
+	ret = write_sb(ls);
+	if (ret)
+		goto err;
+
+	if (fdatasync(ls->fd)) {
+		ret = -errno;
+		goto err;
+	}
+
+	ret = log_cleaner_start(ls);
+	if (ret)
+		goto err;
+
+	vdev->private = ls;
+
+	return 0;
+
+err:
+	freelogstore(ls);
+
+	return ret;
+}
+
+static int log_load(struct objstore_vdev *vdev)
+{
+	struct logstore *ls;
+	uint64_t size;
+	int ret;
+
+	cmn_err(CE_WARN, "The log objstore backend is still experimental");
+	cmn_err(CE_WARN, "Do not expect compatibility from version to version");
+
+	ls = alloclogstore(vdev);
+	if (!ls)
+		return -ENOMEM;
+
+	ls->fd = xopen(vdev->path, O_RDWR, 0);
+	if (ls->fd < 0) {
+		ret = ls->fd;
+		goto err;
+	}
+
+	ret = get_size(ls, false, &size);
+	if (ret)
+		goto err;
+
+	ret = read_sb(ls, size);
+	if (ret)
+		goto err;
+
+	ret = log_replay(ls);
+	if (ret)
+		goto err;
+
+	ret = log_cleaner_start(ls);
+	if (ret)
+		goto err;
+
+	vdev->private = ls;
+
+	return 0;
+
+err:
+	freelogstore(ls);
+
+	return ret;
+}
+
+/* each volume gets its own root directory */
+static int log_create_vol(struct objstore *vol)
+{
+	struct logstore *ls = vol->vdev->private;
+	struct nvclock *clock;
+	struct logop op;
+	int ret;
+
+	clock = nvclock_alloc(true);
+	if (!clock)
+		return -ENOMEM;
+
+	MXLOCK(&ls->lock);
+
+	memset(&op, 0, sizeof(op));
+	op.type = LOG_REC_NEW;
+	op.root = true;
+	noid_set(&op.oid, &vol->id, ls->next_uniq++);
+	op.clock = clock;
+	op.attrs.mode = NATTR_DIR | 0777;
+	op.attrs.nlink = 1;
+	op.attrs.atime = gettime();
+	op.attrs.btime = op.attrs.atime;
+	op.attrs.ctime = op.attrs.atime;
+	op.attrs.mtime = op.attrs.atime;
+
+	ret = log_commit(ls, &op, 1);
+
+	MXUNLOCK(&ls->lock);
+
+	nvclock_free(clock);
+
+	if (ret)
+		return ret;
+
+	vol->ops = &vol_ops;
+	vol->private = ls;
+
+	return 0;
+}
+
+static int log_sync(struct objstore_vdev *vdev)
+{
+	struct logstore *ls = vdev->private;
+
+	if (fdatasync(ls->fd))
+		return -errno;
+
+	return 0;
+}
+
+static int log_usage(struct objstore_vdev *vdev,
+		     struct objstore_vdev_usage *usage)
+{
+	struct logstore *ls = vdev->private;
+
+	MXLOCK(&ls->lock);
+	usage->limit = (uint64_t) ls->nsegs << LOG_SEG_SHIFT;
+	usage->data = ls->used_data;
+	usage->meta = ls->used_meta;
+	usage->dentry = ls->used_dentry;
+	usage->used = usage->data + usage->meta + usage->dentry;
+	MXUNLOCK(&ls->lock);
+
+	return 0;
+}
+
+const struct objstore_vdev_def objvdev = {
+	.name = "log",
+
+	.create = log_create,
+	.create_vol = log_create_vol,
+	.load = log_load,
+	.sync = log_sync,
+	.usage = log_usage,
+};
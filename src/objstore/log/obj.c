@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+#include <jeffpc/time.h>
+
+#include "log.h"
+
+/*
+ * Every modification follows the same pattern: build the record(s)
+ * describing it, append them to the log, apply them to the index, and
+ * then copy the new state of the backend version into the generic one.
+ *
+ * The store lock is dropped while the records are written out and while
+ * reading data.  This is safe since the generic objstore code serializes
+ * all operations on an object - the only other thing that can touch an
+ * object's index entries in the mean time is the cleaner relocating them.
+ */
+
+static inline struct logstore *getstore(struct obj *obj)
+{
+	return obj->vol->vdev->private;
+}
+
+static int sync_ver(struct objver *ver)
+{
+	struct logver *lver = ver->private;
+
+	ver->attrs = lver->attrs;
+	ver->obj->nlink = lver->obj->nlink;
+
+	return nvclock_copy(ver->clock, lver->clock);
+}
+
+/* the clock a modified version will have */
+static struct nvclock *next_clock(const struct nvclock *clock)
+{
+	struct nvclock *ret;
+	int err;
+
+	ret = nvclock_dup(clock);
+	if (!ret)
+		return ERR_PTR(-ENOMEM);
+
+	err = nvclock_inc(ret);
+	if (err) {
+		nvclock_free(ret);
+		return ERR_PTR(err);
+	}
+
+	return ret;
+}
+
+static int log_obj_getversion(struct objver *ver)
+{
+	struct logstore *ls = getstore(ver->obj);
+	struct logver *lver;
+	int ret;
+
+	MXLOCK(&ls->lock);
+
+	lver = log_find_ver(ver->obj->private, ver->clock);
+	if (IS_ERR(lver)) {
+		ret = PTR_ERR(lver);
+	} else {
+		ver->private = lver;
+		ver->attrs = lver->attrs;
+
+		ret = nvclock_copy(ver->clock, lver->clock);
+	}
+
+	MXUNLOCK(&ls->lock);
+
+	return ret;
+}
+
+static int log_obj_getattr(struct objver *ver, struct nattr *attr)
+{
+	*attr = ver->attrs;
+	attr->nlink = ver->obj->nlink;
+
+	return 0;
+}
+
+static int log_obj_setattr(struct objver *ver, struct nattr *attr,
+			   const unsigned valid)
+{
+	struct logstore *ls = getstore(ver->obj);
+	struct logver *lver = ver->private;
+	struct nvclock *clock;
+	struct logop op;
+	int ret;
+
+	/*
+	 * first do some checks
+	 */
+	if ((valid & OBJ_ATTR_SIZE) && !NATTR_ISREG(ver->attrs.mode))
+		return -EINVAL;
+
+	/* we can't change the type of the object */
+	if ((valid & OBJ_ATTR_MODE) &&
+	    (attr->mode & NATTR_TMASK) != (ver->attrs.mode & NATTR_TMASK))
+		return -EINVAL;
+
+	if (!valid)
+		goto out;
+
+	/*
+	 * now do the updates
+	 */
+	MXLOCK(&ls->lock);
+
+	clock = next_clock(lver->clock);
+	if (IS_ERR(clock)) {
+		ret = PTR_ERR(clock);
+		goto err;
+	}
+
+	log_fill_op(&op, LOG_REC_ATTR, lver, clock);
+
+	if (valid & OBJ_ATTR_SIZE)
+		op.attrs.size = attr->size;
+
+	if (valid & OBJ_ATTR_MODE)
+		op.attrs.mode = attr->mode;
+
+	ret = log_commit(ls, &op, 1);
+	if (!ret)
+		ret = sync_ver(ver);
+
+	nvclock_free(clock);
+
+err:
+	MXUNLOCK(&ls->lock);
+
+	if (ret)
+		return ret;
+
+out:
+	/* return the latest attributes */
+	*attr = ver->attrs;
+	attr->nlink = ver->obj->nlink;
+
+	return 0;
+}
+
+static ssize_t log_obj_read(struct objver *ver, void *buf, size_t len,
+			    uint64_t offset)
+{
+	struct logstore *ls = getstore(ver->obj);
+	struct logver *lver = ver->private;
+	struct logext *ext;
+	uint64_t end;
+	uint64_t off;
+	int ret;
+
+	if (offset >= ver->attrs.size)
+		return 0;
+
+	end = MIN(offset + len, ver->attrs.size);
+	ret = 0;
+
+	MXLOCK(&ls->lock);
+
+	for (off = offset; off < end; ) {
+		uint64_t loc;
+		uint64_t n;
+
+		/* the cleaner may have moved things while we were reading */
+		ext = log_find_ext(lver, off);
+
+		if (!ext || (ext->off >= end)) {
+			/* the rest is a hole */
+			memset(buf + (off - offset), 0, end - off);
+			break;
+		}
+
+		if (ext->off > off) {
+			memset(buf + (off - offset), 0, ext->off - off);
+			off = ext->off;
+		}
+
+		n = MIN(end, ext->off + ext->len) - off;
+		loc = ext->loc + (off - ext->off);
+
+		/* keep the cleaner from reusing the segment under us */
+		log_pin_seg(ls, log_loc_seg(loc));
+
+		MXUNLOCK(&ls->lock);
+
+		ret = xpread(ls->fd, buf + (off - offset), n, loc);
+
+		MXLOCK(&ls->lock);
+
+		log_unpin_seg(ls, log_loc_seg(loc));
+
+		if (ret)
+			break;
+
+		off += n;
+	}
+
+	MXUNLOCK(&ls->lock);
+
+	return ret ? ret : (end - offset);
+}
+
+static ssize_t log_obj_write(struct objver *ver, const void *buf, size_t len,
+			     uint64_t offset)
+{
+	struct logstore *ls = getstore(ver->obj);
+	struct logver *lver = ver->private;
+	struct nvclock *clock;
+	struct logop op;
+	size_t done;
+	int ret;
+
+	if (!len)
+		return 0;
+
+	MXLOCK(&ls->lock);
+
+	clock = next_clock(lver->clock);
+	if (IS_ERR(clock)) {
+		ret = PTR_ERR(clock);
+		goto err;
+	}
+
+	/*
+	 * Large writes are split into multiple records, all of them
+	 * carrying the new clock.  They are not atomic.
+	 */
+	for (done = 0; done < len; done += op.datalen) {
+		log_fill_op(&op, LOG_REC_WRITE, lver, clock);
+		op.arg = offset + done;
+		op.data = buf + done;
+		op.datalen = MIN(len - done, LOG_MAX_WRITE);
+		op.attrs.size = MAX(op.attrs.size, op.arg + op.datalen);
+
+		ret = log_commit(ls, &op, 1);
+		if (ret)
+			break;
+	}
+
+	if (done) {
+		int err;
+
+		err = sync_ver(ver);
+		if (err && !ret)
+			ret = err;
+	}
+
+	nvclock_free(clock);
+
+err:
+	MXUNLOCK(&ls->lock);
+
+	if (ret && !done)
+		return ret;
+
+	return done;
+}
+
+static int log_obj_seek(struct objver *ver, uint64_t offset,
+			enum objstore_seek whence, uint64_t *result)
+{
+	struct logstore *ls = getstore(ver->obj);
+	struct logver *lver = ver->private;
+	struct logext *ext;
+	int ret;
+
+	MXLOCK(&ls->lock);
+
+	ext = log_find_ext(lver, offset);
+
+	if (whence == OBJ_SEEK_DATA) {
+		if (ext) {
+			*result = MAX(offset, ext->off);
+			ret = 0;
+		} else {
+			ret = -ENXIO;
+		}
+	} else {
+		/* skip over adjacent extents */
+		while (ext && (ext->off <= offset)) {
+			offset = ext->off + ext->len;
+			ext = AVL_NEXT(&lver->extents, ext);
+		}
+
+		/* the end of the object is an implicit hole */
+		*result = MIN(offset, ver->attrs.size);
+		ret = 0;
+	}
+
+	MXUNLOCK(&ls->lock);
+
+	return ret;
+}
+
+static int log_obj_lookup(struct objver *dirver, const char *name,
+			  struct noid *child)
+{
+	struct logstore *ls = getstore(dirver->obj);
+	struct logdentry *dentry;
+	int ret;
+
+	MXLOCK(&ls->lock);
+
+	dentry = log_find_dentry(dirver->private, name);
+	if (dentry) {
+		noid_set(child, &dirver->obj->oid.vol, dentry->uniq);
+		ret = 0;
+	} else {
+		ret = -ENOENT;
+	}
+
+	MXUNLOCK(&ls->lock);
+
+	return ret;
+}
+
+static int log_obj_create(struct objver *dirver, const char *name,
+			  uint16_t mode, struct noid *child)
+{
+	struct logstore *ls = getstore(dirver->obj);
+	struct logver *dirlver = dirver->private;
+	struct nvclock *childclock;
+	struct nvclock *dirclock;
+	struct logop ops[2];
+	int ret;
+
+	if (strlen(name) > LOG_MAX_NAME)
+		return -ENAMETOOLONG;
+
+	childclock = nvclock_alloc(true);
+	if (!childclock)
+		return -ENOMEM;
+
+	MXLOCK(&ls->lock);
+
+	if (log_find_dentry(dirlver, name)) {
+		ret = -EEXIST;
+		goto err;
+	}
+
+	dirclock = next_clock(dirlver->clock);
+	if (IS_ERR(dirclock)) {
+		ret = PTR_ERR(dirclock);
+		goto err;
+	}
+
+	/* the new object... */
+	memset(&ops[0], 0, sizeof(struct logop));
+	ops[0].type = LOG_REC_NEW;
+	noid_set(&ops[0].oid, &dirver->obj->oid.vol, ls->next_uniq++);
+	ops[0].clock = childclock;
+	ops[0].attrs.mode = mode;
+	ops[0].attrs.nlink = 1;
+	ops[0].attrs.atime = gettime();
+	ops[0].attrs.btime = ops[0].attrs.atime;
+	ops[0].attrs.ctime = ops[0].attrs.atime;
+	ops[0].attrs.mtime = ops[0].attrs.atime;
+
+	/*
+	 * ...and the directory entry pointing to it.  The size of a
+	 * directory is the number of entries in it.
+	 */
+	log_fill_op(&ops[1], LOG_REC_LINK, dirlver, dirclock);
+	ops[1].attrs.size++;
+	ops[1].name = name;
+	ops[1].arg = ops[0].oid.uniq;
+	ops[1].cookie = dirlver->next_cookie;
+
+	ret = log_commit(ls, ops, 2);
+	if (!ret)
+		ret = sync_ver(dirver);
+	if (!ret)
+		*child = ops[0].oid;
+
+	nvclock_free(dirclock);
+
+err:
+	MXUNLOCK(&ls->lock);
+
+	nvclock_free(childclock);
+
+	return ret;
+}
+
+static int log_obj_unlink(struct objver *dirver, const char *name,
+			  struct obj *child)
+{
+	struct logstore *ls = getstore(dirver->obj);
+	struct logver *dirlver = dirver->private;
+	struct logobj *lchild = child->private;
+	struct logdentry *dentry;
+	struct nvclock *dirclock;
+	struct logver *childver;
+	struct logop ops[2];
+	int ret;
+
+	MXLOCK(&ls->lock);
+
+	dentry = log_find_dentry(dirlver, name);
+	if (!dentry) {
+		ret = -ENOENT;
+		goto err;
+	}
+
+	VERIFY3U(dentry->uniq, ==, lchild->oid.uniq);
+
+	dirclock = next_clock(dirlver->clock);
+	if (IS_ERR(dirclock)) {
+		ret = PTR_ERR(dirclock);
+		goto err;
+	}
+
+	/* remove the directory entry... */
+	log_fill_op(&ops[0], LOG_REC_UNLINK, dirlver, dirclock);
+	ops[0].attrs.size--;
+	ops[0].name = name;
+
+	/*
+	 * ...and drop the link count.  The link count is per object, so
+	 * any version will do.
+	 */
+	childver = avl_first(&lchild->versions);
+	log_fill_op(&ops[1], LOG_REC_ATTR, childver, childver->clock);
+	ops[1].attrs.nlink--;
+
+	ret = log_commit(ls, ops, 2);
+	if (!ret) {
+		child->nlink = lchild->nlink;
+
+		ret = sync_ver(dirver);
+	}
+
+	nvclock_free(dirclock);
+
+err:
+	MXUNLOCK(&ls->lock);
+
+	return ret;
+}
+
+static int log_obj_getdent(struct objver *dirver, const uint64_t cookie,
+			   struct noid *child, char **childname,
+			   uint64_t *next_cookie)
+{
+	struct logstore *ls = getstore(dirver->obj);
+	struct logver *dirlver = dirver->private;
+	const struct logdentry key = {
+		.cookie = cookie,
+	};
+	struct logdentry *dentry;
+	avl_index_t where;
+	int ret;
+
+	MXLOCK(&ls->lock);
+
+	/* the dentry the cookie was handed out for may be gone */
+	dentry = avl_find(&dirlver->cookies, &key, &where);
+	if (!dentry)
+		dentry = avl_nearest(&dirlver->cookies, where, AVL_AFTER);
+
+	if (!dentry) {
+		ret = -ENOENT;
+	} else {
+		noid_set(child, &dirver->obj->oid.vol, dentry->uniq);
+		*childname = strdup(dentry->name);
+		*next_cookie = dentry->cookie + 1;
+
+		ret = *childname ? 0 : -ENOMEM;
+	}
+
+	MXUNLOCK(&ls->lock);
+
+	return ret;
+}
+
+/*
+ * Once the last link is gone and nobody has the object open anymore, we
+ * can forget about it.  The cleaner will reclaim the space.
+ */
+static void log_obj_free(struct obj *obj)
+{
+	struct logstore *ls = getstore(obj);
+	struct logobj *lobj = obj->private;
+
+	if (!lobj)
+		return;
+
+	MXLOCK(&ls->lock);
+
+	if (!lobj->nlink && !lobj->root) {
+		/* the cleaner may be in the middle of relocating it */
+		log_drain(ls);
+
+		log_free_obj(ls, lobj);
+
+		/* the cleaner may be able to make progress again */
+		ls->nospc = false;
+	}
+
+	MXUNLOCK(&ls->lock);
+}
+
+const struct obj_ops obj_ops = {
+	.getversion = log_obj_getversion,
+	.getattr = log_obj_getattr,
+	.setattr = log_obj_setattr,
+	.read    = log_obj_read,
+	.write   = log_obj_write,
+	.seek    = log_obj_seek,
+	.lookup  = log_obj_lookup,
+	.create  = log_obj_create,
+	.unlink  = log_obj_unlink,
+	.getdent = log_obj_getdent,
+	.free    = log_obj_free,
+};
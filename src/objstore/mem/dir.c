@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+
+#include <nomad/objstore_backend.h>
+
+#include "mem.h"
+
+/*
+ * Directory name index
+ *
+ * The name -> dentry mapping of a directory is an open addressing hash
+ * table with linear probing.  Each slot holds the full 32-bit hash of the
+ * name along with the dentry pointer, so a probe sequence only touches the
+ * (contiguous) slot array until it finds a slot with a matching hash.  Only
+ * then do we dereference the dentry to compare the (inline) name.
+ *
+ * The table size is always a power of two, and the table doubles whenever
+ * it becomes more than 3/4 full.  Removal uses backward shift deletion so
+ * that we never need tombstones.  The slot array is charged to the
+ * store's directory entry usage.
+ */
+
+#define MEMDIR_MIN_SLOTS	8
+
+/* 32-bit FNV-1a */
+static uint32_t memdir_hash(const char *name)
+{
+	const uint8_t *p = (const uint8_t *) name;
+	uint32_t hash = 0x811c9dc5;
+
+	while (*p) {
+		hash ^= *p++;
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+void memdir_init(struct memdir *dir)
+{
+	dir->slots = NULL;
+	dir->mask = 0;
+	dir->nents = 0;
+}
+
+static inline uint64_t slots_bytes(uint64_t nslots)
+{
+	return nslots * sizeof(struct memdirslot);
+}
+
+void memdir_destroy(struct memstore *ms, struct memdir *dir)
+{
+	if (dir->slots)
+		mem_uncharge(ms, &ms->used_dentry,
+			     slots_bytes((uint64_t) dir->mask + 1));
+
+	free(dir->slots);
+
+	memdir_init(dir);
+}
+
+static void __insert_slot(struct memdirslot *slots, uint32_t mask,
+			  uint32_t hash, struct memdentry *dentry)
+{
+	uint32_t i;
+
+	for (i = hash & mask; slots[i].dentry; i = (i + 1) & mask)
+		;
+
+	slots[i].hash = hash;
+	slots[i].dentry = dentry;
+}
+
+static int __grow(struct memstore *ms, struct memdir *dir)
+{
+	struct memdirslot *slots;
+	uint32_t nslots;
+	uint32_t mask;
+	uint32_t i;
+	int ret;
+
+	nslots = dir->slots ? (dir->mask + 1) * 2 : MEMDIR_MIN_SLOTS;
+	if (!nslots)
+		return -ENOSPC;
+
+	ret = mem_charge(ms, &ms->used_dentry, slots_bytes(nslots));
+	if (ret)
+		return ret;
+
+	slots = calloc(nslots, sizeof(struct memdirslot));
+	if (!slots) {
+		mem_uncharge(ms, &ms->used_dentry, slots_bytes(nslots));
+		return -ENOMEM;
+	}
+
+	mask = nslots - 1;
+
+	if (dir->slots) {
+		for (i = 0; i <= dir->mask; i++) {
+			if (!dir->slots[i].dentry)
+				continue;
+
+			__insert_slot(slots, mask, dir->slots[i].hash,
+				      dir->slots[i].dentry);
+		}
+
+		free(dir->slots);
+		mem_uncharge(ms, &ms->used_dentry,
+			     slots_bytes((uint64_t) dir->mask + 1));
+	}
+
+	dir->slots = slots;
+	dir->mask = mask;
+
+	return 0;
+}
+
+struct memdentry *memdir_lookup(struct memdir *dir, const char *name)
+{
+	uint32_t hash;
+	uint32_t i;
+
+	if (!dir->slots)
+		return NULL;
+
+	hash = memdir_hash(name);
+
+	for (i = hash & dir->mask; dir->slots[i].dentry;
+	     i = (i + 1) & dir->mask) {
+		struct memdirslot *slot = &dir->slots[i];
+
+		if ((slot->hash == hash) && !strcmp(slot->dentry->name, name))
+			return slot->dentry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add @dentry to @dir.  The caller is responsible for making sure that
+ * there isn't already a dentry with the same name.
+ */
+int memdir_add(struct memstore *ms, struct memdir *dir,
+	       struct memdentry *dentry)
+{
+	uint64_t nslots = (uint64_t) dir->mask + 1;
+	int ret;
+
+	if (!dir->slots || (((uint64_t) dir->nents + 1) * 4 > nslots * 3)) {
+		ret = __grow(ms, dir);
+		if (ret)
+			return ret;
+	}
+
+	__insert_slot(dir->slots, dir->mask, memdir_hash(dentry->name),
+		      dentry);
+
+	dir->nents++;
+
+	return 0;
+}
+
+void memdir_remove(struct memdir *dir, struct memdentry *dentry)
+{
+	const uint32_t mask = dir->mask;
+	struct memdirslot *slots = dir->slots;
+	uint32_t i, j;
+
+	VERIFY(slots);
+
+	/* find the slot */
+	for (i = memdir_hash(dentry->name) & mask; slots[i].dentry != dentry;
+	     i = (i + 1) & mask)
+		VERIFY(slots[i].dentry);
+
+	/*
+	 * Shift back any entries in the same cluster that would otherwise
+	 * become unreachable.  An entry at j can fill the hole at i if its
+	 * home slot is not cyclically in (i, j].
+	 */
+	for (j = (i + 1) & mask; slots[j].dentry; j = (j + 1) & mask) {
+		uint32_t home = slots[j].hash & mask;
+
+		if ((i <= j) ? ((i < home) && (home <= j)) :
+			       ((i < home) || (home <= j)))
+			continue;
+
+		slots[i] = slots[j];
+		i = j;
+	}
+
+	slots[i].dentry = NULL;
+
+	dir->nents--;
+}
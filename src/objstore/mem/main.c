@@ -27,11 +27,16 @@
 #include <jeffpc/error.h>
 #include <jeffpc/rand.h>
 
+#include <nomad/config.h>
 #include <nomad/objstore_backend.h>
 
 #include "mem.h"
 
 static struct lock_class memstore_lc;
+static struct lock_class memobjshard_lc;
+
+/* the last store id handed out; 0 is never used */
+static atomic64_t last_store_id;
 
 static int mem_vdev_getroot(struct objstore *vol, struct noid *root)
 {
@@ -47,15 +52,9 @@ static int mem_vdev_getroot(struct objstore *vol, struct noid *root)
 static int mem_allocobj(struct obj *obj)
 {
 	struct memstore *ms = obj->vol->vdev->private;
-	struct memobj key = {
-		.oid = obj->oid,
-	};
 	struct memobj *mobj;
 
-	MXLOCK(&ms->lock);
-	mobj = memobj_getref(avl_find(&ms->objs, &key, NULL));
-	MXUNLOCK(&ms->lock);
-
+	mobj = findmemobj(ms, &obj->oid);
 	if (!mobj)
 		return -ENOENT;
 
@@ -91,32 +90,76 @@ static int objcmp(const void *va, const void *vb)
 	return noid_cmp(&a->oid, &b->oid);
 }
 
-static int mem_create(struct objstore_vdev *vdev)
+static struct memstore *allocmemstore(struct objstore_vdev *vdev)
 {
 	struct memstore *ms;
-	struct memobj *obj;
+	unsigned i;
 
 	ms = malloc(sizeof(struct memstore));
 	if (!ms)
-		return -ENOMEM;
+		return NULL;
 
 	ms->vdev = vdev;
+	ms->root = NULL;
+	ms->snap_base = NULL;
+	ms->snap_len = 0;
+
+	ms->limit = config_get_mem_limit();
+	atomic_set(&ms->used, 0);
+	atomic_set(&ms->used_data, 0);
+	atomic_set(&ms->used_meta, 0);
+	atomic_set(&ms->used_dentry, 0);
+
+	ms->id = atomic_inc(&last_store_id);
 
 	atomic_set(&ms->next_oid_uniq, 1);
-	avl_create(&ms->objs, objcmp, sizeof(struct memobj),
-		   offsetof(struct memobj, node));
+
+	for (i = 0; i < MEM_OBJ_SHARDS; i++) {
+		struct memobjshard *shard = &ms->shards[i];
+
+		MXINIT(&shard->lock, &memobjshard_lc);
+		avl_create(&shard->objs, objcmp, sizeof(struct memobj),
+			   offsetof(struct memobj, node));
+	}
 
 	MXINIT(&ms->lock, &memstore_lc);
 
+	return ms;
+}
+
+static void freememstore(struct memstore *ms)
+{
+	unsigned i;
+
+	for (i = 0; i < MEM_OBJ_SHARDS; i++) {
+		struct memobjshard *shard = &ms->shards[i];
+
+		avl_destroy(&shard->objs);
+		MXDESTROY(&shard->lock);
+	}
+
+	MXDESTROY(&ms->lock);
+	free(ms);
+}
+
+static int mem_create(struct objstore_vdev *vdev)
+{
+	struct memstore *ms;
+	struct memobj *obj;
+
+	ms = allocmemstore(vdev);
+	if (!ms)
+		return -ENOMEM;
+
 	obj = newmemobj(ms, NATTR_DIR | 0777);
 	if (IS_ERR(obj)) {
-		free(ms);
+		freememstore(ms);
 		return PTR_ERR(obj);
 	}
 
 	obj->nlink++;
 
-	avl_add(&ms->objs, memobj_getref(obj));
+	memstore_add_obj(ms, obj);
 	ms->root = obj; /* hand off our reference */
 
 	vdev->private = ms;
@@ -124,8 +167,67 @@ static int mem_create(struct objstore_vdev *vdev)
 	return 0;
 }
 
+/*
+ * Loading a mem vdev restores the snapshot saved in the file named by the
+ * vdev path (see snapshot.c).
+ */
+static int mem_load(struct objstore_vdev *vdev)
+{
+	struct memstore *ms;
+	int ret;
+
+	if (!vdev->path[0])
+		return -ENOENT;
+
+	ms = allocmemstore(vdev);
+	if (!ms)
+		return -ENOMEM;
+
+	ret = mem_snapshot_load(ms);
+	if (ret) {
+		freememstore(ms);
+		return ret;
+	}
+
+	vdev->private = ms;
+
+	return 0;
+}
+
+/*
+ * Save a snapshot of the vdev.  A vdev without a path is not persistent at
+ * all.
+ */
+static int mem_sync(struct objstore_vdev *vdev)
+{
+	struct memstore *ms = vdev->private;
+
+	if (!vdev->path[0])
+		return 0;
+
+	return mem_snapshot_write(ms);
+}
+
+static int mem_usage(struct objstore_vdev *vdev,
+		     struct objstore_vdev_usage *usage)
+{
+	struct memstore *ms = vdev->private;
+
+	usage->limit = ms->limit;
+	usage->used = atomic_read(&ms->used);
+	usage->data = atomic_read(&ms->used_data);
+	usage->meta = atomic_read(&ms->used_meta);
+	usage->dentry = atomic_read(&ms->used_dentry);
+
+	return 0;
+}
+
 const struct objstore_vdev_def objvdev = {
 	.name = "mem",
 
+	.init = mem_obj_init,
 	.create = mem_create,
+	.load = mem_load,
+	.sync = mem_sync,
+	.usage = mem_usage,
 };
@@ -55,11 +55,75 @@
  *  (2) nvclock_set_node() due to a merge of two versions
  *
  * Aside from the vector clock, `struct memver' contains the "values"
- * associated with the object - i.e., the file attributes, the file blob (in
+ * associated with the object - i.e., the file attributes, the file data (in
  * case of a file), the dentries (in case of a directory).
+ *
+ * Each dentry is assigned a directory cookie when it is created.  Cookies
+ * are handed out in increasing order and never reused within a directory
+ * version, so a getdent cursor (which is just the cookie to resume at) stays
+ * valid no matter what other entries are created or unlinked in the mean
+ * time.  The dentries are kept both in a by-name hash table (for lookups)
+ * and in a by-cookie tree (for getdent).
  */
 
 struct memobj;
+struct memstore;
+struct memdentry;
+
+/*
+ * Directory name index - a hash table of dentries (see dir.c).
+ */
+struct memdirslot {
+	uint32_t hash;
+	struct memdentry *dentry; /* NULL if the slot is empty */
+};
+
+struct memdir {
+	struct memdirslot *slots;
+	uint32_t mask;		/* number of slots - 1 */
+	uint32_t nents;
+};
+
+/*
+ * File contents.  The data is split up into MEM_CHUNK_SIZE byte chunks,
+ * so that growing a file or writing into the middle of it only touches the
+ * affected chunks, and truncating it can free whole chunks.  Chunk i holds
+ * bytes [i * MEM_CHUNK_SIZE, (i + 1) * MEM_CHUNK_SIZE) of the file.  Only
+ * the last chunk may be allocated shorter than MEM_CHUNK_SIZE - this keeps
+ * small files small.
+ *
+ * A NULL chunk is a hole - it reads as all zeros and takes up no space.
+ * Extending a file (via setattr or by writing past EOF) only creates
+ * holes, chunks are allocated only once they are written to.
+ *
+ * The chunk size matches the largest read FUSE issues, so that aligned
+ * reads can be served from a single chunk.
+ *
+ * Chunks are reference counted so that we can hand out zero-copy
+ * references to the data (see mem_obj_read_ref()).  A chunk that is
+ * referenced by anything other than its memver must not be modified -
+ * writers make a private copy first.
+ *
+ * Normally, the chunk data lives in buf.  Chunks loaded from a snapshot
+ * point directly into the (read-only) snapshot mapping instead and are
+ * treated as shared.
+ */
+#define MEM_CHUNK_SHIFT		17
+#define MEM_CHUNK_SIZE		(1ul << MEM_CHUNK_SHIFT)
+
+struct memchunk {
+	refcnt_t refcnt;
+	struct memstore *store;	/* charged store; NULL if not charged */
+	size_t size;		/* size of data */
+	uint8_t *data;		/* either buf or in the snapshot mapping */
+	uint8_t buf[];
+};
+
+/* number of chunks needed to hold size bytes */
+static inline size_t mem_nchunks(uint64_t size)
+{
+	return (size + MEM_CHUNK_SIZE - 1) >> MEM_CHUNK_SHIFT;
+}
 
 /* each version */
 struct memver {
@@ -73,8 +137,11 @@ struct memver {
 	 *   - nlink: use nlink field in struct memobj
 	 */
 	struct nattr attrs;
-	void *blob; /* used if the memobj is a file */
-	avl_tree_t dentries; /* used if the memobj is a director */
+	struct memchunk **chunks; /* used if the memobj is a file */
+	size_t nchunks; /* size of the chunks array */
+	struct memdir dentries; /* used if the memobj is a director */
+	avl_tree_t dentry_cookies; /* dentries sorted by cookie */
+	uint64_t next_cookie; /* the cookie for the next new dentry */
 
 	/* misc */
 	struct memobj *obj;
@@ -89,12 +156,19 @@ struct memobj {
 	/* value */
 	avl_tree_t versions;   /* all versions */
 	uint32_t nlink;	 /* file link count */
+	struct memstore *store;
 
 	/* misc */
 	avl_node_t node;
 	refcnt_t refcnt;
 };
 
+/*
+ * Names shorter than this are stored inline in the dentry - this covers
+ * the vast majority of names.  Longer names are allocated separately.
+ */
+#define MEMDENTRY_INLINE_NAME	48
+
 /* <name> -> <specific version of an obj> */
 struct memdentry {
 	/* key */
@@ -102,31 +176,97 @@ struct memdentry {
 
 	/* value */
 	struct memobj *obj;
+	uint64_t cookie;
 
 	/* misc */
-	avl_node_t node;
+	avl_node_t cookie_node;
+	char inline_name[MEMDENTRY_INLINE_NAME];
+};
+
+/*
+ * The oid -> memobj index is split into a number of shards, each with its
+ * own lock and tree.  An object's shard is determined by a hash of the
+ * unique part of its oid, so unrelated opens and creates rarely contend on
+ * the same lock.
+ */
+#define MEM_OBJ_SHARD_SHIFT	6
+#define MEM_OBJ_SHARDS		(1u << MEM_OBJ_SHARD_SHIFT)
+
+struct memobjshard {
+	struct lock lock;
+	avl_tree_t objs;
 };
 
 /* the whole store */
 struct memstore {
 	struct objstore_vdev *vdev;
+	uint64_t id;		/* unique id of this store in this process */
 
-	avl_tree_t objs;
+	struct memobjshard shards[MEM_OBJ_SHARDS];
 	struct memobj *root;
 
 	atomic64_t next_oid_uniq; /* the next unique part of noid */
 
 	struct lock lock;
+
+	/* memory accounting (see mem_charge()) */
+	uint64_t limit;		/* 0 = unlimited */
+	atomic64_t used;	/* total of the below */
+	atomic64_t used_data;	/* file data chunks */
+	atomic64_t used_meta;	/* objects, versions, and chunk arrays */
+	atomic64_t used_dentry;	/* directory entries & name indexes */
+
+	/* the snapshot this store was loaded from (see snapshot.c) */
+	void *snap_base;
+	size_t snap_len;
 };
 
+static inline struct memobjshard *mem_obj_shard(struct memstore *ms,
+						const struct noid *oid)
+{
+	/* Fibonacci hashing to spread out sequentially allocated oids */
+	return &ms->shards[(oid->uniq * 0x9e3779b97f4a7c15ull) >>
+			   (64 - MEM_OBJ_SHARD_SHIFT)];
+}
+
 extern const struct obj_ops obj_ops;
 
+extern int mem_obj_init(void);
 extern void mem_obj_free(struct obj *obj);
 
+extern int mem_charge(struct memstore *ms, atomic64_t *counter,
+		      uint64_t bytes);
+extern void mem_uncharge(struct memstore *ms, atomic64_t *counter,
+			 uint64_t bytes);
+
 extern struct memobj *newmemobj(struct memstore *ms, uint16_t mode);
+extern struct memobj *allocmemobj(struct memstore *ms,
+				  const struct noid *oid);
 extern void freememobj(struct memobj *obj);
 extern struct memobj *findmemobj(struct memstore *store, const struct noid *oid);
+extern void memstore_add_obj(struct memstore *store, struct memobj *obj);
+extern void memstore_remove_obj(struct memstore *store, struct memobj *obj);
+extern struct memver *newobjver(struct memstore *ms, uint16_t mode);
+extern void freememver(struct memstore *ms, struct memver *ver);
+extern struct memdentry *newdentry(struct memstore *ms, struct memobj *child,
+				   const char *name);
+extern void freedentry(struct memstore *ms, struct memdentry *dentry);
+extern struct memchunk *newmemchunk_mapped(void *data, size_t size);
+extern void freememchunk(struct memchunk *chunk);
+extern int mem_chunks_reserve(struct memstore *ms, struct memver *mver,
+			      size_t n);
+
+extern int mem_snapshot_load(struct memstore *ms);
+extern int mem_snapshot_write(struct memstore *ms);
+
+extern void memdir_init(struct memdir *dir);
+extern void memdir_destroy(struct memstore *ms, struct memdir *dir);
+extern struct memdentry *memdir_lookup(struct memdir *dir, const char *name);
+extern int memdir_add(struct memstore *ms, struct memdir *dir,
+		      struct memdentry *dentry);
+extern void memdir_remove(struct memdir *dir, struct memdentry *dentry);
 
 REFCNT_INLINE_FXNS(struct memobj, memobj, refcnt, freememobj, NULL);
+REFCNT_INLINE_FXNS(struct memchunk, memchunk, refcnt, freememchunk, NULL);
 
 #endif
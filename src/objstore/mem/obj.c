@@ -31,6 +31,63 @@
 
 #include "mem.h"
 
+static struct mem_cache *memobj_cache;
+static struct mem_cache *memver_cache;
+static struct mem_cache *memdentry_cache;
+
+int mem_obj_init(void)
+{
+	memobj_cache = mem_cache_create("memobj", sizeof(struct memobj), 0);
+	if (IS_ERR(memobj_cache))
+		return PTR_ERR(memobj_cache);
+
+	memver_cache = mem_cache_create("memver", sizeof(struct memver), 0);
+	if (IS_ERR(memver_cache)) {
+		mem_cache_destroy(memobj_cache);
+		return PTR_ERR(memver_cache);
+	}
+
+	memdentry_cache = mem_cache_create("memdentry",
+					   sizeof(struct memdentry), 0);
+	if (IS_ERR(memdentry_cache)) {
+		mem_cache_destroy(memver_cache);
+		mem_cache_destroy(memobj_cache);
+		return PTR_ERR(memdentry_cache);
+	}
+
+	return 0;
+}
+
+/*
+ * Memory accounting
+ *
+ * Each store keeps track of how many bytes are used by file data,
+ * metadata (objects, versions, and the versions' chunk arrays), and
+ * directory entries.  The counters are maintained incrementally as
+ * things are allocated and freed.  If the store has a limit, any
+ * allocation that would push the total above it fails with ENOSPC.
+ *
+ * Chunks that point into a snapshot mapping aren't charged since they
+ * don't use any heap memory.
+ */
+int mem_charge(struct memstore *ms, atomic64_t *counter, uint64_t bytes)
+{
+	if ((atomic_add(&ms->used, bytes) > ms->limit) && ms->limit) {
+		atomic_sub(&ms->used, bytes);
+		return -ENOSPC;
+	}
+
+	atomic_add(counter, bytes);
+
+	return 0;
+}
+
+void mem_uncharge(struct memstore *ms, atomic64_t *counter, uint64_t bytes)
+{
+	atomic_sub(counter, bytes);
+	atomic_sub(&ms->used, bytes);
+}
+
 static int ver_cmp(const void *va, const void *vb)
 {
 	const struct memver *a = va;
@@ -39,55 +96,83 @@ static int ver_cmp(const void *va, const void *vb)
 	return nvclock_cmp_total(a->clock, b->clock);
 }
 
-static int dentry_cmp(const void *a, const void *b)
+static int dentry_cookie_cmp(const void *va, const void *vb)
 {
-	const struct memdentry *na = a;
-	const struct memdentry *nb = b;
-	int ret;
+	const struct memdentry *a = va;
+	const struct memdentry *b = vb;
 
-	ret = strcmp(na->name, nb->name);
-	if (ret > 0)
-		return 1;
-	else if (ret < 0)
+	if (a->cookie < b->cookie)
 		return -1;
+	if (a->cookie > b->cookie)
+		return 1;
 	return 0;
 }
 
-static struct memdentry *newdentry(struct memobj *child, const char *name)
+static inline size_t dentry_bytes(size_t len)
+{
+	if (len < MEMDENTRY_INLINE_NAME)
+		return sizeof(struct memdentry);
+
+	return sizeof(struct memdentry) + len + 1;
+}
+
+struct memdentry *newdentry(struct memstore *ms, struct memobj *child,
+			    const char *name)
 {
 	struct memdentry *dentry;
-	char *dupname;
+	size_t len;
+	int ret;
 
 	if (!child || !name)
 		return ERR_PTR(-EINVAL);
 
-	dentry = malloc(sizeof(struct memdentry));
-	if (!dentry)
-		return ERR_PTR(-ENOMEM);
+	len = strlen(name);
+
+	ret = mem_charge(ms, &ms->used_dentry, dentry_bytes(len));
+	if (ret)
+		return ERR_PTR(ret);
 
-	dupname = strdup(name);
-	if (!dupname)
+	dentry = mem_cache_alloc(memdentry_cache);
+	if (!dentry) {
+		ret = -ENOMEM;
 		goto err;
+	}
+
+	if (len < MEMDENTRY_INLINE_NAME) {
+		memcpy(dentry->inline_name, name, len + 1);
+		dentry->name = dentry->inline_name;
+	} else {
+		dentry->name = strdup(name);
+		if (!dentry->name) {
+			mem_cache_free(memdentry_cache, dentry);
+			ret = -ENOMEM;
+			goto err;
+		}
+	}
 
-	dentry->name = dupname;
 	dentry->obj = memobj_getref(child);
 
 	return dentry;
 
 err:
-	free(dentry);
-	return ERR_PTR(-ENOMEM);
+	mem_uncharge(ms, &ms->used_dentry, dentry_bytes(len));
+
+	return ERR_PTR(ret);
 }
 
-static struct memver *newobjver(uint16_t mode)
+struct memver *newobjver(struct memstore *ms, uint16_t mode)
 {
 	struct memver *ver;
 	int ret;
 
-	ver = malloc(sizeof(struct memver));
+	ret = mem_charge(ms, &ms->used_meta, sizeof(struct memver));
+	if (ret)
+		goto err;
+
+	ver = mem_cache_alloc(memver_cache);
 	if (!ver) {
 		ret = -ENOMEM;
-		goto err;
+		goto err_uncharge;
 	}
 
 	ver->clock = nvclock_alloc(true);
@@ -96,10 +181,16 @@ static struct memver *newobjver(uint16_t mode)
 		goto err_free;
 	}
 
-	avl_create(&ver->dentries, dentry_cmp, sizeof(struct memdentry),
-	           offsetof(struct memdentry, node));
+	memdir_init(&ver->dentries);
+	avl_create(&ver->dentry_cookies, dentry_cookie_cmp,
+		   sizeof(struct memdentry),
+		   offsetof(struct memdentry, cookie_node));
 
-	ver->blob = NULL;
+	/* cookie 0 means "start of directory", so real cookies start at 1 */
+	ver->next_cookie = 1;
+
+	ver->chunks = NULL;
+	ver->nchunks = 0;
 	ver->attrs._reserved = 0;
 	ver->attrs.mode = mode;
 	ver->attrs.nlink = 0xBAAAAAAD; /* don't use this, use memobj's nlink */
@@ -112,93 +203,193 @@ static struct memver *newobjver(uint16_t mode)
 	return ver;
 
 err_free:
-	free(ver);
+	mem_cache_free(memver_cache, ver);
+
+err_uncharge:
+	mem_uncharge(ms, &ms->used_meta, sizeof(struct memver));
 
 err:
 	return ERR_PTR(ret);
 }
 
-struct memobj *newmemobj(struct memstore *ms, uint16_t mode)
+/*
+ * Allocating the unique part of each new oid with an atomic increment on
+ * the shared counter would make all creating threads bounce its cache line
+ * back and forth.  Instead, each thread grabs a batch of values at a time
+ * and hands them out locally.  Unused values in a batch are simply
+ * skipped - oids only need to be unique, not dense.
+ *
+ * The batch is tagged with the id of the store it belongs to (rather than
+ * its address, which could be reused).
+ */
+#define MEM_OID_BATCH	64
+
+static __thread struct {
+	uint64_t store_id;
+	uint64_t next;
+	uint64_t end;
+} oid_batch;
+
+static uint64_t alloc_uniq(struct memstore *ms)
+{
+	if ((oid_batch.store_id != ms->id) ||
+	    (oid_batch.next == oid_batch.end)) {
+		oid_batch.store_id = ms->id;
+		oid_batch.end = atomic_add(&ms->next_oid_uniq, MEM_OID_BATCH);
+		oid_batch.next = oid_batch.end - MEM_OID_BATCH;
+	}
+
+	return oid_batch.next++;
+}
+
+/* allocate an object without any versions */
+struct memobj *allocmemobj(struct memstore *ms, const struct noid *oid)
 {
-	struct memver *ver;
 	struct memobj *obj;
 	int ret;
 
-	ret = -ENOMEM;
-
-	obj = malloc(sizeof(struct memobj));
-	if (!obj)
-		goto err;
+	ret = mem_charge(ms, &ms->used_meta, sizeof(struct memobj));
+	if (ret)
+		return ERR_PTR(ret);
 
-	ver = newobjver(mode);
-	if (IS_ERR(ver)) {
-		ret = PTR_ERR(ver);
-		goto err;
+	obj = mem_cache_alloc(memobj_cache);
+	if (!obj) {
+		mem_uncharge(ms, &ms->used_meta, sizeof(struct memobj));
+		return ERR_PTR(-ENOMEM);
 	}
 
+	obj->oid = *oid;
 	obj->nlink = 0;
+	obj->store = ms;
 
 	refcnt_init(&obj->refcnt, 1);
 
 	avl_create(&obj->versions, ver_cmp, sizeof(struct memver),
 		   offsetof(struct memver, node));
 
-	noid_set(&obj->oid, &ms->vdev->uuid, atomic_inc(&ms->next_oid_uniq));
+	return obj;
+}
+
+struct memobj *newmemobj(struct memstore *ms, uint16_t mode)
+{
+	struct memver *ver;
+	struct memobj *obj;
+	struct noid oid;
+
+	noid_set(&oid, &ms->vdev->uuid, alloc_uniq(ms));
+
+	obj = allocmemobj(ms, &oid);
+	if (IS_ERR(obj))
+		return obj;
+
+	ver = newobjver(ms, mode);
+	if (IS_ERR(ver)) {
+		memobj_putref(obj);
+		return ERR_CAST(ver);
+	}
 
 	avl_add(&obj->versions, ver);
 	ver->obj = obj;
 
 	return obj;
-
-err:
-	free(obj);
-
-	return ERR_PTR(ret);
 }
 
-static void freedentry(struct memdentry *dentry)
+void freedentry(struct memstore *ms, struct memdentry *dentry)
 {
 	if (!dentry)
 		return;
 
+	mem_uncharge(ms, &ms->used_dentry, dentry_bytes(strlen(dentry->name)));
+
 	memobj_putref(dentry->obj);
-	free((void *) dentry->name);
-	free(dentry);
+	if (dentry->name != dentry->inline_name)
+		free((void *) dentry->name);
+	mem_cache_free(memdentry_cache, dentry);
 }
 
-static void freeobjver(struct memver *ver)
+void freememver(struct memstore *ms, struct memver *ver)
 {
+	struct memdentry *dentry;
+	void *cookie;
+	size_t i;
+
 	if (!ver)
 		return;
 
-	avl_destroy(&ver->dentries);
+	cookie = NULL;
+	while ((dentry = avl_destroy_nodes(&ver->dentry_cookies, &cookie)))
+		freedentry(ms, dentry);
+
+	avl_destroy(&ver->dentry_cookies);
+	memdir_destroy(ms, &ver->dentries);
+	for (i = 0; i < ver->nchunks; i++)
+		memchunk_putref(ver->chunks[i]);
+	free(ver->chunks);
 	nvclock_free(ver->clock);
-	free(ver);
+
+	mem_uncharge(ms, &ms->used_meta, sizeof(struct memver) +
+		     sizeof(struct memchunk *) * ver->nchunks);
+
+	mem_cache_free(memver_cache, ver);
 }
 
 void freememobj(struct memobj *obj)
 {
+	struct memstore *ms;
 	struct memver *ver;
 	void *cookie;
 
 	if (!obj)
 		return;
 
+	ms = obj->store;
+
 	cookie = NULL;
 	while ((ver = avl_destroy_nodes(&obj->versions, &cookie)))
-		freeobjver(ver);
+		freememver(ms, ver);
 
 	avl_destroy(&obj->versions);
-	free(obj);
+	mem_cache_free(memobj_cache, obj);
+
+	mem_uncharge(ms, &ms->used_meta, sizeof(struct memobj));
 }
 
+/* returns a referenced object */
 struct memobj *findmemobj(struct memstore *store, const struct noid *oid)
 {
+	struct memobjshard *shard = mem_obj_shard(store, oid);
 	struct memobj key = {
 		.oid = *oid,
 	};
+	struct memobj *obj;
+
+	MXLOCK(&shard->lock);
+	obj = memobj_getref(avl_find(&shard->objs, &key, NULL));
+	MXUNLOCK(&shard->lock);
 
-	return memobj_getref(avl_find(&store->objs, &key, NULL));
+	return obj;
+}
+
+/* add the object to the store's index, the index gets its own reference */
+void memstore_add_obj(struct memstore *store, struct memobj *obj)
+{
+	struct memobjshard *shard = mem_obj_shard(store, &obj->oid);
+
+	MXLOCK(&shard->lock);
+	avl_add(&shard->objs, memobj_getref(obj));
+	MXUNLOCK(&shard->lock);
+}
+
+/* remove the object from the store's index, dropping the index's reference */
+void memstore_remove_obj(struct memstore *store, struct memobj *obj)
+{
+	struct memobjshard *shard = mem_obj_shard(store, &obj->oid);
+
+	MXLOCK(&shard->lock);
+	avl_remove(&shard->objs, obj);
+	MXUNLOCK(&shard->lock);
+
+	memobj_putref(obj);
 }
 
 /*
@@ -211,10 +402,7 @@ struct memver *findver_by_hndl(struct memstore *store,
 	struct memobj *obj;
 	struct memver *ver;
 
-	MXLOCK(&store->lock);
 	obj = findmemobj(store, oid);
-	MXUNLOCK(&store->lock);
-
 	if (!obj)
 		return ERR_PTR(-ENOENT);
 
@@ -269,16 +457,22 @@ static void sync_obj_to_mobj(struct obj *obj)
 	mobj->nlink = obj->nlink;
 }
 
-static void sync_ver_to_mver(struct objver *ver)
+static int sync_ver_to_mver(struct objver *ver)
 {
 	struct memver *mver = ver->private;
+	int ret;
 
 	/* object */
 	sync_obj_to_mobj(ver->obj);
 
 	/* version */
-	nvclock_copy(mver->clock, ver->clock);
+	ret = nvclock_copy(mver->clock, ver->clock);
+	if (ret)
+		return ret;
+
 	mver->attrs = ver->attrs;
+
+	return 0;
 }
 
 static int mem_obj_getversion(struct objver *ver)
@@ -305,38 +499,204 @@ static int mem_obj_getattr(struct objver *ver, struct nattr *attr)
 	return 0;
 }
 
+/* allocate a chunk referencing existing (read-only) data */
+struct memchunk *newmemchunk_mapped(void *data, size_t size)
+{
+	struct memchunk *chunk;
+
+	chunk = malloc(sizeof(struct memchunk));
+	if (!chunk)
+		return ERR_PTR(-ENOMEM);
+
+	refcnt_init(&chunk->refcnt, 1);
+	chunk->store = NULL;
+	chunk->size = size;
+	chunk->data = data;
+
+	return chunk;
+}
+
+void freememchunk(struct memchunk *chunk)
+{
+	if (chunk->store)
+		mem_uncharge(chunk->store, &chunk->store->used_data,
+			     chunk->size);
+
+	free(chunk);
+}
+
+/* is the chunk ours to modify? */
+static inline bool __chunk_private(struct memchunk *chunk)
+{
+	return (refcnt_read(&chunk->refcnt) == 1) &&
+	       (chunk->data == chunk->buf);
+}
+
+/* make sure the chunks array has at least n slots */
+int mem_chunks_reserve(struct memstore *ms, struct memver *mver, size_t n)
+{
+	struct memchunk **tmp;
+	size_t nchunks;
+	int ret;
+
+	if (n <= mver->nchunks)
+		return 0;
+
+	nchunks = MAX(n, mver->nchunks * 2);
+
+	ret = mem_charge(ms, &ms->used_meta, sizeof(struct memchunk *) *
+			 (nchunks - mver->nchunks));
+	if (ret)
+		return ret;
+
+	tmp = realloc(mver->chunks, sizeof(struct memchunk *) * nchunks);
+	if (!tmp) {
+		mem_uncharge(ms, &ms->used_meta, sizeof(struct memchunk *) *
+			     (nchunks - mver->nchunks));
+		return -ENOMEM;
+	}
+
+	memset(&tmp[mver->nchunks], 0,
+	       sizeof(struct memchunk *) * (nchunks - mver->nchunks));
+
+	mver->chunks = tmp;
+	mver->nchunks = nchunks;
+
+	return 0;
+}
+
 /*
- * Truncate the blob buffer.
+ * Make sure that chunk idx is at least size bytes long and that we can
+ * modify it.  If the current chunk is shared (i.e., someone holds a
+ * reference obtained via mem_obj_read_ref()), we make a private copy of
+ * the first copysize bytes and drop our reference to the shared one.  If
+ * the chunk is a hole, we allocate a zero-filled chunk.
  *
- * The objver's size is updated to the new size, and the memver's blob is
- * reallocated as necessary.  safeoff indicates what starting offset is
- * going to be overwritten anyway.  In other words, we must zero out bytes
- * [ver->attrs.size, safeoff).
+ * Since the last chunk of a file that's being appended to keeps growing,
+ * we round the allocation up to the next power of two to avoid copying
+ * the chunk on every append.
  */
-static int __truncate(struct objver *ver, uint64_t newsize, uint64_t safeoff)
+static int __chunk_prep(struct memstore *ms, struct memver *mver, size_t idx,
+			size_t size, size_t copysize)
 {
+	struct memchunk *chunk = mver->chunks[idx];
+	struct memchunk *tmp;
+	size_t allocsize;
+	int ret;
+
+	ASSERT3U(size, <=, MEM_CHUNK_SIZE);
+
+	/* not shared & big enough */
+	if (chunk && __chunk_private(chunk) && (chunk->size >= size))
+		return 0;
+
+	for (allocsize = 64; allocsize < size; allocsize *= 2)
+		;
+
+	if (chunk && __chunk_private(chunk)) {
+		/* not shared, we can resize it in place */
+		ret = mem_charge(ms, &ms->used_data, allocsize - chunk->size);
+		if (ret)
+			return ret;
+
+		tmp = realloc(chunk, sizeof(struct memchunk) + allocsize);
+		if (!tmp) {
+			mem_uncharge(ms, &ms->used_data,
+				     allocsize - chunk->size);
+			return -ENOMEM;
+		}
+
+		tmp->size = allocsize;
+		tmp->data = tmp->buf;
+
+		mver->chunks[idx] = tmp;
+
+		return 0;
+	}
+
+	ret = mem_charge(ms, &ms->used_data, allocsize);
+	if (ret)
+		return ret;
+
+	tmp = malloc(sizeof(struct memchunk) + allocsize);
+	if (!tmp) {
+		mem_uncharge(ms, &ms->used_data, allocsize);
+		return -ENOMEM;
+	}
+
+	refcnt_init(&tmp->refcnt, 1);
+	tmp->store = ms;
+	tmp->size = allocsize;
+	tmp->data = tmp->buf;
+
+	if (chunk)
+		memcpy(tmp->data, chunk->data, MIN(copysize, chunk->size));
+	else
+		memset(tmp->data, 0, size);
+
+	memchunk_putref(chunk);
+
+	mver->chunks[idx] = tmp;
+
+	return 0;
+}
+
+/*
+ * Truncate the file data.
+ *
+ * The objver's size is updated to the new size.  Shrinking frees all
+ * chunks past the new EOF, while growing simply adds holes.
+ */
+static int __truncate(struct objver *ver, uint64_t newsize)
+{
+	struct memstore *ms = ver->obj->vol->vdev->private;
 	struct memver *mver = ver->private;
-	void *tmp;
+	const uint64_t oldsize = ver->attrs.size;
+	const size_t oldchunks = mem_nchunks(oldsize);
+	const size_t newchunks = mem_nchunks(newsize);
+	size_t choff;
+	size_t idx;
+	int ret;
 
-	if (newsize == ver->attrs.size)
+	if (newsize == oldsize)
 		return 0;
 
-	if (newsize < ver->attrs.size) {
+	if (newsize < oldsize) {
+		/* free all the chunks that are entirely past the new EOF */
+		for (idx = newchunks; idx < oldchunks; idx++) {
+			memchunk_putref(mver->chunks[idx]);
+			mver->chunks[idx] = NULL;
+		}
+
 		ver->attrs.size = newsize;
 		return 0;
 	}
 
-	tmp = realloc(mver->blob, newsize);
-	if (!tmp)
-		return -ENOMEM;
+	ret = mem_chunks_reserve(ms, mver, newchunks);
+	if (ret)
+		return ret;
 
-	/* clear the new bytes up until safeoff */
-	if (ver->attrs.size < safeoff)
-		memset(tmp + ver->attrs.size, 0, safeoff - ver->attrs.size);
+	/*
+	 * All the chunks past the old EOF are already holes.  The only
+	 * thing we have to worry about is the old last chunk - it may be
+	 * short, or it may contain stale data past the old EOF (left over
+	 * from an earlier truncation), so we grow it and zero its tail.
+	 */
+	idx = oldsize >> MEM_CHUNK_SHIFT;
+	choff = oldsize & (MEM_CHUNK_SIZE - 1);
 
-	ver->attrs.size = newsize;
+	if (choff && mver->chunks[idx]) {
+		const uint64_t start = (uint64_t) idx << MEM_CHUNK_SHIFT;
+		const size_t size = MIN(newsize - start, MEM_CHUNK_SIZE);
+
+		ret = __chunk_prep(ms, mver, idx, size, choff);
+		if (ret)
+			return ret;
 
-	mver->blob = tmp;
+		memset(mver->chunks[idx]->data + choff, 0, size - choff);
+	}
+
+	ver->attrs.size = newsize;
 
 	return 0;
 }
@@ -362,7 +722,7 @@ static int mem_obj_setattr(struct objver *ver, struct nattr *attr,
 	 */
 	/* must be first since it can fail */
 	if (valid & OBJ_ATTR_SIZE) {
-		ret = __truncate(ver, attr->size, attr->size);
+		ret = __truncate(ver, attr->size);
 		if (ret)
 			return ret;
 	}
@@ -374,7 +734,9 @@ static int mem_obj_setattr(struct objver *ver, struct nattr *attr,
 	if (valid)
 		nvclock_inc(ver->clock);
 
-	sync_ver_to_mver(ver);
+	ret = sync_ver_to_mver(ver);
+	if (ret)
+		return ret;
 
 	/* return the latest attributes */
 	*attr = ver->attrs;
@@ -388,6 +750,7 @@ static ssize_t mem_obj_read(struct objver *ver, void *buf, size_t len,
 {
 	struct memver *mver = ver->private;
 	ssize_t ret;
+	size_t done;
 
 	if (offset >= ver->attrs.size)
 		ret = 0;
@@ -396,8 +759,71 @@ static ssize_t mem_obj_read(struct objver *ver, void *buf, size_t len,
 	else
 		ret = len;
 
-	if (ret)
-		memcpy(buf, mver->blob + offset, ret);
+	for (done = 0; done < ret; ) {
+		const size_t idx = offset >> MEM_CHUNK_SHIFT;
+		const size_t choff = offset & (MEM_CHUNK_SIZE - 1);
+		const size_t chlen = MIN(ret - done, MEM_CHUNK_SIZE - choff);
+		struct memchunk *chunk = mver->chunks[idx];
+
+		if (chunk)
+			memcpy((uint8_t *) buf + done, chunk->data + choff,
+			       chlen);
+		else
+			memset((uint8_t *) buf + done, 0, chlen);
+
+		done += chlen;
+		offset += chlen;
+	}
+
+	return ret;
+}
+
+/* backing for references to holes */
+static const uint8_t zero_chunk[MEM_CHUNK_SIZE];
+
+static void mem_bufref_release(struct objstore_bufref *ref)
+{
+	memchunk_putref(ref->private);
+}
+
+static ssize_t mem_obj_read_ref(struct objver *ver, size_t len,
+				uint64_t offset, struct objstore_bufref *ref)
+{
+	struct memver *mver = ver->private;
+	struct memchunk *chunk;
+	size_t choff;
+	ssize_t ret;
+
+	if (offset >= ver->attrs.size)
+		return 0;
+	else if ((offset + len) > ver->attrs.size)
+		ret = ver->attrs.size - offset;
+	else
+		ret = len;
+
+	/* we can only reference data in one chunk */
+	chunk = mver->chunks[offset >> MEM_CHUNK_SHIFT];
+	choff = offset & (MEM_CHUNK_SIZE - 1);
+	ret = MIN(ret, MEM_CHUNK_SIZE - choff);
+
+	if (!chunk) {
+		/* a hole - hand out a reference to the shared zeros */
+		ref->data = zero_chunk + choff;
+		ref->len = ret;
+		ref->release = NULL;
+		ref->private = NULL;
+
+		return ret;
+	}
+
+	/*
+	 * The reference keeps the chunk alive and unmodified - any future
+	 * writes will see that it is shared and make a copy.
+	 */
+	ref->data = chunk->data + choff;
+	ref->len = ret;
+	ref->release = mem_bufref_release;
+	ref->private = memchunk_getref(chunk);
 
 	return ret;
 }
@@ -405,36 +831,96 @@ static ssize_t mem_obj_read(struct objver *ver, void *buf, size_t len,
 static ssize_t mem_obj_write(struct objver *ver, const void *buf, size_t len,
 			     uint64_t offset)
 {
+	struct memstore *ms = ver->obj->vol->vdev->private;
 	struct memver *mver = ver->private;
+	const uint64_t oldsize = ver->attrs.size;
+	const uint64_t end = offset + len;
+	uint64_t off;
 	ssize_t ret;
 
-	/* object will grow - need to resize the blob buffer */
-	if ((offset + len) > ver->attrs.size) {
-		ret = __truncate(ver, offset + len, offset);
+	if (end > oldsize) {
+		/* object will grow - extend it with a hole first */
+		ret = __truncate(ver, end);
 		if (ret)
 			return ret;
 	}
 
-	memcpy(mver->blob + offset, buf, len);
+	/*
+	 * Make sure that every chunk in the range is allocated and that we
+	 * aren't going to scribble over any shared chunks.  We do this
+	 * before copying any data so that a failure doesn't leave us with
+	 * a partially written range.
+	 */
+	for (off = offset; off < end;
+	     off = (off & ~(MEM_CHUNK_SIZE - 1)) + MEM_CHUNK_SIZE) {
+		const size_t idx = off >> MEM_CHUNK_SHIFT;
+		const uint64_t start = (uint64_t) idx << MEM_CHUNK_SHIFT;
+		const size_t size = MIN(ver->attrs.size - start,
+					MEM_CHUNK_SIZE);
+
+		ret = __chunk_prep(ms, mver, idx, size, size);
+		if (ret) {
+			/* undo any growth; shrinking can't fail */
+			VERIFY0(__truncate(ver, oldsize));
+			return ret;
+		}
+	}
+
+	/* all the chunks in the range are now private, copy the data */
+	for (off = offset; off < end; ) {
+		const size_t idx = off >> MEM_CHUNK_SHIFT;
+		const size_t choff = off & (MEM_CHUNK_SIZE - 1);
+		const size_t chlen = MIN(end - off, MEM_CHUNK_SIZE - choff);
+
+		memcpy(mver->chunks[idx]->data + choff,
+		       (const uint8_t *) buf + (off - offset), chlen);
+
+		off += chlen;
+	}
 
 	 /* TODO: do we need to tweak the versions AVL tree? */
 	nvclock_inc(ver->clock);
 
-	sync_ver_to_mver(ver);
+	ret = sync_ver_to_mver(ver);
+	if (ret)
+		return ret;
 
 	return len;
 }
 
+static int mem_obj_seek(struct objver *ver, uint64_t offset,
+			enum objstore_seek whence, uint64_t *result)
+{
+	struct memver *mver = ver->private;
+	const bool want_data = (whence == OBJ_SEEK_DATA);
+	size_t idx;
+
+	for (idx = offset >> MEM_CHUNK_SHIFT;
+	     idx < mem_nchunks(ver->attrs.size); idx++) {
+		const uint64_t start = (uint64_t) idx << MEM_CHUNK_SHIFT;
+
+		if ((mver->chunks[idx] != NULL) == want_data) {
+			*result = MAX(offset, start);
+			return 0;
+		}
+	}
+
+	if (want_data)
+		return -ENXIO;
+
+	/* the end of the object is an implicit hole */
+	*result = ver->attrs.size;
+
+	return 0;
+}
+
 static int mem_obj_lookup(struct objver *dirver, const char *name,
 			  struct noid *child)
 {
-	const struct memdentry key = {
-		.name = name,
-	};
 	struct memver *dirmver = dirver->private;
 	struct memdentry *dentry;
 
-	dentry = avl_find(&dirmver->dentries, &key, NULL);
+	dentry = memdir_lookup(&dirmver->dentries, name);
 	if (!dentry)
 		return -ENOENT;
 
@@ -458,6 +944,7 @@ static struct memobj *__obj_create(struct memstore *store, struct memver *dir,
 {
 	struct memdentry *dentry;
 	struct memobj *mchild;
+	int ret;
 
 	/* allocate the child object */
 	mchild = newmemobj(store, mode);
@@ -465,21 +952,27 @@ static struct memobj *__obj_create(struct memstore *store, struct memver *dir,
 		return mchild;
 
 	/* allocate the dentry */
-	dentry = newdentry(mchild, name);
+	dentry = newdentry(store, mchild, name);
 	if (IS_ERR(dentry)) {
 		memobj_putref(mchild);
 		return ERR_CAST(dentry);
 	}
 
 	/* add the dentry to the parent */
-	avl_add(&dir->dentries, dentry);
+	ret = memdir_add(store, &dir->dentries, dentry);
+	if (ret) {
+		freedentry(store, dentry);
+		memobj_putref(mchild);
+		return ERR_PTR(ret);
+	}
+
+	dentry->cookie = dir->next_cookie++;
+	avl_add(&dir->dentry_cookies, dentry);
 
 	mchild->nlink++;
 
 	/* add object to the global list */
-	MXLOCK(&store->lock);
-	avl_add(&store->objs, memobj_getref(mchild));
-	MXUNLOCK(&store->lock);
+	memstore_add_obj(store, mchild);
 
 	return mchild;
 }
@@ -487,14 +980,11 @@ static struct memobj *__obj_create(struct memstore *store, struct memver *dir,
 static int mem_obj_create(struct objver *dirver, const char *name,
 			  uint16_t mode, struct noid *child)
 {
-	const struct memdentry key = {
-		.name = name,
-	};
 	struct memstore *ms = dirver->obj->vol->vdev->private;
 	struct memver *dirmver = dirver->private;
 	struct memobj *childobj;
 
-	if (avl_find(&dirmver->dentries, &key, NULL))
+	if (memdir_lookup(&dirmver->dentries, name))
 		return -EEXIST;
 
 	childobj = __obj_create(ms, dirmver, name, mode);
@@ -506,55 +996,59 @@ static int mem_obj_create(struct objver *dirver, const char *name,
 
 	memobj_putref(childobj);
 
-	/*
-	 * We lie and say that each entry takes up a byte.  This will make
-	 * seeking easier in getdents.
-	 */
+	/* the size of a directory is the number of entries in it */
 	dirver->attrs.size++;
 
 	/*
 	 * We changed the dir, so we need to up the version.
 	 *
-	 * TODO: do we need to tweak the dentries AVL tree?
+	 * TODO: do we need to tweak the versions AVL tree?
 	 */
 	nvclock_inc(dirver->clock);
 
-	sync_ver_to_mver(dirver);
-
-	return 0;
+	return sync_ver_to_mver(dirver);
 }
 
-static void __obj_unlink(struct memver *dir, struct memdentry *dentry,
-			 struct obj *child)
+static void __obj_unlink(struct memstore *store, struct memver *dir,
+			 struct memdentry *dentry, struct obj *child)
 {
-	VERIFY3P(child->private, ==, dentry->obj);
+	struct memobj *mchild = dentry->obj;
+
+	VERIFY3P(child->private, ==, mchild);
 
 	/* remove the dentry from the directory */
-	avl_remove(&dir->dentries, dentry);
+	memdir_remove(&dir->dentries, dentry);
+	avl_remove(&dir->dentry_cookies, dentry);
 
 	/* free the dentry */
-	freedentry(dentry);
+	freedentry(store, dentry);
 
 	child->nlink--;
 
 	sync_obj_to_mobj(child);
+
+	/*
+	 * Once the last link is gone, nothing can find the object anymore.
+	 * Remove it from the global list so that it (and all its data) gets
+	 * freed as soon as the last open handle goes away.
+	 */
+	if (!child->nlink)
+		memstore_remove_obj(store, mchild);
 }
 
 static int mem_obj_unlink(struct objver *dirver, const char *name,
 			  struct obj *child)
 {
-	const struct memdentry key = {
-		.name = name,
-	};
+	struct memstore *ms = dirver->obj->vol->vdev->private;
 	struct memver *dirmver = dirver->private;
 	struct memdentry *dentry;
 
-	dentry = avl_find(&dirmver->dentries, &key, NULL);
+	dentry = memdir_lookup(&dirmver->dentries, name);
 	if (!dentry)
 		return -ENOENT;
 
 	/* ok, we got the dentry - remove it */
-	__obj_unlink(dirmver, dentry, child);
+	__obj_unlink(ms, dirmver, dentry, child);
 
 	/* see comment in mem_obj_create() */
 	dirver->attrs.size--;
@@ -566,33 +1060,38 @@ static int mem_obj_unlink(struct objver *dirver, const char *name,
 	 */
 	nvclock_inc(dirver->clock);
 
-	sync_ver_to_mver(dirver);
-
-	return 0;
+	return sync_ver_to_mver(dirver);
 }
 
-static int mem_obj_getdent(struct objver *dirver, const uint64_t user_offset,
+static int mem_obj_getdent(struct objver *dirver, const uint64_t cookie,
 			   struct noid *child, char **childname,
-			   uint64_t *entry_size)
+			   uint64_t *next_cookie)
 {
 	struct memver *dirmver = dirver->private;
+	const struct memdentry key = {
+		.cookie = cookie,
+	};
 	struct memdentry *dentry;
-	uint64_t off;
+	avl_index_t where;
 
-	for (dentry = avl_first(&dirmver->dentries), off = 0;
-	     dentry;
-	     dentry = AVL_NEXT(&dirmver->dentries, dentry), off++) {
-		if (off < user_offset)
-			continue;
-
-		*child = dentry->obj->oid;
-		*childname = strdup(dentry->name);
-		*entry_size = 1; /* see comment in mem_obj_create() */
+	/*
+	 * Seek directly to the first dentry at or after the cookie.  The
+	 * dentry the cookie was handed out for may have been unlinked in
+	 * the mean time, in which case we simply continue with the next
+	 * one.
+	 */
+	dentry = avl_find(&dirmver->dentry_cookies, &key, &where);
+	if (!dentry)
+		dentry = avl_nearest(&dirmver->dentry_cookies, where,
+				     AVL_AFTER);
+	if (!dentry)
+		return -ENOENT;
 
-		return *childname ? 0 : -ENOMEM;
-	}
+	*child = dentry->obj->oid;
+	*childname = strdup(dentry->name);
+	*next_cookie = dentry->cookie + 1;
 
-	return -ENOENT;
+	return *childname ? 0 : -ENOMEM;
 }
 
 const struct obj_ops obj_ops = {
@@ -600,7 +1099,9 @@ const struct obj_ops obj_ops = {
 	.getattr = mem_obj_getattr,
 	.setattr = mem_obj_setattr,
 	.read    = mem_obj_read,
+	.read_ref = mem_obj_read_ref,
 	.write   = mem_obj_write,
+	.seek    = mem_obj_seek,
 	.lookup  = mem_obj_lookup,
 	.create  = mem_obj_create,
 	.unlink  = mem_obj_unlink,
@@ -0,0 +1,665 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+
+#include <nomad/objstore_backend.h>
+
+#include "mem.h"
+
+/*
+ * Snapshots
+ *
+ * The mem backend can save the entire store to the file named by the vdev
+ * path, and load it back when the vdev is imported.  The snapshot is a
+ * stream of XDR encoded items:
+ *
+ *   header:
+ *     magic (uint32), version (uint32)
+ *     vdev uuid (xuuid)
+ *     next unique part of noid (uint64)
+ *     root oid (noid)
+ *   for each object:
+ *     another object follows (bool, TRUE)
+ *     oid (noid)
+ *     nlink (uint32)
+ *     number of versions (uint32)
+ *     for each version:
+ *       clock (nvclock)
+ *       attributes (nattr)
+ *       if a file:
+ *         number of chunks (uint64)
+ *         for each chunk:
+ *           present (bool)
+ *           if present: chunk data (fixed length opaque)
+ *       if a directory:
+ *         next cookie (uint64)
+ *         number of dentries (uint32)
+ *         for each dentry (in cookie order):
+ *           cookie (uint64)
+ *           child oid (noid)
+ *           name (string)
+ *   end of objects (bool, FALSE)
+ *
+ * The length of each chunk is implied by the file size.
+ *
+ * When loading, the snapshot file is mapped read-only and the metadata is
+ * decoded right out of the mapping.  File data is not copied at all -
+ * the chunks point directly into the mapping, so only data that is
+ * actually accessed ever gets read from disk.  Chunks pointing into the
+ * mapping are never modified; writes make private copies.  The mapping
+ * stays around for the lifetime of the vdev.
+ *
+ * Writing a snapshot doesn't lock individual objects, so it must only be
+ * done when the store is quiescent (e.g., during shutdown).  The snapshot
+ * is written to a temporary file and renamed over the old one, so a crash
+ * during the write leaves the old snapshot intact and any existing mapping
+ * of it stays valid.
+ */
+
+#define SNAP_MAGIC	0x4e4d454d	/* "NMEM" */
+#define SNAP_VERSION	2
+
+#define SNAP_MAX_NAME	(~0u)
+
+/* XDR pads opaque data to a multiple of 4 bytes */
+#define SNAP_PAD(len)	(((len) + 3) & ~((size_t) 3))
+
+static int write_file(XDR *xdrs, struct memver *ver)
+{
+	uint64_t nchunks = mem_nchunks(ver->attrs.size);
+	uint64_t idx;
+
+	if (!xdr_uint64_t(xdrs, &nchunks))
+		return -EIO;
+
+	for (idx = 0; idx < nchunks; idx++) {
+		const uint64_t start = idx << MEM_CHUNK_SHIFT;
+		struct memchunk *chunk = ver->chunks[idx];
+		bool_t present = (chunk != NULL);
+
+		if (!xdr_bool(xdrs, &present))
+			return -EIO;
+
+		if (present &&
+		    !xdr_opaque(xdrs, (char *) chunk->data,
+				MIN(ver->attrs.size - start, MEM_CHUNK_SIZE)))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static int write_dir(XDR *xdrs, struct memver *ver)
+{
+	struct memdentry *dentry;
+	uint32_t ndentries;
+
+	ndentries = avl_numnodes(&ver->dentry_cookies);
+
+	if (!xdr_uint64_t(xdrs, &ver->next_cookie) ||
+	    !xdr_uint32_t(xdrs, &ndentries))
+		return -EIO;
+
+	for (dentry = avl_first(&ver->dentry_cookies);
+	     dentry;
+	     dentry = AVL_NEXT(&ver->dentry_cookies, dentry)) {
+		if (!xdr_uint64_t(xdrs, &dentry->cookie) ||
+		    !xdr_noid(xdrs, &dentry->obj->oid) ||
+		    !xdr_string(xdrs, (char **) &dentry->name, SNAP_MAX_NAME))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static int write_obj(XDR *xdrs, struct memobj *obj)
+{
+	struct memver *ver;
+	uint32_t nversions;
+	int ret;
+
+	nversions = avl_numnodes(&obj->versions);
+
+	if (!xdr_noid(xdrs, &obj->oid) ||
+	    !xdr_uint32_t(xdrs, &obj->nlink) ||
+	    !xdr_uint32_t(xdrs, &nversions))
+		return -EIO;
+
+	for (ver = avl_first(&obj->versions);
+	     ver;
+	     ver = AVL_NEXT(&obj->versions, ver)) {
+		if (!xdr_nvclock(xdrs, ver->clock) ||
+		    !xdr_nattr(xdrs, &ver->attrs))
+			return -EIO;
+
+		if (NATTR_ISREG(ver->attrs.mode))
+			ret = write_file(xdrs, ver);
+		else if (NATTR_ISDIR(ver->attrs.mode))
+			ret = write_dir(xdrs, ver);
+		else
+			ret = 0;
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int write_shard(XDR *xdrs, struct memobjshard *shard)
+{
+	bool_t more = TRUE;
+	struct memobj *obj;
+	int ret;
+
+	ret = 0;
+
+	MXLOCK(&shard->lock);
+	for (obj = avl_first(&shard->objs);
+	     obj;
+	     obj = AVL_NEXT(&shard->objs, obj)) {
+		if (!xdr_bool(xdrs, &more)) {
+			ret = -EIO;
+			break;
+		}
+
+		ret = write_obj(xdrs, obj);
+		if (ret)
+			break;
+	}
+	MXUNLOCK(&shard->lock);
+
+	return ret;
+}
+
+static int write_store(XDR *xdrs, struct memstore *ms)
+{
+	uint32_t magic = SNAP_MAGIC;
+	uint32_t version = SNAP_VERSION;
+	bool_t more = FALSE;
+	uint64_t next_uniq;
+	unsigned i;
+	int ret;
+
+	next_uniq = atomic_read(&ms->next_oid_uniq);
+
+	if (!xdr_uint32_t(xdrs, &magic) ||
+	    !xdr_uint32_t(xdrs, &version) ||
+	    !xdr_xuuid(xdrs, &ms->vdev->uuid) ||
+	    !xdr_uint64_t(xdrs, &next_uniq) ||
+	    !xdr_noid(xdrs, &ms->root->oid))
+		return -EIO;
+
+	for (i = 0; i < MEM_OBJ_SHARDS; i++) {
+		ret = write_shard(xdrs, &ms->shards[i]);
+		if (ret)
+			return ret;
+	}
+
+	if (!xdr_bool(xdrs, &more))
+		return -EIO;
+
+	return 0;
+}
+
+int mem_snapshot_write(struct memstore *ms)
+{
+	const char *path = ms->vdev->path;
+	char tmppath[FILENAME_MAX];
+	FILE *file;
+	XDR xdrs;
+	int ret;
+	int fd;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	fd = xopen(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return fd;
+
+	file = fdopen(fd, "w");
+	if (!file) {
+		ret = -errno;
+		xclose(fd);
+		goto err;
+	}
+
+	xdrstdio_create(&xdrs, file, XDR_ENCODE);
+
+	MXLOCK(&ms->lock);
+	ret = write_store(&xdrs, ms);
+	MXUNLOCK(&ms->lock);
+
+	xdr_destroy(&xdrs);
+
+	if (!ret && fflush(file))
+		ret = -errno;
+
+	if (!ret && fsync(fileno(file)))
+		ret = -errno;
+
+	if (fclose(file) && !ret)
+		ret = -errno;
+
+	if (ret)
+		goto err;
+
+	if (rename(tmppath, path)) {
+		ret = -errno;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	unlink(tmppath);
+
+	return ret;
+}
+
+/*
+ * Find the object with the given oid.  If it hasn't been loaded yet,
+ * allocate an empty one - its versions will be filled in once we get to
+ * its record.  The returned object is owned by the store's index.
+ *
+ * Nothing else can access the store while it is being loaded, so we don't
+ * bother locking the shards.
+ */
+static struct memobj *load_getobj(struct memstore *ms, const struct noid *oid)
+{
+	struct memobjshard *shard = mem_obj_shard(ms, oid);
+	struct memobj key = {
+		.oid = *oid,
+	};
+	struct memobj *obj;
+	avl_index_t where;
+
+	obj = avl_find(&shard->objs, &key, &where);
+	if (obj)
+		return obj;
+
+	obj = allocmemobj(ms, oid);
+	if (IS_ERR(obj))
+		return obj;
+
+	avl_insert(&shard->objs, obj, where);
+
+	return obj;
+}
+
+static int load_file(XDR *xdrs, struct memstore *ms, struct memver *ver)
+{
+	uint8_t *base = ms->snap_base;
+	uint64_t nchunks;
+	uint64_t idx;
+	int ret;
+
+	if (!xdr_uint64_t(xdrs, &nchunks))
+		return -EINVAL;
+
+	if (nchunks != mem_nchunks(ver->attrs.size))
+		return -EINVAL;
+
+	if (!nchunks)
+		return 0;
+
+	ret = mem_chunks_reserve(ms, ver, nchunks);
+	if (ret)
+		return ret;
+
+	for (idx = 0; idx < nchunks; idx++) {
+		const uint64_t start = idx << MEM_CHUNK_SHIFT;
+		const size_t len = MIN(ver->attrs.size - start, MEM_CHUNK_SIZE);
+		struct memchunk *chunk;
+		bool_t present;
+		size_t pos;
+
+		if (!xdr_bool(xdrs, &present))
+			return -EINVAL;
+
+		if (!present)
+			continue;
+
+		/* reference the data in the mapping instead of copying it */
+		pos = xdr_getpos(xdrs);
+		if ((pos > ms->snap_len) ||
+		    ((ms->snap_len - pos) < SNAP_PAD(len)))
+			return -EINVAL;
+
+		chunk = newmemchunk_mapped(base + pos, len);
+		if (IS_ERR(chunk))
+			return PTR_ERR(chunk);
+
+		ver->chunks[idx] = chunk;
+
+		if (!xdr_setpos(xdrs, pos + SNAP_PAD(len)))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int load_dentry(XDR *xdrs, struct memstore *ms, struct memver *ver)
+{
+	struct memdentry key;
+	struct memdentry *dentry;
+	struct memobj *child;
+	avl_index_t where;
+	struct noid oid;
+	char *name;
+	int ret;
+
+	name = NULL;
+
+	if (!xdr_uint64_t(xdrs, &key.cookie) ||
+	    !xdr_noid(xdrs, &oid) ||
+	    !xdr_string(xdrs, &name, SNAP_MAX_NAME)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* each name and cookie may appear only once */
+	if ((key.cookie == 0) || (key.cookie >= ver->next_cookie) ||
+	    avl_find(&ver->dentry_cookies, &key, &where) ||
+	    memdir_lookup(&ver->dentries, name)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	child = load_getobj(ms, &oid);
+	if (IS_ERR(child)) {
+		ret = PTR_ERR(child);
+		goto out;
+	}
+
+	dentry = newdentry(ms, child, name);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto out;
+	}
+
+	ret = memdir_add(ms, &ver->dentries, dentry);
+	if (ret) {
+		freedentry(ms, dentry);
+		goto out;
+	}
+
+	dentry->cookie = key.cookie;
+	avl_insert(&ver->dentry_cookies, dentry, where);
+
+out:
+	free(name);
+
+	return ret;
+}
+
+static int load_dir(XDR *xdrs, struct memstore *ms, struct memver *ver)
+{
+	uint32_t ndentries;
+	uint32_t i;
+	int ret;
+
+	if (!xdr_uint64_t(xdrs, &ver->next_cookie) ||
+	    !xdr_uint32_t(xdrs, &ndentries))
+		return -EINVAL;
+
+	for (i = 0; i < ndentries; i++) {
+		ret = load_dentry(xdrs, ms, ver);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int load_ver(XDR *xdrs, struct memstore *ms, struct memobj *obj)
+{
+	struct memver key;
+	struct nvclock clock;
+	struct nattr attrs;
+	struct memver *ver;
+	avl_index_t where;
+	int ret;
+
+	memset(&clock, 0, sizeof(clock));
+
+	if (!xdr_nvclock(xdrs, &clock) ||
+	    !xdr_nattr(xdrs, &attrs)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* each version may appear only once */
+	key.clock = &clock;
+	if (avl_find(&obj->versions, &key, &where)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ver = newobjver(ms, attrs.mode);
+	if (IS_ERR(ver)) {
+		ret = PTR_ERR(ver);
+		goto out;
+	}
+
+	ret = nvclock_copy(ver->clock, &clock);
+	if (ret) {
+		freememver(ms, ver);
+		goto out;
+	}
+
+	ver->attrs = attrs;
+	ver->obj = obj;
+
+	/*
+	 * From here on, the version is owned by the object and will be
+	 * freed along with it on failure.
+	 */
+	avl_insert(&obj->versions, ver, where);
+
+	if (NATTR_ISREG(attrs.mode))
+		ret = load_file(xdrs, ms, ver);
+	else if (NATTR_ISDIR(attrs.mode))
+		ret = load_dir(xdrs, ms, ver);
+	else
+		ret = 0;
+
+out:
+	xdr_free((xdrproc_t) xdr_nvclock, (char *) &clock);
+
+	return ret;
+}
+
+static int load_obj(XDR *xdrs, struct memstore *ms)
+{
+	uint32_t nversions;
+	struct memobj *obj;
+	struct noid oid;
+	uint32_t i;
+	int ret;
+
+	if (!xdr_noid(xdrs, &oid))
+		return -EINVAL;
+
+	obj = load_getobj(ms, &oid);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
+
+	/* each object may appear only once */
+	if (avl_numnodes(&obj->versions))
+		return -EINVAL;
+
+	if (!xdr_uint32_t(xdrs, &obj->nlink) ||
+	    !xdr_uint32_t(xdrs, &nversions))
+		return -EINVAL;
+
+	/* every object has at least one version */
+	if (!nversions)
+		return -EINVAL;
+
+	for (i = 0; i < nversions; i++) {
+		ret = load_ver(xdrs, ms, obj);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int load_store(XDR *xdrs, struct memstore *ms)
+{
+	struct memobj *obj;
+	uint64_t next_uniq;
+	struct noid root;
+	uint32_t version;
+	uint32_t magic;
+	bool_t more;
+	unsigned i;
+	int ret;
+
+	if (!xdr_uint32_t(xdrs, &magic) ||
+	    !xdr_uint32_t(xdrs, &version))
+		return -EINVAL;
+
+	if ((magic != SNAP_MAGIC) || (version != SNAP_VERSION))
+		return -EINVAL;
+
+	if (!xdr_xuuid(xdrs, &ms->vdev->uuid) ||
+	    !xdr_uint64_t(xdrs, &next_uniq) ||
+	    !xdr_noid(xdrs, &root))
+		return -EINVAL;
+
+	atomic_set(&ms->next_oid_uniq, next_uniq);
+
+	for (;;) {
+		if (!xdr_bool(xdrs, &more))
+			return -EINVAL;
+
+		if (!more)
+			break;
+
+		ret = load_obj(xdrs, ms);
+		if (ret)
+			return ret;
+	}
+
+	/*
+	 * Every object referenced by a dentry must have had a record of
+	 * its own.
+	 */
+	for (i = 0; i < MEM_OBJ_SHARDS; i++) {
+		avl_tree_t *objs = &ms->shards[i].objs;
+
+		for (obj = avl_first(objs); obj; obj = AVL_NEXT(objs, obj))
+			if (!avl_numnodes(&obj->versions))
+				return -EINVAL;
+	}
+
+	ms->root = findmemobj(ms, &root);
+	if (!ms->root)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void unload_store(struct memstore *ms)
+{
+	struct memobj *obj;
+	void *cookie;
+	unsigned i;
+
+	if (ms->root)
+		memobj_putref(ms->root);
+	ms->root = NULL;
+
+	for (i = 0; i < MEM_OBJ_SHARDS; i++) {
+		cookie = NULL;
+		while ((obj = avl_destroy_nodes(&ms->shards[i].objs, &cookie)))
+			memobj_putref(obj);
+	}
+}
+
+int mem_snapshot_load(struct memstore *ms)
+{
+	struct stat statbuf;
+	void *base;
+	XDR xdrs;
+	int ret;
+	int fd;
+
+	fd = xopen(ms->vdev->path, O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	ret = xfstat(fd, &statbuf);
+	if (ret)
+		goto err_close;
+
+	if (!statbuf.st_size) {
+		ret = -EINVAL;
+		goto err_close;
+	}
+
+	base = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		ret = -errno;
+		goto err_close;
+	}
+
+	/* the mapping keeps the file contents accessible */
+	xclose(fd);
+
+	ms->snap_base = base;
+	ms->snap_len = statbuf.st_size;
+
+	xdrmem_create(&xdrs, base, statbuf.st_size, XDR_DECODE);
+
+	ret = load_store(&xdrs, ms);
+
+	xdr_destroy(&xdrs);
+
+	if (ret) {
+		unload_store(ms);
+
+		munmap(base, statbuf.st_size);
+
+		ms->snap_base = NULL;
+		ms->snap_len = 0;
+	}
+
+	return ret;
+
+err_close:
+	xclose(fd);
+
+	return ret;
+}
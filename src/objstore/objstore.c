@@ -50,6 +50,7 @@ static struct backend *load_backend(const char *name)
 {
 	char path[FILENAME_MAX];
 	struct backend *backend;
+	int ret;
 
 	cmn_err(CE_DEBUG, "Loading '%s' backend...", name);
 
@@ -67,12 +68,26 @@ static struct backend *load_backend(const char *name)
 
 	backend->def = dlsym(backend->module, "objvdev");
 	if (!backend->def) {
-		dlclose(backend->module);
-		free(backend);
-		return ERR_PTR(-ENOENT);
+		ret = -ENOENT;
+		goto err;
+	}
+
+	if (backend->def->init) {
+		ret = backend->def->init();
+		if (ret) {
+			cmn_err(CE_ERROR, "Failed to initialize '%s' "
+				"backend: %s", name, xstrerror(ret));
+			goto err;
+		}
 	}
 
 	return backend;
+
+err:
+	dlclose(backend->module);
+	free(backend);
+
+	return ERR_PTR(ret);
 }
 
 static int __load_backends(void)
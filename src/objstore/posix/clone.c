@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* for copy_file_range(2) on glibc */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+
+#include <nomad/config.h>
+
+#include "posix.h"
+
+/*
+ * Cheap file copies
+ *
+ * Forking a version (see posix_fork_verfile()) needs a copy of the
+ * version file.  Copying the data through user space would make forking
+ * O(object size), so we try, in order:
+ *
+ *  (1) FICLONE, which makes the copy share all the blocks with the
+ *      original (btrfs, XFS with reflink, ...)
+ *  (2) copy_file_range, which copies in the kernel and can share extents
+ *      on some file systems (e.g., NFS 4.2 server-side copy)
+ *  (3) a chunked read/write loop that leaves all-zero chunks as holes
+ *
+ * Once a method turns out to be unsupported by the volume's file system,
+ * we stop trying it.
+ */
+
+#define CHUNK_SIZE	POSIXIO_BUF_SIZE
+
+/* does this error mean that the method isn't supported here? */
+static bool unsupported(int ret)
+{
+	switch (ret) {
+		case -ENOSYS:
+		case -ENOTTY:
+		case -ENOTSUP:
+#if EOPNOTSUPP != ENOTSUP
+		case -EOPNOTSUPP:
+#endif
+		case -EXDEV:
+		case -EINVAL:
+			return true;
+	}
+
+	return false;
+}
+
+static int __ficlone(int dstfd, int srcfd)
+{
+#ifdef FICLONE
+	if (ioctl(dstfd, FICLONE, srcfd))
+		return -errno;
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static int __copy_range(int dstfd, int srcfd, uint64_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t srcoff = 0;
+	loff_t dstoff = 0;
+
+	while (dstoff < len) {
+		ssize_t ret;
+
+		ret = copy_file_range(srcfd, &srcoff, dstfd, &dstoff,
+				      len - dstoff, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!ret)
+			return -EPIPE; /* the source is too short */
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static bool is_zero(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i])
+			return false;
+
+	return true;
+}
+
+static int __copy_chunks(struct posixvol *pvol, int dstfd, int srcfd,
+			 uint64_t len)
+{
+	uint64_t off;
+	uint8_t *buf;
+	int ret;
+
+	buf = posix_io_buf_alloc(pvol->ring, CHUNK_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = 0;
+
+	for (off = 0; off < len; off += CHUNK_SIZE) {
+		const size_t chunk = MIN(len - off, CHUNK_SIZE);
+
+		/* fails with -EPIPE if the source is too short */
+		ret = posix_pread(pvol->ring, srcfd, -1, buf, chunk, off);
+		if (ret)
+			break;
+
+		/* the destination is already zero filled */
+		if (is_zero(buf, chunk))
+			continue;
+
+		ret = posix_pwrite(pvol->ring, dstfd, -1, buf, chunk, off);
+		if (ret)
+			break;
+	}
+
+	posix_io_buf_free(pvol->ring, buf);
+
+	return ret;
+}
+
+/*
+ * Make the (empty) file @dstfd a copy of the first @len bytes of @srcfd.
+ * Fails with -EPIPE if @srcfd is shorter than @len.
+ */
+int posix_clone_file(struct posixvol *pvol, int dstfd, int srcfd,
+		     uint64_t len)
+{
+	int ret;
+
+	if (!pvol->noclone) {
+		ret = __ficlone(dstfd, srcfd);
+		if (!ret)
+			return 0;
+		if (!unsupported(ret))
+			return ret;
+
+		pvol->noclone = true;
+	}
+
+	ret = xftruncate(dstfd, len);
+	if (ret)
+		return ret;
+
+	if (!pvol->nocopyrange) {
+		ret = __copy_range(dstfd, srcfd, len);
+		if (!ret)
+			return 0;
+		if (!unsupported(ret))
+			return ret;
+
+		pvol->nocopyrange = true;
+	}
+
+	return __copy_chunks(pvol, dstfd, srcfd, len);
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* for syncfs(2) on glibc */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/time.h>
+
+#include <nomad/config.h>
+
+#include "posix.h"
+
+/*
+ * Group commit
+ *
+ * With "posix-commit" enabled in the config, every modifying operation
+ * (write, setattr, create, unlink) is durable by the time it returns.
+ * Syncing each modification individually would limit us to however many
+ * cache flushes the disk can do per second, so instead the modifications
+ * are committed in batches:
+ *
+ * After the operation completes (and the object lock has been dropped),
+ * the caller joins the currently open batch and waits.  A per-vdev
+ * committer thread closes the batch once it has been open for
+ * "posix-commit-delay" microseconds or it has gathered
+ * "posix-commit-batch" callers, whichever comes first.  It then makes
+ * everything on the vdev's file system durable with a single syncfs and
+ * wakes up all the callers in the batch together.  While one batch is
+ * being synced, the next one is already collecting callers.
+ *
+ * Since a caller joins a batch only after its modification completed, the
+ * sync for that batch (which starts later still) covers it.
+ *
+ * If a sync ever fails, we cannot know what made it to disk.  The error
+ * is therefore sticky: it is returned to all the callers in the batch
+ * and to everyone trying to commit afterwards.
+ */
+
+static struct lock_class posixcommit_lc;
+
+static int sync_vdev(struct posixvdev *pv)
+{
+#ifdef HAVE_SYNCFS
+	if (syncfs(pv->basefd))
+		return -errno;
+#else
+	/* best effort - sync(2) is not guaranteed to wait for the I/O */
+	sync();
+#endif
+
+	return 0;
+}
+
+static void *committer(void *arg)
+{
+	struct posixvdev *pv = arg;
+	struct posixcommit *cm = &pv->commit;
+
+	MXLOCK(&cm->lock);
+	for (;;) {
+		uint64_t deadline;
+		uint64_t gen;
+		int ret;
+
+		while (!cm->nwaiters && !cm->exit)
+			CONDWAIT(&cm->cond, &cm->lock);
+
+		if (!cm->nwaiters)
+			break; /* told to exit & nothing left to do */
+
+		/* give others a chance to join the batch */
+		deadline = gettime() + cm->delay * 1000;
+
+		while ((cm->nwaiters < cm->batch) && !cm->exit) {
+			const uint64_t now = gettime();
+
+			if (now >= deadline)
+				break;
+
+			CONDWAIT_TIMEOUT(&cm->cond, &cm->lock, deadline - now);
+		}
+
+		/* close the batch */
+		gen = cm->open++;
+		cm->nwaiters = 0;
+
+		MXUNLOCK(&cm->lock);
+		ret = sync_vdev(pv);
+		MXLOCK(&cm->lock);
+
+		if (ret) {
+			cmn_err(CE_ERROR, "posix: failed to commit batch %"
+				PRIu64 " on %s: %s", gen, pv->vdev->path,
+				xstrerror(ret));
+			cm->err = ret;
+		} else {
+			cm->durable = gen;
+		}
+
+		CONDBCAST(&cm->done);
+	}
+	MXUNLOCK(&cm->lock);
+
+	return NULL;
+}
+
+int posix_commit_init(struct posixvdev *pv)
+{
+	struct posixcommit *cm = &pv->commit;
+	int ret;
+
+	MXINIT(&cm->lock, &posixcommit_lc);
+	CONDINIT(&cm->cond);
+	CONDINIT(&cm->done);
+	cm->enabled = config_get_posix_commit() != 0;
+	cm->delay = config_get_posix_commit_delay();
+	cm->batch = MAX(config_get_posix_commit_batch(), 1);
+	cm->open = 1;
+	cm->durable = 0;
+	cm->nwaiters = 0;
+	cm->err = 0;
+	cm->exit = false;
+
+	if (!cm->enabled)
+		return 0;
+
+	ret = -pthread_create(&cm->thread, NULL, committer, pv);
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	CONDDESTROY(&cm->done);
+	CONDDESTROY(&cm->cond);
+	MXDESTROY(&cm->lock);
+
+	return ret;
+}
+
+void posix_commit_fini(struct posixvdev *pv)
+{
+	struct posixcommit *cm = &pv->commit;
+
+	if (cm->enabled) {
+		MXLOCK(&cm->lock);
+		cm->exit = true;
+		CONDSIG(&cm->cond);
+		MXUNLOCK(&cm->lock);
+
+		VERIFY0(pthread_join(cm->thread, NULL));
+	}
+
+	CONDDESTROY(&cm->done);
+	CONDDESTROY(&cm->cond);
+	MXDESTROY(&cm->lock);
+}
+
+/* wait for all modifications completed so far to become durable */
+int posix_commit(struct objstore_vdev *vdev)
+{
+	struct posixvdev *pv = vdev->private;
+	struct posixcommit *cm = &pv->commit;
+	uint64_t target;
+	int ret;
+
+	if (!cm->enabled)
+		return 0;
+
+	MXLOCK(&cm->lock);
+	target = cm->open;
+
+	cm->nwaiters++;
+	if ((cm->nwaiters == 1) || (cm->nwaiters >= cm->batch))
+		CONDSIG(&cm->cond);
+
+	while ((cm->durable < target) && !cm->err)
+		CONDWAIT(&cm->done, &cm->lock);
+
+	ret = (cm->durable >= target) ? 0 : cm->err;
+	MXUNLOCK(&cm->lock);
+
+	return ret;
+}
@@ -0,0 +1,720 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/int.h>
+
+#include "posix.h"
+
+/*
+ * On-disk directory format
+ *
+ * The contents of a directory version file (i.e., everything after the
+ * version header) are an extendible hash table made up of DIR_BLOCK_SIZE
+ * blocks.  Block 0 holds the directory header, which points to the
+ * bucket table.  The table has 2^depth slots, each holding the block
+ * number of a bucket.  A name's bucket is found by using the top depth
+ * bits of the name's hash as an index into the table.
+ *
+ * Each bucket has a local depth - the number of top hash bits shared by
+ * all of its entries.  A bucket with local depth d is referenced by
+ * 2^(depth - d) consecutive table slots.  When a bucket fills up, it is
+ * split into two buckets of local depth d + 1 (doubling the table first
+ * if d == depth).  Once a bucket reaches DIR_MAX_DEPTH, it isn't split
+ * any more; instead additional blocks are chained to it.
+ *
+ * A lookup therefore costs one table slot read and one bucket block read
+ * no matter how big the directory is (until the buckets start chaining,
+ * which requires millions of entries).
+ *
+ * Entries are packed at the start of each bucket block.  New entries are
+ * appended, and removing an entry shifts the following entries down, so
+ * blocks are updated in place.  Blocks are never freed - empty buckets
+ * simply stay around, and old bucket tables are abandoned when the table
+ * grows.
+ *
+ * Cookies
+ *
+ * Each entry has a collision discriminator (cd) that is unique among the
+ * entries with the same hash.  The cookie of an entry is (hash << 32 |
+ * cd).  Since the table slots are ordered by hash, and splitting a bucket
+ * doesn't change which slots cover which hashes, visiting the entries in
+ * cookie order is simple (see posix_dir_next()) and cookies stay valid no
+ * matter how the directory is modified.
+ *
+ * A directory version file without any contents is an empty directory.
+ * The directory structure is created on the first insert.
+ *
+ * All on-disk fields are big-endian.
+ */
+
+#define DIR_BLOCK_SIZE	4096
+#define DIR_MAGIC	0x4e584452 /* "NXDR" */
+#define DIR_VERSION	1
+#define DIR_MAX_DEPTH	20
+#define DIR_MAX_NAME	255
+
+struct dirhdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t depth;		/* the table has 2^depth slots */
+	uint32_t table;		/* first block of the bucket table */
+	uint32_t nblocks;	/* number of blocks in use */
+	uint32_t _pad;
+};
+
+struct dirblk {
+	uint32_t depth;		/* local depth */
+	uint32_t next;		/* next block in chain (0 = none) */
+	uint32_t used;		/* bytes of data in use */
+	uint32_t _pad;
+	uint8_t data[DIR_BLOCK_SIZE - 16];
+};
+
+struct dirrec {
+	uint32_t hash;
+	uint32_t cd;		/* collision discriminator */
+	uint64_t uniq;		/* child */
+	uint16_t namelen;
+	char name[];		/* not nul-terminated */
+};
+
+#define REC_SIZE(namelen) \
+	((offsetof(struct dirrec, name) + (namelen) + 7) & ~7ul)
+
+/* in-memory version of the directory header */
+struct dir {
+	struct posixring *ring;
+	int fd;
+	int slot;		/* registered file slot (-1 = none) */
+	uint32_t depth;
+	uint32_t table;
+	uint32_t nblocks;
+};
+
+/* 32-bit FNV-1a */
+static uint32_t dir_hash(const char *name, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) name;
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+static inline uint64_t blkoff(uint32_t blkno)
+{
+	return POSIX_HDR_SIZE + (uint64_t) blkno * DIR_BLOCK_SIZE;
+}
+
+static inline uint32_t hash_slot(uint32_t hash, uint32_t depth)
+{
+	return depth ? (hash >> (32 - depth)) : 0;
+}
+
+static inline uint64_t rec_cookie(const struct dirrec *rec)
+{
+	return ((uint64_t) be32_to_cpu(rec->hash) << 32) |
+		be32_to_cpu(rec->cd);
+}
+
+static inline struct dirrec *blk_rec(struct dirblk *blk, size_t off)
+{
+	return (struct dirrec *) &blk->data[off];
+}
+
+#define for_each_rec(rec, off, blk)					\
+	for (off = 0;							\
+	     (off < be32_to_cpu((blk)->used)) &&			\
+	     ((rec = blk_rec((blk), off)) != NULL);			\
+	     off += REC_SIZE(be16_to_cpu(rec->namelen)))
+
+static int read_hdr(struct posixvol *pvol, struct posixfd *pfd,
+		    struct dir *dir)
+{
+	struct dirhdr hdr;
+	int ret;
+
+	dir->ring = pvol->ring;
+	dir->fd = pfd->fd;
+	dir->slot = pfd->slot;
+
+	ret = posix_pread(dir->ring, dir->fd, dir->slot, &hdr, sizeof(hdr),
+			  blkoff(0));
+	if (ret == -EPIPE)
+		return -ENOENT; /* no contents = empty directory */
+	if (ret)
+		return ret;
+
+	if (be32_to_cpu(hdr.magic) != DIR_MAGIC)
+		return -EINVAL;
+	if (be32_to_cpu(hdr.version) != DIR_VERSION)
+		return -ENOTSUP;
+
+	dir->depth = be32_to_cpu(hdr.depth);
+	dir->table = be32_to_cpu(hdr.table);
+	dir->nblocks = be32_to_cpu(hdr.nblocks);
+
+	if (dir->depth > DIR_MAX_DEPTH)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int write_hdr(struct dir *dir)
+{
+	struct dirhdr hdr = {
+		.magic = cpu32_to_be(DIR_MAGIC),
+		.version = cpu32_to_be(DIR_VERSION),
+		.depth = cpu32_to_be(dir->depth),
+		.table = cpu32_to_be(dir->table),
+		.nblocks = cpu32_to_be(dir->nblocks),
+	};
+
+	return posix_pwrite(dir->ring, dir->fd, dir->slot, &hdr, sizeof(hdr),
+			    blkoff(0));
+}
+
+static int read_blk(struct dir *dir, uint32_t blkno, struct dirblk *blk)
+{
+	int ret;
+
+	ret = posix_pread(dir->ring, dir->fd, dir->slot, blk, sizeof(*blk),
+			  blkoff(blkno));
+	if (ret)
+		return ret;
+
+	if (be32_to_cpu(blk->used) > sizeof(blk->data))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int write_blk(struct dir *dir, uint32_t blkno, struct dirblk *blk)
+{
+	return posix_pwrite(dir->ring, dir->fd, dir->slot, blk, sizeof(*blk),
+			    blkoff(blkno));
+}
+
+static void init_blk(struct dirblk *blk, uint32_t depth)
+{
+	memset(blk, 0, sizeof(*blk));
+
+	blk->depth = cpu32_to_be(depth);
+}
+
+static int get_slot(struct dir *dir, uint32_t slot, uint32_t *blkno)
+{
+	uint32_t tmp;
+	int ret;
+
+	ret = posix_pread(dir->ring, dir->fd, dir->slot, &tmp, sizeof(tmp),
+			  blkoff(dir->table) + slot * sizeof(uint32_t));
+	if (ret)
+		return ret;
+
+	*blkno = be32_to_cpu(tmp);
+
+	if (!*blkno || (*blkno >= dir->nblocks))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int set_slots(struct dir *dir, uint32_t slot, uint32_t nslots,
+		     uint32_t blkno)
+{
+	uint32_t *tmp;
+	uint32_t i;
+	int ret;
+
+	tmp = malloc(nslots * sizeof(uint32_t));
+	if (!tmp)
+		return -ENOMEM;
+
+	for (i = 0; i < nslots; i++)
+		tmp[i] = cpu32_to_be(blkno);
+
+	ret = posix_pwrite(dir->ring, dir->fd, dir->slot, tmp,
+			   nslots * sizeof(uint32_t),
+			   blkoff(dir->table) + slot * sizeof(uint32_t));
+
+	free(tmp);
+
+	return ret;
+}
+
+/*
+ * Create an empty directory with a single bucket.  The I/O fields of @dir
+ * must already be set up (see read_hdr()).
+ */
+static int init_dir(struct dir *dir)
+{
+	struct dirblk blk;
+	int ret;
+
+	dir->depth = 0;
+	dir->table = 1;
+	dir->nblocks = 3;
+
+	init_blk(&blk, 0);
+
+	ret = write_blk(dir, 2, &blk);
+	if (ret)
+		return ret;
+
+	ret = set_slots(dir, 0, 1, 2);
+	if (ret)
+		return ret;
+
+	return write_hdr(dir);
+}
+
+/* double the bucket table, moving it to the end of the directory */
+static int grow_table(struct dir *dir)
+{
+	const uint32_t nslots = 1u << dir->depth;
+	const size_t size = 2 * nslots * sizeof(uint32_t);
+	uint32_t *old, *new;
+	uint32_t i;
+	int ret;
+
+	old = malloc(nslots * sizeof(uint32_t));
+	new = malloc(size);
+	if (!old || !new) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = posix_pread(dir->ring, dir->fd, dir->slot, old,
+			  nslots * sizeof(uint32_t), blkoff(dir->table));
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nslots; i++) {
+		new[2 * i] = old[i];
+		new[2 * i + 1] = old[i];
+	}
+
+	ret = posix_pwrite(dir->ring, dir->fd, dir->slot, new, size,
+			   blkoff(dir->nblocks));
+	if (ret)
+		goto out;
+
+	dir->depth++;
+	dir->table = dir->nblocks;
+	dir->nblocks += (size + DIR_BLOCK_SIZE - 1) / DIR_BLOCK_SIZE;
+
+	ret = write_hdr(dir);
+
+out:
+	free(old);
+	free(new);
+
+	return ret;
+}
+
+/*
+ * Split bucket @blkno (which covers @hash) into two buckets with one more
+ * bit of local depth.
+ */
+static int split_bucket(struct dir *dir, uint32_t blkno, uint32_t hash)
+{
+	struct dirblk old, lo, hi;
+	struct dirrec *rec;
+	uint32_t nslots;
+	uint32_t depth;
+	uint32_t slot;
+	uint32_t bit;
+	uint32_t newblk;
+	size_t off;
+	int ret;
+
+	ret = read_blk(dir, blkno, &old);
+	if (ret)
+		return ret;
+
+	depth = be32_to_cpu(old.depth);
+
+	/* only buckets at the maximum depth have chains */
+	ASSERT0(old.next);
+
+	if (depth == dir->depth) {
+		ret = grow_table(dir);
+		if (ret)
+			return ret;
+	}
+
+	bit = 1u << (31 - depth);
+
+	init_blk(&lo, depth + 1);
+	init_blk(&hi, depth + 1);
+
+	for_each_rec(rec, off, &old) {
+		const size_t size = REC_SIZE(be16_to_cpu(rec->namelen));
+		struct dirblk *dst;
+
+		dst = (be32_to_cpu(rec->hash) & bit) ? &hi : &lo;
+
+		memcpy(&dst->data[be32_to_cpu(dst->used)], rec, size);
+		dst->used = cpu32_to_be(be32_to_cpu(dst->used) + size);
+	}
+
+	newblk = dir->nblocks++;
+
+	ret = write_blk(dir, newblk, &hi);
+	if (ret)
+		return ret;
+
+	ret = write_hdr(dir);
+	if (ret)
+		return ret;
+
+	ret = write_blk(dir, blkno, &lo);
+	if (ret)
+		return ret;
+
+	/* the upper half of the old bucket's slots now go to the new one */
+	nslots = 1u << (dir->depth - depth);
+	slot = hash_slot(hash, dir->depth) & ~(nslots - 1);
+
+	return set_slots(dir, slot + nslots / 2, nslots / 2, newblk);
+}
+
+/*
+ * Find the record for @name in the bucket starting at @blkno.  On
+ * success, @blk contains the block with the record.
+ */
+static int find_rec(struct dir *dir, uint32_t blkno, uint32_t hash,
+		    const char *name, size_t namelen, struct dirblk *blk,
+		    uint32_t *recblk, size_t *recoff)
+{
+	struct dirrec *rec;
+	size_t off;
+	int ret;
+
+	while (blkno) {
+		ret = read_blk(dir, blkno, blk);
+		if (ret)
+			return ret;
+
+		for_each_rec(rec, off, blk) {
+			if ((be32_to_cpu(rec->hash) != hash) ||
+			    (be16_to_cpu(rec->namelen) != namelen) ||
+			    memcmp(rec->name, name, namelen))
+				continue;
+
+			*recblk = blkno;
+			*recoff = off;
+			return 0;
+		}
+
+		blkno = be32_to_cpu(blk->next);
+	}
+
+	return -ENOENT;
+}
+
+int posix_dir_lookup(struct posixvol *pvol, struct posixfd *pfd,
+		     const char *name, uint64_t *uniq)
+{
+	const size_t namelen = strlen(name);
+	const uint32_t hash = dir_hash(name, namelen);
+	struct dirblk blk;
+	struct dir dir;
+	uint32_t blkno;
+	size_t off;
+	int ret;
+
+	ret = read_hdr(pvol, pfd, &dir);
+	if (ret)
+		return ret;
+
+	ret = get_slot(&dir, hash_slot(hash, dir.depth), &blkno);
+	if (ret)
+		return ret;
+
+	ret = find_rec(&dir, blkno, hash, name, namelen, &blk, &blkno, &off);
+	if (ret)
+		return ret;
+
+	*uniq = be64_to_cpu(blk_rec(&blk, off)->uniq);
+
+	return 0;
+}
+
+static void append_rec(struct dirblk *blk, uint32_t hash, uint32_t cd,
+		       const char *name, size_t namelen, uint64_t uniq)
+{
+	const uint32_t used = be32_to_cpu(blk->used);
+	struct dirrec *rec = blk_rec(blk, used);
+
+	memset(rec, 0, REC_SIZE(namelen));
+
+	rec->hash = cpu32_to_be(hash);
+	rec->cd = cpu32_to_be(cd);
+	rec->uniq = cpu64_to_be(uniq);
+	rec->namelen = cpu16_to_be(namelen);
+	memcpy(rec->name, name, namelen);
+
+	blk->used = cpu32_to_be(used + REC_SIZE(namelen));
+}
+
+/*
+ * Add @name -> @uniq to the directory.  The caller is responsible for
+ * making sure that the name isn't already present.
+ */
+int posix_dir_insert(struct posixvol *pvol, struct posixfd *pfd,
+		     const char *name, uint64_t uniq)
+{
+	const size_t namelen = strlen(name);
+	const size_t size = REC_SIZE(namelen);
+	const uint32_t hash = dir_hash(name, namelen);
+	struct dirblk blk;
+	struct dir dir;
+	int ret;
+
+	if (namelen > DIR_MAX_NAME)
+		return -ENAMETOOLONG;
+
+	ret = read_hdr(pvol, pfd, &dir);
+	if (ret == -ENOENT)
+		ret = init_dir(&dir);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		struct dirrec *rec;
+		uint32_t first;
+		uint32_t blkno;
+		uint32_t last;
+		uint32_t room;
+		uint32_t cd;
+		size_t off;
+
+		ret = get_slot(&dir, hash_slot(hash, dir.depth), &first);
+		if (ret)
+			return ret;
+
+		/*
+		 * Find the next free collision discriminator for this hash,
+		 * and a block in the chain with enough room.
+		 */
+		cd = 0;
+		room = 0;
+		last = first;
+		for (blkno = first; blkno; blkno = be32_to_cpu(blk.next)) {
+			ret = read_blk(&dir, blkno, &blk);
+			if (ret)
+				return ret;
+
+			for_each_rec(rec, off, &blk)
+				if (be32_to_cpu(rec->hash) == hash)
+					cd = MAX(cd, be32_to_cpu(rec->cd) + 1);
+
+			if (!room &&
+			    (be32_to_cpu(blk.used) + size <= sizeof(blk.data)))
+				room = blkno;
+
+			last = blkno;
+		}
+
+		if (room) {
+			ret = read_blk(&dir, room, &blk);
+			if (ret)
+				return ret;
+
+			append_rec(&blk, hash, cd, name, namelen, uniq);
+
+			return write_blk(&dir, room, &blk);
+		}
+
+		ret = read_blk(&dir, first, &blk);
+		if (ret)
+			return ret;
+
+		if (be32_to_cpu(blk.depth) < DIR_MAX_DEPTH) {
+			/* split the bucket & try again */
+			ret = split_bucket(&dir, first, hash);
+			if (ret)
+				return ret;
+
+			continue;
+		}
+
+		/* the bucket can't be split, extend its chain */
+		room = dir.nblocks++;
+
+		init_blk(&blk, DIR_MAX_DEPTH);
+		append_rec(&blk, hash, cd, name, namelen, uniq);
+
+		ret = write_blk(&dir, room, &blk);
+		if (ret)
+			return ret;
+
+		ret = write_hdr(&dir);
+		if (ret)
+			return ret;
+
+		ret = read_blk(&dir, last, &blk);
+		if (ret)
+			return ret;
+
+		blk.next = cpu32_to_be(room);
+
+		return write_blk(&dir, last, &blk);
+	}
+}
+
+/* Remove @name from the directory, returning the uniq it referred to. */
+int posix_dir_remove(struct posixvol *pvol, struct posixfd *pfd,
+		     const char *name, uint64_t *uniq)
+{
+	const size_t namelen = strlen(name);
+	const uint32_t hash = dir_hash(name, namelen);
+	struct dirrec *rec;
+	struct dirblk blk;
+	struct dir dir;
+	uint32_t blkno;
+	uint32_t used;
+	size_t size;
+	size_t off;
+	int ret;
+
+	ret = read_hdr(pvol, pfd, &dir);
+	if (ret)
+		return ret;
+
+	ret = get_slot(&dir, hash_slot(hash, dir.depth), &blkno);
+	if (ret)
+		return ret;
+
+	ret = find_rec(&dir, blkno, hash, name, namelen, &blk, &blkno, &off);
+	if (ret)
+		return ret;
+
+	rec = blk_rec(&blk, off);
+	size = REC_SIZE(namelen);
+	used = be32_to_cpu(blk.used);
+
+	*uniq = be64_to_cpu(rec->uniq);
+
+	memmove(rec, &blk.data[off + size], used - off - size);
+	memset(&blk.data[used - size], 0, size);
+	blk.used = cpu32_to_be(used - size);
+
+	return write_blk(&dir, blkno, &blk);
+}
+
+/*
+ * Find the entry with the smallest cookie that is greater than or equal
+ * to @cookie.
+ */
+int posix_dir_next(struct posixvol *pvol, struct posixfd *pfd,
+		   uint64_t cookie, uint64_t *uniq, char **name,
+		   uint64_t *entcookie)
+{
+	char bestname[DIR_MAX_NAME + 1];
+	uint64_t bestcookie;
+	uint64_t bestuniq;
+	struct dirrec *rec;
+	struct dirblk blk;
+	struct dir dir;
+	uint32_t depth;
+	uint32_t blkno;
+	uint64_t slot;
+	uint32_t shift;
+	bool found;
+	size_t off;
+	int ret;
+
+	ret = read_hdr(pvol, pfd, &dir);
+	if (ret)
+		return ret;
+
+	found = false;
+	bestcookie = 0;
+	bestuniq = 0;
+
+	slot = hash_slot(cookie >> 32, dir.depth);
+
+	while (!found && (slot < (1ull << dir.depth))) {
+		ret = get_slot(&dir, slot, &blkno);
+		if (ret)
+			return ret;
+
+		depth = 0;
+
+		/* look for the best match in the bucket */
+		while (blkno) {
+			ret = read_blk(&dir, blkno, &blk);
+			if (ret)
+				return ret;
+
+			depth = MIN(be32_to_cpu(blk.depth), dir.depth);
+
+			for_each_rec(rec, off, &blk) {
+				const uint64_t c = rec_cookie(rec);
+				const size_t len = be16_to_cpu(rec->namelen);
+
+				if (c < cookie)
+					continue;
+				if (found && (c >= bestcookie))
+					continue;
+
+				if (len > DIR_MAX_NAME)
+					return -EINVAL;
+
+				found = true;
+				bestcookie = c;
+				bestuniq = be64_to_cpu(rec->uniq);
+				memcpy(bestname, rec->name, len);
+				bestname[len] = '\0';
+			}
+
+			blkno = be32_to_cpu(blk.next);
+		}
+
+		/* skip all the slots referencing this bucket */
+		shift = dir.depth - depth;
+		slot = ((slot >> shift) + 1) << shift;
+	}
+
+	if (!found)
+		return -ENOENT;
+
+	*name = strdup(bestname);
+	if (!*name)
+		return -ENOMEM;
+
+	*uniq = bestuniq;
+	*entcookie = bestcookie;
+
+	return 0;
+}
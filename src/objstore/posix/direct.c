@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+
+#include <nomad/config.h>
+
+#include "posix.h"
+
+/*
+ * Direct I/O
+ *
+ * Large sequential workloads gain nothing from having object data cached
+ * in the host's page cache - it only doubles the memory use and adds a
+ * copy.  Therefore, the data of objects that are at least "posix-direct-io"
+ * bytes big is read and written through a second, O_DIRECT descriptor for
+ * the version file (see fdcache_open_direct()).  A vdev can override the
+ * config with a "directio" file containing the threshold.
+ *
+ * Direct I/O requires the buffer, the file offset, and the length to be
+ * aligned.  The object data starts POSIX_HDR_SIZE bytes into the version
+ * file, which keeps aligned object offsets aligned in the file.  Aligned
+ * requests go straight to the file; everything else is bounced through an
+ * (aligned) I/O buffer in DIO_CHUNK sized pieces.  Partial blocks at the
+ * ends of a write are read first and merged with the new data.  This
+ * read-modify-write cycle is safe since writes to an object are serialized
+ * by the object lock.
+ *
+ * The header and the final partial block of a file are always accessed
+ * through the regular descriptor.  If the file system rejects O_DIRECT,
+ * the volume falls back to using the page cache for everything.
+ */
+
+#define DIRECTIO_FILENAME	"directio"
+
+#define DIO_ALIGN	POSIXIO_BUF_ALIGN
+#define DIO_CHUNK	POSIXIO_BUF_SIZE
+
+#define ALIGN_DOWN(x)	((x) & ~((uint64_t) DIO_ALIGN - 1))
+#define ALIGN_UP(x)	ALIGN_DOWN((x) + DIO_ALIGN - 1)
+#define IS_ALIGNED(x)	(!((uint64_t) (x) & (DIO_ALIGN - 1)))
+
+/*
+ * Set the vdev's threshold from the config, unless the vdev has its own
+ * "directio" file.
+ */
+int posix_direct_init(struct posixvdev *pv)
+{
+	unsigned long long val;
+	char *tmp;
+	char *end;
+	int ret;
+
+	pv->direct = config_get_posix_direct_io();
+
+	tmp = read_file_at(pv->basefd, DIRECTIO_FILENAME);
+	if (IS_ERR(tmp)) {
+		ret = PTR_ERR(tmp);
+
+		return (ret == -ENOENT) ? 0 : ret;
+	}
+
+	errno = 0;
+	val = strtoull(tmp, &end, 10);
+	if (errno || (end == tmp) || (*end && (*end != '\n'))) {
+		ret = -EINVAL;
+	} else {
+		pv->direct = val;
+		ret = 0;
+	}
+
+	free(tmp);
+
+	return ret;
+}
+
+/* should the data of an object of @size bytes use direct I/O? */
+bool posix_direct_wanted(struct posixvol *pvol, uint64_t size)
+{
+	return pvol->direct && !pvol->nodirect && (size >= pvol->direct);
+}
+
+/*
+ * Get the O_DIRECT descriptor for @pfd.  Returns -ENOTSUP if the caller
+ * should use the page cache instead.
+ */
+static int getdfd(struct posixvol *pvol, struct posixfd *pfd)
+{
+	int ret;
+
+	ret = fdcache_open_direct(pvol, pfd);
+	switch (ret) {
+		case 0:
+			return 0;
+		case -EINVAL:
+		case -ENOTSUP:
+#if EOPNOTSUPP != ENOTSUP
+		case -EOPNOTSUPP:
+#endif
+			if (!pvol->nodirect)
+				cmn_err(CE_INFO, "posix: file system does not "
+					"support direct I/O, using the page "
+					"cache");
+
+			pvol->nodirect = true;
+			return -ENOTSUP;
+	}
+
+	return ret;
+}
+
+/*
+ * Read the DIO_ALIGN bytes at @off into @blk.  Anything past the end of
+ * the file (@filesize) is zero filled.
+ */
+static int read_block(struct posixvol *pvol, struct posixfd *pfd,
+		      uint8_t *blk, uint64_t off, uint64_t filesize)
+{
+	if ((off + DIO_ALIGN) <= filesize)
+		return posix_pread(pvol->ring, pfd->dfd, pfd->dslot, blk,
+				   DIO_ALIGN, off);
+
+	memset(blk, 0, DIO_ALIGN);
+
+	if (off >= filesize)
+		return 0;
+
+	return posix_pread(pvol->ring, pfd->fd, pfd->slot, blk,
+			   filesize - off, off);
+}
+
+/*
+ * Same as posix_pread() on the version file, but bypassing the page
+ * cache.  @off is the file offset and the file is @filesize bytes long.
+ * The whole range must be within the file.
+ */
+int posix_direct_pread(struct posixvol *pvol, struct posixfd *pfd,
+		       void *_buf, size_t len, uint64_t off, uint64_t filesize)
+{
+	const uint64_t dend = ALIGN_DOWN(filesize);
+	uint8_t *buf = _buf;
+	uint8_t *bounce;
+	int ret;
+
+	ret = getdfd(pvol, pfd);
+	if (ret == -ENOTSUP)
+		return posix_pread(pvol->ring, pfd->fd, pfd->slot, buf, len,
+				   off);
+	if (ret)
+		return ret;
+
+	/* the partial block at the end of the file */
+	if ((off + len) > dend) {
+		const uint64_t toff = MAX(off, dend);
+
+		ret = posix_pread(pvol->ring, pfd->fd, pfd->slot,
+				  buf + (toff - off), off + len - toff, toff);
+		if (ret)
+			return ret;
+
+		len = toff - off;
+	}
+
+	if (!len)
+		return 0;
+
+	if (IS_ALIGNED(buf) && IS_ALIGNED(off) && IS_ALIGNED(len))
+		return posix_pread(pvol->ring, pfd->dfd, pfd->dslot, buf, len,
+				   off);
+
+	bounce = posix_io_buf_alloc(pvol->ring, DIO_CHUNK);
+	if (!bounce)
+		return -ENOMEM;
+
+	while (len) {
+		const uint64_t start = ALIGN_DOWN(off);
+		const size_t skip = off - start;
+		const size_t n = MIN(len, DIO_CHUNK - skip);
+
+		/* stays below dend, since dend is aligned */
+		ret = posix_pread(pvol->ring, pfd->dfd, pfd->dslot, bounce,
+				  ALIGN_UP(skip + n), start);
+		if (ret)
+			break;
+
+		memcpy(buf, bounce + skip, n);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+
+	posix_io_buf_free(pvol->ring, bounce);
+
+	return ret;
+}
+
+/*
+ * Same as posix_pwrite() on the version file, but bypassing the page
+ * cache.  @off is the file offset and the file is @filesize bytes long
+ * before the write.
+ */
+int posix_direct_pwrite(struct posixvol *pvol, struct posixfd *pfd,
+			const void *_buf, size_t len, uint64_t off,
+			uint64_t filesize)
+{
+	const uint64_t newsize = MAX(filesize, off + len);
+	const uint8_t *buf = _buf;
+	uint8_t *bounce;
+	int ret;
+
+	ret = getdfd(pvol, pfd);
+	if (ret == -ENOTSUP)
+		return posix_pwrite(pvol->ring, pfd->fd, pfd->slot, buf, len,
+				    off);
+	if (ret)
+		return ret;
+
+	if (IS_ALIGNED(buf) && IS_ALIGNED(off) && IS_ALIGNED(len))
+		return posix_pwrite(pvol->ring, pfd->dfd, pfd->dslot, buf, len,
+				    off);
+
+	bounce = posix_io_buf_alloc(pvol->ring, DIO_CHUNK);
+	if (!bounce)
+		return -ENOMEM;
+
+	ret = 0;
+
+	while (len) {
+		const uint64_t start = ALIGN_DOWN(off);
+		const size_t skip = off - start;
+		const size_t n = MIN(len, DIO_CHUNK - skip);
+		const size_t iolen = ALIGN_UP(skip + n);
+
+		/* merge partial blocks with what is already there */
+		if (skip) {
+			ret = read_block(pvol, pfd, bounce, start, filesize);
+			if (ret)
+				break;
+		}
+
+		if (!IS_ALIGNED(skip + n) && (!skip || (iolen > DIO_ALIGN))) {
+			ret = read_block(pvol, pfd, bounce + iolen - DIO_ALIGN,
+					 start + iolen - DIO_ALIGN, filesize);
+			if (ret)
+				break;
+		}
+
+		memcpy(bounce + skip, buf, n);
+
+		ret = posix_pwrite(pvol->ring, pfd->dfd, pfd->dslot, bounce,
+				   iolen, start);
+		if (ret)
+			break;
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+
+	posix_io_buf_free(pvol->ring, bounce);
+
+	if (ret)
+		return ret;
+
+	/* drop the padding of the last block */
+	if (ALIGN_UP(off) > newsize)
+		ret = xftruncate(pfd->fd, newsize);
+
+	return ret;
+}
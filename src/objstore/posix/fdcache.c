@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* for O_DIRECT on glibc */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+
+#include "posix.h"
+
+/*
+ * Open version file cache
+ *
+ * Opening a version file requires a path walk through the object's
+ * directory, so we keep a bounded number of version file descriptors
+ * open.  The cache is keyed by the object's uniq and the name of the
+ * version file within the object's directory.
+ *
+ * Entries that are in use (i.e., have a non-zero reference count) are
+ * never closed.  Only idle entries live on the LRU list, and whenever the
+ * cache holds more than max entries, we close idle entries starting with
+ * the least recently used one.  If all entries are in use, the cache may
+ * temporarily exceed its size limit.
+ *
+ * Each cached fd is also registered with the vdev's I/O engine (see
+ * uring.c) for as long as it stays in the cache.  Entries used for direct
+ * I/O (see direct.c) additionally hold an O_DIRECT descriptor for the
+ * same file.
+ */
+
+static struct lock_class fdcache_lc;
+
+static int posixfd_cmp(const void *va, const void *vb)
+{
+	const struct posixfd *a = va;
+	const struct posixfd *b = vb;
+	int ret;
+
+	if (a->uniq < b->uniq)
+		return -1;
+	if (a->uniq > b->uniq)
+		return +1;
+
+	ret = strcmp(a->name, b->name);
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return +1;
+	return 0;
+}
+
+void fdcache_init(struct fdcache *cache, size_t max,
+		  struct posixring *ring)
+{
+	cache->ring = ring;
+	MXINIT(&cache->lock, &fdcache_lc);
+	avl_create(&cache->fds, posixfd_cmp, sizeof(struct posixfd),
+		   offsetof(struct posixfd, node));
+	list_create(&cache->lru, sizeof(struct posixfd),
+		    offsetof(struct posixfd, lru));
+	cache->nfds = 0;
+	cache->max = max;
+}
+
+static void __free_posixfd(struct fdcache *cache, struct posixfd *pfd)
+{
+	if (pfd->dfd >= 0) {
+		posix_io_unregister_fd(cache->ring, pfd->dslot);
+		xclose(pfd->dfd);
+	}
+
+	posix_io_unregister_fd(cache->ring, pfd->slot);
+	xclose(pfd->fd);
+	free(pfd->name);
+	free(pfd);
+}
+
+void fdcache_fini(struct fdcache *cache)
+{
+	struct posixfd *pfd;
+	void *cookie;
+
+	cookie = NULL;
+	while ((pfd = avl_destroy_nodes(&cache->fds, &cookie))) {
+		ASSERT0(pfd->refs);
+
+		__free_posixfd(cache, pfd);
+	}
+
+	avl_destroy(&cache->fds);
+	list_destroy(&cache->lru);
+	MXDESTROY(&cache->lock);
+}
+
+/* close idle entries until we are back within the limit */
+static void __evict(struct fdcache *cache)
+{
+	struct posixfd *pfd;
+
+	while (cache->nfds > cache->max) {
+		pfd = list_remove_head(&cache->lru);
+		if (!pfd)
+			break; /* everything is in use */
+
+		avl_remove(&cache->fds, pfd);
+		cache->nfds--;
+
+		__free_posixfd(cache, pfd);
+	}
+}
+
+static struct posixfd *__lookup(struct fdcache *cache, uint64_t uniq,
+				const char *name)
+{
+	struct posixfd key = {
+		.uniq = uniq,
+		.name = (char *) name,
+	};
+	struct posixfd *pfd;
+
+	pfd = avl_find(&cache->fds, &key, NULL);
+	if (!pfd)
+		return NULL;
+
+	if (!pfd->refs)
+		list_remove(&cache->lru, pfd);
+
+	pfd->refs++;
+
+	return pfd;
+}
+
+/*
+ * Return a referenced cache entry for version file @name of object @uniq.
+ * The reference must be released with fdcache_put().
+ */
+struct posixfd *fdcache_get(struct posixvol *pvol, uint64_t uniq,
+			    const char *name)
+{
+	struct fdcache *cache = &pvol->fdcache;
+	struct posixfd *pfd;
+	char path[PATH_MAX];
+	int ret;
+
+	MXLOCK(&cache->lock);
+	pfd = __lookup(cache, uniq, name);
+	MXUNLOCK(&cache->lock);
+
+	if (pfd)
+		return pfd;
+
+	/* not cached, open it without holding the lock */
+	ret = snprintf(path, sizeof(path), OIDFMT "/%s", uniq, name);
+	if (ret >= sizeof(path))
+		return ERR_PTR(-ENAMETOOLONG);
+
+	pfd = malloc(sizeof(struct posixfd));
+	if (!pfd)
+		return ERR_PTR(-ENOMEM);
+
+	pfd->name = strdup(name);
+	if (!pfd->name) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	pfd->fd = xopenat(pvol->basefd, path, O_RDWR, 0);
+	if (pfd->fd < 0) {
+		ret = pfd->fd;
+		goto err_free_name;
+	}
+
+	pfd->slot = posix_io_register_fd(cache->ring, pfd->fd);
+	pfd->dfd = -1;
+	pfd->dslot = -1;
+	pfd->uniq = uniq;
+	pfd->refs = 1;
+
+	MXLOCK(&cache->lock);
+	if (avl_find(&cache->fds, pfd, NULL)) {
+		/* someone else opened it in the meantime - use theirs */
+		struct posixfd *other = __lookup(cache, uniq, name);
+
+		MXUNLOCK(&cache->lock);
+
+		__free_posixfd(cache, pfd);
+
+		return other;
+	}
+
+	avl_add(&cache->fds, pfd);
+	cache->nfds++;
+
+	__evict(cache);
+	MXUNLOCK(&cache->lock);
+
+	return pfd;
+
+err_free_name:
+	free(pfd->name);
+
+err_free:
+	free(pfd);
+
+	return ERR_PTR(ret);
+}
+
+void fdcache_put(struct posixvol *pvol, struct posixfd *pfd)
+{
+	struct fdcache *cache = &pvol->fdcache;
+
+	MXLOCK(&cache->lock);
+	ASSERT3U(pfd->refs, >, 0);
+
+	if (!--pfd->refs) {
+		list_insert_tail(&cache->lru, pfd);
+
+		__evict(cache);
+	}
+	MXUNLOCK(&cache->lock);
+}
+
+/*
+ * Close all cached descriptors for object @uniq.  None of them may be in
+ * use.
+ */
+void fdcache_drop(struct posixvol *pvol, uint64_t uniq)
+{
+	struct fdcache *cache = &pvol->fdcache;
+	struct posixfd key = {
+		.uniq = uniq,
+		.name = "",
+	};
+	struct posixfd *pfd;
+	avl_index_t where;
+
+	MXLOCK(&cache->lock);
+	pfd = avl_find(&cache->fds, &key, &where);
+	if (!pfd)
+		pfd = avl_nearest(&cache->fds, where, AVL_AFTER);
+
+	while (pfd && (pfd->uniq == uniq)) {
+		struct posixfd *next = AVL_NEXT(&cache->fds, pfd);
+
+		ASSERT0(pfd->refs);
+
+		list_remove(&cache->lru, pfd);
+		avl_remove(&cache->fds, pfd);
+		cache->nfds--;
+
+		__free_posixfd(cache, pfd);
+
+		pfd = next;
+	}
+	MXUNLOCK(&cache->lock);
+}
+
+/*
+ * Rename version file @oldname of object @uniq to @newname, keeping any
+ * cached descriptor (which still refers to the same file) in sync.
+ */
+int fdcache_rename(struct posixvol *pvol, uint64_t uniq, const char *oldname,
+		   const char *newname)
+{
+	struct fdcache *cache = &pvol->fdcache;
+	char oldpath[PATH_MAX];
+	char newpath[PATH_MAX];
+	struct posixfd key = {
+		.uniq = uniq,
+		.name = (char *) oldname,
+	};
+	struct posixfd *pfd;
+	char *name;
+	int ret;
+
+	if ((snprintf(oldpath, sizeof(oldpath), OIDFMT "/%s", uniq,
+		      oldname) >= sizeof(oldpath)) ||
+	    (snprintf(newpath, sizeof(newpath), OIDFMT "/%s", uniq,
+		      newname) >= sizeof(newpath)))
+		return -ENAMETOOLONG;
+
+	name = strdup(newname);
+	if (!name)
+		return -ENOMEM;
+
+	MXLOCK(&cache->lock);
+	if (renameat(pvol->basefd, oldpath, pvol->basefd, newpath)) {
+		ret = -errno;
+		goto out;
+	}
+
+	pfd = avl_find(&cache->fds, &key, NULL);
+	if (pfd) {
+		avl_remove(&cache->fds, pfd);
+		free(pfd->name);
+		pfd->name = name;
+		avl_add(&cache->fds, pfd);
+
+		name = NULL;
+	}
+
+	ret = 0;
+
+out:
+	MXUNLOCK(&cache->lock);
+
+	free(name);
+
+	return ret;
+}
+
+/*
+ * Make sure that the referenced cache entry @pfd has an O_DIRECT
+ * descriptor.  The file is opened with the cache lock held, since
+ * otherwise a concurrent fdcache_rename() could change its name under us.
+ * That only happens once per cache entry.
+ */
+int fdcache_open_direct(struct posixvol *pvol, struct posixfd *pfd)
+{
+#ifdef O_DIRECT
+	struct fdcache *cache = &pvol->fdcache;
+	char path[PATH_MAX];
+	int ret;
+
+	MXLOCK(&cache->lock);
+	ASSERT3U(pfd->refs, >, 0);
+
+	if (pfd->dfd >= 0) {
+		ret = 0;
+		goto out;
+	}
+
+	if (snprintf(path, sizeof(path), OIDFMT "/%s", pfd->uniq,
+		     pfd->name) >= sizeof(path)) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+
+	ret = xopenat(pvol->basefd, path, O_RDWR | O_DIRECT, 0);
+	if (ret < 0)
+		goto out;
+
+	pfd->dfd = ret;
+	pfd->dslot = posix_io_register_fd(cache->ring, pfd->dfd);
+
+	ret = 0;
+
+out:
+	MXUNLOCK(&cache->lock);
+
+	return ret;
+#else
+	return -ENOTSUP;
+#endif
+}
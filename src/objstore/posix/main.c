@@ -20,6 +20,9 @@
  * SOFTWARE.
  */
 
+#include <dirent.h>
+#include <string.h>
+
 #include <jeffpc/error.h>
 #include <jeffpc/io.h>
 #include <jeffpc/rand.h>
@@ -29,6 +32,8 @@
 #define VDEV_FILENAME	"vdev"
 #define VOL_FILENAME	"vol"
 
+static struct lock_class posixvdev_lc;
+
 static int store_vdevid(struct posixvdev *pv)
 {
 	char vdevid[XUUID_PRINTABLE_STRING_LENGTH];
@@ -69,6 +74,10 @@ static int prep_vdev(struct posixvdev *pv)
 	if (ret)
 		goto err_basefd;
 
+	ret = posix_direct_init(pv);
+	if (ret)
+		goto err_basefd;
+
 	return 0;
 
 err_basefd:
@@ -102,6 +111,10 @@ static int open_vdev(struct posixvdev *pvdev)
 		goto err_free;
 	}
 
+	ret = posix_direct_init(pvdev);
+	if (ret)
+		goto err_free;
+
 	return 0;
 
 err_free:
@@ -113,6 +126,50 @@ err:
 	return ret;
 }
 
+static struct posixvdev *allocposixvdev(struct objstore_vdev *vdev)
+{
+	struct posixvdev *pv;
+
+	pv = malloc(sizeof(struct posixvdev));
+	if (!pv)
+		return NULL;
+
+	pv->vdev = vdev;
+
+	pv->ring = posix_io_init();
+
+	if (posix_finish_init(pv))
+		goto err_io;
+
+	if (posix_commit_init(pv))
+		goto err_finish;
+
+	MXINIT(&pv->lock, &posixvdev_lc);
+	list_create(&pv->vols, sizeof(struct posixvol),
+		    offsetof(struct posixvol, node));
+
+	return pv;
+
+err_finish:
+	posix_finish_fini(pv);
+
+err_io:
+	posix_io_fini(pv->ring);
+	free(pv);
+
+	return NULL;
+}
+
+static void freeposixvdev(struct posixvdev *pv)
+{
+	posix_commit_fini(pv);
+	posix_finish_fini(pv);
+	posix_io_fini(pv->ring);
+	list_destroy(&pv->vols);
+	MXDESTROY(&pv->lock);
+	free(pv);
+}
+
 static int posix_create(struct objstore_vdev *vdev)
 {
 	struct posixvdev *pv;
@@ -121,12 +178,10 @@ static int posix_create(struct objstore_vdev *vdev)
 	cmn_err(CE_WARN, "The POSIX objstore backend is still experimental");
 	cmn_err(CE_WARN, "Do not expect compatibility from version to version");
 
-	pv = malloc(sizeof(struct posixvdev));
+	pv = allocposixvdev(vdev);
 	if (!pv)
 		return -ENOMEM;
 
-	pv->vdev = vdev;
-
 	ret = prep_vdev(pv);
 	if (ret)
 		goto err_free;
@@ -136,7 +191,7 @@ static int posix_create(struct objstore_vdev *vdev)
 	return 0;
 
 err_free:
-	free(pv);
+	freeposixvdev(pv);
 
 	return ret;
 }
@@ -154,8 +209,15 @@ static int store_volinfo(struct posixvol *pvol)
 	if (ret)
 		goto err;
 
+	ret = pack_create(pvol);
+	if (ret)
+		goto err_oidbmap;
+
 	return 0;
 
+err_oidbmap:
+	oidbmap_fini(pvol);
+
 err:
 	xclose(pvol->volfd);
 	xunlinkat(pvol->basefd, VOL_FILENAME, 0);
@@ -196,6 +258,7 @@ err_mkdir:
 static int posix_create_vol(struct objstore *vol)
 {
 	char volid[XUUID_PRINTABLE_STRING_LENGTH];
+	struct posixvdev *pv = vol->vdev->private;
 	struct posixvol *pvol;
 	int ret;
 
@@ -204,6 +267,13 @@ static int posix_create_vol(struct objstore *vol)
 		return -ENOMEM;
 
 	pvol->vol = vol;
+	pvol->ring = pv->ring;
+	pvol->noclone = false;
+	pvol->nocopyrange = false;
+	pvol->direct = pv->direct;
+	pvol->nodirect = false;
+
+	fdcache_init(&pvol->fdcache, POSIX_FDCACHE_SIZE, pvol->ring);
 
 	xuuid_unparse(&vol->id, volid);
 
@@ -212,7 +282,7 @@ static int posix_create_vol(struct objstore *vol)
 		goto err_free;
 
 	/* create the root */
-	ret = posix_new_obj(pvol, NATTR_DIR | 0777, &pvol->root);
+	ret = posix_new_obj(pvol, NATTR_DIR | 0777, 1, &pvol->root);
 	if (ret)
 		goto err_paths;
 
@@ -221,17 +291,120 @@ static int posix_create_vol(struct objstore *vol)
 	vol->ops = &posix_vol_ops;
 	vol->private = pvol;
 
+	MXLOCK(&pv->lock);
+	list_insert_tail(&pv->vols, pvol);
+	MXUNLOCK(&pv->lock);
+
 	return 0;
 
 err_paths:
 	FIXME("remove partially constructed volume files & dirs");
+	pack_fini(pvol);
+	oidbmap_fini(pvol);
+	xclose(pvol->volfd);
+	xclose(pvol->basefd);
 
 err_free:
+	fdcache_fini(&pvol->fdcache);
 	free(pvol);
 
 	return ret;
 }
 
+/*
+ * Existing volumes aren't imported yet, but their on-disk metadata still
+ * has to be made consistent after a crash.  Loading the pack trims any
+ * torn record at its end, and loading the oid bitmap replays its intent
+ * log and writes the result back out.  Once that is done, we let go of
+ * the volume again.
+ */
+static int recover_vol(struct posixvdev *pv, const char *volid)
+{
+	struct posixvol pvol;
+	int ret;
+
+	memset(&pvol, 0, sizeof(pvol));
+	pvol.ring = pv->ring;
+	pvol.direct = pv->direct;
+
+	fdcache_init(&pvol.fdcache, POSIX_FDCACHE_SIZE, pvol.ring);
+
+	pvol.basefd = xopenat(pv->basefd, volid, O_RDONLY, 0);
+	if (pvol.basefd < 0) {
+		ret = pvol.basefd;
+		goto err_fdcache;
+	}
+
+	pvol.volfd = xopenat(pvol.basefd, VOL_FILENAME, O_RDWR, 0);
+	if (pvol.volfd < 0) {
+		ret = pvol.volfd;
+		goto err_basefd;
+	}
+
+	ret = pack_load(&pvol);
+	if (ret)
+		goto err_volfd;
+
+	ret = oidbmap_load(&pvol);
+	if (ret)
+		goto err_pack;
+
+	oidbmap_fini(&pvol);
+
+err_pack:
+	pack_fini(&pvol);
+
+err_volfd:
+	xclose(pvol.volfd);
+
+err_basefd:
+	xclose(pvol.basefd);
+
+err_fdcache:
+	fdcache_fini(&pvol.fdcache);
+
+	return ret;
+}
+
+/* every directory named by a uuid is a volume */
+static int recover_vols(struct posixvdev *pv)
+{
+	struct dirent *de;
+	struct xuuid id;
+	DIR *dir;
+	int ret;
+	int fd;
+
+	fd = xopenat(pv->basefd, ".", O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		ret = -errno;
+		xclose(fd);
+		return ret;
+	}
+
+	ret = 0;
+
+	while ((de = readdir(dir))) {
+		if (!xuuid_parse(&id, de->d_name))
+			continue;
+
+		ret = recover_vol(pv, de->d_name);
+		if (ret) {
+			cmn_err(CE_ERROR, "failed to recover volume %s: %s",
+				de->d_name, xstrerror(ret));
+			break;
+		}
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
 static int posix_load(struct objstore_vdev *vdev)
 {
 	struct posixvdev *pv;
@@ -240,22 +413,51 @@ static int posix_load(struct objstore_vdev *vdev)
 	cmn_err(CE_WARN, "The POSIX objstore backend is still experimental");
 	cmn_err(CE_WARN, "Do not expect compatibility from version to version");
 
-	pv = malloc(sizeof(struct posixvdev));
+	pv = allocposixvdev(vdev);
 	if (!pv)
 		return -ENOMEM;
 
-	pv->vdev = vdev;
-
 	ret = open_vdev(pv);
 	if (ret)
 		goto err_free;
 
+	ret = recover_vols(pv);
+	if (ret)
+		goto err_close;
+
 	vdev->private = pv;
 
 	return 0;
 
+err_close:
+	xclose(pv->basefd);
+
 err_free:
-	free(pv);
+	freeposixvdev(pv);
+
+	return ret;
+}
+
+/* write out any deferred volume metadata */
+static int posix_sync(struct objstore_vdev *vdev)
+{
+	struct posixvdev *pv = vdev->private;
+	struct posixvol *pvol;
+	int ret;
+
+	ret = 0;
+
+	MXLOCK(&pv->lock);
+	list_for_each(pvol, &pv->vols) {
+		ret = oidbmap_sync(pvol);
+		if (ret)
+			break;
+
+		ret = pack_sync(pvol);
+		if (ret)
+			break;
+	}
+	MXUNLOCK(&pv->lock);
 
 	return ret;
 }
@@ -266,4 +468,6 @@ const struct objstore_vdev_def objvdev = {
 	.create = posix_create,
 	.create_vol = posix_create_vol,
 	.load = posix_load,
+	.sync = posix_sync,
+	.commit = posix_commit,
 };
@@ -1,6 +1,1053 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/int.h>
+#include <jeffpc/io.h>
+
+#include <nomad/crc32c.h>
 #include <nomad/objstore_backend.h>
 
 #include "posix.h"
 
+/*
+ * Version file header
+ *
+ * The header (see struct posixhdr) is a fixed-size binary structure, so
+ * getting at the attributes is one small pread and the object contents
+ * always start at the same (aligned) offset.
+ */
+
+static inline uint32_t hdr_cksum(const struct posixhdr *hdr)
+{
+	return nomad_crc32c(hdr, offsetof(struct posixhdr, cksum));
+}
+
+int posix_decode_header(const struct posixhdr *hdr, struct nattr *attrs,
+			struct nvclock *clock)
+{
+	uint32_t nents;
+	uint32_t i;
+	int ret;
+
+	if ((be32_to_cpu(hdr->magic) != POSIX_HDR_MAGIC) ||
+	    (be32_to_cpu(hdr->cksum) != hdr_cksum(hdr)))
+		return -EINVAL;
+
+	if (be32_to_cpu(hdr->version) != POSIX_HDR_VERSION)
+		return -ENOTSUP;
+
+	nents = be32_to_cpu(hdr->nents);
+	if (nents > NVCLOCK_NUM_NODES)
+		return -EINVAL;
+
+	attrs->_reserved = 0;
+	attrs->mode = be16_to_cpu(hdr->mode);
+	attrs->nlink = be32_to_cpu(hdr->nlink);
+	attrs->size = be64_to_cpu(hdr->size);
+	attrs->atime = be64_to_cpu(hdr->atime);
+	attrs->btime = be64_to_cpu(hdr->btime);
+	attrs->ctime = be64_to_cpu(hdr->ctime);
+	attrs->mtime = be64_to_cpu(hdr->mtime);
+
+	/* the caller may not care about the clock */
+	if (!clock)
+		return 0;
+
+	for (i = 0; i < nents; i++) {
+		ret = nvclock_set_node(clock, be64_to_cpu(hdr->clock[i].node),
+				       be64_to_cpu(hdr->clock[i].seq));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void posix_encode_header(struct posixhdr *hdr, const struct nattr *attrs,
+			 uint32_t nlink, struct nvclock *clock)
+{
+	unsigned nents;
+	unsigned i;
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->magic = cpu32_to_be(POSIX_HDR_MAGIC);
+	hdr->version = cpu32_to_be(POSIX_HDR_VERSION);
+
+	hdr->mode = cpu16_to_be(attrs->mode);
+	hdr->nlink = cpu32_to_be(nlink);
+	hdr->size = cpu64_to_be(attrs->size);
+	hdr->atime = cpu64_to_be(attrs->atime);
+	hdr->btime = cpu64_to_be(attrs->btime);
+	hdr->ctime = cpu64_to_be(attrs->ctime);
+	hdr->mtime = cpu64_to_be(attrs->mtime);
+
+	nents = nvclock_get_ents(clock, hdr->clock);
+	hdr->nents = cpu32_to_be(nents);
+
+	for (i = 0; i < nents; i++) {
+		hdr->clock[i].node = cpu64_to_be(hdr->clock[i].node);
+		hdr->clock[i].seq = cpu64_to_be(hdr->clock[i].seq);
+	}
+
+	hdr->cksum = cpu32_to_be(hdr_cksum(hdr));
+}
+
+int posix_read_header(int fd, struct nattr *attrs, struct nvclock *clock)
+{
+	struct posixhdr hdr;
+	int ret;
+
+	ret = xpread(fd, &hdr, sizeof(hdr), 0);
+	if (ret)
+		return ret;
+
+	return posix_decode_header(&hdr, attrs, clock);
+}
+
+int posix_write_header(int fd, const struct nattr *attrs, uint32_t nlink,
+		       struct nvclock *clock)
+{
+	struct posixhdr hdr;
+
+	posix_encode_header(&hdr, attrs, nlink, clock);
+
+	return xpwrite(fd, &hdr, sizeof(hdr), 0);
+}
+
+static struct posixfd *getfd(struct objver *ver, char *name, size_t len)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	int ret;
+
+	ret = nvclock_to_str(ver->clock, name, len);
+	if (ret)
+		return ERR_PTR(ret);
+
+	return fdcache_get(pvol, ver->obj->oid.uniq, name);
+}
+
+static void putfd(struct objver *ver, struct posixfd *pfd)
+{
+	fdcache_put(ver->obj->vol->private, pfd);
+}
+
+/*
+ * The version file is named after the version's clock.  Once we modify a
+ * version, we bump its clock, write out the new header, and rename the
+ * file to match.
+ */
+static int update_version(struct objver *ver, struct posixfd *pfd,
+			  const char *oldname)
+{
+	char newname[PATH_MAX];
+	struct nvclock *clock;
+	int ret;
+
+	clock = nvclock_dup(ver->clock);
+	if (!clock)
+		return -ENOMEM;
+
+	ret = nvclock_inc(clock);
+	if (ret)
+		goto err;
+
+	ret = nvclock_to_str(clock, newname, sizeof(newname));
+	if (ret)
+		goto err;
+
+	ret = posix_write_header(pfd->fd, &ver->attrs, ver->obj->nlink, clock);
+	if (ret)
+		goto err;
+
+	ret = fdcache_rename(ver->obj->vol->private, ver->obj->oid.uniq,
+			     oldname, newname);
+	if (ret)
+		goto err;
+
+	nvclock_free(ver->clock);
+	ver->clock = clock;
+
+	return 0;
+
+err:
+	nvclock_free(clock);
+
+	return ret;
+}
+
+/* read the header of a version, wherever it is stored */
+int posix_get_header(struct posixvol *pvol, uint64_t uniq, const char *name,
+		     struct nattr *attrs, struct nvclock *clock)
+{
+	struct posixfd *pfd;
+	int ret;
+
+	ret = pack_read_header(pvol, uniq, name, attrs, clock);
+	if (ret != -ENOENT)
+		return ret;
+
+	pfd = fdcache_get(pvol, uniq, name);
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	ret = posix_read_header(pfd->fd, attrs, clock);
+
+	fdcache_put(pvol, pfd);
+
+	return ret;
+}
+
+/*
+ * Packed versions are rewritten as a whole (see pack.c).  @data holds
+ * all of the version's new contents.
+ */
+static int update_packed(struct objver *ver, const char *oldname,
+			 const void *data)
+{
+	char newname[PATH_MAX];
+	struct nvclock *clock;
+	int ret;
+
+	clock = nvclock_dup(ver->clock);
+	if (!clock)
+		return -ENOMEM;
+
+	ret = nvclock_inc(clock);
+	if (ret)
+		goto err;
+
+	ret = nvclock_to_str(clock, newname, sizeof(newname));
+	if (ret)
+		goto err;
+
+	ret = pack_write(ver->obj->vol->private, ver->obj->oid.uniq, newname,
+			 oldname, &ver->attrs, ver->obj->nlink, clock, data);
+	if (ret)
+		goto err;
+
+	nvclock_free(ver->clock);
+	ver->clock = clock;
+
+	return 0;
+
+err:
+	nvclock_free(clock);
+
+	return ret;
+}
+
+/*
+ * Read a packed version's contents into a buffer of @size bytes, zero
+ * filling anything past the end of the version.
+ */
+static void *read_packed(struct objver *ver, const char *name, uint64_t size)
+{
+	uint8_t *data;
+	int ret;
+
+	data = malloc(MAX(size, 1));
+	if (!data)
+		return ERR_PTR(-ENOMEM);
+
+	ret = pack_read(ver->obj->vol->private, ver->obj->oid.uniq, name,
+			data, MIN(size, ver->attrs.size), 0);
+	if (ret) {
+		free(data);
+		return ERR_PTR(ret);
+	}
+
+	if (size > ver->attrs.size)
+		memset(data + ver->attrs.size, 0, size - ver->attrs.size);
+
+	return data;
+}
+
+/* move a packed version into a dedicated version file */
+static int unpack(struct objver *ver, const char *name)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	const uint64_t uniq = ver->obj->oid.uniq;
+	void *data;
+	int ret;
+
+	data = read_packed(ver, name, ver->attrs.size);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	ret = posix_create_verfile(pvol, uniq, name, &ver->attrs,
+				   ver->obj->nlink, ver->clock, data);
+	if (!ret)
+		ret = pack_remove(pvol, uniq, name);
+
+	free(data);
+
+	return ret;
+}
+
+/*
+ * Figure out the version's name, and whether it should be packed after
+ * growing (or shrinking) to @newsize.  Packed versions that get too big
+ * are moved to a dedicated version file first.
+ */
+static int prep_version(struct objver *ver, char *name, size_t len,
+			uint64_t newsize, bool *packed)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	int ret;
+
+	ret = nvclock_to_str(ver->clock, name, len);
+	if (ret)
+		return ret;
+
+	*packed = pack_contains(pvol, ver->obj->oid.uniq, name);
+	if (!*packed || pack_wanted(pvol, ver->attrs.mode, newsize))
+		return 0;
+
+	*packed = false;
+
+	return unpack(ver, name);
+}
+
+static int posix_obj_getversion(struct objver *ver)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	const uint64_t uniq = ver->obj->oid.uniq;
+	char name[PATH_MAX];
+	struct nvclock *clock;
+	int ret;
+
+	if (nvclock_is_null(ver->clock)) {
+		uint64_t nversions;
+
+		/* find the only version; the header will tell us its clock */
+		ret = posix_find_versions(pvol, uniq, &nversions, name,
+					  sizeof(name));
+		if (ret)
+			return ret;
+
+		if (!nversions)
+			return -ENOENT;
+		if (nversions > 1)
+			return -ENOTUNIQ;
+
+		clock = ver->clock;
+	} else {
+		ret = nvclock_to_str(ver->clock, name, sizeof(name));
+		if (ret)
+			return ret;
+
+		clock = NULL;
+	}
+
+	return posix_get_header(pvol, uniq, name, &ver->attrs, clock);
+}
+
+static int posix_obj_getattr(struct objver *ver, struct nattr *attr)
+{
+	*attr = ver->attrs;
+	attr->nlink = ver->obj->nlink;
+
+	return 0;
+}
+
+static int setattr_packed(struct objver *ver, const char *name,
+			  struct nattr *attr, const unsigned valid)
+{
+	const struct nattr oldattrs = ver->attrs;
+	void *data;
+	int ret;
+
+	data = read_packed(ver, name, (valid & OBJ_ATTR_SIZE) ?
+			   attr->size : ver->attrs.size);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	if (valid & OBJ_ATTR_SIZE)
+		ver->attrs.size = attr->size;
+
+	if (valid & OBJ_ATTR_MODE)
+		ver->attrs.mode = attr->mode;
+
+	ret = update_packed(ver, name, data);
+	if (ret)
+		ver->attrs = oldattrs;
+
+	free(data);
+
+	return ret;
+}
+
+static int posix_obj_setattr(struct objver *ver, struct nattr *attr,
+			     const unsigned valid)
+{
+	char name[PATH_MAX];
+	struct posixfd *pfd;
+	bool packed;
+	int ret;
+
+	/*
+	 * first do some checks
+	 */
+	if ((valid & OBJ_ATTR_SIZE) && !NATTR_ISREG(ver->attrs.mode))
+		return -EINVAL;
+
+	/* we can't change the type of the object */
+	if ((valid & OBJ_ATTR_MODE) &&
+	    (attr->mode & NATTR_TMASK) != (ver->attrs.mode & NATTR_TMASK))
+		return -EINVAL;
+
+	if (!valid)
+		goto out;
+
+	ret = prep_version(ver, name, sizeof(name), (valid & OBJ_ATTR_SIZE) ?
+			   attr->size : ver->attrs.size, &packed);
+	if (ret)
+		return ret;
+
+	if (packed) {
+		ret = setattr_packed(ver, name, attr, valid);
+		if (ret)
+			return ret;
+
+		goto out;
+	}
+
+	pfd = fdcache_get(ver->obj->vol->private, ver->obj->oid.uniq, name);
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	/*
+	 * now do the updates
+	 */
+	/* must be first since it can fail */
+	if (valid & OBJ_ATTR_SIZE) {
+		ret = xftruncate(pfd->fd, POSIX_HDR_SIZE + attr->size);
+		if (ret)
+			goto err;
+
+		ver->attrs.size = attr->size;
+	}
+
+	if (valid & OBJ_ATTR_MODE)
+		ver->attrs.mode = attr->mode;
+
+	ret = update_version(ver, pfd, name);
+	if (ret)
+		goto err;
+
+	putfd(ver, pfd);
+
+out:
+	/* return the latest attributes */
+	*attr = ver->attrs;
+	attr->nlink = ver->obj->nlink;
+
+	return 0;
+
+err:
+	putfd(ver, pfd);
+
+	return ret;
+}
+
+static ssize_t posix_obj_read(struct objver *ver, void *buf, size_t len,
+			      uint64_t offset)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	const uint64_t uniq = ver->obj->oid.uniq;
+	char name[PATH_MAX];
+	struct posixfd *pfd;
+	ssize_t ret;
+	int err;
+
+	if (offset >= ver->attrs.size)
+		return 0;
+	else if ((offset + len) > ver->attrs.size)
+		ret = ver->attrs.size - offset;
+	else
+		ret = len;
+
+	err = nvclock_to_str(ver->clock, name, sizeof(name));
+	if (err)
+		return err;
+
+	if (pack_contains(pvol, uniq, name)) {
+		err = pack_read(pvol, uniq, name, buf, ret, offset);
+
+		return err ? err : ret;
+	}
+
+	pfd = fdcache_get(pvol, uniq, name);
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	/* the file is always at least as long as the object */
+	if (posix_direct_wanted(pvol, ver->attrs.size))
+		err = posix_direct_pread(pvol, pfd, buf, ret,
+					 POSIX_HDR_SIZE + offset,
+					 POSIX_HDR_SIZE + ver->attrs.size);
+	else
+		err = posix_pread(pvol->ring, pfd->fd, pfd->slot, buf, ret,
+				  POSIX_HDR_SIZE + offset);
+
+	putfd(ver, pfd);
+
+	return err ? err : ret;
+}
+
+struct posixaio {
+	struct posixio io;
+	struct posixvol *pvol;
+	struct posixfd *pfd;
+	struct objstore_aio *aio;
+	struct posixfinish *finish;
+	int err;
+	struct list_node node;	/* on the finisher's list */
+};
+
+/*
+ * Finishing async I/Os
+ *
+ * Async reads complete on the I/O engine's completion thread, but we
+ * can't finish them there.  objstore_aio_done() drops the object
+ * reference held for the I/O, and the aio's done callback may drop more.
+ * If the last one goes, freeing the object may remove its files - doing
+ * more I/O through the same engine and waiting for the completion thread
+ * to reap it.  So, the completion thread just hands each finished I/O to
+ * a per-vdev finisher thread, which does the rest.
+ */
+
+static struct lock_class posixfinish_lc;
+
+static void *finisher(void *arg)
+{
+	struct posixfinish *finish = arg;
+
+	MXLOCK(&finish->lock);
+	for (;;) {
+		struct posixaio *paio;
+
+		paio = list_remove_head(&finish->aios);
+		if (!paio) {
+			if (finish->exit)
+				break;
+
+			CONDWAIT(&finish->cond, &finish->lock);
+			continue;
+		}
+
+		MXUNLOCK(&finish->lock);
+
+		fdcache_put(paio->pvol, paio->pfd);
+
+		objstore_aio_done(paio->aio, paio->err ? paio->err :
+				  paio->io.len);
+
+		free(paio);
+
+		MXLOCK(&finish->lock);
+	}
+	MXUNLOCK(&finish->lock);
+
+	return NULL;
+}
+
+int posix_finish_init(struct posixvdev *pv)
+{
+	struct posixfinish *finish = &pv->finish;
+	int ret;
+
+	MXINIT(&finish->lock, &posixfinish_lc);
+	CONDINIT(&finish->cond);
+	list_create(&finish->aios, sizeof(struct posixaio),
+		    offsetof(struct posixaio, node));
+	finish->exit = false;
+
+	/* without an I/O engine, all I/O is synchronous */
+	finish->enabled = pv->ring != NULL;
+	if (!finish->enabled)
+		return 0;
+
+	ret = -pthread_create(&finish->thread, NULL, finisher, finish);
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	list_destroy(&finish->aios);
+	CONDDESTROY(&finish->cond);
+	MXDESTROY(&finish->lock);
+
+	return ret;
+}
+
+void posix_finish_fini(struct posixvdev *pv)
+{
+	struct posixfinish *finish = &pv->finish;
+
+	if (finish->enabled) {
+		MXLOCK(&finish->lock);
+		finish->exit = true;
+		CONDSIG(&finish->cond);
+		MXUNLOCK(&finish->lock);
+
+		VERIFY0(pthread_join(finish->thread, NULL));
+	}
+
+	list_destroy(&finish->aios);
+	CONDDESTROY(&finish->cond);
+	MXDESTROY(&finish->lock);
+}
+
+static void read_async_done(struct posixio *io, int err)
+{
+	struct posixaio *paio = io->private;
+	struct posixfinish *finish = paio->finish;
+
+	paio->err = err;
+
+	MXLOCK(&finish->lock);
+	list_insert_tail(&finish->aios, paio);
+	CONDSIG(&finish->cond);
+	MXUNLOCK(&finish->lock);
+}
+
+/*
+ * Reads of dedicated version files go through the I/O engine (see
+ * uring.c) without waiting for them.  Packed versions, objects using
+ * direct I/O (which may need a bounce buffer), and everything on vdevs
+ * without an io_uring, are read synchronously.
+ */
+static ssize_t posix_obj_read_async(struct objver *ver, void *buf, size_t len,
+				    uint64_t offset, struct objstore_aio *aio)
+{
+	struct posixvdev *pv = ver->obj->vol->vdev->private;
+	struct posixvol *pvol = ver->obj->vol->private;
+	const uint64_t uniq = ver->obj->oid.uniq;
+	struct posixaio *paio;
+	char name[PATH_MAX];
+	struct posixfd *pfd;
+	int ret;
+
+	if (!pvol->ring || posix_direct_wanted(pvol, ver->attrs.size))
+		return posix_obj_read(ver, buf, len, offset);
+
+	if (offset >= ver->attrs.size)
+		return 0;
+	else if ((offset + len) > ver->attrs.size)
+		len = ver->attrs.size - offset;
+
+	ret = nvclock_to_str(ver->clock, name, sizeof(name));
+	if (ret)
+		return ret;
+
+	if (pack_contains(pvol, uniq, name)) {
+		ret = pack_read(pvol, uniq, name, buf, len, offset);
+
+		return ret ? ret : len;
+	}
+
+	paio = malloc(sizeof(struct posixaio));
+	if (!paio)
+		return -ENOMEM;
+
+	pfd = fdcache_get(pvol, uniq, name);
+	if (IS_ERR(pfd)) {
+		free(paio);
+		return PTR_ERR(pfd);
+	}
+
+	paio->io.op = POSIXIO_READ;
+	paio->io.fd = pfd->fd;
+	paio->io.slot = pfd->slot;
+	paio->io.buf = buf;
+	paio->io.len = len;
+	paio->io.off = POSIX_HDR_SIZE + offset;
+	paio->io.done = read_async_done;
+	paio->io.private = paio;
+	paio->pvol = pvol;
+	paio->pfd = pfd;
+	paio->aio = aio;
+	paio->finish = &pv->finish;
+
+	posix_io_queue(pvol->ring, &paio->io);
+	posix_io_submit(pvol->ring);
+
+	return -EINPROGRESS;
+}
+
+static int write_packed(struct objver *ver, const char *name, const void *buf,
+			size_t len, uint64_t offset)
+{
+	const uint64_t oldsize = ver->attrs.size;
+	const uint64_t newsize = MAX(oldsize, offset + len);
+	uint8_t *data;
+	int ret;
+
+	data = read_packed(ver, name, newsize);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	memcpy(data + offset, buf, len);
+
+	ver->attrs.size = newsize;
+
+	ret = update_packed(ver, name, data);
+	if (ret)
+		ver->attrs.size = oldsize;
+
+	free(data);
+
+	return ret;
+}
+
+static ssize_t posix_obj_write(struct objver *ver, const void *buf, size_t len,
+			       uint64_t offset)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	const uint64_t oldsize = ver->attrs.size;
+	char name[PATH_MAX];
+	struct posixfd *pfd;
+	bool packed;
+	int ret;
+
+	ret = prep_version(ver, name, sizeof(name),
+			   MAX(oldsize, offset + len), &packed);
+	if (ret)
+		return ret;
+
+	if (packed) {
+		ret = write_packed(ver, name, buf, len, offset);
+
+		return ret ? ret : len;
+	}
+
+	pfd = fdcache_get(pvol, ver->obj->oid.uniq, name);
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	if (posix_direct_wanted(pvol, MAX(oldsize, offset + len)))
+		ret = posix_direct_pwrite(pvol, pfd, buf, len,
+					  POSIX_HDR_SIZE + offset,
+					  POSIX_HDR_SIZE + oldsize);
+	else
+		ret = posix_pwrite(pvol->ring, pfd->fd, pfd->slot, buf, len,
+				   POSIX_HDR_SIZE + offset);
+	if (ret)
+		goto out;
+
+	ver->attrs.size = MAX(oldsize, offset + len);
+
+	ret = update_version(ver, pfd, name);
+	if (ret)
+		ver->attrs.size = oldsize;
+
+out:
+	putfd(ver, pfd);
+
+	return ret ? ret : len;
+}
+
+static int fork_packed(struct objver *ver, const char *oldname,
+		       const char *newname, struct nvclock *clock)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	const uint64_t uniq = ver->obj->oid.uniq;
+	char path[PATH_MAX];
+	void *data;
+	int ret;
+
+	/* make sure there isn't a version file by the new name */
+	snprintf(path, sizeof(path), OIDFMT "/%s", uniq, newname);
+	if (!faccessat(pvol->basefd, path, F_OK, 0))
+		return -EEXIST;
+
+	/* packed objects are small, so copying them is cheap anyway */
+	data = read_packed(ver, oldname, ver->attrs.size);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	ret = pack_write(pvol, uniq, newname, NULL, &ver->attrs,
+			 ver->obj->nlink, clock, data);
+
+	free(data);
+
+	return ret;
+}
+
+static int posix_obj_fork(struct objver *ver, const struct nvclock *newclock)
+{
+	struct posixvol *pvol = ver->obj->vol->private;
+	const uint64_t uniq = ver->obj->oid.uniq;
+	char oldname[PATH_MAX];
+	char newname[PATH_MAX];
+	struct nvclock *clock;
+	int ret;
+
+	clock = nvclock_dup(newclock);
+	if (!clock)
+		return -ENOMEM;
+
+	ret = nvclock_to_str(ver->clock, oldname, sizeof(oldname));
+	if (ret)
+		goto out;
+
+	ret = nvclock_to_str(clock, newname, sizeof(newname));
+	if (ret)
+		goto out;
+
+	if (pack_contains(pvol, uniq, newname))
+		ret = -EEXIST;
+	else if (pack_contains(pvol, uniq, oldname))
+		ret = fork_packed(ver, oldname, newname, clock);
+	else
+		ret = posix_fork_verfile(pvol, uniq, oldname, newname,
+					 &ver->attrs, ver->obj->nlink, clock);
+
+	if (!ret)
+		ver->obj->nversions++;
+
+out:
+	nvclock_free(clock);
+
+	return ret;
+}
+
+static int posix_obj_lookup(struct objver *dirver, const char *name,
+			    struct noid *child)
+{
+	struct posixvol *pvol = dirver->obj->vol->private;
+	char vername[PATH_MAX];
+	struct posixfd *pfd;
+	uint64_t uniq;
+	int ret;
+
+	pfd = getfd(dirver, vername, sizeof(vername));
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	ret = posix_dir_lookup(pvol, pfd, name, &uniq);
+
+	putfd(dirver, pfd);
+
+	if (ret)
+		return ret;
+
+	noid_set(child, &dirver->obj->vol->id, uniq);
+
+	return 0;
+}
+
+static int posix_obj_create(struct objver *dirver, const char *name,
+			    uint16_t mode, struct noid *child)
+{
+	struct posixvol *pvol = dirver->obj->vol->private;
+	char vername[PATH_MAX];
+	struct posixfd *pfd;
+	uint64_t uniq;
+	int ret;
+
+	pfd = getfd(dirver, vername, sizeof(vername));
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	ret = posix_dir_lookup(pvol, pfd, name, &uniq);
+	if (!ret)
+		ret = -EEXIST;
+	if (ret != -ENOENT)
+		goto out;
+
+	ret = posix_new_obj(pvol, mode, 1, child);
+	if (ret)
+		goto out;
+
+	ret = posix_dir_insert(pvol, pfd, name, child->uniq);
+	if (ret) {
+		posix_remove_obj(pvol, child->uniq);
+		goto out;
+	}
+
+	/* the size of a directory is the number of entries in it */
+	dirver->attrs.size++;
+
+	/* we changed the dir, so we need to up the version */
+	ret = update_version(dirver, pfd, vername);
+
+out:
+	putfd(dirver, pfd);
+
+	return ret;
+}
+
+static int __set_nlink(struct posixvol *pvol, uint64_t uniq,
+		       const char *name, void *arg)
+{
+	const uint32_t nlink = *((uint32_t *) arg);
+	struct nvclock *clock;
+	struct posixfd *pfd;
+	struct nattr attrs;
+	int ret;
+
+	if (pack_contains(pvol, uniq, name))
+		return pack_set_nlink(pvol, uniq, name, nlink);
+
+	clock = nvclock_alloc(false);
+	if (!clock)
+		return -ENOMEM;
+
+	pfd = fdcache_get(pvol, uniq, name);
+	if (IS_ERR(pfd)) {
+		ret = PTR_ERR(pfd);
+		goto out;
+	}
+
+	ret = posix_read_header(pfd->fd, &attrs, clock);
+	if (!ret)
+		ret = posix_write_header(pfd->fd, &attrs, nlink, clock);
+
+	fdcache_put(pvol, pfd);
+
+out:
+	nvclock_free(clock);
+
+	return ret;
+}
+
+/* every version's header has a copy of the link count */
+static int set_nlink(struct obj *obj)
+{
+	return posix_for_each_version(obj->vol->private, obj->oid.uniq,
+				      __set_nlink, &obj->nlink);
+}
+
+static int posix_obj_unlink(struct objver *dirver, const char *name,
+			    struct obj *child)
+{
+	struct posixvol *pvol = dirver->obj->vol->private;
+	char vername[PATH_MAX];
+	struct posixfd *pfd;
+	uint64_t uniq;
+	int ret;
+
+	pfd = getfd(dirver, vername, sizeof(vername));
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	ret = posix_dir_lookup(pvol, pfd, name, &uniq);
+	if (ret)
+		goto out;
+
+	VERIFY3U(uniq, ==, child->oid.uniq);
+
+	/*
+	 * Once the last link is gone, the object is removed when the
+	 * generic object is freed (see posix_obj_free()).
+	 *
+	 * The new link count goes out before the entry is removed, so that
+	 * a failure to update it leaves the directory untouched.
+	 */
+	child->nlink--;
+
+	ret = set_nlink(child);
+	if (!ret)
+		ret = posix_dir_remove(pvol, pfd, name, &uniq);
+	if (ret) {
+		/* some of the headers may already have the new count */
+		child->nlink++;
+		(void) set_nlink(child);
+		goto out;
+	}
+
+	/* see comment in posix_obj_create() */
+	dirver->attrs.size--;
+
+	ret = update_version(dirver, pfd, vername);
+
+out:
+	putfd(dirver, pfd);
+
+	return ret;
+}
+
+static int posix_obj_getdent(struct objver *dirver, const uint64_t cookie,
+			     struct noid *child, char **childname,
+			     uint64_t *next_cookie)
+{
+	struct posixvol *pvol = dirver->obj->vol->private;
+	char vername[PATH_MAX];
+	struct posixfd *pfd;
+	uint64_t entcookie;
+	uint64_t uniq;
+	int ret;
+
+	pfd = getfd(dirver, vername, sizeof(vername));
+	if (IS_ERR(pfd))
+		return PTR_ERR(pfd);
+
+	ret = posix_dir_next(pvol, pfd, cookie, &uniq, childname,
+			     &entcookie);
+
+	putfd(dirver, pfd);
+
+	if (ret)
+		return ret;
+
+	noid_set(child, &dirver->obj->vol->id, uniq);
+	*next_cookie = entcookie + 1;
+
+	return 0;
+}
+
+static void posix_obj_free(struct obj *obj)
+{
+	int ret;
+
+	if (obj->nlink)
+		return;
+
+	ret = posix_remove_obj(obj->vol->private, obj->oid.uniq);
+	if (ret)
+		cmn_err(CE_WARN, "failed to remove unlinked object "
+			OIDFMT": %s", obj->oid.uniq, xstrerror(ret));
+}
+
 const struct obj_ops obj_ops = {
+	.getversion = posix_obj_getversion,
+	.getattr = posix_obj_getattr,
+	.setattr = posix_obj_setattr,
+	.read    = posix_obj_read,
+	.read_async = posix_obj_read_async,
+	.write   = posix_obj_write,
+	.fork    = posix_obj_fork,
+	.lookup  = posix_obj_lookup,
+	.create  = posix_obj_create,
+	.unlink  = posix_obj_unlink,
+	.getdent = posix_obj_getdent,
+	.free    = posix_obj_free,
 };
@@ -21,98 +21,678 @@
  */
 
 #include <jeffpc/error.h>
+#include <jeffpc/int.h>
 #include <jeffpc/io.h>
 
 #include "posix.h"
 
+/*
+ * OID bitmap
+ *
+ * The unique part of each oid in a volume is allocated from a bitmap
+ * stored in the vol file.  A set bit means the corresponding uniq is in
+ * use.
+ *
+ * The bitmap is split into segments of SEG_SIZE bytes.  A segment is only
+ * allocated (in memory and on disk) once one of its bits gets set.  Until
+ * then, it is implicitly all zeros.  Since uniqs are allocated mostly
+ * sequentially, a volume only ever has a handful of segments and the vol
+ * file stays sparse - creating a volume doesn't touch the bitmap at all.
+ * On disk, segment i lives at OID_BMAP_OFFSET + i * SEG_SIZE; segments
+ * past the end of the file are all zeros.
+ *
+ * In addition to the bitmap itself, we keep a hierarchical summary of it.
+ * Level 0 is the bitmap; in each following level, bit i is set iff word i
+ * of the previous level is full (i.e., all ones).  With 2^32 uniqs, the
+ * levels have 2^32, 2^26, 2^20, 2^14, 2^8, and 4 bits.  The top level is a
+ * single word, and any bits past the end of it are set so that they never
+ * look free.  The summary levels are zero-filled allocations, so only the
+ * parts covering allocated segments ever get touched.
+ *
+ * Finding a free uniq therefore takes one bit scan per level instead of a
+ * linear search through 512 MiB.  Allocation starts at a rotating hint
+ * (just past the last allocated uniq) so that freed uniqs aren't reused
+ * right away and so that consecutive allocations touch the same words.
+ *
+ * Persistence
+ *
+ * Changes to the bitmap are made in memory only.  We keep track of which
+ * segments are dirty, and write them all out in one go whenever
+ * oidbmap_sync() is called or enough changes accumulate.
+ *
+ * To make sure that a crash can't cause a uniq to be handed out twice,
+ * every allocated uniq must first be covered by a record in the intent
+ * log.  Each record covers a range of OIDBMAP_RESV uniqs, and since the
+ * rotating hint makes allocations mostly sequential, only about one in
+ * every OIDBMAP_RESV allocations has to write (and sync) the log.  When
+ * the bitmap is loaded after a crash, every uniq in a logged range is
+ * checked against the objects that actually exist (see oidbmap_load()).
+ * The log is truncated after each flush of the bitmap.
+ *
+ * Frees are not logged.  If we crash before a freed uniq is written out,
+ * the uniq simply stays allocated.
+ */
+
 #define MAX_OID_UNIQ	(1ull << 32)
 #define OID_BMAP_SIZE	(MAX_OID_UNIQ / 8)
 #define OID_BMAP_OFFSET	4096
 
-int oidbmap_create(struct posixvol *pvol)
+#define OIDLOG_FILENAME	"oidlog"
+
+#define SEG_WORDS	(OIDBMAP_SEG_SIZE / sizeof(uint64_t))
+#define NSEGS		(OID_BMAP_SIZE / OIDBMAP_SEG_SIZE)
+
+#define OIDBMAP_RESV	1024	/* uniqs covered by each intent log record */
+#define MAX_DIRTY	64	/* flush when this many segments are dirty */
+#define MAX_LOG		64	/* flush when the log has this many records */
+
+struct oidlog_rec {
+	uint64_t start;		/* big endian */
+	uint64_t end;		/* big endian */
+};
+
+static struct lock_class oidbmap_lc;
+
+#define LEVEL_BITS(l)	(MAX_OID_UNIQ >> (6 * (l)))
+#define LEVEL_WORDS(l)	((LEVEL_BITS(l) + 63) / 64)
+
+#define TOP_LEVEL	(OIDBMAP_LEVELS - 1)
+
+/*
+ * Returns a pointer to word idx of the given level, or NULL if it is in a
+ * bitmap segment that hasn't been allocated (and therefore is zero).
+ */
+static inline uint64_t *__word(struct oidbmap *bmap, unsigned level,
+			       uint64_t idx)
+{
+	uint64_t *seg;
+
+	if (level)
+		return &bmap->levels[level][idx];
+
+	seg = bmap->segs[idx / SEG_WORDS];
+
+	return seg ? &seg[idx % SEG_WORDS] : NULL;
+}
+
+/* make sure the segment holding uniq is allocated */
+static int __seg_prep(struct oidbmap *bmap, uint64_t uniq)
+{
+	uint64_t **seg = &bmap->segs[(uniq / 64) / SEG_WORDS];
+
+	if (*seg)
+		return 0;
+
+	*seg = calloc(SEG_WORDS, sizeof(uint64_t));
+
+	return *seg ? 0 : -ENOMEM;
+}
+
+/* set bit idx in level and propagate fullness upward */
+static void __mark(struct oidbmap *bmap, unsigned level, uint64_t idx)
+{
+	uint64_t *word = __word(bmap, level, idx / 64);
+
+	*word |= 1ull << (idx % 64);
+
+	if ((*word == ~0ull) && (level < TOP_LEVEL))
+		__mark(bmap, level + 1, idx / 64);
+}
+
+/* clear bit idx in level and propagate non-fullness upward */
+static void __unmark(struct oidbmap *bmap, unsigned level, uint64_t idx)
 {
+	uint64_t *word = __word(bmap, level, idx / 64);
+	bool was_full;
+
+	if (!word)
+		return; /* unallocated segment - already clear */
+
+	was_full = (*word == ~0ull);
+
+	*word &= ~(1ull << (idx % 64));
+
+	if (was_full && (level < TOP_LEVEL))
+		__unmark(bmap, level + 1, idx / 64);
+}
+
+/* find the first clear bit at or after start in level */
+static bool __find(struct oidbmap *bmap, unsigned level, uint64_t start,
+		   uint64_t *result)
+{
+	uint64_t *wordp;
+	uint64_t idx;
+	uint64_t word;
+
+	if (start >= LEVEL_BITS(level))
+		return false;
+
+	idx = start / 64;
+
+	/* pretend that all the bits before start are in use */
+	wordp = __word(bmap, level, idx);
+	word = (wordp ? *wordp : 0) | ((1ull << (start % 64)) - 1);
+
+	if (word == ~0ull) {
+		/* the next word with a clear bit is found one level up */
+		if (level == TOP_LEVEL)
+			return false;
+
+		if (!__find(bmap, level + 1, idx + 1, &idx))
+			return false;
+
+		wordp = __word(bmap, level, idx);
+		word = wordp ? *wordp : 0;
+	}
+
+	*result = (idx * 64) + __builtin_ctzll(~word);
+
+	return true;
+}
+
+static void __dirty(struct oidbmap *bmap, uint64_t uniq)
+{
+	const uint64_t seg = (uniq / 64) / SEG_WORDS;
+	uint64_t *word = &bmap->dirty[seg / 64];
+	const uint64_t bit = 1ull << (seg % 64);
+
+	if (*word & bit)
+		return;
+
+	*word |= bit;
+	bmap->ndirty++;
+}
+
+/* make sure that uniq is covered by the intent log */
+static int __log_resv(struct posixvol *pvol, uint64_t uniq)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+	struct oidlog_rec rec;
+	uint64_t end;
 	int ret;
 
-	ret = xftruncate(pvol->volfd, OID_BMAP_SIZE + OID_BMAP_OFFSET);
+	if ((uniq >= bmap->resv_start) && (uniq < bmap->resv_end))
+		return 0;
+
+	end = MIN(uniq + OIDBMAP_RESV, MAX_OID_UNIQ);
+
+	rec.start = cpu64_to_be(uniq);
+	rec.end = cpu64_to_be(end);
+
+	ret = posix_pwrite(pvol->ring, bmap->logfd, -1, &rec, sizeof(rec),
+			   bmap->nlog * sizeof(rec));
+	if (ret)
+		return ret;
+
+	ret = posix_fdatasync(pvol->ring, bmap->logfd, -1);
 	if (ret)
 		return ret;
 
-	return oidbmap_set(pvol, 0); /* reserve 0 - it is illegal */
+	bmap->nlog++;
+	bmap->resv_start = uniq;
+	bmap->resv_end = end;
+
+	return 0;
 }
 
-int oidbmap_set(struct posixvol *pvol, uint64_t uniq)
+/*
+ * Write out all dirty segments.  The writes are submitted to the I/O
+ * engine as one batch so that they can all be in flight at once.
+ */
+static int __write_segs(struct posixvol *pvol)
 {
-	const off_t off = (uniq / 8) + OID_BMAP_OFFSET;
-	const uint8_t bit = 1 << (uniq % 8);
-	uint8_t tmp;
+	struct oidbmap *bmap = &pvol->oidbmap;
+	struct posixiobatch batch;
+	struct posixio *ios;
+	unsigned nios;
+	uint64_t seg;
 	int ret;
 
-	/* TODO: locking */
+	ios = calloc(bmap->ndirty, sizeof(struct posixio));
+	if (!ios)
+		return -ENOMEM;
+
+	posix_io_batch_init(&batch);
+
+	nios = 0;
+
+	for (seg = 0; (nios < bmap->ndirty) && (seg < NSEGS); seg++) {
+		struct posixio *io;
+
+		if (!(bmap->dirty[seg / 64] & (1ull << (seg % 64))))
+			continue;
+
+		io = &ios[nios++];
+		io->op = POSIXIO_WRITE;
+		io->fd = pvol->volfd;
+		io->slot = -1;
+		io->buf = bmap->segs[seg];
+		io->len = OIDBMAP_SEG_SIZE;
+		io->off = OID_BMAP_OFFSET + seg * OIDBMAP_SEG_SIZE;
+
+		posix_io_batch_add(pvol->ring, &batch, io);
+	}
+
+	ret = posix_io_batch_wait(pvol->ring, &batch);
+
+	free(ios);
 
-	ret = xpread(pvol->volfd, &tmp, sizeof(tmp), off);
 	if (ret)
 		return ret;
 
-	tmp |= bit;
+	ret = posix_fdatasync(pvol->ring, pvol->volfd, -1);
+	if (ret)
+		return ret;
 
-	return xpwrite(pvol->volfd, &tmp, sizeof(tmp), off);
+	memset(bmap->dirty, 0, (NSEGS / 64) * sizeof(uint64_t));
+	bmap->ndirty = 0;
+
+	return 0;
 }
 
-int oidbmap_get_new(struct posixvol *pvol, uint64_t *new)
+/* write out all dirty segments and empty the intent log */
+static int __sync(struct posixvol *pvol)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+	int ret;
+
+	if (bmap->ndirty) {
+		ret = __write_segs(pvol);
+		if (ret)
+			return ret;
+	}
+
+	if (!bmap->nlog)
+		return 0;
+
+	ret = xftruncate(bmap->logfd, 0);
+	if (ret)
+		return ret;
+
+	ret = posix_fdatasync(pvol->ring, bmap->logfd, -1);
+	if (ret)
+		return ret;
+
+	bmap->nlog = 0;
+	bmap->resv_start = 0;
+	bmap->resv_end = 0;
+
+	return 0;
+}
+
+static void __free_summary(struct oidbmap *bmap)
+{
+	unsigned level;
+
+	for (level = 1; level < OIDBMAP_LEVELS; level++) {
+		free(bmap->levels[level]);
+		bmap->levels[level] = NULL;
+	}
+}
+
+static int __alloc_summary(struct oidbmap *bmap)
+{
+	unsigned level;
+
+	for (level = 1; level < OIDBMAP_LEVELS; level++) {
+		bmap->levels[level] = calloc(LEVEL_WORDS(level),
+					     sizeof(uint64_t));
+		if (!bmap->levels[level]) {
+			__free_summary(bmap);
+			return -ENOMEM;
+		}
+	}
+
+	/* the bits past the end of the top level are never free */
+	bmap->levels[TOP_LEVEL][0] = ~0ull << LEVEL_BITS(TOP_LEVEL);
+
+	return 0;
+}
+
+static void __free_segs(struct oidbmap *bmap)
+{
+	uint64_t seg;
+
+	for (seg = 0; seg < NSEGS; seg++)
+		free(bmap->segs[seg]);
+
+	free(bmap->segs);
+}
+
+static int __init(struct posixvol *pvol)
 {
+	struct oidbmap *bmap = &pvol->oidbmap;
+	int ret;
+
+	bmap->hint = 0;
+
+	bmap->segs = calloc(NSEGS, sizeof(uint64_t *));
+	if (!bmap->segs)
+		return -ENOMEM;
+
+	ret = __alloc_summary(bmap);
+	if (ret)
+		goto err_segs;
+
+	bmap->dirty = calloc(NSEGS / 64, sizeof(uint64_t));
+	if (!bmap->dirty) {
+		ret = -ENOMEM;
+		goto err_summary;
+	}
+
+	bmap->ndirty = 0;
+
+	bmap->logfd = xopenat(pvol->basefd, OIDLOG_FILENAME,
+			      O_RDWR | O_CREAT, 0600);
+	if (bmap->logfd < 0) {
+		ret = bmap->logfd;
+		goto err_dirty;
+	}
+
+	bmap->nlog = 0;
+	bmap->resv_start = 0;
+	bmap->resv_end = 0;
+
+	MXINIT(&bmap->lock, &oidbmap_lc);
+
+	return 0;
+
+err_dirty:
+	free(bmap->dirty);
+
+err_summary:
+	__free_summary(bmap);
+
+err_segs:
+	free(bmap->segs);
+
+	return ret;
+}
+
+static void __fini(struct posixvol *pvol)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+
+	MXDESTROY(&bmap->lock);
+	xclose(bmap->logfd);
+	free(bmap->dirty);
+	__free_summary(bmap);
+	__free_segs(bmap);
+}
+
+int oidbmap_create(struct posixvol *pvol)
+{
+	int ret;
+
+	/* the bitmap is all zeros, so there are no segments yet */
+	ret = __init(pvol);
+	if (ret)
+		return ret;
+
+	ret = oidbmap_set(pvol, 0); /* reserve 0 - it is illegal */
+	if (ret)
+		goto err;
+
+	ret = oidbmap_sync(pvol);
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	__fini(pvol);
+
+	return ret;
+}
+
+/* read in a segment that (at least partially) exists on disk */
+static int __load_seg(struct posixvol *pvol, uint64_t seg, off_t filesize)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+	const off_t off = OID_BMAP_OFFSET + seg * OIDBMAP_SEG_SIZE;
+	const size_t len = MIN(filesize - off, OIDBMAP_SEG_SIZE);
+	uint64_t *words;
+	uint64_t idx;
+	bool empty;
+	int ret;
+
+	words = calloc(SEG_WORDS, sizeof(uint64_t));
+	if (!words)
+		return -ENOMEM;
+
+	ret = xpread(pvol->volfd, words, len, off);
+	if (ret) {
+		free(words);
+		return ret;
+	}
+
+	empty = true;
+
+	for (idx = 0; idx < SEG_WORDS; idx++) {
+		if (words[idx])
+			empty = false;
+
+		if (words[idx] == ~0ull)
+			__mark(bmap, 1, seg * SEG_WORDS + idx);
+	}
+
+	/* keep all-zero segments unallocated */
+	if (empty)
+		free(words);
+	else
+		bmap->segs[seg] = words;
+
+	return 0;
+}
+
+/* read in all the segments that exist on disk */
+static int __load_segs(struct posixvol *pvol)
+{
+	struct stat statbuf;
+	uint64_t seg;
 	off_t off;
 	int ret;
 
-	/*
-	 * FIXME: This is a terrible O(n) algorithm.  We can certainly do
-	 * better than this.
-	 */
+	ret = xfstat(pvol->volfd, &statbuf);
+	if (ret)
+		return ret;
 
-	for (off = 0; off < OID_BMAP_SIZE; off++) {
-		off_t file_off = off + OID_BMAP_SIZE;
-		uint8_t tmp;
-		int bitno;
+	for (seg = 0; seg < NSEGS; seg++) {
+		off = OID_BMAP_OFFSET + seg * OIDBMAP_SEG_SIZE;
+		if (off >= statbuf.st_size)
+			break;
 
-		ret = xpread(pvol->volfd, &tmp, sizeof(tmp), file_off);
+#ifdef SEEK_DATA
+		/* skip over holes in the file, if the fs can tell us */
+		off = lseek(pvol->volfd, off, SEEK_DATA);
+		if ((off < 0) && (errno == ENXIO))
+			break; /* no more data */
+		if (off >= 0)
+			seg = (off - OID_BMAP_OFFSET) / OIDBMAP_SEG_SIZE;
+		if (seg >= NSEGS)
+			break;
+#endif
+
+		ret = __load_seg(pvol, seg, statbuf.st_size);
 		if (ret)
 			return ret;
+	}
 
-		/* all full */
-		if (tmp == 0xff)
-			continue;
+	return 0;
+}
 
-		for (bitno = 0; bitno < 8; bitno++)
-			if (!((1 << bitno) & tmp))
-				break;
+/*
+ * Load an existing bitmap, rebuild the summary, and replay the intent log.
+ */
+int oidbmap_load(struct posixvol *pvol)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+	struct oidlog_rec rec;
+	int ret;
+
+	ret = __init(pvol);
+	if (ret)
+		return ret;
+
+	ret = __load_segs(pvol);
+	if (ret)
+		goto err;
 
-		tmp |= 1 << bitno;
+	/*
+	 * Any uniq in a logged range may or may not have been allocated
+	 * before we crashed.  The object directory (or the pack index for
+	 * packed objects) tells us, so the pack must be loaded first.
+	 */
+	for (;;) {
+		uint64_t start, end;
+		uint64_t uniq;
 
-		ret = xpwrite(pvol->volfd, &tmp, sizeof(tmp), file_off);
+		ret = xpread(bmap->logfd, &rec, sizeof(rec),
+			     bmap->nlog * sizeof(rec));
+		if (ret == -EPIPE)
+			break; /* short read - end of log */
 		if (ret)
-			return ret;
+			goto err;
 
-		*new = (off * 8) + bitno;
+		bmap->nlog++;
 
-		return 0;
+		start = be64_to_cpu(rec.start);
+		end = be64_to_cpu(rec.end);
+
+		if ((start > end) || (end > MAX_OID_UNIQ)) {
+			ret = -EINVAL;
+			goto err;
+		}
+
+		for (uniq = MAX(start, 1); uniq < end; uniq++) {
+			char name[20];
+			struct stat statbuf;
+
+			snprintf(name, sizeof(name), OIDFMT, uniq);
+
+			if (pack_has_obj(pvol, uniq) ||
+			    !fstatat(pvol->basefd, name, &statbuf,
+				     AT_SYMLINK_NOFOLLOW)) {
+				ret = __seg_prep(bmap, uniq);
+				if (ret)
+					goto err;
+
+				__mark(bmap, 0, uniq);
+			} else if (errno == ENOENT) {
+				__unmark(bmap, 0, uniq);
+			} else {
+				ret = -errno;
+				goto err;
+			}
+
+			if (bmap->segs[(uniq / 64) / SEG_WORDS])
+				__dirty(bmap, uniq);
+		}
 	}
 
-	return -ENOSPC;
+	ret = oidbmap_sync(pvol);
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	__fini(pvol);
+
+	return ret;
 }
 
-int oidbmap_put(struct posixvol *pvol, uint64_t uniq)
+void oidbmap_fini(struct posixvol *pvol)
 {
-	const off_t off = (uniq / 8) + OID_BMAP_OFFSET;
-	const uint8_t bit = 1 << (uniq % 8);
-	uint8_t tmp;
+	__fini(pvol);
+}
+
+int oidbmap_sync(struct posixvol *pvol)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
 	int ret;
 
-	/* TODO: locking */
+	MXLOCK(&bmap->lock);
+	ret = __sync(pvol);
+	MXUNLOCK(&bmap->lock);
+
+	return ret;
+}
 
-	ret = xpread(pvol->volfd, &tmp, sizeof(tmp), off);
+int oidbmap_set(struct posixvol *pvol, uint64_t uniq)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+	int ret;
+
+	if (uniq >= MAX_OID_UNIQ)
+		return -EINVAL;
+
+	MXLOCK(&bmap->lock);
+	ret = __seg_prep(bmap, uniq);
+	if (!ret) {
+		__mark(bmap, 0, uniq);
+		__dirty(bmap, uniq);
+	}
+	MXUNLOCK(&bmap->lock);
+
+	return ret;
+}
+
+int oidbmap_get_new(struct posixvol *pvol, uint64_t *new)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+	uint64_t uniq;
+	int ret;
+
+	MXLOCK(&bmap->lock);
+
+	/* write out accumulated changes before they get out of hand */
+	if ((bmap->ndirty >= MAX_DIRTY) || (bmap->nlog >= MAX_LOG)) {
+		ret = __sync(pvol);
+		if (ret)
+			goto out;
+	}
+
+	if (!__find(bmap, 0, bmap->hint, &uniq) &&
+	    !__find(bmap, 0, 0, &uniq)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	ret = __seg_prep(bmap, uniq);
 	if (ret)
-		return ret;
+		goto out;
+
+	ret = __log_resv(pvol, uniq);
+	if (ret)
+		goto out;
+
+	__mark(bmap, 0, uniq);
+	__dirty(bmap, uniq);
+
+	bmap->hint = (uniq + 1) % MAX_OID_UNIQ;
+
+	*new = uniq;
+
+out:
+	MXUNLOCK(&bmap->lock);
 
-	tmp &= ~bit;
+	return ret;
+}
+
+int oidbmap_put(struct posixvol *pvol, uint64_t uniq)
+{
+	struct oidbmap *bmap = &pvol->oidbmap;
+
+	if (!uniq || (uniq >= MAX_OID_UNIQ))
+		return -EINVAL;
+
+	MXLOCK(&bmap->lock);
+	if (bmap->segs[(uniq / 64) / SEG_WORDS]) {
+		__unmark(bmap, 0, uniq);
+		__dirty(bmap, uniq);
+	}
+	MXUNLOCK(&bmap->lock);
 
-	return xpwrite(pvol->volfd, &tmp, sizeof(tmp), off);
+	return 0;
 }
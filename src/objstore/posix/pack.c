@@ -0,0 +1,1092 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/int.h>
+#include <jeffpc/io.h>
+
+#include <nomad/config.h>
+#include <nomad/crc32c.h>
+
+#include "posix.h"
+
+/*
+ * Packed small objects
+ *
+ * Giving each object its own directory and each version its own file
+ * costs two inodes and two path walks per object.  For volumes with many
+ * small files, that is more overhead than the data itself.  Therefore,
+ * versions of small regular files can instead be packed into large
+ * segment files:
+ *
+ * /data/<volid>/pack             - the pack directory
+ * /data/<volid>/pack/<segno>     - segments
+ *
+ * Segments are append-only logs of records.  Each record holds one whole
+ * version of an object - the version header (struct posixhdr) followed
+ * by all of the object's data.  Modifying a packed version appends a new
+ * record; the record can also name a version it replaces (e.g., because
+ * the clock got bumped), which makes renames atomic.  Removing a version
+ * appends a delete record.
+ *
+ * An in-memory index maps each packed (uniq, version name) to the
+ * location of its latest record.  The index is rebuilt by scanning all
+ * the segments when the volume is loaded.  A torn record at the end of
+ * the last segment is simply truncated away.
+ *
+ * Once an object grows past the pack size limit ("posix-pack-max" in the
+ * config, 0 disables packing), it moves to a dedicated version file.
+ * Directories are never packed.
+ *
+ * Compaction
+ *
+ * Superseded and deleted records are garbage.  We keep track of how many
+ * bytes the index still refers to, and whenever more than half of the
+ * pack is garbage, the oldest segment is compacted: its records are
+ * scanned, the ones the index still points to are appended to the end of
+ * the pack, and the segment is deleted.  Each write compacts at most one
+ * segment, so the copying is spread out over time.
+ *
+ * Only the oldest segment is ever deleted.  That way, delete records (and
+ * the old names of replacing records) only ever need to suppress records
+ * in segments that are still around, and replaying the remaining
+ * segments in order always produces the same index.  The copies are
+ * synced before the segment is deleted, so a crash in between merely
+ * leaves a duplicate record behind.  Segments are numbered sequentially,
+ * so after compaction the pack starts at a non-zero segment number.
+ *
+ * Readers hold a reference on the segment they're reading from, so a
+ * segment that is deleted while in use is only closed once the last
+ * reader is done with it.
+ *
+ * All on-disk fields are big-endian.
+ */
+
+#define PACK_DIRNAME		"pack"
+#define PACK_SEG_FMT		"%08x"
+#define PACK_SEG_SIZE		(64ull * 1024 * 1024)
+#define PACK_MAX_OBJ_SIZE	(1024 * 1024)
+
+#define PACK_REC_MAGIC		0x4e585052 /* "NXPR" */
+#define PACK_REC_DELETE		0x1
+
+struct packrec {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t uniq;
+	uint16_t namelen;	/* version name */
+	uint16_t oldnamelen;	/* name of replaced version (0 = none) */
+	uint32_t datalen;
+	uint32_t _pad;
+	uint32_t cksum;		/* CRC32C of the record (with cksum = 0) */
+
+	/*
+	 * followed by:
+	 *   - name & old name, padded to a multiple of 8 bytes
+	 *   - unless deleting: struct posixhdr & data, padded to a multiple
+	 *     of 8 bytes
+	 */
+};
+
+struct packseg {
+	uint32_t segno;
+	int fd;
+	uint64_t len;		/* bytes used */
+	uint32_t refs;		/* in-flight reads */
+	bool dead;		/* deleted by compaction */
+};
+
+struct packent {
+	uint64_t uniq;		/* key: object */
+	char *name;		/* key: version name */
+
+	struct packseg *seg;	/* location of the record */
+	uint64_t rec;
+	uint64_t len;
+	uint64_t off;		/* location of the version header */
+
+	avl_node_t node;
+};
+
+static struct lock_class pack_lc;
+
+#define ROUND8(x)	(((x) + 7) & ~7ull)
+
+static inline size_t rec_hdrlen(size_t namelen, size_t oldnamelen)
+{
+	return sizeof(struct packrec) + ROUND8(namelen + oldnamelen);
+}
+
+static inline size_t rec_len(size_t namelen, size_t oldnamelen,
+			     uint32_t flags, size_t datalen)
+{
+	size_t len = rec_hdrlen(namelen, oldnamelen);
+
+	if (!(flags & PACK_REC_DELETE))
+		len += ROUND8(sizeof(struct posixhdr) + datalen);
+
+	return len;
+}
+
+static int packent_cmp(const void *va, const void *vb)
+{
+	const struct packent *a = va;
+	const struct packent *b = vb;
+	int ret;
+
+	if (a->uniq < b->uniq)
+		return -1;
+	if (a->uniq > b->uniq)
+		return +1;
+
+	ret = strcmp(a->name, b->name);
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return +1;
+	return 0;
+}
+
+static struct packent *__find(struct pack *pack, uint64_t uniq,
+			      const char *name)
+{
+	struct packent key = {
+		.uniq = uniq,
+		.name = (char *) name,
+	};
+
+	return avl_find(&pack->index, &key, NULL);
+}
+
+/* return the first index entry for @uniq */
+static struct packent *__first(struct pack *pack, uint64_t uniq)
+{
+	struct packent key = {
+		.uniq = uniq,
+		.name = "",
+	};
+	struct packent *ent;
+	avl_index_t where;
+
+	ent = avl_find(&pack->index, &key, &where);
+	if (!ent)
+		ent = avl_nearest(&pack->index, where, AVL_AFTER);
+
+	return (ent && (ent->uniq == uniq)) ? ent : NULL;
+}
+
+static void __drop(struct pack *pack, uint64_t uniq, const char *name)
+{
+	struct packent *ent;
+
+	ent = __find(pack, uniq, name);
+	if (!ent)
+		return;
+
+	pack->live -= ent->len;
+
+	avl_remove(&pack->index, ent);
+	free(ent->name);
+	free(ent);
+}
+
+static int __set(struct pack *pack, uint64_t uniq, const char *name,
+		 struct packseg *seg, uint64_t rec, uint64_t len,
+		 uint64_t off)
+{
+	struct packent *ent;
+
+	ent = __find(pack, uniq, name);
+	if (ent) {
+		pack->live -= ent->len;
+	} else {
+		ent = malloc(sizeof(struct packent));
+		if (!ent)
+			return -ENOMEM;
+
+		ent->uniq = uniq;
+		ent->name = strdup(name);
+		if (!ent->name) {
+			free(ent);
+			return -ENOMEM;
+		}
+
+		avl_add(&pack->index, ent);
+	}
+
+	ent->seg = seg;
+	ent->rec = rec;
+	ent->len = len;
+	ent->off = off;
+
+	pack->live += len;
+
+	return 0;
+}
+
+/*
+ * Update the index according to the record at @off in @seg.  The version
+ * header is @hdroff bytes into the record.
+ */
+static int __apply(struct pack *pack, uint64_t uniq, uint32_t flags,
+		   const char *name, const char *oldname, struct packseg *seg,
+		   uint64_t off, uint64_t len, uint64_t hdroff)
+{
+	if (oldname)
+		__drop(pack, uniq, oldname);
+
+	if (flags & PACK_REC_DELETE) {
+		__drop(pack, uniq, name);
+		return 0;
+	}
+
+	return __set(pack, uniq, name, seg, off, len, off + hdroff);
+}
+
+static inline struct packseg *last_seg(struct pack *pack)
+{
+	return pack->segs[pack->nsegs - 1];
+}
+
+/* open (or create) segment @segno and add it to the end of the pack */
+static int __open_seg(struct pack *pack, uint32_t segno, int flags)
+{
+	struct packseg **segs;
+	struct packseg *seg;
+	char name[16];
+
+	segs = realloc(pack->segs, sizeof(struct packseg *) *
+		       (pack->nsegs + 1));
+	if (!segs)
+		return -ENOMEM;
+
+	pack->segs = segs;
+
+	seg = malloc(sizeof(struct packseg));
+	if (!seg)
+		return -ENOMEM;
+
+	snprintf(name, sizeof(name), PACK_SEG_FMT, segno);
+
+	seg->fd = xopenat(pack->dirfd, name, O_RDWR | flags, 0600);
+	if (seg->fd < 0) {
+		int ret = seg->fd;
+
+		free(seg);
+		return ret;
+	}
+
+	seg->segno = segno;
+	seg->len = 0;
+	seg->refs = 0;
+	seg->dead = false;
+
+	pack->segs[pack->nsegs++] = seg;
+	pack->tail = 0;
+
+	return 0;
+}
+
+static void __free_seg(struct packseg *seg)
+{
+	xclose(seg->fd);
+	free(seg);
+}
+
+static void seg_put(struct pack *pack, struct packseg *seg)
+{
+	MXLOCK(&pack->lock);
+	VERIFY3U(seg->refs, >, 0);
+	if (!--seg->refs && seg->dead)
+		__free_seg(seg);
+	MXUNLOCK(&pack->lock);
+}
+
+/* append a record to the last segment, starting a new one if necessary */
+static int __append(struct pack *pack, const void *buf, size_t len,
+		    struct packseg **seg, uint64_t *off)
+{
+	int ret;
+
+	if (pack->tail && ((pack->tail + len) > PACK_SEG_SIZE)) {
+		/* pack_sync() only syncs the last segment */
+		ret = posix_fdatasync(pack->ring, last_seg(pack)->fd, -1);
+		if (ret)
+			return ret;
+
+		ret = __open_seg(pack, last_seg(pack)->segno + 1,
+				 O_CREAT | O_EXCL);
+		if (ret)
+			return ret;
+	}
+
+	ret = posix_pwrite(pack->ring, last_seg(pack)->fd, -1, buf, len,
+			   pack->tail);
+	if (ret)
+		return ret;
+
+	*seg = last_seg(pack);
+	*off = pack->tail;
+
+	pack->tail += len;
+	pack->size += len;
+	(*seg)->len = pack->tail;
+
+	return 0;
+}
+
+/*
+ * Construct a record.  Returns the record length and the offset of the
+ * version header within it.
+ */
+static void *build_rec(struct pack *pack, uint64_t uniq, uint32_t flags,
+		       const char *name, const char *oldname,
+		       const struct posixhdr *hdr, const void *data,
+		       size_t datalen, size_t *len, size_t *hdroff)
+{
+	const size_t namelen = strlen(name);
+	const size_t oldnamelen = oldname ? strlen(oldname) : 0;
+	struct packrec *rec;
+	uint8_t *buf;
+
+	*len = rec_len(namelen, oldnamelen, flags, datalen);
+	*hdroff = rec_hdrlen(namelen, oldnamelen);
+
+	/* most records fit in a registered I/O buffer */
+	buf = posix_io_buf_alloc(pack->ring, *len);
+	if (!buf)
+		return NULL;
+
+	rec = (struct packrec *) buf;
+	rec->magic = cpu32_to_be(PACK_REC_MAGIC);
+	rec->flags = cpu32_to_be(flags);
+	rec->uniq = cpu64_to_be(uniq);
+	rec->namelen = cpu16_to_be(namelen);
+	rec->oldnamelen = cpu16_to_be(oldnamelen);
+	rec->datalen = cpu32_to_be(datalen);
+
+	memcpy(buf + sizeof(struct packrec), name, namelen);
+	if (oldname)
+		memcpy(buf + sizeof(struct packrec) + namelen, oldname,
+		       oldnamelen);
+
+	if (!(flags & PACK_REC_DELETE)) {
+		memcpy(buf + *hdroff, hdr, sizeof(struct posixhdr));
+		if (datalen)
+			memcpy(buf + *hdroff + sizeof(struct posixhdr), data,
+			       datalen);
+	}
+
+	rec->cksum = cpu32_to_be(nomad_crc32c(buf, *len));
+
+	return buf;
+}
+
+/* is more than half of the pack garbage? */
+static inline bool __want_compact(struct pack *pack)
+{
+	return !pack->compacting && (pack->nsegs > 1) &&
+	       ((pack->size - pack->live) > pack->live);
+}
+
+/*
+ * If the index still refers to the record at @off in @seg, append a copy
+ * of it to the end of the pack.  Returns the length of the record in
+ * @len.
+ */
+static int copy_rec(struct pack *pack, struct packseg *seg, uint64_t off,
+		    uint64_t *len)
+{
+	char name[PATH_MAX];
+	struct packseg *newseg;
+	struct packent *ent;
+	struct packrec rec;
+	size_t namelen, oldnamelen;
+	uint32_t flags, datalen;
+	size_t newhdroff;
+	uint64_t newoff;
+	size_t hdroff;
+	size_t newlen;
+	uint8_t *newbuf;
+	uint8_t *buf;
+	uint64_t uniq;
+	int ret;
+
+	ret = posix_pread(pack->ring, seg->fd, -1, &rec, sizeof(rec), off);
+	if (ret)
+		return ret;
+
+	uniq = be64_to_cpu(rec.uniq);
+	namelen = be16_to_cpu(rec.namelen);
+	oldnamelen = be16_to_cpu(rec.oldnamelen);
+	flags = be32_to_cpu(rec.flags);
+	datalen = be32_to_cpu(rec.datalen);
+
+	/* the segment was checked when it was loaded or written */
+	if ((be32_to_cpu(rec.magic) != PACK_REC_MAGIC) ||
+	    !namelen || (namelen >= sizeof(name)))
+		return -EINVAL;
+
+	*len = rec_len(namelen, oldnamelen, flags, datalen);
+
+	/* delete records are never referenced by the index */
+	if (flags & PACK_REC_DELETE)
+		return 0;
+
+	buf = malloc(*len);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = posix_pread(pack->ring, seg->fd, -1, buf, *len, off);
+	if (ret)
+		goto out;
+
+	memcpy(name, buf + sizeof(struct packrec), namelen);
+	name[namelen] = '\0';
+
+	hdroff = rec_hdrlen(namelen, oldnamelen);
+
+	/* the old name was dealt with when the record was first applied */
+	newbuf = build_rec(pack, uniq, 0, name, NULL,
+			   (struct posixhdr *) (buf + hdroff),
+			   buf + hdroff + sizeof(struct posixhdr), datalen,
+			   &newlen, &newhdroff);
+	if (!newbuf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	MXLOCK(&pack->lock);
+	ent = __find(pack, uniq, name);
+	if (ent && (ent->seg == seg) && (ent->rec == off)) {
+		ret = __append(pack, newbuf, newlen, &newseg, &newoff);
+		if (!ret)
+			ret = __set(pack, uniq, name, newseg, newoff, newlen,
+				    newoff + newhdroff);
+	}
+	MXUNLOCK(&pack->lock);
+
+	posix_io_buf_free(pack->ring, newbuf);
+
+out:
+	free(buf);
+
+	return ret;
+}
+
+/* move the live records out of the oldest segment & delete it */
+static int compact_seg(struct pack *pack, struct packseg *seg)
+{
+	char name[16];
+	uint64_t off;
+	uint64_t len;
+	uint32_t i;
+	int ret;
+
+	for (off = 0; off < seg->len; off += len) {
+		ret = copy_rec(pack, seg, off, &len);
+		if (ret)
+			return ret;
+	}
+
+	MXLOCK(&pack->lock);
+
+	/* the copies must be stable before the original goes away */
+	for (i = 1; i < pack->nsegs; i++) {
+		ret = posix_fdatasync(pack->ring, pack->segs[i]->fd, -1);
+		if (ret)
+			goto out;
+	}
+
+	snprintf(name, sizeof(name), PACK_SEG_FMT, seg->segno);
+
+	ret = xunlinkat(pack->dirfd, name, 0);
+	if (ret)
+		goto out;
+
+	VERIFY3P(pack->segs[0], ==, seg);
+
+	pack->nsegs--;
+	memmove(&pack->segs[0], &pack->segs[1],
+		sizeof(struct packseg *) * pack->nsegs);
+
+	pack->size -= seg->len;
+
+	seg->dead = true;
+	if (!seg->refs)
+		__free_seg(seg);
+
+out:
+	MXUNLOCK(&pack->lock);
+
+	return ret;
+}
+
+/*
+ * Compact the oldest segment if there is enough garbage.  Failing to
+ * compact doesn't affect the write that triggered it, so errors are only
+ * logged.
+ */
+static void compact(struct pack *pack)
+{
+	struct packseg *seg;
+	int ret;
+
+	MXLOCK(&pack->lock);
+	if (!__want_compact(pack)) {
+		MXUNLOCK(&pack->lock);
+		return;
+	}
+
+	pack->compacting = true;
+	seg = pack->segs[0];
+	MXUNLOCK(&pack->lock);
+
+	ret = compact_seg(pack, seg);
+	if (ret)
+		cmn_err(CE_ERROR, "failed to compact pack segment "
+			PACK_SEG_FMT ": %s", seg->segno, xstrerror(ret));
+
+	MXLOCK(&pack->lock);
+	pack->compacting = false;
+	MXUNLOCK(&pack->lock);
+}
+
+static int write_rec(struct pack *pack, uint64_t uniq, uint32_t flags,
+		     const char *name, const char *oldname,
+		     const struct posixhdr *hdr, const void *data,
+		     size_t datalen)
+{
+	struct packseg *seg;
+	size_t hdroff;
+	uint64_t off;
+	size_t len;
+	void *buf;
+	int ret;
+
+	buf = build_rec(pack, uniq, flags, name, oldname, hdr, data, datalen,
+			&len, &hdroff);
+	if (!buf)
+		return -ENOMEM;
+
+	MXLOCK(&pack->lock);
+	ret = __append(pack, buf, len, &seg, &off);
+	if (!ret)
+		ret = __apply(pack, uniq, flags, name, oldname, seg, off, len,
+			      hdroff);
+	MXUNLOCK(&pack->lock);
+
+	posix_io_buf_free(pack->ring, buf);
+
+	if (ret)
+		return ret;
+
+	compact(pack);
+
+	return 0;
+}
+
+static void __init(struct posixvol *pvol)
+{
+	struct pack *pack = &pvol->pack;
+
+	pack->ring = pvol->ring;
+	MXINIT(&pack->lock, &pack_lc);
+	avl_create(&pack->index, packent_cmp, sizeof(struct packent),
+		   offsetof(struct packent, node));
+
+	pack->max = MIN(config_get_posix_pack_max(), PACK_MAX_OBJ_SIZE);
+	pack->dirfd = -1;
+	pack->segs = NULL;
+	pack->nsegs = 0;
+	pack->tail = 0;
+	pack->size = 0;
+	pack->live = 0;
+	pack->compacting = false;
+}
+
+void pack_fini(struct posixvol *pvol)
+{
+	struct pack *pack = &pvol->pack;
+	struct packent *ent;
+	void *cookie;
+	uint32_t i;
+
+	cookie = NULL;
+	while ((ent = avl_destroy_nodes(&pack->index, &cookie))) {
+		free(ent->name);
+		free(ent);
+	}
+
+	avl_destroy(&pack->index);
+
+	for (i = 0; i < pack->nsegs; i++)
+		__free_seg(pack->segs[i]);
+	free(pack->segs);
+
+	if (pack->dirfd >= 0)
+		xclose(pack->dirfd);
+
+	MXDESTROY(&pack->lock);
+}
+
+int pack_create(struct posixvol *pvol)
+{
+	struct pack *pack = &pvol->pack;
+	int ret;
+
+	__init(pvol);
+
+	ret = xmkdirat(pvol->basefd, PACK_DIRNAME, 0700);
+	if (ret)
+		goto err;
+
+	pack->dirfd = xopenat(pvol->basefd, PACK_DIRNAME, O_RDONLY, 0);
+	if (pack->dirfd < 0) {
+		ret = pack->dirfd;
+		goto err_rmdir;
+	}
+
+	ret = __open_seg(pack, 0, O_CREAT | O_EXCL);
+	if (ret)
+		goto err_rmdir;
+
+	return 0;
+
+err_rmdir:
+	xunlinkat(pvol->basefd, PACK_DIRNAME, AT_REMOVEDIR);
+
+err:
+	pack_fini(pvol);
+
+	return ret;
+}
+
+/*
+ * Replay all the records in a segment.  Stops at the first incomplete or
+ * corrupt record, returning its offset in @end.
+ */
+static int __scan_seg(struct pack *pack, struct packseg *seg, uint64_t *end)
+{
+	const int fd = seg->fd;
+	struct packrec rec;
+	uint64_t off;
+	size_t len;
+	int ret;
+
+	for (off = 0; ; off += len) {
+		char name[PATH_MAX];
+		char oldname[PATH_MAX];
+		size_t namelen, oldnamelen;
+		uint32_t flags, datalen;
+		uint32_t cksum;
+		uint8_t *buf;
+
+		ret = xpread(fd, &rec, sizeof(rec), off);
+		if (ret == -EPIPE)
+			break; /* end of segment */
+		if (ret)
+			return ret;
+
+		namelen = be16_to_cpu(rec.namelen);
+		oldnamelen = be16_to_cpu(rec.oldnamelen);
+		flags = be32_to_cpu(rec.flags);
+		datalen = be32_to_cpu(rec.datalen);
+
+		if ((be32_to_cpu(rec.magic) != PACK_REC_MAGIC) ||
+		    (flags & ~PACK_REC_DELETE) ||
+		    !namelen || (namelen >= sizeof(name)) ||
+		    (oldnamelen >= sizeof(oldname)) ||
+		    (datalen > PACK_MAX_OBJ_SIZE))
+			break;
+
+		len = rec_len(namelen, oldnamelen, flags, datalen);
+
+		buf = malloc(len);
+		if (!buf)
+			return -ENOMEM;
+
+		ret = xpread(fd, buf, len, off);
+		if (ret) {
+			free(buf);
+
+			if (ret == -EPIPE)
+				break; /* torn record */
+			return ret;
+		}
+
+		cksum = be32_to_cpu(((struct packrec *) buf)->cksum);
+		((struct packrec *) buf)->cksum = 0;
+
+		if (cksum != nomad_crc32c(buf, len)) {
+			free(buf);
+			break;
+		}
+
+		memcpy(name, buf + sizeof(struct packrec), namelen);
+		name[namelen] = '\0';
+		memcpy(oldname, buf + sizeof(struct packrec) + namelen,
+		       oldnamelen);
+		oldname[oldnamelen] = '\0';
+
+		free(buf);
+
+		ret = __apply(pack, be64_to_cpu(rec.uniq), flags, name,
+			      oldnamelen ? oldname : NULL, seg, off, len,
+			      rec_hdrlen(namelen, oldnamelen));
+		if (ret)
+			return ret;
+	}
+
+	*end = off;
+
+	return 0;
+}
+
+/* find the lowest numbered segment (compaction deletes the oldest ones) */
+static int __first_segno(struct pack *pack, uint32_t *first)
+{
+	struct dirent *de;
+	DIR *dir;
+	int ret;
+	int fd;
+
+	fd = xopenat(pack->dirfd, ".", O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		ret = -errno;
+		xclose(fd);
+		return ret;
+	}
+
+	*first = 0;
+	ret = -ENOENT;
+
+	while ((de = readdir(dir))) {
+		unsigned long segno;
+		char *end;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		errno = 0;
+		segno = strtoul(de->d_name, &end, 16);
+		if (errno || *end || (segno > UINT32_MAX))
+			continue;
+
+		if (ret || (segno < *first))
+			*first = segno;
+
+		ret = 0;
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+int pack_load(struct posixvol *pvol)
+{
+	struct pack *pack = &pvol->pack;
+	uint32_t first;
+	uint64_t end;
+	int ret;
+
+	__init(pvol);
+
+	pack->dirfd = xopenat(pvol->basefd, PACK_DIRNAME, O_RDONLY, 0);
+	if (pack->dirfd < 0) {
+		ret = pack->dirfd;
+		goto err;
+	}
+
+	ret = __first_segno(pack, &first);
+	if (ret == -ENOENT) {
+		ret = __open_seg(pack, 0, O_CREAT | O_EXCL);
+		if (ret)
+			goto err;
+
+		return 0;
+	}
+	if (ret)
+		goto err;
+
+	for (;;) {
+		ret = __open_seg(pack, first + pack->nsegs, 0);
+		if (ret == -ENOENT)
+			break;
+		if (ret)
+			goto err;
+
+		ret = __scan_seg(pack, last_seg(pack), &end);
+		if (ret)
+			goto err;
+
+		last_seg(pack)->len = end;
+		pack->size += end;
+	}
+
+	/* get rid of any torn record at the end */
+	ret = xftruncate(last_seg(pack)->fd, end);
+	if (ret)
+		goto err;
+
+	pack->tail = end;
+
+	return 0;
+
+err:
+	pack_fini(pvol);
+
+	return ret;
+}
+
+int pack_sync(struct posixvol *pvol)
+{
+	struct pack *pack = &pvol->pack;
+	int ret;
+
+	MXLOCK(&pack->lock);
+	ret = posix_fdatasync(pack->ring, last_seg(pack)->fd, -1);
+	MXUNLOCK(&pack->lock);
+
+	return ret;
+}
+
+/* should a version with this mode & size be packed? */
+bool pack_wanted(struct posixvol *pvol, uint16_t mode, uint64_t size)
+{
+	return pvol->pack.max && NATTR_ISREG(mode) && (size <= pvol->pack.max);
+}
+
+bool pack_contains(struct posixvol *pvol, uint64_t uniq, const char *name)
+{
+	struct pack *pack = &pvol->pack;
+	bool ret;
+
+	MXLOCK(&pack->lock);
+	ret = __find(pack, uniq, name) != NULL;
+	MXUNLOCK(&pack->lock);
+
+	return ret;
+}
+
+/* does object @uniq have any packed versions? */
+bool pack_has_obj(struct posixvol *pvol, uint64_t uniq)
+{
+	struct pack *pack = &pvol->pack;
+	bool ret;
+
+	MXLOCK(&pack->lock);
+	ret = __first(pack, uniq) != NULL;
+	MXUNLOCK(&pack->lock);
+
+	return ret;
+}
+
+/*
+ * Write out a (new) packed version @name containing @attrs->size bytes of
+ * @data.  If @oldname is not NULL, that version is removed at the same
+ * time.
+ */
+int pack_write(struct posixvol *pvol, uint64_t uniq, const char *name,
+	       const char *oldname, const struct nattr *attrs, uint32_t nlink,
+	       struct nvclock *clock, const void *data)
+{
+	struct posixhdr hdr;
+
+	if (attrs->size > PACK_MAX_OBJ_SIZE)
+		return -EFBIG;
+
+	posix_encode_header(&hdr, attrs, nlink, clock);
+
+	return write_rec(&pvol->pack, uniq, 0, name, oldname, &hdr, data,
+			 attrs->size);
+}
+
+/*
+ * Find the segment & offset of a packed version header.  The caller must
+ * release the segment with seg_put().
+ */
+static int locate(struct pack *pack, uint64_t uniq, const char *name,
+		  struct packseg **seg, uint64_t *off)
+{
+	struct packent *ent;
+
+	MXLOCK(&pack->lock);
+	ent = __find(pack, uniq, name);
+	if (ent) {
+		*seg = ent->seg;
+		*off = ent->off;
+		ent->seg->refs++;
+	}
+	MXUNLOCK(&pack->lock);
+
+	return ent ? 0 : -ENOENT;
+}
+
+int pack_read_header(struct posixvol *pvol, uint64_t uniq, const char *name,
+		     struct nattr *attrs, struct nvclock *clock)
+{
+	struct packseg *seg;
+	struct posixhdr hdr;
+	uint64_t off;
+	int ret;
+
+	ret = locate(&pvol->pack, uniq, name, &seg, &off);
+	if (ret)
+		return ret;
+
+	ret = posix_pread(pvol->ring, seg->fd, -1, &hdr, sizeof(hdr), off);
+
+	seg_put(&pvol->pack, seg);
+
+	if (ret)
+		return ret;
+
+	return posix_decode_header(&hdr, attrs, clock);
+}
+
+/*
+ * Read @len bytes of data at @offset.  The caller must make sure that
+ * the range is within the object.
+ */
+int pack_read(struct posixvol *pvol, uint64_t uniq, const char *name,
+	      void *buf, size_t len, uint64_t offset)
+{
+	struct packseg *seg;
+	uint64_t off;
+	int ret;
+
+	ret = locate(&pvol->pack, uniq, name, &seg, &off);
+	if (ret)
+		return ret;
+
+	ret = posix_pread(pvol->ring, seg->fd, -1, buf, len,
+			  off + sizeof(struct posixhdr) + offset);
+
+	seg_put(&pvol->pack, seg);
+
+	return ret;
+}
+
+int pack_set_nlink(struct posixvol *pvol, uint64_t uniq, const char *name,
+		   uint32_t nlink)
+{
+	struct nvclock *clock;
+	struct nattr attrs;
+	void *data;
+	int ret;
+
+	clock = nvclock_alloc(false);
+	if (!clock)
+		return -ENOMEM;
+
+	ret = pack_read_header(pvol, uniq, name, &attrs, clock);
+	if (ret)
+		goto err;
+
+	data = malloc(MAX(attrs.size, 1));
+	if (!data) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = pack_read(pvol, uniq, name, data, attrs.size, 0);
+	if (!ret)
+		ret = pack_write(pvol, uniq, name, NULL, &attrs, nlink, clock,
+				 data);
+
+	free(data);
+
+err:
+	nvclock_free(clock);
+
+	return ret;
+}
+
+int pack_remove(struct posixvol *pvol, uint64_t uniq, const char *name)
+{
+	return write_rec(&pvol->pack, uniq, PACK_REC_DELETE, name, NULL, NULL,
+			 NULL, 0);
+}
+
+/*
+ * Call @fxn for each packed version of object @uniq.  Stops at the first
+ * non-zero return value.
+ */
+int pack_for_each(struct posixvol *pvol, uint64_t uniq,
+		  int (*fxn)(struct posixvol *, uint64_t, const char *,
+			     void *),
+		  void *arg)
+{
+	struct pack *pack = &pvol->pack;
+	struct packent *ent;
+	char **names;
+	size_t nnames;
+	size_t i;
+	int ret;
+
+	/* grab the names first, so that @fxn can modify the pack */
+	names = NULL;
+	nnames = 0;
+	ret = 0;
+
+	MXLOCK(&pack->lock);
+	for (ent = __first(pack, uniq); ent && (ent->uniq == uniq);
+	     ent = AVL_NEXT(&pack->index, ent)) {
+		char **tmp;
+
+		tmp = realloc(names, sizeof(char *) * (nnames + 1));
+		if (!tmp) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		names = tmp;
+
+		names[nnames] = strdup(ent->name);
+		if (!names[nnames]) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		nnames++;
+	}
+	MXUNLOCK(&pack->lock);
+
+	for (i = 0; !ret && (i < nnames); i++)
+		ret = fxn(pvol, uniq, names[i], arg);
+
+	for (i = 0; i < nnames; i++)
+		free(names[i]);
+	free(names);
+
+	return ret;
+}
@@ -23,6 +23,12 @@
 #ifndef __NOMAD_OBJSTORE_POSIX_H
 #define __NOMAD_OBJSTORE_POSIX_H
 
+#include <pthread.h>
+#include <sys/avl.h>
+
+#include <jeffpc/list.h>
+#include <jeffpc/synch.h>
+
 #include <nomad/types.h>
 
 #include <nomad/objstore.h>
@@ -37,19 +43,205 @@
  *
  * /data                   - the data dir
  * /data/vdev              - vdev info (uuid)
+ * /data/directio          - optional direct I/O threshold (see direct.c)
  * /data/<volid>           - volume
  * /data/<volid>/vol       - volume info (root OID, uuid, OID bmap, etc.)
+ * /data/<volid>/oidlog    - OID bmap intent log
+ * /data/<volid>/pack      - packed small objects (see pack.c)
  * /data/<volid>/<oid>     - everything related to the object
  * /data/<volid>/<oid>/<clock> - one version of the object
  *
  * Each /data/<volid>/<oid>/<clock> file contains a header (containing
- * attributes, etc.) followed by the object contents.
+ * attributes, etc.) followed by the object contents.  The header occupies
+ * the first POSIX_HDR_SIZE bytes of the file, so that the contents start
+ * on a page (and file system block) boundary.
+ */
+
+#define OIDFMT	"%016"PRIx64
+
+/*
+ * On-disk version file header.  All fields are big-endian.  Only the
+ * structure itself is written - the rest of the POSIX_HDR_SIZE bytes are
+ * unused.  Since the structure is smaller than a sector, it is updated
+ * atomically, but the checksum catches torn writes anyway.
  */
+#define POSIX_HDR_SIZE		4096
+#define POSIX_HDR_MAGIC		0x4e585648 /* "NXVH" */
+#define POSIX_HDR_VERSION	1
+
+struct posixhdr {
+	uint32_t magic;		/* POSIX_HDR_MAGIC */
+	uint32_t version;	/* POSIX_HDR_VERSION */
+
+	/* attributes */
+	uint16_t mode;
+	uint16_t _pad0;
+	uint32_t nlink;
+	uint64_t size;
+	uint64_t atime;
+	uint64_t btime;
+	uint64_t ctime;
+	uint64_t mtime;
+
+	/* vector clock */
+	uint32_t nents;
+	uint32_t _pad1;
+	struct nvclockent clock[NVCLOCK_NUM_NODES];
+
+	uint32_t _pad2;
+	uint32_t cksum;		/* CRC32C of everything above */
+};
+
+/* see uring.c */
+#define POSIXIO_BUF_SIZE	65536	/* registered buffer pool entry size */
+#define POSIXIO_BUF_ALIGN	4096
+
+enum posixio_op {
+	POSIXIO_READ,
+	POSIXIO_WRITE,
+	POSIXIO_FDATASYNC,
+};
+
+struct posixio {
+	enum posixio_op op;
+	int fd;
+	int slot;		/* registered file slot (-1 = none) */
+	void *buf;
+	size_t len;
+	uint64_t off;
+
+	/* called with 0 or a negated errno once the whole I/O is done */
+	void (*done)(struct posixio *, int);
+	void *private;
+
+	/* internal */
+	size_t xfer;		/* bytes transferred so far */
+	int err;
+	void *sqe;		/* the SQE, until reaped */
+	struct list_node node;	/* on the ring's list of I/Os */
+};
+
+/* a group of I/Os that is waited on as a whole */
+struct posixiobatch {
+	struct lock lock;
+	struct cond cond;
+	unsigned pending;
+	int err;		/* first error */
+};
+
+struct posixring;
+
+/* see commit.c */
+struct posixcommit {
+	bool enabled;		/* constant */
+	uint64_t delay;		/* constant: max batch delay (us) */
+	uint64_t batch;		/* constant: max callers per batch */
+
+	struct lock lock;
+	struct cond cond;	/* wakes up the committer */
+	struct cond done;	/* signaled when a batch is done */
+	uint64_t open;		/* batch accepting new callers */
+	uint64_t durable;	/* last durable batch */
+	uint64_t nwaiters;	/* callers in the open batch */
+	int err;		/* sticky sync error */
+	bool exit;
+
+	pthread_t thread;
+};
+
+/* see obj.c */
+struct posixfinish {
+	bool enabled;		/* constant */
+
+	struct lock lock;
+	struct cond cond;	/* wakes up the finisher */
+	struct list aios;	/* completed async I/Os */
+	bool exit;
+
+	pthread_t thread;
+};
 
 struct posixvdev {
 	struct objstore_vdev *vdev;
 
 	int basefd;	/* base directory */
+
+	struct posixring *ring;	/* I/O engine (NULL = synchronous) */
+	struct posixcommit commit;
+	struct posixfinish finish;
+
+	uint64_t direct;	/* direct I/O threshold (0 = disabled) */
+
+	struct lock lock;
+	struct list vols;	/* volumes created on this vdev */
+};
+
+/* see oidbmap.c */
+#define OIDBMAP_LEVELS		6
+#define OIDBMAP_SEG_SIZE	65536
+
+struct oidbmap {
+	struct lock lock;
+
+	uint64_t **segs;	/* bitmap segments; NULL = all zero */
+	uint64_t *levels[OIDBMAP_LEVELS]; /* summary ([0] is unused) */
+	uint64_t hint;		/* where to start looking for a free uniq */
+
+	/* deferred persistence */
+	uint64_t *dirty;	/* bitmap of dirty segments */
+	unsigned ndirty;	/* number of dirty segments */
+	int logfd;		/* intent log */
+	unsigned nlog;		/* number of records in the intent log */
+	uint64_t resv_start;	/* range of uniqs covered by the last */
+	uint64_t resv_end;	/*   intent log record */
+};
+
+/* see fdcache.c */
+#define POSIX_FDCACHE_SIZE	256
+
+struct posixfd {
+	uint64_t uniq;		/* key: object */
+	char *name;		/* key: version file name */
+
+	int fd;
+	int slot;		/* registered file slot (-1 = none) */
+	int dfd;		/* O_DIRECT fd (-1 = not open) */
+	int dslot;		/* registered file slot of dfd */
+	uint32_t refs;		/* 0 = idle & on the LRU list */
+
+	avl_node_t node;
+	struct list_node lru;
+};
+
+struct fdcache {
+	struct posixring *ring;
+	struct lock lock;
+	avl_tree_t fds;		/* all cached fds */
+	struct list lru;	/* idle fds, least recently used first */
+	size_t nfds;
+	size_t max;
+};
+
+/* see pack.c */
+struct packseg;
+
+struct pack {
+	struct posixring *ring;
+	struct lock lock;
+
+	uint64_t max;		/* largest object to pack; 0 = disabled */
+
+	avl_tree_t index;	/* packed versions */
+
+	int dirfd;		/* pack directory */
+	struct packseg **segs;	/* segment files, oldest first */
+	uint32_t nsegs;
+	uint64_t tail;		/* end of the last segment */
+
+	/* compaction */
+	uint64_t size;		/* bytes in all segments */
+	uint64_t live;		/* bytes in records the index refers to */
+	bool compacting;
 };
 
 struct posixvol {
@@ -59,15 +251,147 @@ struct posixvol {
 
 	int basefd;	/* base directory */
 	int volfd;	/* volume info file */
+
+	struct posixring *ring;	/* the vdev's I/O engine */
+
+	/* unsupported file copy methods (see clone.c) */
+	bool noclone;
+	bool nocopyrange;
+
+	/* direct I/O (see direct.c) */
+	uint64_t direct;	/* threshold (0 = disabled) */
+	bool nodirect;		/* O_DIRECT is unsupported */
+
+	struct oidbmap oidbmap;
+	struct fdcache fdcache;
+	struct pack pack;
+
+	struct list_node node;	/* posixvdev's list of volumes */
 };
 
 extern const struct vol_ops posix_vol_ops;
+extern const struct obj_ops obj_ops;
 
-extern int posix_new_obj(struct posixvol *pvol, uint16_t mode, struct noid *oid);
+extern int posix_new_obj(struct posixvol *pvol, uint16_t mode,
+			 uint32_t nlink, struct noid *oid);
+extern int posix_remove_obj(struct posixvol *pvol, uint64_t uniq);
+extern int posix_create_verfile(struct posixvol *pvol, uint64_t uniq,
+				const char *name, const struct nattr *attrs,
+				uint32_t nlink, struct nvclock *clock,
+				const void *data);
+extern int posix_fork_verfile(struct posixvol *pvol, uint64_t uniq,
+			      const char *oldname, const char *newname,
+			      const struct nattr *attrs, uint32_t nlink,
+			      struct nvclock *clock);
+extern int posix_clone_file(struct posixvol *pvol, int dstfd, int srcfd,
+			    uint64_t len);
+extern int posix_get_header(struct posixvol *pvol, uint64_t uniq,
+			    const char *name, struct nattr *attrs,
+			    struct nvclock *clock);
+extern int posix_for_each_version(struct posixvol *pvol, uint64_t uniq,
+				  int (*fxn)(struct posixvol *, uint64_t,
+					     const char *, void *),
+				  void *arg);
+extern int posix_find_versions(struct posixvol *pvol, uint64_t uniq,
+			       uint64_t *nversions, char *name, size_t len);
+extern int posix_decode_header(const struct posixhdr *hdr,
+			       struct nattr *attrs, struct nvclock *clock);
+extern void posix_encode_header(struct posixhdr *hdr,
+				const struct nattr *attrs, uint32_t nlink,
+				struct nvclock *clock);
+extern int posix_read_header(int fd, struct nattr *attrs,
+			     struct nvclock *clock);
+extern int posix_write_header(int fd, const struct nattr *attrs,
+			      uint32_t nlink, struct nvclock *clock);
 
 extern int oidbmap_create(struct posixvol *pvol);
+extern int oidbmap_load(struct posixvol *pvol);
+extern void oidbmap_fini(struct posixvol *pvol);
+extern int oidbmap_sync(struct posixvol *pvol);
 extern int oidbmap_set(struct posixvol *pvol, uint64_t uniq);
 extern int oidbmap_get_new(struct posixvol *pvol, uint64_t *new);
 extern int oidbmap_put(struct posixvol *pvol, uint64_t uniq);
 
+extern int pack_create(struct posixvol *pvol);
+extern int pack_load(struct posixvol *pvol);
+extern void pack_fini(struct posixvol *pvol);
+extern int pack_sync(struct posixvol *pvol);
+extern bool pack_wanted(struct posixvol *pvol, uint16_t mode, uint64_t size);
+extern bool pack_contains(struct posixvol *pvol, uint64_t uniq,
+			  const char *name);
+extern bool pack_has_obj(struct posixvol *pvol, uint64_t uniq);
+extern int pack_write(struct posixvol *pvol, uint64_t uniq, const char *name,
+		      const char *oldname, const struct nattr *attrs,
+		      uint32_t nlink, struct nvclock *clock, const void *data);
+extern int pack_read_header(struct posixvol *pvol, uint64_t uniq,
+			    const char *name, struct nattr *attrs,
+			    struct nvclock *clock);
+extern int pack_read(struct posixvol *pvol, uint64_t uniq, const char *name,
+		     void *buf, size_t len, uint64_t offset);
+extern int pack_set_nlink(struct posixvol *pvol, uint64_t uniq,
+			  const char *name, uint32_t nlink);
+extern int pack_remove(struct posixvol *pvol, uint64_t uniq,
+		       const char *name);
+extern int pack_for_each(struct posixvol *pvol, uint64_t uniq,
+			 int (*fxn)(struct posixvol *, uint64_t,
+				    const char *, void *),
+			 void *arg);
+
+extern int posix_dir_lookup(struct posixvol *pvol, struct posixfd *pfd,
+			    const char *name, uint64_t *uniq);
+extern int posix_dir_insert(struct posixvol *pvol, struct posixfd *pfd,
+			    const char *name, uint64_t uniq);
+extern int posix_dir_remove(struct posixvol *pvol, struct posixfd *pfd,
+			    const char *name, uint64_t *uniq);
+extern int posix_dir_next(struct posixvol *pvol, struct posixfd *pfd,
+			  uint64_t cookie, uint64_t *uniq, char **name,
+			  uint64_t *entcookie);
+
+extern void fdcache_init(struct fdcache *cache, size_t max,
+			 struct posixring *ring);
+extern void fdcache_fini(struct fdcache *cache);
+extern struct posixfd *fdcache_get(struct posixvol *pvol, uint64_t uniq,
+				   const char *name);
+extern void fdcache_put(struct posixvol *pvol, struct posixfd *pfd);
+extern void fdcache_drop(struct posixvol *pvol, uint64_t uniq);
+extern int fdcache_rename(struct posixvol *pvol, uint64_t uniq,
+			  const char *oldname, const char *newname);
+extern int fdcache_open_direct(struct posixvol *pvol, struct posixfd *pfd);
+
+extern int posix_direct_init(struct posixvdev *pv);
+extern bool posix_direct_wanted(struct posixvol *pvol, uint64_t size);
+extern int posix_direct_pread(struct posixvol *pvol, struct posixfd *pfd,
+			      void *buf, size_t len, uint64_t off,
+			      uint64_t filesize);
+extern int posix_direct_pwrite(struct posixvol *pvol, struct posixfd *pfd,
+			       const void *buf, size_t len, uint64_t off,
+			       uint64_t filesize);
+
+extern int posix_finish_init(struct posixvdev *pv);
+extern void posix_finish_fini(struct posixvdev *pv);
+
+extern int posix_commit_init(struct posixvdev *pv);
+extern void posix_commit_fini(struct posixvdev *pv);
+extern int posix_commit(struct objstore_vdev *vdev);
+
+extern struct posixring *posix_io_init(void);
+extern void posix_io_fini(struct posixring *ring);
+extern int posix_io_register_fd(struct posixring *ring, int fd);
+extern void posix_io_unregister_fd(struct posixring *ring, int slot);
+extern void *posix_io_buf_alloc(struct posixring *ring, size_t len);
+extern void posix_io_buf_free(struct posixring *ring, void *buf);
+extern void posix_io_queue(struct posixring *ring, struct posixio *io);
+extern void posix_io_submit(struct posixring *ring);
+extern void posix_io_batch_init(struct posixiobatch *batch);
+extern void posix_io_batch_add(struct posixring *ring,
+			       struct posixiobatch *batch,
+			       struct posixio *io);
+extern int posix_io_batch_wait(struct posixring *ring,
+			       struct posixiobatch *batch);
+extern int posix_pread(struct posixring *ring, int fd, int slot, void *buf,
+		       size_t len, uint64_t off);
+extern int posix_pwrite(struct posixring *ring, int fd, int slot,
+			const void *buf, size_t len, uint64_t off);
+extern int posix_fdatasync(struct posixring *ring, int fd, int slot);
+
 #endif
@@ -0,0 +1,971 @@
+/*
+ * Copyright (c) 2018 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+
+#include <nomad/config.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "posix.h"
+
+/*
+ * I/O engine
+ *
+ * Data I/O that the posix backend issues in bulk (the OID bitmap
+ * segments) or without waiting for it (async version file reads) goes
+ * through a per-vdev io_uring instance instead of blocking pread/pwrite
+ * calls on the request thread.
+ *
+ * A struct posixio describes one read, write, or fdatasync.  Callers
+ * queue any number of them with posix_io_queue() and then hand them all
+ * to the kernel with a single posix_io_submit() (an io_uring_enter()
+ * system call).  A dedicated completion thread reaps the completion queue
+ * and calls each I/O's done callback, resubmitting the remainder of short
+ * transfers first so that callers only ever see whole I/Os.  Callers that
+ * need to wait for a group of I/Os use struct posixiobatch.  Single
+ * synchronous I/Os (posix_pread(), etc.) bypass the ring entirely.
+ *
+ * To cut per-I/O kernel overhead further, the ring has:
+ *
+ *  - a table of registered files; the fd cache registers every version
+ *    file it opens, and I/Os that carry a slot use it instead of the fd
+ *  - a pool of registered buffers; I/Os whose buffer lies within the pool
+ *    (see posix_io_buf_alloc()) use the fixed buffer opcodes
+ *
+ * The ring depth comes from "posix-io-depth" in the config.  If it is
+ * zero, nomad was built without liburing, or the kernel refuses to set up
+ * a ring, the ring pointer is NULL and every I/O is done synchronously on
+ * the calling thread instead.
+ *
+ * Transient errors (EINTR, EAGAIN, EBUSY) from submitting or reaping are
+ * retried.  Any other submission error fails the I/Os that didn't make it
+ * to the kernel.  If reaping fails, all the I/Os owned by the ring are
+ * failed and any further I/O is done synchronously.
+ */
+
+#define POSIXIO_MAX_DEPTH	4096
+#define POSIXIO_NSLOTS		1024	/* registered file table size */
+#define POSIXIO_NBUFS		64	/* must be <= 64 (see freebufs) */
+
+struct posixring {
+#ifdef HAVE_LIBURING
+	struct lock lock;	/* protects everything below */
+	struct cond cond;	/* signaled when inflight drops */
+	struct io_uring ring;
+	struct list ios;	/* I/Os with a prepped SQE, in SQ order */
+	unsigned inflight;	/* prepped SQEs without a reaped CQE */
+	unsigned maxinflight;	/* CQ ring size */
+	unsigned queued;	/* prepped SQEs not yet submitted */
+	unsigned nstale;	/* leading queued SQEs that are just NOPs */
+	int dead;		/* reaper failure (negated errno) */
+
+	bool *slots;		/* registered file slots in use */
+
+	uint8_t *bufs;		/* registered buffer pool */
+	uint64_t freebufs;	/* bitmap of free pool buffers */
+
+	pthread_t reaper;
+#endif
+};
+
+static void __done(struct posixio *io, int ret)
+{
+	io->done(io, ret);
+}
+
+/* do an I/O synchronously on the calling thread */
+static void __sync_io(struct posixio *io)
+{
+	int ret;
+
+	switch (io->op) {
+		case POSIXIO_READ:
+			ret = xpread(io->fd, io->buf, io->len, io->off);
+			break;
+		case POSIXIO_WRITE:
+			ret = xpwrite(io->fd, io->buf, io->len, io->off);
+			break;
+		case POSIXIO_FDATASYNC:
+			ret = fdatasync(io->fd) ? -errno : 0;
+			break;
+		default:
+			panic("unknown posix I/O op %d", io->op);
+	}
+
+	__done(io, ret);
+}
+
+/*
+ * Buffers that don't come from the pool are still aligned, so that any
+ * buffer returned by posix_io_buf_alloc() can be used for direct I/O.
+ */
+static void *__alloc_buf(size_t len)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, POSIXIO_BUF_ALIGN, len))
+		return NULL;
+
+	memset(buf, 0, len);
+
+	return buf;
+}
+
+#ifdef HAVE_LIBURING
+static struct lock_class posixring_lc;
+
+static bool is_pool_buf(struct posixring *ring, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if (!ring->bufs || (p < ring->bufs) ||
+	    (p >= (ring->bufs + POSIXIO_NBUFS * POSIXIO_BUF_SIZE)))
+		return false;
+
+	/* must not straddle two pool buffers */
+	return ((p - ring->bufs) % POSIXIO_BUF_SIZE) + len <= POSIXIO_BUF_SIZE;
+}
+
+/* prep an SQE for the remainder of @io; must hold the ring lock */
+static void __prep(struct posixring *ring, struct io_uring_sqe *sqe,
+		   struct posixio *io)
+{
+	const int fd = (io->slot >= 0) ? io->slot : io->fd;
+	uint8_t *buf = (uint8_t *) io->buf + io->xfer;
+	const size_t len = io->len - io->xfer;
+	const uint64_t off = io->off + io->xfer;
+	const bool fixed = is_pool_buf(ring, buf, len);
+
+	switch (io->op) {
+		case POSIXIO_READ:
+			if (fixed)
+				io_uring_prep_read_fixed(sqe, fd, buf, len,
+							 off, 0);
+			else
+				io_uring_prep_read(sqe, fd, buf, len, off);
+			break;
+		case POSIXIO_WRITE:
+			if (fixed)
+				io_uring_prep_write_fixed(sqe, fd, buf, len,
+							  off, 0);
+			else
+				io_uring_prep_write(sqe, fd, buf, len, off);
+			break;
+		case POSIXIO_FDATASYNC:
+			io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+			break;
+		default:
+			panic("unknown posix I/O op %d", io->op);
+	}
+
+	if (io->slot >= 0)
+		sqe->flags |= IOSQE_FIXED_FILE;
+
+	io_uring_sqe_set_data(sqe, io);
+}
+
+static bool is_transient(int err)
+{
+	return (err == -EINTR) || (err == -EAGAIN) || (err == -EBUSY);
+}
+
+static int __submit(struct posixring *ring)
+{
+	int ret;
+
+	while (ring->queued) {
+		ret = io_uring_submit(&ring->ring);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			return ret;
+
+		ret = MIN(ring->queued, ret);
+		ring->queued -= ret;
+		ring->nstale -= MIN(ring->nstale, ret);
+	}
+
+	return 0;
+}
+
+/*
+ * The kernel refused to take the queued SQEs.  Since they are already on
+ * the submission queue, we can't take them back - instead, we turn them
+ * into NOPs (which are harmless whenever they do get submitted) and move
+ * their I/Os to @failed with @err.  The caller must complete those
+ * without the ring lock held (see __fail()).
+ */
+static void __fail_queued(struct posixring *ring, struct list *failed,
+			  int err)
+{
+	unsigned n;
+
+	if (ring->queued == ring->nstale)
+		return;
+
+	cmn_err(CE_ERROR, "posix: failed to submit I/O: %s", xstrerror(err));
+
+	for (n = ring->queued - ring->nstale; n; n--) {
+		struct posixio *io = list_tail(&ring->ios);
+
+		list_remove(&ring->ios, io);
+
+		io_uring_prep_nop(io->sqe);
+		io_uring_sqe_set_data(io->sqe, ring);
+
+		io->err = err;
+		list_insert_head(failed, io);
+	}
+
+	ring->nstale = ring->queued;
+}
+
+/*
+ * Submit everything queued.  If the kernel is temporarily out of
+ * resources, wait for some of the in-flight I/Os to complete first.  Any
+ * other error is returned after the queued I/Os are moved to @failed.
+ */
+static int __submit_all(struct posixring *ring, struct list *failed)
+{
+	int ret;
+
+	while ((ret = __submit(ring))) {
+		if (!is_transient(ret)) {
+			__fail_queued(ring, failed, ret);
+			return ret;
+		}
+
+		if (ring->inflight > ring->queued) {
+			CONDWAIT(&ring->cond, &ring->lock);
+		} else {
+			/* nothing to wait for - just back off */
+			MXUNLOCK(&ring->lock);
+			usleep(1000);
+			MXLOCK(&ring->lock);
+		}
+	}
+
+	return 0;
+}
+
+static struct io_uring_sqe *__get_sqe(struct posixring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring->ring);
+	if (sqe)
+		return sqe;
+
+	/* the submission queue is full - push it to the kernel */
+	if (__submit(ring))
+		return NULL;
+
+	return io_uring_get_sqe(&ring->ring);
+}
+
+/*
+ * (Re)queue @io.  Returns 0 if the ring now owns the I/O, or a negated
+ * errno if it could not be queued.
+ */
+static int __queue(struct posixring *ring, struct posixio *io)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = __get_sqe(ring);
+	if (!sqe)
+		return -EAGAIN;
+
+	__prep(ring, sqe, io);
+
+	io->sqe = sqe;
+	list_insert_tail(&ring->ios, io);
+
+	ring->inflight++;
+	ring->queued++;
+
+	return 0;
+}
+
+/* handle one completion; must hold the ring lock */
+static bool __complete(struct posixring *ring, struct posixio *io, int res)
+{
+	if ((res == -EINTR) || (res == -EAGAIN))
+		goto retry;
+
+	if (res < 0)
+		goto done;
+
+	if (io->op == POSIXIO_FDATASYNC) {
+		res = 0;
+		goto done;
+	}
+
+	if (!res) {
+		/* same as xpread/xpwrite */
+		res = -EPIPE;
+		goto done;
+	}
+
+	io->xfer += res;
+	if (io->xfer < io->len)
+		goto retry;
+
+	res = 0;
+	goto done;
+
+retry:
+	/* the reaper submits it before waiting for the next completion */
+	res = __queue(ring, io);
+	if (!res)
+		return false;
+
+done:
+	/* stash the result for the callback, which runs unlocked */
+	io->err = res;
+
+	return true;
+}
+
+/* complete I/Os that never made it to the kernel */
+static void __fail(struct list *failed)
+{
+	struct posixio *io;
+
+	while ((io = list_remove_head(failed)))
+		__done(io, io->err);
+
+	list_destroy(failed);
+}
+
+static void init_failed(struct list *failed)
+{
+	list_create(failed, sizeof(struct posixio),
+		    offsetof(struct posixio, node));
+}
+
+/*
+ * Submit any retries queued up by __complete().  The reaper must not wait
+ * for completions (it is the one reaping them), so on a transient error
+ * we only back off if there is nothing in flight to wake us up.
+ */
+static void reaper_submit(struct posixring *ring, struct list *failed)
+{
+	int ret;
+
+	while ((ret = __submit(ring))) {
+		if (!is_transient(ret)) {
+			__fail_queued(ring, failed, ret);
+			break;
+		}
+
+		if (ring->inflight > ring->queued)
+			break;
+
+		MXUNLOCK(&ring->lock);
+		usleep(1000);
+		MXLOCK(&ring->lock);
+	}
+}
+
+/*
+ * The completion queue is unusable.  We can't tell which I/Os the kernel
+ * still has, so we fail all of them and do any further I/O synchronously.
+ */
+static void reaper_fail(struct posixring *ring, int err)
+{
+	struct posixio *io;
+	struct list failed;
+
+	cmn_err(CE_ERROR, "posix: failed to reap I/O completions, using "
+		"synchronous I/O: %s", xstrerror(err));
+
+	init_failed(&failed);
+
+	MXLOCK(&ring->lock);
+	ring->dead = err;
+
+	while ((io = list_remove_head(&ring->ios))) {
+		io->err = err;
+		list_insert_tail(&failed, io);
+	}
+
+	ring->inflight = 0;
+	ring->queued = 0;
+	ring->nstale = 0;
+	CONDBCAST(&ring->cond);
+	MXUNLOCK(&ring->lock);
+
+	__fail(&failed);
+}
+
+static void *reaper(void *arg)
+{
+	struct posixring *ring = arg;
+
+	for (;;) {
+		struct io_uring_cqe *cqe;
+		struct posixio *io;
+		struct list failed;
+		bool done;
+		int ret;
+
+		ret = io_uring_wait_cqe(&ring->ring, &cqe);
+		if (ret && is_transient(ret))
+			continue;
+		if (ret) {
+			reaper_fail(ring, ret);
+			break;
+		}
+
+		io = io_uring_cqe_get_data(cqe);
+		ret = cqe->res;
+
+		io_uring_cqe_seen(&ring->ring, cqe);
+
+		/* a NULL I/O is the request to exit */
+		if (!io)
+			break;
+
+		init_failed(&failed);
+
+		MXLOCK(&ring->lock);
+		ring->inflight--;
+
+		if (io == (void *) ring) {
+			/* a NOP left behind by a failed submit */
+			done = false;
+		} else {
+			list_remove(&ring->ios, io);
+			done = __complete(ring, io, ret);
+
+			/* a retry - submit it before we wait again */
+			if (!done)
+				reaper_submit(ring, &failed);
+		}
+
+		CONDBCAST(&ring->cond);
+		MXUNLOCK(&ring->lock);
+
+		if (done)
+			__done(io, io->err);
+
+		__fail(&failed);
+	}
+
+	return NULL;
+}
+
+static int setup_files(struct posixring *ring)
+{
+	int fds[POSIXIO_NSLOTS];
+	int i;
+
+	ring->slots = calloc(POSIXIO_NSLOTS, sizeof(bool));
+	if (!ring->slots)
+		return -ENOMEM;
+
+	for (i = 0; i < POSIXIO_NSLOTS; i++)
+		fds[i] = -1;
+
+	return io_uring_register_files(&ring->ring, fds, POSIXIO_NSLOTS);
+}
+
+static int setup_bufs(struct posixring *ring)
+{
+	struct iovec iov;
+	int ret;
+
+	ret = posix_memalign((void **) &ring->bufs, POSIXIO_BUF_ALIGN,
+			     POSIXIO_NBUFS * POSIXIO_BUF_SIZE);
+	if (ret) {
+		ring->bufs = NULL;
+		return -ret;
+	}
+
+	/* the whole pool is one registered buffer */
+	iov.iov_base = ring->bufs;
+	iov.iov_len = POSIXIO_NBUFS * POSIXIO_BUF_SIZE;
+
+	ret = io_uring_register_buffers(&ring->ring, &iov, 1);
+	if (ret) {
+		free(ring->bufs);
+		ring->bufs = NULL;
+		return ret;
+	}
+
+	ring->freebufs = ~0ull;
+
+	return 0;
+}
+
+static void free_ring(struct posixring *ring)
+{
+	list_destroy(&ring->ios);
+	free(ring->bufs);
+	free(ring->slots);
+	CONDDESTROY(&ring->cond);
+	MXDESTROY(&ring->lock);
+	free(ring);
+}
+
+/*
+ * Set up the I/O engine.  This never fails - if we can't set up a ring,
+ * we return NULL and all I/O is done synchronously.  Failing to register
+ * the files or the buffer pool (e.g., due to RLIMIT_MEMLOCK) just means
+ * that the ring runs without them.
+ */
+struct posixring *posix_io_init(void)
+{
+	const uint64_t depth = config_get_posix_io_depth();
+	struct io_uring_params params;
+	struct posixring *ring;
+	int ret;
+
+	if (!depth)
+		return NULL;
+
+	ring = calloc(1, sizeof(struct posixring));
+	if (!ring) {
+		cmn_err(CE_WARN, "posix: failed to allocate io_uring, using "
+			"synchronous I/O");
+		return NULL;
+	}
+
+	MXINIT(&ring->lock, &posixring_lc);
+	CONDINIT(&ring->cond);
+	list_create(&ring->ios, sizeof(struct posixio),
+		    offsetof(struct posixio, node));
+
+	memset(&params, 0, sizeof(params));
+
+	ret = io_uring_queue_init_params(MIN(depth, POSIXIO_MAX_DEPTH),
+					 &ring->ring, &params);
+	if (ret) {
+		/* e.g., an old kernel or a seccomp policy */
+		cmn_err(CE_WARN, "posix: failed to set up io_uring, using "
+			"synchronous I/O: %s", xstrerror(ret));
+		free_ring(ring);
+		return NULL;
+	}
+
+	ring->maxinflight = params.cq_entries;
+
+	ret = setup_files(ring);
+	if (ret) {
+		cmn_err(CE_WARN, "posix: failed to register files with "
+			"io_uring: %s", xstrerror(ret));
+		free(ring->slots);
+		ring->slots = NULL;
+	}
+
+	ret = setup_bufs(ring);
+	if (ret)
+		cmn_err(CE_WARN, "posix: failed to register buffers with "
+			"io_uring: %s", xstrerror(ret));
+
+	ret = -pthread_create(&ring->reaper, NULL, reaper, ring);
+	if (ret) {
+		cmn_err(CE_WARN, "posix: failed to start io_uring completion "
+			"thread, using synchronous I/O: %s", xstrerror(ret));
+		io_uring_queue_exit(&ring->ring);
+		free_ring(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void posix_io_fini(struct posixring *ring)
+{
+	struct io_uring_sqe *sqe;
+	struct list failed;
+	int ret;
+
+	if (!ring)
+		return;
+
+	init_failed(&failed);
+
+	MXLOCK(&ring->lock);
+	if (!ring->dead)
+		(void) __submit_all(ring, &failed);
+
+	/* wait for everything but the NOPs that can't be submitted */
+	while (!ring->dead && (ring->inflight > ring->nstale))
+		CONDWAIT(&ring->cond, &ring->lock);
+
+	if (ring->dead) {
+		/* the reaper is already gone */
+		MXUNLOCK(&ring->lock);
+		__fail(&failed);
+		goto join;
+	}
+
+	/* wake up the reaper with a NULL I/O */
+	sqe = __get_sqe(ring);
+	if (sqe) {
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		ring->queued++;
+		ring->inflight++;
+
+		ret = __submit_all(ring, &failed);
+	} else {
+		ret = -EAGAIN;
+	}
+	MXUNLOCK(&ring->lock);
+
+	__fail(&failed);
+
+	if (ret) {
+		/* leak the ring rather than free it under the reaper */
+		cmn_err(CE_ERROR, "posix: failed to stop io_uring completion "
+			"thread: %s", xstrerror(ret));
+		return;
+	}
+
+join:
+	VERIFY0(pthread_join(ring->reaper, NULL));
+
+	io_uring_queue_exit(&ring->ring);
+	free_ring(ring);
+}
+
+/*
+ * Add @fd to the ring's registered file table.  Returns the slot to put
+ * in posixio->slot, or -1 if the fd could not be registered (in which
+ * case I/Os simply use the fd).
+ */
+int posix_io_register_fd(struct posixring *ring, int fd)
+{
+	int slot;
+
+	/* the ring may be running without a registered file table */
+	if (!ring || !ring->slots)
+		return -1;
+
+	MXLOCK(&ring->lock);
+	for (slot = 0; slot < POSIXIO_NSLOTS; slot++)
+		if (!ring->slots[slot])
+			break;
+
+	if (slot == POSIXIO_NSLOTS) {
+		slot = -1;
+	} else if (io_uring_register_files_update(&ring->ring, slot,
+						  &fd, 1) != 1) {
+		slot = -1;
+	} else {
+		ring->slots[slot] = true;
+	}
+	MXUNLOCK(&ring->lock);
+
+	return slot;
+}
+
+/* there must not be any I/O using the slot in flight */
+void posix_io_unregister_fd(struct posixring *ring, int slot)
+{
+	int fd = -1;
+
+	if (!ring || (slot < 0))
+		return;
+
+	MXLOCK(&ring->lock);
+	ASSERT(ring->slots[slot]);
+
+	if (io_uring_register_files_update(&ring->ring, slot, &fd, 1) == 1)
+		ring->slots[slot] = false;
+	/* else leak the slot - the next register will skip it */
+	MXUNLOCK(&ring->lock);
+}
+
+/*
+ * Allocate a zeroed, POSIXIO_BUF_ALIGN aligned buffer of @len bytes,
+ * preferring the ring's pool of registered buffers.  Always free it with
+ * posix_io_buf_free().
+ */
+void *posix_io_buf_alloc(struct posixring *ring, size_t len)
+{
+	void *buf = NULL;
+	int idx;
+
+	if (!ring || (len > POSIXIO_BUF_SIZE))
+		return __alloc_buf(len);
+
+	MXLOCK(&ring->lock);
+	if (ring->freebufs) {
+		idx = __builtin_ctzll(ring->freebufs);
+		ring->freebufs &= ~(1ull << idx);
+
+		buf = ring->bufs + idx * POSIXIO_BUF_SIZE;
+	}
+	MXUNLOCK(&ring->lock);
+
+	if (!buf)
+		return __alloc_buf(len);
+
+	memset(buf, 0, len);
+
+	return buf;
+}
+
+void posix_io_buf_free(struct posixring *ring, void *buf)
+{
+	size_t idx;
+
+	if (!ring || !is_pool_buf(ring, buf, 0)) {
+		free(buf);
+		return;
+	}
+
+	idx = ((uint8_t *) buf - ring->bufs) / POSIXIO_BUF_SIZE;
+
+	MXLOCK(&ring->lock);
+	ASSERT(!(ring->freebufs & (1ull << idx)));
+	ring->freebufs |= 1ull << idx;
+	MXUNLOCK(&ring->lock);
+}
+
+/*
+ * Queue @io for submission.  The I/O is not started until the next
+ * posix_io_submit() call.  Once it completes (successfully or not),
+ * io->done is called from the completion thread.
+ */
+void posix_io_queue(struct posixring *ring, struct posixio *io)
+{
+	struct list failed;
+	int ret;
+
+	io->xfer = 0;
+
+	if (!ring) {
+		__sync_io(io);
+		return;
+	}
+
+	init_failed(&failed);
+
+	MXLOCK(&ring->lock);
+	ret = 0;
+
+	/* don't overrun the completion queue or the submission queue */
+	while (!ret && !ring->dead &&
+	       ((ring->inflight >= ring->maxinflight) ||
+		!io_uring_sq_space_left(&ring->ring))) {
+		if (ring->queued)
+			ret = __submit_all(ring, &failed);
+		else
+			CONDWAIT(&ring->cond, &ring->lock);
+	}
+
+	if (ring->dead) {
+		MXUNLOCK(&ring->lock);
+		__fail(&failed);
+		__sync_io(io);
+		return;
+	}
+
+	if (!ret)
+		ret = __queue(ring, io);
+	MXUNLOCK(&ring->lock);
+
+	__fail(&failed);
+
+	if (ret)
+		__done(io, ret);
+}
+
+/* submit all queued I/Os */
+void posix_io_submit(struct posixring *ring)
+{
+	struct list failed;
+
+	if (!ring)
+		return;
+
+	init_failed(&failed);
+
+	MXLOCK(&ring->lock);
+	if (!ring->dead)
+		(void) __submit_all(ring, &failed);
+	MXUNLOCK(&ring->lock);
+
+	__fail(&failed);
+}
+#else
+struct posixring *posix_io_init(void)
+{
+	if (config_get_posix_io_depth())
+		cmn_err(CE_INFO, "posix: built without io_uring support, "
+			"using synchronous I/O");
+
+	return NULL;
+}
+
+void posix_io_fini(struct posixring *ring)
+{
+}
+
+int posix_io_register_fd(struct posixring *ring, int fd)
+{
+	return -1;
+}
+
+void posix_io_unregister_fd(struct posixring *ring, int slot)
+{
+}
+
+void *posix_io_buf_alloc(struct posixring *ring, size_t len)
+{
+	return __alloc_buf(len);
+}
+
+void posix_io_buf_free(struct posixring *ring, void *buf)
+{
+	free(buf);
+}
+
+void posix_io_queue(struct posixring *ring, struct posixio *io)
+{
+	io->xfer = 0;
+
+	__sync_io(io);
+}
+
+void posix_io_submit(struct posixring *ring)
+{
+}
+#endif
+
+/*
+ * Batches of I/Os that the caller waits for as a whole
+ */
+
+static struct lock_class posixiobatch_lc;
+
+static void batch_done(struct posixio *io, int ret)
+{
+	struct posixiobatch *batch = io->private;
+
+	MXLOCK(&batch->lock);
+	if (ret && !batch->err)
+		batch->err = ret;
+
+	batch->pending--;
+	if (!batch->pending)
+		CONDSIG(&batch->cond);
+	MXUNLOCK(&batch->lock);
+}
+
+void posix_io_batch_init(struct posixiobatch *batch)
+{
+	MXINIT(&batch->lock, &posixiobatch_lc);
+	CONDINIT(&batch->cond);
+	batch->pending = 0;
+	batch->err = 0;
+}
+
+void posix_io_batch_add(struct posixring *ring, struct posixiobatch *batch,
+			struct posixio *io)
+{
+	io->done = batch_done;
+	io->private = batch;
+
+	MXLOCK(&batch->lock);
+	batch->pending++;
+	MXUNLOCK(&batch->lock);
+
+	posix_io_queue(ring, io);
+}
+
+/*
+ * Submit the batch's I/Os and wait for all of them to finish.  Returns
+ * the first error encountered, if any.
+ */
+int posix_io_batch_wait(struct posixring *ring, struct posixiobatch *batch)
+{
+	int ret;
+
+	posix_io_submit(ring);
+
+	MXLOCK(&batch->lock);
+	while (batch->pending)
+		CONDWAIT(&batch->cond, &batch->lock);
+	ret = batch->err;
+	MXUNLOCK(&batch->lock);
+
+	CONDDESTROY(&batch->cond);
+	MXDESTROY(&batch->lock);
+
+	return ret;
+}
+
+/*
+ * Synchronous I/O helpers with the same semantics as xpread & xpwrite.
+ *
+ * A single I/O that the caller waits for is done with a plain system call
+ * on the calling thread.  Going through the ring would cost a wakeup from
+ * the completion thread (and a couple of context switches) on top of the
+ * I/O itself, which is most of the cost of the small, mostly cached reads
+ * and writes these are used for.  @ring and @slot (the registered file
+ * slot, or -1) are accepted for symmetry with struct posixio.
+ */
+static int __one(enum posixio_op op, int fd, void *buf, size_t len,
+		 uint64_t off)
+{
+	switch (op) {
+		case POSIXIO_READ:
+			return xpread(fd, buf, len, off);
+		case POSIXIO_WRITE:
+			return xpwrite(fd, buf, len, off);
+		case POSIXIO_FDATASYNC:
+			return fdatasync(fd) ? -errno : 0;
+	}
+
+	panic("unknown posix I/O op %d", op);
+}
+
+int posix_pread(struct posixring *ring, int fd, int slot, void *buf,
+		size_t len, uint64_t off)
+{
+	return __one(POSIXIO_READ, fd, buf, len, off);
+}
+
+int posix_pwrite(struct posixring *ring, int fd, int slot, const void *buf,
+		 size_t len, uint64_t off)
+{
+	return __one(POSIXIO_WRITE, fd, (void *) buf, len, off);
+}
+
+int posix_fdatasync(struct posixring *ring, int fd, int slot)
+{
+	return __one(POSIXIO_FDATASYNC, fd, NULL, 0, 0);
+}
@@ -20,21 +20,184 @@
  * SOFTWARE.
  */
 
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <jeffpc/error.h>
 #include <jeffpc/io.h>
+#include <jeffpc/time.h>
 
 #include "posix.h"
 
-#define OIDFMT	"%016"PRIx64
+/*
+ * Create a dedicated version file @name for object @uniq, and fill it with
+ * the header and @attrs->size bytes of @data (if not NULL).
+ */
+int posix_create_verfile(struct posixvol *pvol, uint64_t uniq,
+			 const char *name, const struct nattr *attrs,
+			 uint32_t nlink, struct nvclock *clock,
+			 const void *data)
+{
+	char dirname[20];
+	bool newdir;
+	int verfd;
+	int ret;
+	int fd;
+
+	snprintf(dirname, sizeof(dirname), OIDFMT, uniq);
+
+	/* packed objects don't have a directory */
+	ret = xmkdirat(pvol->basefd, dirname, 0700);
+	if (ret && (ret != -EEXIST))
+		return ret;
+
+	newdir = !ret;
+
+	fd = xopenat(pvol->basefd, dirname, O_RDONLY, 0);
+	if (fd < 0) {
+		ret = fd;
+		goto err_unlink_dir;
+	}
+
+	verfd = xopenat(fd, name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (verfd < 0) {
+		ret = verfd;
+		goto err_close;
+	}
 
-int posix_new_obj(struct posixvol *pvol, uint16_t mode, struct noid *oid)
+	/* the data starts right after the header */
+	ret = xftruncate(verfd, POSIX_HDR_SIZE + attrs->size);
+	if (ret)
+		goto err_close_ver;
+
+	if (data && attrs->size) {
+		ret = posix_pwrite(pvol->ring, verfd, -1, data, attrs->size,
+				   POSIX_HDR_SIZE);
+		if (ret)
+			goto err_close_ver;
+	}
+
+	ret = posix_write_header(verfd, attrs, nlink, clock);
+	if (ret)
+		goto err_close_ver;
+
+	xclose(verfd);
+	xclose(fd);
+
+	return 0;
+
+err_close_ver:
+	xclose(verfd);
+	xunlinkat(fd, name, 0);
+
+err_close:
+	xclose(fd);
+
+err_unlink_dir:
+	if (newdir)
+		xunlinkat(pvol->basefd, dirname, AT_REMOVEDIR);
+
+	return ret;
+}
+
+/*
+ * Create version file @newname of object @uniq as a copy of version file
+ * @oldname, but with a header describing the new version (@attrs,
+ * @nlink, and @clock).  The data is cloned (see clone.c), so this is
+ * cheap even for large objects.  We copy the whole file, since the size
+ * in @attrs is not the length of the data for all objects (e.g., it is
+ * the number of entries for directories).
+ *
+ * The copy is assembled under a temporary name (which
+ * posix_for_each_version() ignores) and linked into place once it is
+ * complete.  This way a crash never leaves a half-copied version behind,
+ * and we get -EEXIST if the new version already exists.
+ */
+int posix_fork_verfile(struct posixvol *pvol, uint64_t uniq,
+		       const char *oldname, const char *newname,
+		       const struct nattr *attrs, uint32_t nlink,
+		       struct nvclock *clock)
+{
+	char tmpname[PATH_MAX];
+	struct stat statbuf;
+	char dirname[20];
+	struct posixfd *src;
+	int dirfd;
+	int ret;
+	int fd;
+
+	snprintf(dirname, sizeof(dirname), OIDFMT, uniq);
+
+	ret = snprintf(tmpname, sizeof(tmpname), ".fork-%s", newname);
+	if (ret >= sizeof(tmpname))
+		return -ENAMETOOLONG;
+
+	src = fdcache_get(pvol, uniq, oldname);
+	if (IS_ERR(src))
+		return PTR_ERR(src);
+
+	ret = xfstat(src->fd, &statbuf);
+	if (ret)
+		goto err_src;
+
+	dirfd = xopenat(pvol->basefd, dirname, O_RDONLY, 0);
+	if (dirfd < 0) {
+		ret = dirfd;
+		goto err_src;
+	}
+
+	/* get rid of any leftovers from a crash in the middle of a fork */
+	(void) xunlinkat(dirfd, tmpname, 0);
+
+	fd = xopenat(dirfd, tmpname, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		ret = fd;
+		goto err_dir;
+	}
+
+	ret = posix_clone_file(pvol, fd, src->fd, statbuf.st_size);
+	if (ret)
+		goto err_tmp;
+
+	/* this un-shares only the header block */
+	ret = posix_write_header(fd, attrs, nlink, clock);
+	if (ret)
+		goto err_tmp;
+
+	if (linkat(dirfd, tmpname, dirfd, newname, 0)) {
+		ret = -errno;
+		goto err_tmp;
+	}
+
+	xunlinkat(dirfd, tmpname, 0);
+	xclose(fd);
+	xclose(dirfd);
+	fdcache_put(pvol, src);
+
+	return 0;
+
+err_tmp:
+	xclose(fd);
+	xunlinkat(dirfd, tmpname, 0);
+
+err_dir:
+	xclose(dirfd);
+
+err_src:
+	fdcache_put(pvol, src);
+
+	return ret;
+}
+
+int posix_new_obj(struct posixvol *pvol, uint16_t mode, uint32_t nlink,
+		  struct noid *oid)
 {
 	struct nvclock *clock;
 	char vername[PATH_MAX];
-	char dirname[20];
+	struct nattr attrs;
 	uint64_t uniq;
 	int ret;
-	int fd;
 
 	clock = nvclock_alloc(true);
 	if (!clock)
@@ -48,39 +211,29 @@ int posix_new_obj(struct posixvol *pvol, uint16_t mode, struct noid *oid)
 	if (ret)
 		goto err_free_clock;
 
-	snprintf(dirname, sizeof(dirname), OIDFMT, uniq);
+	memset(&attrs, 0, sizeof(attrs));
+	attrs.mode = mode;
+	attrs.size = 0;
+	attrs.atime = gettime();
+	attrs.btime = attrs.atime;
+	attrs.ctime = attrs.atime;
+	attrs.mtime = attrs.atime;
 
-	ret = xmkdirat(pvol->basefd, dirname, 0700);
+	if (pack_wanted(pvol, mode, 0))
+		ret = pack_write(pvol, uniq, vername, NULL, &attrs, nlink,
+				 clock, NULL);
+	else
+		ret = posix_create_verfile(pvol, uniq, vername, &attrs, nlink,
+					   clock, NULL);
 	if (ret)
 		goto err_free_uniq;
 
-	fd = xopenat(pvol->basefd, dirname, O_RDONLY, 0);
-	if (fd < 0) {
-		ret = fd;
-		goto err_unlink_dir;
-	}
-
-	ret = xopenat(fd, vername, O_RDWR | O_CREAT, 0600);
-	if (ret < 0)
-		goto err_close;
-
-	FIXME("write out obj attrs");
-
-	xclose(ret);
-	xclose(fd);
-
 	nvclock_free(clock);
 
 	noid_set(oid, &pvol->vol->id, uniq);
 
 	return 0;
 
-err_close:
-	xclose(fd);
-
-err_unlink_dir:
-	xunlinkat(pvol->basefd, dirname, 0);
-
 err_free_uniq:
 	oidbmap_put(pvol, uniq);
 
@@ -99,18 +252,157 @@ static int posix_getroot(struct objstore *vol, struct noid *root)
 	return 0;
 }
 
+/*
+ * Call @fxn for each version file of object @uniq.  Stops at the first
+ * non-zero return value.
+ */
+int posix_for_each_version(struct posixvol *pvol, uint64_t uniq,
+			   int (*fxn)(struct posixvol *, uint64_t,
+				      const char *, void *),
+			   void *arg)
+{
+	struct dirent *de;
+	char oidstr[32];
+	bool packed;
+	DIR *dir;
+	int ret;
+	int fd;
+
+	packed = pack_has_obj(pvol, uniq);
+
+	ret = pack_for_each(pvol, uniq, fxn, arg);
+	if (ret)
+		return ret;
+
+	snprintf(oidstr, sizeof(oidstr), OIDFMT, uniq);
+
+	fd = xopenat(pvol->basefd, oidstr, O_RDONLY, 0);
+	if (fd < 0)
+		/* a packed object may not have any version files */
+		return ((fd == -ENOENT) && packed) ? 0 : fd;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		ret = -errno;
+		xclose(fd);
+		return ret;
+	}
+
+	ret = 0;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		ret = fxn(pvol, uniq, de->d_name, arg);
+		if (ret)
+			break;
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+struct find_versions_state {
+	uint64_t nversions;
+	char *name;
+	size_t len;
+};
+
+static int __find_versions(struct posixvol *pvol, uint64_t uniq,
+			   const char *name, void *arg)
+{
+	struct find_versions_state *state = arg;
+
+	if (!state->nversions++)
+		snprintf(state->name, state->len, "%s", name);
+
+	return 0;
+}
+
+/*
+ * Count the versions of an object, and return the name of one of them.
+ */
+int posix_find_versions(struct posixvol *pvol, uint64_t uniq,
+			uint64_t *nversions, char *name, size_t len)
+{
+	struct find_versions_state state = {
+		.nversions = 0,
+		.name = name,
+		.len = len,
+	};
+	int ret;
+
+	ret = posix_for_each_version(pvol, uniq, __find_versions, &state);
+
+	*nversions = state.nversions;
+
+	return ret;
+}
+
+static int __remove_version(struct posixvol *pvol, uint64_t uniq,
+			    const char *name, void *arg)
+{
+	char path[PATH_MAX];
+
+	if (pack_contains(pvol, uniq, name))
+		return pack_remove(pvol, uniq, name);
+
+	snprintf(path, sizeof(path), OIDFMT "/%s", uniq, name);
+
+	return xunlinkat(pvol->basefd, path, 0);
+}
+
+/*
+ * Remove all traces of an object (which must not be referenced from
+ * anywhere anymore), and free up its uniq.
+ */
+int posix_remove_obj(struct posixvol *pvol, uint64_t uniq)
+{
+	char oidstr[32];
+	int ret;
+
+	fdcache_drop(pvol, uniq);
+
+	ret = posix_for_each_version(pvol, uniq, __remove_version, NULL);
+	if (ret)
+		return ret;
+
+	snprintf(oidstr, sizeof(oidstr), OIDFMT, uniq);
+
+	/* packed objects may not have a directory */
+	ret = xunlinkat(pvol->basefd, oidstr, AT_REMOVEDIR);
+	if (ret && (ret != -ENOENT))
+		return ret;
+
+	return oidbmap_put(pvol, uniq);
+}
+
 static int posix_allocobj(struct obj *obj)
 {
 	struct posixvol *pvol = obj->vol->private;
-	char oidstr[32];
-	int objfd;
+	char name[PATH_MAX];
+	struct nattr attrs;
+	uint64_t nversions;
+	int ret;
 
-	snprintf(oidstr, sizeof(oidstr), OIDFMT, obj->oid.uniq);
+	ret = posix_find_versions(pvol, obj->oid.uniq, &nversions, name,
+				  sizeof(name));
+	if (ret)
+		return ret;
 
-	objfd = xopenat(pvol->basefd, oidstr, O_RDONLY, 0);
-	ASSERT3S(objfd, >=, 0);
+	if (!nversions)
+		return -ENOENT;
+
+	/* every version's header has the current link count */
+	ret = posix_get_header(pvol, obj->oid.uniq, name, &attrs, NULL);
+	if (ret)
+		return ret;
 
-	FIXME("allocobj not fully implemented");
+	obj->nversions = nversions;
+	obj->nlink = attrs.nlink;
+	obj->ops = &obj_ops;
 
 	return 0;
 }
@@ -119,6 +119,11 @@ static struct objstore_vdev *vdev_load(const char *type, const char *path,
 		xuuid_clear(&vdev->uuid);
 	}
 
+	if (!fxn) {
+		ret = -ENOTSUP;
+		goto err;
+	}
+
 	ret = fxn(vdev);
 	if (ret)
 		goto err;
@@ -144,3 +149,51 @@ struct objstore_vdev *objstore_vdev_load(const char *type, const char *path)
 {
 	return vdev_load(type, path, false);
 }
+
+/*
+ * Write out any state the vdev keeps in memory to stable storage.
+ */
+int objstore_vdev_sync(struct objstore_vdev *vdev)
+{
+	if (!vdev->def->sync)
+		return 0;
+
+	return vdev->def->sync(vdev);
+}
+
+/*
+ * Sync all loaded vdevs.  All vdevs are synced even if some fail.  Returns
+ * the first error encountered.
+ */
+int objstore_vdev_sync_all(void)
+{
+	struct objstore_vdev *vdev;
+	int ret;
+
+	ret = 0;
+
+	MXLOCK(&loaded_vdevs.lock);
+	list_for_each(vdev, &loaded_vdevs.list) {
+		int tmp;
+
+		tmp = objstore_vdev_sync(vdev);
+		if (tmp) {
+			cmn_err(CE_ERROR, "failed to sync vdev %s: %s",
+				vdev->path, xstrerror(tmp));
+			if (!ret)
+				ret = tmp;
+		}
+	}
+	MXUNLOCK(&loaded_vdevs.lock);
+
+	return ret;
+}
+
+int objstore_vdev_usage(struct objstore_vdev *vdev,
+			struct objstore_vdev_usage *usage)
+{
+	if (!vdev->def->usage)
+		return -ENOTSUP;
+
+	return vdev->def->usage(vdev, usage);
+}
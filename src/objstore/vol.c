@@ -279,8 +279,13 @@ static struct objver *__fetch_ver(struct obj *obj, const struct nvclock *clock)
 	if (IS_ERR(ver))
 		return ver;
 
-	if (clock)
-		nvclock_copy(ver->clock, clock);
+	if (clock) {
+		ret = nvclock_copy(ver->clock, clock);
+		if (ret) {
+			freeobjver(ver);
+			return ERR_PTR(ret);
+		}
+	}
 
 	ver->obj = obj;
 
@@ -374,6 +379,24 @@ static struct objver *getver(struct objstore *vol, const struct noid *oid,
 	return ver;
 }
 
+/*
+ * Called after a modifying operation with its return value.  If it
+ * succeeded, wait for the vdev to make it durable (if the vdev wants to).
+ * Must be called without any object locks held.
+ */
+static ssize_t __commit(struct objstore *vol, ssize_t ret)
+{
+	const struct objstore_vdev_def *def = vol->vdev->def;
+	int err;
+
+	if ((ret < 0) || !def->commit)
+		return ret;
+
+	err = def->commit(vol->vdev);
+
+	return err ? err : ret;
+}
+
 int objstore_getroot(struct objstore *vol, struct noid *root)
 {
 	int ret;
@@ -533,7 +556,7 @@ int objstore_setattr(struct objstore *vol, void *cookie, struct nattr *attr,
 	ret = obj->ops->setattr(objver, attr, valid);
 	MXUNLOCK(&obj->lock);
 
-	return ret;
+	return __commit(vol, ret);
 }
 
 ssize_t objstore_read(struct objstore *vol, void *cookie, void *buf, size_t len,
@@ -572,6 +595,167 @@ ssize_t objstore_read(struct objstore *vol, void *cookie, void *buf, size_t len,
 	return ret;
 }
 
+static void __free_bufref(struct objstore_bufref *ref)
+{
+	free(ref->private);
+}
+
+/*
+ * Backends that cannot hand out references to their data get a bounce
+ * buffer.
+ */
+static ssize_t __read_ref_copy(struct objver *objver, size_t len,
+			       uint64_t offset, struct objstore_bufref *ref)
+{
+	struct obj *obj = objver->obj;
+	ssize_t ret;
+	void *buf;
+
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = obj->ops->read(objver, buf, len, offset);
+	if (ret <= 0) {
+		free(buf);
+		return ret;
+	}
+
+	ref->data = buf;
+	ref->len = ret;
+	ref->release = __free_bufref;
+	ref->private = buf;
+
+	return ret;
+}
+
+/*
+ * Backends may reference less than asked for even if the object is long
+ * enough (e.g., if the data isn't contiguous).  In that case, we copy the
+ * whole range instead so that callers can treat short reads as EOF.
+ */
+static ssize_t __read_ref(struct objver *objver, size_t len, uint64_t offset,
+			  struct objstore_bufref *ref)
+{
+	struct obj *obj = objver->obj;
+	ssize_t ret;
+
+	ret = obj->ops->read_ref(objver, len, offset, ref);
+	if ((ret <= 0) || (ret == len) || !obj->ops->read ||
+	    ((offset + ret) >= objver->attrs.size))
+		return ret;
+
+	objstore_bufref_put(ref);
+
+	return __read_ref_copy(objver, len, offset, ref);
+}
+
+/*
+ * Get a reference to (up to) len bytes of object data starting at offset.
+ *
+ * Returns the number of bytes referenced, which is fewer than requested
+ * only if the range extends past the end of the file.  A zero return
+ * indicates end of file.  A positive return must be paired with a call to
+ * objstore_bufref_put().
+ */
+ssize_t objstore_read_ref(struct objstore *vol, void *cookie, size_t len,
+			  uint64_t offset, struct objstore_bufref *ref)
+{
+	struct objver *objver = cookie;
+	struct obj *obj;
+	ssize_t ret;
+
+	if (!vol || !objver || !ref)
+		return -EINVAL;
+
+	if (len > (SIZE_MAX / 2))
+		return -EOVERFLOW;
+
+	if (vol != objver->obj->vol)
+		return -ENXIO;
+
+	obj = objver->obj;
+
+	if (!obj->ops || (!obj->ops->read_ref && !obj->ops->read))
+		return -ENOTSUP;
+
+	ref->data = NULL;
+	ref->len = 0;
+	ref->release = NULL;
+	ref->private = NULL;
+
+	/* nothing to do */
+	if (!len)
+		return 0;
+
+	MXLOCK(&obj->lock);
+	if (NATTR_ISDIR(objver->attrs.mode))
+		ret = -EISDIR;
+	else if (obj->ops->read_ref)
+		ret = __read_ref(objver, len, offset, ref);
+	else
+		ret = __read_ref_copy(objver, len, offset, ref);
+	MXUNLOCK(&obj->lock);
+
+	return ret;
+}
+
+void objstore_bufref_put(struct objstore_bufref *ref)
+{
+	if (!ref || !ref->release)
+		return;
+
+	ref->release(ref);
+
+	ref->data = NULL;
+	ref->len = 0;
+	ref->release = NULL;
+	ref->private = NULL;
+}
+
+/*
+ * Find the next data (OBJ_SEEK_DATA) or hole (OBJ_SEEK_HOLE) offset at or
+ * after the given offset - just like lseek's SEEK_DATA and SEEK_HOLE.
+ */
+int objstore_seek(struct objstore *vol, void *cookie, uint64_t offset,
+		  enum objstore_seek whence, uint64_t *result)
+{
+	struct objver *objver = cookie;
+	struct obj *obj;
+	int ret;
+
+	if (!vol || !objver || !result)
+		return -EINVAL;
+
+	if ((whence != OBJ_SEEK_DATA) && (whence != OBJ_SEEK_HOLE))
+		return -EINVAL;
+
+	if (vol != objver->obj->vol)
+		return -ENXIO;
+
+	obj = objver->obj;
+
+	if (!obj->ops)
+		return -ENOTSUP;
+
+	MXLOCK(&obj->lock);
+	if (NATTR_ISDIR(objver->attrs.mode)) {
+		ret = -EISDIR;
+	} else if (offset >= objver->attrs.size) {
+		ret = -ENXIO;
+	} else if (obj->ops->seek) {
+		ret = obj->ops->seek(objver, offset, whence, result);
+	} else {
+		/* no holes - the whole object is data */
+		*result = (whence == OBJ_SEEK_DATA) ? offset :
+			  objver->attrs.size;
+		ret = 0;
+	}
+	MXUNLOCK(&obj->lock);
+
+	return ret;
+}
+
 ssize_t objstore_write(struct objstore *vol, void *cookie, const void *buf,
 		       size_t len, uint64_t offset)
 {
@@ -605,7 +789,150 @@ ssize_t objstore_write(struct objstore *vol, void *cookie, const void *buf,
 		ret = obj->ops->write(objver, buf, len, offset);
 	MXUNLOCK(&obj->lock);
 
-	return ret;
+	return __commit(vol, ret);
+}
+
+/*
+ * Asynchronous I/O
+ *
+ * The async variants of read and write do the same checks as their
+ * synchronous counterparts, but instead of returning the result, they
+ * hand it to aio->done.  The object is locked only while the I/O is being
+ * started - not until it finishes.  This lets a single thread have many
+ * I/Os outstanding, but it also means that concurrent I/Os to the same
+ * range of an object are not ordered with respect to each other.
+ *
+ * If the backend cannot do asynchronous I/O, the operation is done
+ * synchronously and the callback is invoked before returning.  Backends
+ * that do asynchronous writes are responsible for committing them (see
+ * the vdev commit op) before calling objstore_aio_done().
+ *
+ * Returns 0 if aio->done will be (or has been) called, or a negated errno
+ * if the arguments are invalid.
+ */
+static int __aio(struct objver *objver, bool write, void *buf, size_t len,
+		 uint64_t offset, struct objstore_aio *aio)
+{
+	struct obj *obj = objver->obj;
+	ssize_t ret;
+
+	aio->obj = obj_getref(obj);
+
+	/* nothing to do */
+	if (!len) {
+		objstore_aio_done(aio, 0);
+		return 0;
+	}
+
+	MXLOCK(&obj->lock);
+	if (NATTR_ISDIR(objver->attrs.mode))
+		ret = -EISDIR;
+	else if (write && obj->ops->write_async)
+		ret = obj->ops->write_async(objver, buf, len, offset, aio);
+	else if (write)
+		ret = obj->ops->write(objver, buf, len, offset);
+	else if (obj->ops->read_async)
+		ret = obj->ops->read_async(objver, buf, len, offset, aio);
+	else
+		ret = obj->ops->read(objver, buf, len, offset);
+	MXUNLOCK(&obj->lock);
+
+	if (ret == -EINPROGRESS)
+		return 0;
+
+	if (write)
+		ret = __commit(obj->vol, ret);
+
+	objstore_aio_done(aio, ret);
+
+	return 0;
+}
+
+int objstore_read_async(struct objstore *vol, void *cookie, void *buf,
+			size_t len, uint64_t offset, struct objstore_aio *aio)
+{
+	struct objver *objver = cookie;
+	struct obj *obj;
+
+	if (!vol || !objver || !buf || !aio || !aio->done)
+		return -EINVAL;
+
+	if (len > (SIZE_MAX / 2))
+		return -EOVERFLOW;
+
+	if (vol != objver->obj->vol)
+		return -ENXIO;
+
+	obj = objver->obj;
+
+	if (!obj->ops || !obj->ops->read)
+		return -ENOTSUP;
+
+	return __aio(objver, false, buf, len, offset, aio);
+}
+
+int objstore_write_async(struct objstore *vol, void *cookie, const void *buf,
+			 size_t len, uint64_t offset, struct objstore_aio *aio)
+{
+	struct objver *objver = cookie;
+	struct obj *obj;
+
+	if (!vol || !objver || !buf || !aio || !aio->done)
+		return -EINVAL;
+
+	if (len > (SIZE_MAX / 2))
+		return -EOVERFLOW;
+
+	if (vol != objver->obj->vol)
+		return -ENXIO;
+
+	obj = objver->obj;
+
+	if (!obj->ops || !obj->ops->write)
+		return -ENOTSUP;
+
+	return __aio(objver, true, (void *) buf, len, offset, aio);
+}
+
+/* called by the backend (or __aio) once an asynchronous I/O finishes */
+void objstore_aio_done(struct objstore_aio *aio, ssize_t ret)
+{
+	struct obj *obj = aio->obj;
+
+	aio->obj = NULL;
+	aio->done(aio, ret);
+
+	obj_putref(obj);
+}
+
+/*
+ * Create a new version of an object, with clock @clock, as a copy of the
+ * version open via @cookie.  The new version can then be opened with
+ * objstore_open().
+ */
+int objstore_fork(struct objstore *vol, void *cookie,
+		  const struct nvclock *clock)
+{
+	struct objver *objver = cookie;
+	struct obj *obj;
+	int ret;
+
+	if (!vol || !objver || !clock || nvclock_is_null(clock))
+		return -EINVAL;
+
+	if (vol != objver->obj->vol)
+		return -ENXIO;
+
+	obj = objver->obj;
+
+	if (!obj->ops || !obj->ops->fork)
+		return -ENOTSUP;
+
+	MXLOCK(&obj->lock);
+	ret = obj->ops->fork(objver, clock);
+	MXUNLOCK(&obj->lock);
+
+	return __commit(vol, ret);
 }
 
 int objstore_lookup(struct objstore *vol, void *dircookie, const char *name,
@@ -661,7 +988,7 @@ int objstore_create(struct objstore *vol, void *dircookie, const char *name,
 		ret = dir->ops->create(dirver, name, mode, child);
 	MXUNLOCK(&dir->lock);
 
-	return ret;
+	return __commit(vol, ret);
 }
 
 static struct obj *getobj_in_dir(struct objver *dirver, const char *name)
@@ -711,12 +1038,12 @@ int objstore_unlink(struct objstore *vol, void *dircookie, const char *name)
 	}
 	MXUNLOCK(&dir->lock);
 
-	return ret;
+	return __commit(vol, ret);
 }
 
 int objstore_getdent(struct objstore *vol, void *dircookie,
-		     const uint64_t offset, struct noid *child,
-		     char **childname, uint64_t *entry_size)
+		     const uint64_t cookie, struct noid *child,
+		     char **childname, uint64_t *next_cookie)
 {
 	struct objver *dirver = dircookie;
 	struct obj *dir;
@@ -737,8 +1064,8 @@ int objstore_getdent(struct objstore *vol, void *dircookie,
 	if (!NATTR_ISDIR(dirver->attrs.mode))
 		ret = -ENOTDIR;
 	else
-		ret = dir->ops->getdent(dirver, offset, child, childname,
-					entry_size);
+		ret = dir->ops->getdent(dirver, cookie, child, childname,
+					next_cookie);
 	MXUNLOCK(&dir->lock);
 
 	return ret;